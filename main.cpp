@@ -18,23 +18,90 @@
 #include <atomic>
 #include <random>
 #include <mutex>
+#include <condition_variable>
+#include <type_traits>
+#include <functional>
 #include <signal.h>
 #include <vector>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/signalfd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/utsname.h>
+#include <sys/wait.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <sys/prctl.h>
+#include <dirent.h>
+#include <sched.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <pwd.h>
+#include <pthread.h>
 #include <cstdio>
+#include <cstdint>
+#include <algorithm>
+#include <memory>
+#include <fstream>
+#include <cstdlib>
+#include <string>
+#include <complex>
+#include <new>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
 
 // Variables globales para control
 std::atomic<bool> running(true);
 std::atomic<bool> identical_magnetometers(false);
 std::atomic<bool> show_menu(true);
-std::mutex print_mutex;
 
-// Generadores de números aleatorios
-std::random_device rd;
-std::mt19937 gen(rd());
-std::uniform_real_distribution<> noise_small(-0.1, 0.1);
-std::uniform_real_distribution<> noise_medium(-1.0, 1.0);
+// Generador pseudoaleatorio por dispositivo (splitmix64). Todo su estado es un
+// entero de 64 bits, así que la posición de la secuencia cabe en un checkpoint
+// y al restaurarlo el ruido continúa exactamente donde se quedó.
+struct SimRng {
+    uint64_t state;
+
+    explicit SimRng(uint64_t seed = 0) : state(seed) {}
+
+    uint64_t next() {
+        uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        return z ^ (z >> 31);
+    }
+
+    // Uniforme en [a, b)
+    double uniform(double a, double b) {
+        return a + (b - a) * (static_cast<double>(next() >> 11) * (1.0 / 9007199254740992.0));
+    }
+
+    // Entero uniforme en [0, n)
+    uint32_t below(uint32_t n) {
+        return static_cast<uint32_t>(next() % n);
+    }
+
+    // Normal estándar (Box-Muller, una salida por par de uniformes)
+    double gaussian() {
+        double u = 1.0 - uniform(0.0, 1.0);
+        return std::sqrt(-2.0 * std::log(u)) * std::cos(2.0 * M_PI * uniform(0.0, 1.0));
+    }
+};
+
+// Semilla maestra; cada dispositivo deriva la suya a partir de ella
+uint64_t master_seed = 0;
+
+uint64_t deviceSeed(uint64_t seed, int device_index) {
+    SimRng mixer(seed + static_cast<uint64_t>(device_index) * 0x632BE59BD9B4E019ULL);
+    return mixer.next();
+}
 
 // Estructura para datos del magnetómetro QuSpin
 struct QuSpinData {
@@ -183,417 +250,8651 @@ std::string generateQuSpinLine(const QuSpinData& data) {
     return ss.str();
 }
 
-// Thread para emular GPS
-void gpsEmulatorThread(int master_fd, const std::string& port_name) {
-    GPSData gps_data;
-    gps_data.latitude = sim_values.base_latitude;
-    gps_data.longitude = sim_values.base_longitude;
-    gps_data.altitude = sim_values.base_altitude;
-    gps_data.hdop = 0.57;
-    gps_data.satellites = 9;
-    gps_data.fix_quality = 1;
+// ============================================================================
+// Modelo de campo: campo de referencia + fuentes dipolares sintéticas
+// ============================================================================
 
-    int time_counter = 0;
-    int gnzda_counter = 0;
+// Vector en el marco local del levantamiento (X = este, Y = norte, Z = arriba).
+// Es el mismo marco en que se expresan las componentes vectoriales del QuSpin.
+struct Vec3 {
+    double x, y, z;
 
-    // Tiempo inicial basado en ejemplo: 16:57:32.50
-    int hours = 16;
-    int minutes = 57;
-    int seconds = 32;
-    int centiseconds = 50;
+    Vec3() : x(0.0), y(0.0), z(0.0) {}
+    Vec3(double x_, double y_, double z_) : x(x_), y(y_), z(z_) {}
 
-    while (running) {
-        // Actualizar tiempo UTC
-        std::stringstream time_ss;
-        time_ss << std::setfill('0') << std::setw(2) << hours
-                << std::setfill('0') << std::setw(2) << minutes
-                << std::setfill('0') << std::setw(2) << seconds
-                << "." << std::setfill('0') << std::setw(2) << centiseconds;
-        gps_data.utc_time = time_ss.str();
+    Vec3 operator+(const Vec3& o) const { return Vec3(x + o.x, y + o.y, z + o.z); }
+    Vec3 operator-(const Vec3& o) const { return Vec3(x - o.x, y - o.y, z - o.z); }
+    Vec3 operator*(double k) const { return Vec3(x * k, y * k, z * k); }
+    Vec3& operator+=(const Vec3& o) { x += o.x; y += o.y; z += o.z; return *this; }
+    double dot(const Vec3& o) const { return x * o.x + y * o.y + z * o.z; }
+    double norm() const { return std::sqrt(dot(*this)); }
+};
 
-        // Pequeña variación en posición
-        gps_data.latitude += noise_small(gen) * 0.000001;
-        gps_data.longitude += noise_small(gen) * 0.000001;
-        gps_data.altitude += noise_small(gen) * 0.1;
+// Fuente dipolar: posición (Z negativo bajo el suelo) y momento en A·m²
+struct DipoleSource {
+    Vec3 position;
+    Vec3 moment;
+    uint32_t id;  // Posición de la fuente en su CSV (desde 0), para el canal de verdad
+};
 
-        // Generar sentencia GNGGA
-        std::string nmea_sentence = generateGNGGA(gps_data) + "\r\n";
+// μ0/4π expresado en nT·m³/(A·m²)
+const double DIPOLE_CONSTANT_NT = 100.0;
 
-        // Escribir al puerto
-        write(master_fd, nmea_sentence.c_str(), nmea_sentence.length());
-
-        // Ocasionalmente enviar GNZDA (cada ~50 mensajes como en el ejemplo)
-        gnzda_counter++;
-        if (gnzda_counter >= 50) {
-            std::string gnzda = generateGNZDA(gps_data.utc_time) + "\r\n";
-            write(master_fd, gnzda.c_str(), gnzda.length());
-            gnzda_counter = 0;
-        }
-
-        // Incrementar tiempo (0.1 segundos)
-        centiseconds += 10;
-        if (centiseconds >= 100) {
-            centiseconds -= 100;
-            seconds++;
-            if (seconds >= 60) {
-                seconds = 0;
-                minutes++;
-                if (minutes >= 60) {
-                    minutes = 0;
-                    hours++;
-                    if (hours >= 24) {
-                        hours = 0;
-                    }
+// Campo de un dipolo de momento m visto desde el vector r (fuente -> punto)
+inline Vec3 dipoleField(const Vec3& moment, const Vec3& r) {
+    double r2 = r.dot(r);
+    if (r2 < 1e-6) return Vec3();
+    double inv_r = 1.0 / std::sqrt(r2);
+    double inv_r3 = inv_r * inv_r * inv_r;
+    double inv_r5 = inv_r3 / r2;
+    return (r * (3.0 * moment.dot(r) * inv_r5) - moment * inv_r3) * DIPOLE_CONSTANT_NT;
+}
+
+// Aporte de una fuente al campo en un punto. La evaluación que suma el campo
+// los va apuntando si se le pasa dónde (canal de verdad, ver fillTruthRecord);
+// las fuentes que el octree agrupa en una expansión no se apuntan.
+struct SourceContribution {
+    uint32_t id;
+    Vec3 field_nT;
+};
+typedef std::vector<SourceContribution> SourceContributions;
+
+// Aproximación jerárquica (Barnes–Hut) del campo de muchas fuentes. Cada nodo
+// del octree guarda el momento dipolar total y el tensor cuadrupolar de sus
+// fuentes respecto a su centroide; si el nodo se ve bajo un ángulo menor que
+// theta (lado de su caja / distancia) se usa esa expansión en lugar de recorrer sus
+// fuentes. Con theta más chico el resultado se acerca a la suma exacta.
+class SourceOctree {
+public:
+    SourceOctree(const std::vector<DipoleSource>& sources, double theta)
+        : sources_(sources), theta2_(theta * theta) {
+        if (!sources_.empty()) {
+            nodes_.reserve(2 * sources_.size() / LEAF_SIZE + 1);
+            build(0, static_cast<uint32_t>(sources_.size()), 0);
+        }
+    }
+
+    Vec3 field(const Vec3& point, SourceContributions* contributions = NULL) const {
+        Vec3 total;
+        if (nodes_.empty()) return total;
+
+        uint32_t stack[8 * MAX_DEPTH + 8];
+        int top = 0;
+        stack[top++] = 0;
+        while (top > 0) {
+            const Node& node = nodes_[stack[--top]];
+            Vec3 r = point - node.center;
+            double r2 = r.dot(r);
+
+            if (node.size * node.size < theta2_ * r2) {
+                total += multipoleField(node, r, r2);
+            } else if (node.child_count == 0) {
+                for (uint32_t i = node.begin; i < node.end; i++) {
+                    Vec3 b = dipoleField(sources_[i].moment, point - sources_[i].position);
+                    total += b;
+                    if (contributions) contributions->push_back(SourceContribution{sources_[i].id, b});
+                }
+            } else {
+                for (int c = 0; c < node.child_count; c++) {
+                    stack[top++] = node.children[c];
                 }
             }
         }
-
-        // GPS típicamente envía a 10Hz
-        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        return total;
     }
-}
 
-// Thread para emular magnetómetro QuSpin
-void magnetometerEmulatorThread(int master_fd, const std::string& port_name, int mag_id) {
-    static QuSpinData shared_data;  // Datos compartidos para modo idéntico
-    static std::mutex shared_data_mutex;
+    size_t nodeCount() const { return nodes_.size(); }
 
-    QuSpinData quspin_data;
+private:
+    static const uint32_t LEAF_SIZE = 8;
+    static const int MAX_DEPTH = 24;
 
-    // Estado inicial
-    uint16_t counter = 0;
-    uint32_t timestamp = 86336800;  // Timestamp inicial del ejemplo
-    char current_axis = 'X';
+    struct Node {
+        Vec3 center;          // Centroide de las fuentes del nodo
+        double size;          // Lado mayor de la caja envolvente
+        Vec3 moment;          // Momento dipolar total
+        double q[6];          // Cuadrupolo sin traza: xx, yy, zz, xy, xz, yz
+        uint32_t begin, end;  // Rango de fuentes (ordenadas por nodo)
+        uint32_t children[8];
+        int child_count;
+    };
 
-    // Valores base con pequeño offset entre magnetómetros si no son idénticos
-    double offset = (mag_id == 1 && !identical_magnetometers) ? 10.0 : 0.0;
+    // Campo de la expansión dipolo + cuadrupolo de un nodo en r = punto - centro.
+    // Potencial del cuadrupolo: rᵀQr / r⁵, así que B = 5 (rᵀQr) r / r⁷ - 2 Q r / r⁵.
+    static Vec3 multipoleField(const Node& node, const Vec3& r, double r2) {
+        const double* q = node.q;
+        Vec3 qr(q[0] * r.x + q[3] * r.y + q[4] * r.z,
+                q[3] * r.x + q[1] * r.y + q[5] * r.z,
+                q[4] * r.x + q[5] * r.y + q[2] * r.z);
+        double inv_r2 = 1.0 / r2;
+        double inv_r5 = inv_r2 * inv_r2 / std::sqrt(r2);
+        Vec3 quadrupole = (r * (5.0 * r.dot(qr) * inv_r2) - qr * 2.0) * (inv_r5 * DIPOLE_CONSTANT_NT);
+        return dipoleField(node.moment, r) + quadrupole;
+    }
 
-    while (running) {
-        if (identical_magnetometers) {
-            if (mag_id == 1) {
-                // Magnetómetro 1 genera los datos
-                quspin_data.scalar_field_nT = sim_values.base_scalar_field + noise_medium(gen);
+    uint32_t build(uint32_t begin, uint32_t end, int depth) {
+        uint32_t index = static_cast<uint32_t>(nodes_.size());
+        nodes_.push_back(Node());
+        Node node;
+        node.begin = begin;
+        node.end = end;
+        node.child_count = 0;
 
-                switch (current_axis) {
-                    case 'X':
-                        quspin_data.vector_field_nT = sim_values.base_vector_x + noise_medium(gen);
-                        break;
-                    case 'Y':
-                        quspin_data.vector_field_nT = sim_values.base_vector_y + noise_medium(gen) * 10;
-                        break;
-                    case 'Z':
-                        quspin_data.vector_field_nT = sim_values.base_vector_z + noise_medium(gen);
-                        break;
-                }
+        Vec3 lo = sources_[begin].position, hi = lo, sum;
+        for (uint32_t i = begin; i < end; i++) {
+            const Vec3& p = sources_[i].position;
+            lo = Vec3(std::min(lo.x, p.x), std::min(lo.y, p.y), std::min(lo.z, p.z));
+            hi = Vec3(std::max(hi.x, p.x), std::max(hi.y, p.y), std::max(hi.z, p.z));
+            sum += p;
+            node.moment += sources_[i].moment;
+        }
+        node.center = sum * (1.0 / (end - begin));
+        node.size = std::max(hi.x - lo.x, std::max(hi.y - lo.y, hi.z - lo.z));
 
-                quspin_data.scalar_validation = '_';
-                quspin_data.vector_axis = current_axis;
-                quspin_data.vector_validation = '=';
-                quspin_data.data_counter = counter;
-                quspin_data.timestamp_ms = timestamp;
-                quspin_data.scalar_sensitivity = 135 + (rand() % 10);
-                quspin_data.vector_sensitivity = 110 + (rand() % 10);
+        // S = Σ sim(m ⊗ d), t = Σ m·d  ->  Q = 3S - t·I
+        double s[6] = {0, 0, 0, 0, 0, 0};
+        double trace = 0.0;
+        for (uint32_t i = begin; i < end; i++) {
+            const Vec3& m = sources_[i].moment;
+            Vec3 d = sources_[i].position - node.center;
+            s[0] += m.x * d.x;
+            s[1] += m.y * d.y;
+            s[2] += m.z * d.z;
+            s[3] += 0.5 * (m.x * d.y + m.y * d.x);
+            s[4] += 0.5 * (m.x * d.z + m.z * d.x);
+            s[5] += 0.5 * (m.y * d.z + m.z * d.y);
+            trace += m.dot(d);
+        }
+        for (int k = 0; k < 6; k++) node.q[k] = 3.0 * s[k];
+        for (int k = 0; k < 3; k++) node.q[k] -= trace;
 
-                // Guardar datos para mag2
-                std::lock_guard<std::mutex> lock(shared_data_mutex);
-                shared_data = quspin_data;
-            } else {
-                // Magnetómetro 2 usa los mismos datos
-                std::this_thread::sleep_for(std::chrono::microseconds(100)); // Pequeño delay
-                std::lock_guard<std::mutex> lock(shared_data_mutex);
-                quspin_data = shared_data;
+        if (end - begin > LEAF_SIZE && depth < MAX_DEPTH && node.size > 0.0) {
+            // Reparto en octantes alrededor del centro de la caja
+            Vec3 mid = (lo + hi) * 0.5;
+            uint32_t counts[9] = {0, 0, 0, 0, 0, 0, 0, 0, 0};
+            std::vector<DipoleSource> sorted(sources_.begin() + begin, sources_.begin() + end);
+            std::vector<uint8_t> octant(sorted.size());
+            for (size_t i = 0; i < sorted.size(); i++) {
+                const Vec3& p = sorted[i].position;
+                octant[i] = static_cast<uint8_t>((p.x >= mid.x) | ((p.y >= mid.y) << 1) | ((p.z >= mid.z) << 2));
+                counts[octant[i] + 1]++;
             }
-        } else {
-            // Modo independiente - cada magnetómetro genera sus propios datos
-            quspin_data.scalar_field_nT = sim_values.base_scalar_field + offset + noise_medium(gen);
-
-            switch (current_axis) {
-                case 'X':
-                    quspin_data.vector_field_nT = sim_values.base_vector_x + noise_medium(gen);
-                    break;
-                case 'Y':
-                    quspin_data.vector_field_nT = sim_values.base_vector_y + noise_medium(gen) * 10;
-                    break;
-                case 'Z':
-                    quspin_data.vector_field_nT = sim_values.base_vector_z + noise_medium(gen);
-                    break;
+            for (int o = 1; o < 9; o++) counts[o] += counts[o - 1];
+            uint32_t fill[8];
+            for (int o = 0; o < 8; o++) fill[o] = counts[o];
+            for (size_t i = 0; i < sorted.size(); i++) {
+                sources_[begin + fill[octant[i]]++] = sorted[i];
             }
 
-            quspin_data.scalar_validation = '_';
-            quspin_data.vector_axis = current_axis;
-            quspin_data.vector_validation = '=';
-            quspin_data.data_counter = counter;
-            quspin_data.timestamp_ms = timestamp;
-            quspin_data.scalar_sensitivity = 135 + (rand() % 10);
-            quspin_data.vector_sensitivity = 110 + (rand() % 10);
+            for (int o = 0; o < 8; o++) {
+                if (counts[o + 1] > counts[o]) {
+                    node.children[node.child_count++] = build(begin + counts[o], begin + counts[o + 1], depth + 1);
+                }
+            }
         }
 
-        // Generar línea de datos
-        std::string data_line = generateQuSpinLine(quspin_data) + "\n";
+        nodes_[index] = node;
+        return index;
+    }
 
-        // Escribir al puerto
-        write(master_fd, data_line.c_str(), data_line.length());
+    std::vector<DipoleSource> sources_;
+    std::vector<Node> nodes_;
+    double theta2_;
+};
 
-        // Solo el mag1 actualiza contadores en modo idéntico
-        if (!identical_magnetometers || mag_id == 1) {
-            // Actualizar contadores
-            counter += 2;
-            if (counter > 498) {
-                counter = 0;
+// Índice espacial inmutable de fuentes: rejilla uniforme en planta (este/norte)
+// con las fuentes ordenadas por celda. La suma directa solo recorre las celdas
+// dentro del radio de corte, fuera del cual la contribución dipolar (1/r³) es
+// despreciable. Con theta > 0 usa en cambio el octree de Barnes–Hut sobre todas
+// las fuentes. Al ser de solo lectura se comparte entre hilos y corridas.
+class AnomalySourceIndex {
+public:
+    AnomalySourceIndex(const std::vector<DipoleSource>& sources, double cutoff_m, double theta = 0.0)
+        : cutoff_m_(cutoff_m), cell_size_m_(1.0), min_x_(0.0), min_y_(0.0), cols_(1), rows_(1) {
+        if (theta > 0.0) {
+            octree_.reset(new SourceOctree(sources, theta));
+            sources_ = sources;
+            cell_start_.assign(2, 0);
+            return;
+        }
+        if (!sources.empty()) {
+            double max_x = sources[0].position.x, max_y = sources[0].position.y;
+            min_x_ = max_x;
+            min_y_ = max_y;
+            for (size_t i = 1; i < sources.size(); i++) {
+                min_x_ = std::min(min_x_, sources[i].position.x);
+                min_y_ = std::min(min_y_, sources[i].position.y);
+                max_x = std::max(max_x, sources[i].position.x);
+                max_y = std::max(max_y, sources[i].position.y);
             }
+            // Celdas del tamaño del radio de corte, limitando el tamaño de la rejilla
+            double extent = std::max(max_x - min_x_, max_y - min_y_);
+            cell_size_m_ = cutoff_m_ > 0.0 ? std::max(cutoff_m_, extent / 1024.0) : extent + 1.0;
+            if (cell_size_m_ <= 0.0) cell_size_m_ = 1.0;
+            cols_ = static_cast<int>((max_x - min_x_) / cell_size_m_) + 1;
+            rows_ = static_cast<int>((max_y - min_y_) / cell_size_m_) + 1;
+        }
+
+        // Ordenación por conteo: cell_start_[c] .. cell_start_[c + 1] son las fuentes de la celda c
+        cell_start_.assign(static_cast<size_t>(cols_) * rows_ + 1, 0);
+        for (size_t i = 0; i < sources.size(); i++) {
+            cell_start_[cellOf(sources[i].position) + 1]++;
+        }
+        for (size_t c = 1; c < cell_start_.size(); c++) {
+            cell_start_[c] += cell_start_[c - 1];
+        }
+        std::vector<uint32_t> fill(cell_start_.begin(), cell_start_.end() - 1);
+        sources_.resize(sources.size());
+        for (size_t i = 0; i < sources.size(); i++) {
+            sources_[fill[cellOf(sources[i].position)]++] = sources[i];
+        }
+    }
+
+    // Suma del campo de todas las fuentes dentro del radio de corte
+    Vec3 field(const Vec3& point, SourceContributions* contributions = NULL) const {
+        if (octree_) return octree_->field(point, contributions);
+        Vec3 total;
+        if (sources_.empty()) return total;
 
-            timestamp += 4;
+        int cx = cellCoord(point.x, min_x_, cols_);
+        int cy = cellCoord(point.y, min_y_, rows_);
+        int reach = cutoff_m_ > 0.0 ? static_cast<int>(std::ceil(cutoff_m_ / cell_size_m_)) : std::max(cols_, rows_);
+        double cutoff2 = cutoff_m_ * cutoff_m_;
 
-            // Rotar entre ejes X, Y, Z
-            switch (current_axis) {
-                case 'X': current_axis = 'Y'; break;
-                case 'Y': current_axis = 'Z'; break;
-                case 'Z': current_axis = 'X'; break;
+        for (int y = std::max(0, cy - reach); y <= std::min(rows_ - 1, cy + reach); y++) {
+            for (int x = std::max(0, cx - reach); x <= std::min(cols_ - 1, cx + reach); x++) {
+                size_t cell = static_cast<size_t>(y) * cols_ + x;
+                for (uint32_t i = cell_start_[cell]; i < cell_start_[cell + 1]; i++) {
+                    Vec3 r = point - sources_[i].position;
+                    if (cutoff_m_ > 0.0 && r.dot(r) > cutoff2) continue;
+                    Vec3 b = dipoleField(sources_[i].moment, r);
+                    total += b;
+                    if (contributions) contributions->push_back(SourceContribution{sources_[i].id, b});
+                }
             }
         }
+        return total;
+    }
 
-        // QuSpin típicamente envía a ~250Hz (4ms entre muestras)
-        std::this_thread::sleep_for(std::chrono::milliseconds(4));
+    size_t size() const { return sources_.size(); }
+    const std::vector<DipoleSource>& sources() const { return sources_; }
+
+private:
+    int cellCoord(double v, double min_v, int count) const {
+        int c = static_cast<int>(std::floor((v - min_v) / cell_size_m_));
+        return std::max(0, std::min(count - 1, c));
     }
-}
 
-// Función para limpiar symlinks existentes
-void cleanupPorts() {
-    struct stat st;
+    size_t cellOf(const Vec3& p) const {
+        return static_cast<size_t>(cellCoord(p.y, min_y_, rows_)) * cols_ + cellCoord(p.x, min_x_, cols_);
+    }
+
+    double cutoff_m_;
+    double cell_size_m_;
+    double min_x_, min_y_;
+    int cols_, rows_;
+    std::vector<DipoleSource> sources_;
+    std::vector<uint32_t> cell_start_;
+    std::unique_ptr<SourceOctree> octree_;
+};
 
-    // Limpiar /dev/ttyAMA0
-    if (lstat("/dev/ttyAMA0", &st) == 0) {
-        if (S_ISLNK(st.st_mode)) {
-            // Es un symlink, eliminarlo
-            unlink("/dev/ttyAMA0");
-            std::cout << "Limpiado symlink anterior: /dev/ttyAMA0" << std::endl;
+// Carga fuentes desde CSV: este_m,norte_m,profundidad_m,mx,my,mz (A·m²).
+// Las líneas que no empiezan con un número (cabecera, comentarios) se ignoran.
+bool loadDipoleSources(const std::string& path, std::vector<DipoleSource>& sources, std::string& error) {
+    FILE* file = fopen(path.c_str(), "r");
+    if (!file) {
+        error = path + ": " + strerror(errno);
+        return false;
+    }
+    char line[512];
+    while (fgets(line, sizeof(line), file)) {
+        double east, north, depth, mx, my, mz;
+        if (sscanf(line, " %lf , %lf , %lf , %lf , %lf , %lf", &east, &north, &depth, &mx, &my, &mz) == 6) {
+            DipoleSource source;
+            source.position = Vec3(east, north, -depth);
+            source.moment = Vec3(mx, my, mz);
+            source.id = static_cast<uint32_t>(sources.size());
+            sources.push_back(source);
         }
     }
+    fclose(file);
+    return true;
+}
 
-    // Limpiar /dev/ttyAMA2
-    if (lstat("/dev/ttyAMA2", &st) == 0) {
-        if (S_ISLNK(st.st_mode)) {
-            unlink("/dev/ttyAMA2");
-            std::cout << "Limpiado symlink anterior: /dev/ttyAMA2" << std::endl;
-        }
+// Campo de referencia regional: vector base en el origen más un gradiente
+// horizontal lineal. Es inmutable y se comparte entre todos los cabezales.
+struct ReferenceField {
+    Vec3 base;              // nT en el origen
+    double scalar_base;     // |B| reportado en el origen
+    Vec3 gradient_east;     // nT/m
+    Vec3 gradient_north;    // nT/m
+    Vec3 direction;         // Dirección unitaria del campo base
+
+    Vec3 at(const Vec3& p) const {
+        return base + gradient_east * p.x + gradient_north * p.y;
     }
+};
+
+// Valor del campo en un punto: lo que mide un cabezal ideal sin ruido
+struct FieldSample {
+    double scalar_nT;    // Campo total (aprox. de anomalía de campo total)
+    Vec3 vector_nT;
+    double anomaly_nT;   // Aporte de las fuentes sintéticas al campo total
+    double interference_nT = 0.0;  // Firma de la plataforma (Tolles–Lawson) en el campo total
+};
+
+// Modelo de campo de una simulación: componentes compartidos e inmutables
+// (referencia, índice de fuentes) más los parámetros propios de la corrida
+struct FieldModel {
+    std::shared_ptr<const ReferenceField> reference;
+    std::shared_ptr<const AnomalySourceIndex> sources;
+    double depth_offset_m;  // Profundidad adicional aplicada a todas las fuentes
+
+    FieldModel() : depth_offset_m(0.0) {}
 
-    // Limpiar /dev/ttyAMA4
-    if (lstat("/dev/ttyAMA4", &st) == 0) {
-        if (S_ISLNK(st.st_mode)) {
-            unlink("/dev/ttyAMA4");
-            std::cout << "Limpiado symlink anterior: /dev/ttyAMA4" << std::endl;
+    FieldSample evaluate(const Vec3& p, SourceContributions* contributions = NULL) const {
+        FieldSample sample;
+        Vec3 anomaly;
+        if (sources) {
+            // Hundir las fuentes equivale a elevar el punto de observación
+            anomaly = sources->field(p + Vec3(0.0, 0.0, depth_offset_m), contributions);
         }
+        Vec3 regional = reference->at(p) - reference->base;
+        sample.vector_nT = reference->base + regional + anomaly;
+        sample.anomaly_nT = anomaly.dot(reference->direction);
+        sample.scalar_nT = reference->scalar_base + regional.dot(reference->direction) + sample.anomaly_nT;
+        return sample;
     }
-}
+};
 
-// Crear puerto serial virtual
-int createVirtualPort(const std::string& symlink_path) {
-    int master_fd, slave_fd;
-    char slave_name[256];
+std::shared_ptr<const ReferenceField> makeReferenceField(const SimulationValues& values) {
+    std::shared_ptr<ReferenceField> reference(new ReferenceField());
+    reference->base = Vec3(values.base_vector_x, values.base_vector_y, values.base_vector_z);
+    reference->scalar_base = values.base_scalar_field;
+    reference->gradient_east = Vec3();
+    reference->gradient_north = Vec3();
+    reference->direction = reference->base * (1.0 / reference->base.norm());
+    return reference;
+}
 
-    // Verificar si el archivo existe y hacer backup si es necesario
-    struct stat st;
-    if (lstat(symlink_path.c_str(), &st) == 0) {
-        std::cout << "ADVERTENCIA: " << symlink_path << " ya existe." << std::endl;
+// ============================================================================
+// Trayectoria de la plataforma: plan de vuelo o registro importado (track)
+// ============================================================================
 
-        // Si es un dispositivo real (character device), hacer backup
-        if (S_ISCHR(st.st_mode)) {
-            std::string backup_path = symlink_path + ".backup";
-            std::cout << "Es un dispositivo real. Renombrando a " << backup_path << std::endl;
-            rename(symlink_path.c_str(), backup_path.c_str());
-        } else if (S_ISLNK(st.st_mode)) {
-            // Si es un symlink, simplemente eliminarlo
-            std::cout << "Es un symlink anterior. Eliminando..." << std::endl;
-            unlink(symlink_path.c_str());
+// Número decimal sin exponente ("-784.260"); avanza p. Las cifras más allá
+// del noveno decimal se consumen pero no cuentan.
+inline bool parseFixedPoint(const char*& p, const char* end, double& value) {
+    bool negative = p < end && *p == '-';
+    if (negative) p++;
+    const char* digits = p;
+    uint64_t mantissa = 0;
+    int decimals = -1;
+    for (; p < end; p++) {
+        if (*p >= '0' && *p <= '9') {
+            if (decimals == 9) continue;
+            mantissa = mantissa * 10 + static_cast<uint64_t>(*p - '0');
+            if (decimals >= 0) decimals++;
+        } else if (*p == '.' && decimals < 0) {
+            decimals = 0;
         } else {
-            // Si es otro tipo de archivo, eliminarlo
-            unlink(symlink_path.c_str());
+            break;
         }
     }
+    static const double scale[] = {1.0, 1e-1, 1e-2, 1e-3, 1e-4, 1e-5, 1e-6, 1e-7, 1e-8, 1e-9};
+    if (p == digits) return false;
+    value = static_cast<double>(mantissa) * scale[std::max(0, decimals)];
+    if (negative) value = -value;
+    return true;
+}
 
-    // Abrir pseudo-terminal
-    if (openpty(&master_fd, &slave_fd, slave_name, NULL, NULL) == -1) {
-        std::cerr << "Error al crear pty: " << strerror(errno) << std::endl;
-        return -1;
+// Archivo de solo lectura proyectado en memoria
+struct MappedFile {
+    MappedFile() : data(NULL), size(0) {}
+    ~MappedFile() {
+        if (data != NULL) munmap(const_cast<char*>(data), size);
     }
 
-    // Configurar el puerto como non-blocking
-    int flags = fcntl(master_fd, F_GETFL, 0);
-    fcntl(master_fd, F_SETFL, flags | O_NONBLOCK);
-
-    // Crear symlink
-    if (symlink(slave_name, symlink_path.c_str()) == -1) {
-        std::cerr << "Error al crear symlink " << symlink_path << ": "
-                  << strerror(errno) << std::endl;
-        std::cerr << "¿Estás ejecutando con sudo?" << std::endl;
-        close(master_fd);
-        close(slave_fd);
-        return -1;
+    bool open(const std::string& path) {
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd == -1) return false;
+        struct stat st;
+        bool ok = fstat(fd, &st) == 0 && st.st_size > 0;
+        if (ok) {
+            size = static_cast<size_t>(st.st_size);
+            void* memory = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            ok = memory != MAP_FAILED;
+            data = ok ? static_cast<const char*>(memory) : NULL;
+            if (ok) madvise(memory, size, MADV_SEQUENTIAL);
+        }
+        close(fd);
+        return ok;
     }
 
-    // Configurar permisos
-    chmod(symlink_path.c_str(), 0666);
+    const char* data;
+    size_t size;
+};
 
-    // Si es GPS, configurar baudrate a 9600
-    if (symlink_path.find("AMA0") != std::string::npos) {
-        struct termios tty;
-        tcgetattr(slave_fd, &tty);
-        cfsetospeed(&tty, B9600);
-        cfsetispeed(&tty, B9600);
-        tcsetattr(slave_fd, TCSANOW, &tty);
+// Tiempo UTC (s del día), latitud y longitud (grados) de una sentencia GGA.
+// Con altitude_m también lee la altitud y descarta las GGA sin fix.
+bool parseGgaFix(const char* p, const char* end, double& utc_s, double& latitude, double& longitude,
+                 double* altitude_m = NULL) {
+    if (end - p < 7 || p[0] != '$' || memcmp(p + 3, "GGA,", 4) != 0) return false;
+    p += 7;
+    double hhmmss, lat, lon;
+    if (!parseFixedPoint(p, end, hhmmss) || p == end || *p++ != ',' || !parseFixedPoint(p, end, lat) ||
+        end - p < 3 || *p++ != ',') {
+        return false;
     }
+    char lat_hemisphere = *p++;
+    if (*p++ != ',' || !parseFixedPoint(p, end, lon) || end - p < 2 || *p++ != ',') return false;
+    char lon_hemisphere = *p;
+    if (altitude_m != NULL) {
+        // ,calidad,satélites,hdop,altitud
+        p++;
+        if (end - p < 3 || *p++ != ',' || *p == '0' || *p == ',') return false;
+        for (int field = 0; field < 3; field++) {
+            p = static_cast<const char*>(memchr(p, ',', end - p));
+            if (p == NULL) return false;
+            p++;
+        }
+        if (!parseFixedPoint(p, end, *altitude_m)) return false;
+    }
+    int hours = static_cast<int>(hhmmss / 10000);
+    int minutes = static_cast<int>(hhmmss / 100) % 100;
+    utc_s = hours * 3600.0 + minutes * 60.0 + (hhmmss - hours * 10000 - minutes * 100);
+    // ddmm.mmmmm y dddmm.mmmmm a grados
+    latitude = static_cast<int>(lat / 100) + std::fmod(lat, 100.0) / 60.0;
+    longitude = static_cast<int>(lon / 100) + std::fmod(lon, 100.0) / 60.0;
+    if (lat_hemisphere == 'S') latitude = -latitude;
+    if (lon_hemisphere == 'W') longitude = -longitude;
+    return true;
+}
 
-    std::cout << "Puerto virtual creado: " << symlink_path
-              << " -> " << slave_name << std::endl;
-
-    close(slave_fd);  // No necesitamos el slave
-    return master_fd;
+// Cifras decimales exactas (fechas ISO 8601); avanza p
+inline bool parseDigits(const char*& p, const char* end, int count, int& value) {
+    if (end - p < count) return false;
+    value = 0;
+    for (int i = 0; i < count; i++, p++) {
+        if (*p < '0' || *p > '9') return false;
+        value = value * 10 + (*p - '0');
+    }
+    return true;
 }
 
-// Manejador de señal para salida limpia
-void signalHandler(int signum) {
-    std::cout << "\nRecibida senal " << signum << ". Terminando..." << std::endl;
-    running = false;
+// Días desde 1970-01-01 de una fecha del calendario gregoriano
+int64_t daysFromCivil(int64_t year, int month, int day) {
+    year -= month <= 2;
+    int64_t era = (year >= 0 ? year : year - 399) / 400;
+    int64_t year_of_era = year - era * 400;
+    int64_t day_of_year = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    int64_t day_of_era = year_of_era * 365 + year_of_era / 4 - year_of_era / 100 + day_of_year;
+    return era * 146097 + day_of_era - 719468;
 }
 
-// Mostrar menú de control
-void showControlMenu() {
-    std::cout << "\n=== SIMULADOR QUSPIN v2 Y GPS ===" << std::endl;
-    std::cout << "Puertos virtuales activos:" << std::endl;
-    std::cout << "  - GPS:            /dev/ttyAMA0" << std::endl;
-    std::cout << "  - Magnetometro 1: /dev/ttyAMA2" << std::endl;
-    std::cout << "  - Magnetometro 2: /dev/ttyAMA4" << std::endl;
-    std::cout << "\nComandos:" << std::endl;
-    std::cout << "  i - Toggle magnetometros identicos/Y-splitter (actual: "
-              << (identical_magnetometers ? "SI - IDENTICOS" : "NO - INDEPENDIENTES") << ")" << std::endl;
-    std::cout << "  m - Mostrar este menu" << std::endl;
-    std::cout << "  q - Salir" << std::endl;
-    std::cout << "\nConfiguracion actual:" << std::endl;
-    std::cout << "  - GPS: 9600 baud, 8N1" << std::endl;
-    std::cout << "  - Magnetometros: 115200 baud, 8N1" << std::endl;
-    std::cout << "  - Datacount: 0-498 (incrementa de 2 en 2)" << std::endl;
-    std::cout << "  - Timestamp: incrementa de 4 en 4 ms" << std::endl;
-    std::cout << "\nPara probar en otra terminal:" << std::endl;
-    std::cout << "  GPS:  screen /dev/ttyAMA0 9600" << std::endl;
-    std::cout << "  MAG1: screen /dev/ttyAMA2 115200" << std::endl;
-    std::cout << "  MAG2: screen /dev/ttyAMA4 115200" << std::endl;
-    std::cout << "================================\n" << std::endl;
+// "2024-05-01T10:00:00.25Z" (o con desfase "+02:00") a segundos UTC desde 1970
+bool parseIsoTime(const char*& p, const char* end, double& seconds) {
+    int year, month, day, hours, minutes, whole;
+    if (!parseDigits(p, end, 4, year) || p == end || *p++ != '-' || !parseDigits(p, end, 2, month) ||
+        p == end || *p++ != '-' || !parseDigits(p, end, 2, day) || p == end || (*p != 'T' && *p != ' ')) {
+        return false;
+    }
+    p++;
+    if (!parseDigits(p, end, 2, hours) || p == end || *p++ != ':' || !parseDigits(p, end, 2, minutes) ||
+        p == end || *p++ != ':' || !parseDigits(p, end, 2, whole)) {
+        return false;
+    }
+    double fraction = 0.0;
+    if (p < end && *p == '.') {
+        const char* digits = p;
+        if (!parseFixedPoint(digits, end, fraction)) return false;
+        p = digits;
+    }
+    seconds = daysFromCivil(year, month, day) * 86400.0 + hours * 3600.0 + minutes * 60.0 + whole + fraction;
+    if (p < end && (*p == '+' || *p == '-')) {
+        int sign = *p++ == '+' ? 1 : -1;
+        int zone_hours, zone_minutes = 0;
+        if (!parseDigits(p, end, 2, zone_hours)) return false;
+        if (p < end && *p == ':') p++;
+        parseDigits(p, end, 2, zone_minutes);
+        seconds -= sign * (zone_hours * 3600.0 + zone_minutes * 60.0);
+    } else if (p < end && *p == 'Z') {
+        p++;
+    }
+    return true;
 }
 
-// Thread para manejar entrada del usuario
-void userInputThread() {
-    std::string input;
-    while (running) {
-        if (show_menu) {
-            showControlMenu();
-            show_menu = false;
-        }
+// Registro de vuelo real (GGA de NMEA, GPX o CSV) que sustituye a las líneas
+// del plan. El archivo se proyecta en memoria y no se carga: cada hilo lee
+// los fixes que rodean al instante consultado a una ventana propia, y un
+// índice disperso (el estado del lector cada TRACK_INDEX_STRIDE fixes) crece
+// solo hasta el instante más lejano pedido. Abrir un registro de una semana
+// es inmediato y la memoria queda acotada por el índice y las ventanas.
+// Las páginas ya leídas se devuelven al sistema a medida que se avanza.
+// Entre fixes se interpola con un spline cúbico de Hermite (tangentes por
+// diferencias centradas), continuo en posición y velocidad.
+const size_t TRACK_INDEX_STRIDE = 1024;
+const int TRACK_WINDOW = 64;
+const size_t TRACK_RELEASE_MARGIN = 1 << 20;  // Bytes leídos que se conservan proyectados
 
-        std::getline(std::cin, input);
+class TrackLog {
+public:
+    enum Format { NMEA, GPX, CSV };
 
-        if (input == "q") {
-            running = false;
-        } else if (input == "i") {
-            identical_magnetometers = !identical_magnetometers;
-            std::cout << "\n*** Magnetometros configurados como: "
-                      << (identical_magnetometers ? "IDENTICOS (Y-splitter)" : "INDEPENDIENTES")
-                      << " ***" << std::endl;
-            if (identical_magnetometers) {
-                std::cout << "Ambos magnetometros ahora emiten exactamente los mismos datos." << std::endl;
-            } else {
-                std::cout << "Cada magnetometro genera datos independientes con ruido propio." << std::endl;
+    static std::shared_ptr<const TrackLog> open(const std::string& path, std::string& error) {
+        std::shared_ptr<TrackLog> log(new TrackLog());
+        errno = 0;
+        if (!log->file_.open(path)) {
+            error = path + ": " + (errno != 0 ? strerror(errno) : "archivo vacio");
+            return std::shared_ptr<const TrackLog>();
+        }
+        if (!log->detectFormat()) {
+            error = path + ": cabecera CSV sin columnas de tiempo, latitud y longitud";
+            return std::shared_ptr<const TrackLog>();
+        }
+        Cursor cursor = log->start_;
+        Fix first;
+        if (!log->next(cursor, first)) {
+            error = path + ": no se encontro ningun fix con tiempo y posicion";
+            return std::shared_ptr<const TrackLog>();
+        }
+        log->t0_s_ = first.t_s;
+        log->latitude0_ = first.latitude;
+        log->longitude0_ = first.longitude;
+        log->altitude0_m_ = first.altitude_m;
+        log->cos_latitude0_ = std::cos(first.latitude * M_PI / 180.0);
+        log->scan_ = log->start_;
+        return log;
+    }
+
+    // Posición (este, norte, altura) relativa al primer fix, t segundos después
+    // de él; antes del primero y tras el último se queda en el extremo
+    Vec3 position(double t_s) const {
+        static thread_local Window window;
+        if (window.log_id != id_ || !covers(window, t_s)) {
+            int advances = 0;
+            while (window.log_id == id_ && !covers(window, t_s) && t_s > window.points[1].t_s && advances < 4) {
+                advance(window);
+                advances++;
             }
-            std::cout << std::endl;
-        } else if (input == "m") {
-            show_menu = true;
+            if (window.log_id != id_ || !covers(window, t_s)) reload(window, t_s);
         }
+        return interpolate(window, t_s);
     }
-}
 
-int main() {
-    // Verificar si se ejecuta como root
-    if (geteuid() != 0) {
-        std::cerr << "Este programa necesita permisos de root para crear dispositivos en /dev/" << std::endl;
-        std::cerr << "Por favor ejecuta con: sudo ./quspin_gps_simulator" << std::endl;
-        return 1;
+    // Recorre los fixes en orden (--replay): visit(t_s, begin, end) recibe el
+    // tiempo relativo al primero y el texto que lo contiene; false detiene
+    template <typename Visit>
+    void forEachFix(Visit visit) const {
+        Cursor cursor = start_;
+        Fix fix;
+        size_t begin;
+        while (next(cursor, fix, &begin)) {
+            if (!visit(fix.t_s, file_.data + begin, file_.data + cursor.offset)) return;
+        }
     }
 
-    // Instalar manejador de señal
-    signal(SIGINT, signalHandler);
-    signal(SIGTERM, signalHandler);
+    const MappedFile& file() const { return file_; }
+    Format format() const { return format_; }
+    double latitude0() const { return latitude0_; }
+    double longitude0() const { return longitude0_; }
+    double altitude0_m() const { return altitude0_m_; }
+    double cosLatitude0() const { return cos_latitude0_; }
+    // Hora UTC del primer fix en segundos del día
+    double startTimeOfDay() const { return std::fmod(t0_s_, 86400.0); }
 
-    std::cout << "=== INICIANDO SIMULADOR EN RASPBERRY PI 5 ===" << std::endl;
-    std::cout << "NOTA: Este simulador creara puertos virtuales en:" << std::endl;
-    std::cout << "  /dev/ttyAMA0 (GPS)" << std::endl;
-    std::cout << "  /dev/ttyAMA2 (Magnetometro 1)" << std::endl;
-    std::cout << "  /dev/ttyAMA4 (Magnetometro 2)" << std::endl;
-    std::cout << "\nSi tienes hardware real conectado, este sera temporalmente deshabilitado." << std::endl;
-    std::cout << "Los dispositivos originales seran restaurados al salir del simulador.\n" << std::endl;
+private:
+    // Estado del lector: dónde sigue y el reloj (las GGA solo dan la hora del
+    // día; la medianoche se cruza sumando un día)
+    struct Cursor {
+        size_t offset;
+        double last_raw_s;
+        double last_t_s;
+        int days;
+    };
 
-    // Limpiar puertos anteriores
-    std::cout << "Limpiando puertos anteriores..." << std::endl;
-    cleanupPorts();
+    struct Fix {
+        double t_s;  // Absoluto (días de registro + hora) hasta fijar t0_s_
+        double latitude;
+        double longitude;
+        double altitude_m;
+    };
 
-    std::cout << "\nPresiona ENTER para continuar o Ctrl+C para cancelar..." << std::endl;
-    std::cin.get();
-    std::cout << "Creando puertos virtuales..." << std::endl;
+    struct IndexEntry {
+        Cursor before;  // Estado del lector justo antes del fix
+        double t_s;
+    };
 
-    // Crear puertos virtuales
-    int gps_fd = createVirtualPort("/dev/ttyAMA0");
-    int mag1_fd = createVirtualPort("/dev/ttyAMA2");
-    int mag2_fd = createVirtualPort("/dev/ttyAMA4");
+    struct Point {
+        double t_s;
+        Vec3 local;
+    };
 
-    if (gps_fd == -1 || mag1_fd == -1 || mag2_fd == -1) {
-        std::cerr << "Error al crear puertos virtuales" << std::endl;
-        // Limpiar lo que se haya creado
-        cleanupPorts();
-        return 1;
+    // Fixes consecutivos alrededor del último instante consultado por un hilo
+    struct Window {
+        Window() : log_id(0), count(0), from_start(false), at_end(false), released(0) {}
+        uint64_t log_id;
+        int count;
+        bool from_start;  // points[0] es el primer fix del registro
+        bool at_end;      // points[count - 1] es el último
+        Cursor next;
+        size_t released;  // Hasta dónde se han devuelto las páginas
+        Point points[TRACK_WINDOW];
+    };
+
+    TrackLog() : id_(next_id_++), format_(NMEA), t0_s_(0.0), latitude0_(0.0), longitude0_(0.0),
+                 altitude0_m_(0.0), cos_latitude0_(1.0), scanned_(0), scan_last_t_s_(0.0),
+                 scan_released_(0), scan_complete_(false) {
+        csv_columns_[0] = 0;
+        csv_columns_[1] = 1;
+        csv_columns_[2] = 2;
+        csv_columns_[3] = 3;
+        start_.offset = 0;
+        start_.last_raw_s = 0.0;
+        start_.last_t_s = -INFINITY;
+        start_.days = 0;
     }
 
-    // Mostrar menú inicial
-    show_menu = true;
+    // Por el primer carácter significativo: '<' GPX, '$' NMEA y si no CSV,
+    // con cabecera opcional (columnas time/lat/lon/alt y sinónimos)
+    bool detectFormat() {
+        const char* p = file_.data;
+        const char* end = file_.data + file_.size;
+        if (end - p >= 3 && memcmp(p, "\xEF\xBB\xBF", 3) == 0) p += 3;
+        while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')) p++;
+        if (p < end && *p == '<') {
+            format_ = GPX;
+            return true;
+        }
+        if (p < end && *p == '$') {
+            format_ = NMEA;
+            return true;
+        }
+        format_ = CSV;
+        const char* line_end = static_cast<const char*>(memchr(p, '\n', end - p));
+        if (line_end == NULL) line_end = end;
+        if (p < line_end && ((*p >= '0' && *p <= '9') || *p == '-' || *p == '.')) return true;  // Sin cabecera
 
-    // Crear threads
-    std::thread gps_thread(gpsEmulatorThread, gps_fd, "/dev/ttyAMA0");
-    std::thread mag1_thread(magnetometerEmulatorThread, mag1_fd, "/dev/ttyAMA2", 1);
-    std::thread mag2_thread(magnetometerEmulatorThread, mag2_fd, "/dev/ttyAMA4", 2);
-    std::thread input_thread(userInputThread);
+        static const char* const names[4][6] = {
+            {"time", "t", "t_s", "timestamp", "utc", "datetime"},
+            {"lat", "latitude", "lat_deg", "", "", ""},
+            {"lon", "lng", "long", "longitude", "lon_deg", ""},
+            {"alt", "altitude", "alt_m", "ele", "elevation", "height"}};
+        for (int c = 0; c < 4; c++) csv_columns_[c] = -1;
+        int column = 0;
+        for (const char* field = p; field <= line_end; column++) {
+            const char* field_end = field;
+            while (field_end < line_end && *field_end != ',') field_end++;
+            std::string name = trimAscii(field, field_end);
+            for (int c = 0; c < 4; c++) {
+                for (int n = 0; n < 6 && names[c][n][0] != '\0'; n++) {
+                    if (name == names[c][n] && csv_columns_[c] < 0) csv_columns_[c] = column;
+                }
+            }
+            field = field_end + 1;
+        }
+        start_.offset = static_cast<size_t>(line_end - file_.data);
+        return csv_columns_[0] >= 0 && csv_columns_[1] >= 0 && csv_columns_[2] >= 0;
+    }
 
-    // Esperar a que terminen los threads
-    gps_thread.join();
-    mag1_thread.join();
-    mag2_thread.join();
-    input_thread.join();
+    static std::string trimAscii(const char* begin, const char* end) {
+        while (begin < end && (*begin == ' ' || *begin == '\t' || *begin == '"')) begin++;
+        while (end > begin && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r' || end[-1] == '"')) end--;
+        std::string name(begin, end);
+        for (size_t i = 0; i < name.size(); i++) name[i] = static_cast<char>(tolower(name[i]));
+        return name;
+    }
 
-    // Limpiar
-    close(gps_fd);
-    close(mag1_fd);
-    close(mag2_fd);
+    // Siguiente fix con tiempo posterior al anterior (begin: dónde empieza su
+    // texto); false al final del archivo
+    bool next(Cursor& cursor, Fix& fix, size_t* begin = NULL) const {
+        const char* end = file_.data + file_.size;
+        while (cursor.offset < file_.size) {
+            if (begin != NULL) *begin = cursor.offset;
+            const char* p = file_.data + cursor.offset;
+            double raw_s;
+            bool parsed = format_ == GPX ? readGpxPoint(p, end, raw_s, fix) : readLine(p, end, raw_s, fix);
+            cursor.offset = static_cast<size_t>(p - file_.data);
+            if (!parsed) continue;
+            if (format_ == NMEA && raw_s < cursor.last_raw_s - 43200.0) cursor.days++;
+            cursor.last_raw_s = raw_s;
+            double t_s = raw_s + cursor.days * 86400.0;
+            if (t_s <= cursor.last_t_s) continue;
+            cursor.last_t_s = t_s;
+            fix.t_s = t_s - t0_s_;
+            return true;
+        }
+        return false;
+    }
 
-    std::cout << "\nLimpiando puertos virtuales..." << std::endl;
+    // Una línea NMEA o CSV; p queda tras ella
+    bool readLine(const char*& p, const char* end, double& raw_s, Fix& fix) const {
+        const char* line_end = static_cast<const char*>(memchr(p, '\n', end - p));
+        if (line_end == NULL) line_end = end;
+        const char* line = p;
+        p = line_end < end ? line_end + 1 : end;
+        if (format_ == NMEA) {
+            return parseGgaFix(line, line_end, raw_s, fix.latitude, fix.longitude, &fix.altitude_m);
+        }
 
-    // Eliminar symlinks
-    unlink("/dev/ttyAMA0");
-    unlink("/dev/ttyAMA2");
-    unlink("/dev/ttyAMA4");
+        bool found[4] = {false, false, false, false};
+        double values[4] = {0.0, 0.0, 0.0, 0.0};
+        int column = 0;
+        for (const char* field = line; field < line_end; column++) {
+            while (field < line_end && (*field == ' ' || *field == '\t' || *field == '"')) field++;
+            for (int c = 0; c < 4; c++) {
+                if (column != csv_columns_[c]) continue;
+                const char* q = field;
+                found[c] = (c == 0 && parseIsoTime(q, line_end, values[c])) ||
+                           (q = field, parseFixedPoint(q, line_end, values[c]));
+            }
+            field = static_cast<const char*>(memchr(field, ',', line_end - field));
+            if (field == NULL) break;
+            field++;
+        }
+        if (!found[0] || !found[1] || !found[2]) return false;
+        raw_s = values[0];
+        fix.latitude = values[1];
+        fix.longitude = values[2];
+        fix.altitude_m = values[3];
+        return true;
+    }
 
-    // Restaurar backups si existen
-    struct stat st;
-    if (stat("/dev/ttyAMA0.backup", &st) == 0) {
-        rename("/dev/ttyAMA0.backup", "/dev/ttyAMA0");
-        std::cout << "Restaurado /dev/ttyAMA0 original" << std::endl;
+    // Un <trkpt lat=".." lon=".."> con <time> y <ele> opcional; p queda tras él
+    bool readGpxPoint(const char*& p, const char* end, double& raw_s, Fix& fix) const {
+        const char* point = static_cast<const char*>(memmem(p, end - p, "<trkpt", 6));
+        if (point == NULL) {
+            p = end;
+            return false;
+        }
+        const char* tag_end = static_cast<const char*>(memchr(point, '>', end - point));
+        const char* close = tag_end != NULL ? static_cast<const char*>(memmem(tag_end, end - tag_end, "</trkpt>", 8))
+                                            : NULL;
+        if (close == NULL) {
+            p = end;
+            return false;
+        }
+        p = close + 8;
+        fix.altitude_m = 0.0;
+        if (!gpxAttribute(point, tag_end, " lat=", fix.latitude) ||
+            !gpxAttribute(point, tag_end, " lon=", fix.longitude)) {
+            return false;
+        }
+        const char* ele = static_cast<const char*>(memmem(tag_end, close - tag_end, "<ele>", 5));
+        if (ele != NULL) {
+            ele += 5;
+            parseFixedPoint(ele, close, fix.altitude_m);
+        }
+        const char* time = static_cast<const char*>(memmem(tag_end, close - tag_end, "<time>", 6));
+        if (time == NULL) return false;
+        time += 6;
+        return parseIsoTime(time, close, raw_s);
     }
-    if (stat("/dev/ttyAMA2.backup", &st) == 0) {
-        rename("/dev/ttyAMA2.backup", "/dev/ttyAMA2");
-        std::cout << "Restaurado /dev/ttyAMA2 original" << std::endl;
+
+    static bool gpxAttribute(const char* begin, const char* end, const char* name, double& value) {
+        size_t length = strlen(name);
+        const char* p = static_cast<const char*>(memmem(begin, end - begin, name, length));
+        if (p == NULL || end - p < static_cast<ptrdiff_t>(length) + 2) return false;
+        p += length + 1;  // Comilla simple o doble
+        return parseFixedPoint(p, end, value);
     }
-    if (stat("/dev/ttyAMA4.backup", &st) == 0) {
-        rename("/dev/ttyAMA4.backup", "/dev/ttyAMA4");
-        std::cout << "Restaurado /dev/ttyAMA4 original" << std::endl;
+
+    Vec3 project(const Fix& fix) const {
+        const double meters_per_degree = 111320.0;
+        return Vec3((fix.longitude - longitude0_) * meters_per_degree * cos_latitude0_,
+                    (fix.latitude - latitude0_) * meters_per_degree, fix.altitude_m - altitude0_m_);
     }
 
-    std::cout << "Simulador terminado." << std::endl;
+    // La ventana sirve si hay un fix antes y dos después del tramo de t
+    // (menos en los extremos del registro)
+    bool covers(const Window& window, double t_s) const {
+        if (window.count == 0) return false;
+        bool lower = window.from_start ? true : window.count > 1 && t_s >= window.points[1].t_s;
+        bool upper = window.at_end || (window.count > 2 && t_s < window.points[window.count - 2].t_s);
+        return lower && upper;
+    }
 
-    return 0;
-}
\ No newline at end of file
+    void fill(Window& window) const {
+        Fix fix;
+        while (window.count < TRACK_WINDOW && !window.at_end) {
+            if (next(window.next, fix)) {
+                window.points[window.count].t_s = fix.t_s;
+                window.points[window.count].local = project(fix);
+                window.count++;
+            } else {
+                window.at_end = true;
+            }
+        }
+    }
+
+    // Conserva los tres últimos fixes y sigue leyendo
+    void advance(Window& window) const {
+        if (window.at_end || window.count < 3) return;
+        std::copy(window.points + window.count - 3, window.points + window.count, window.points);
+        window.count = 3;
+        window.from_start = false;
+        fill(window);
+        release(window.released, window.next.offset);
+    }
+
+    // Devuelve las páginas de [released, offset - margen): la proyección es
+    // privada y de solo lectura, así que si otro hilo vuelve a necesitarlas se
+    // leen de nuevo del archivo
+    void release(size_t& released, size_t offset) const {
+        if (offset < released + 2 * TRACK_RELEASE_MARGIN) return;
+        size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+        size_t end = (offset - TRACK_RELEASE_MARGIN) / page * page;
+        madvise(const_cast<char*>(file_.data) + released, end - released, MADV_DONTNEED);
+        released = end;
+    }
+
+    // Sitúa la ventana con el índice (que se extiende hasta t si hace falta)
+    void reload(Window& window, double t_s) const {
+        IndexEntry entry;
+        bool from_start;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            Fix fix;
+            while (!scan_complete_ && (index_.empty() || scan_last_t_s_ < t_s)) {
+                Cursor before = scan_;
+                if (!next(scan_, fix)) {
+                    scan_complete_ = true;
+                    break;
+                }
+                if (scanned_ % TRACK_INDEX_STRIDE == 0) {
+                    IndexEntry added = {before, fix.t_s};
+                    index_.push_back(added);
+                }
+                scanned_++;
+                scan_last_t_s_ = fix.t_s;
+                release(scan_released_, scan_.offset);
+            }
+            // La entrada anterior a la del tramo aporta el fix previo
+            size_t k = std::upper_bound(index_.begin(), index_.end(), t_s,
+                                        [](double t, const IndexEntry& e) { return t < e.t_s; }) - index_.begin();
+            k = k > 1 ? k - 2 : 0;
+            entry = index_[k];
+            from_start = k == 0;
+        }
+        window.log_id = id_;
+        window.count = 0;
+        window.from_start = from_start;
+        window.at_end = false;
+        window.next = entry.before;
+        size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+        window.released = entry.before.offset / page * page;
+        fill(window);
+        while (!covers(window, t_s) && !window.at_end) advance(window);
+    }
+
+    Vec3 interpolate(const Window& window, double t_s) const {
+        const Point* points = window.points;
+        int count = window.count;
+        if (t_s <= points[0].t_s) return points[0].local;
+        if (t_s >= points[count - 1].t_s) return points[count - 1].local;
+        int i = 0;
+        while (i + 2 < count && points[i + 1].t_s <= t_s) i++;
+        double h = points[i + 1].t_s - points[i].t_s;
+        double s = (t_s - points[i].t_s) / h;
+        Vec3 m0 = tangent(points, count, i);
+        Vec3 m1 = tangent(points, count, i + 1);
+        double s2 = s * s, s3 = s2 * s;
+        return points[i].local * (2 * s3 - 3 * s2 + 1) + m0 * (h * (s3 - 2 * s2 + s)) +
+               points[i + 1].local * (3 * s2 - 2 * s3) + m1 * (h * (s3 - s2));
+    }
+
+    static Vec3 tangent(const Point* points, int count, int k) {
+        int a = std::max(0, k - 1);
+        int b = std::min(count - 1, k + 1);
+        return (points[b].local - points[a].local) * (1.0 / (points[b].t_s - points[a].t_s));
+    }
+
+    static std::atomic<uint64_t> next_id_;
+    uint64_t id_;
+    MappedFile file_;
+    Format format_;
+    int csv_columns_[4];  // Tiempo, latitud, longitud y altitud (-1: sin ella)
+    Cursor start_;
+    double t0_s_;
+    double latitude0_;
+    double longitude0_;
+    double altitude0_m_;
+    double cos_latitude0_;
+
+    mutable std::mutex mutex_;
+    mutable std::vector<IndexEntry> index_;
+    mutable Cursor scan_;
+    mutable size_t scanned_;
+    mutable double scan_last_t_s_;
+    mutable size_t scan_released_;
+    mutable bool scan_complete_;
+};
+
+std::atomic<uint64_t> TrackLog::next_id_(1);
+
+// Plan de vuelo en "cortacésped": líneas paralelas hacia el norte/sur separadas
+// hacia el este. Sin líneas la plataforma queda estacionaria en el origen.
+// Con un registro (track) la plataforma lo sigue desde track_offset_s: el
+// origen del marco local es su primer fix, a flight_height_m, y la altura
+// varía con la altitud registrada.
+struct SurveyPlan {
+    double speed_mps = 5.0;
+    double line_length_m = 100.0;
+    double line_spacing_m = 10.0;
+    int lines = 0;
+    double flight_height_m = 2.0;
+    double origin_east_m = 0.0;  // Desplazamiento de la zona de cada plataforma
+    std::shared_ptr<const TrackLog> track;
+    double track_offset_s = 0.0;
+
+    // Posición de la plataforma en el marco local en el instante t
+    Vec3 position(double t_s) const {
+        if (track) {
+            Vec3 p = track->position(t_s + track_offset_s);
+            return Vec3(origin_east_m + p.x, p.y, flight_height_m + p.z);
+        }
+        if (lines <= 0 || speed_mps <= 0.0 || line_length_m <= 0.0) {
+            return Vec3(origin_east_m, 0.0, flight_height_m);
+        }
+        double line_time = line_length_m / speed_mps;
+        int line = static_cast<int>(t_s / line_time);
+        double along = (t_s - line * line_time) * speed_mps;
+        if (line >= lines) {
+            line = lines - 1;
+            along = line_length_m;
+        }
+        double north = (line % 2 == 0) ? along : line_length_m - along;
+        return Vec3(origin_east_m + line * line_spacing_m, north, flight_height_m);
+    }
+
+    double duration() const {
+        return (lines > 0 && speed_mps > 0.0) ? lines * line_length_m / speed_mps : 0.0;
+    }
+};
+
+// Periodos de emisión de cada dispositivo en microsegundos de simulación
+const uint64_t GPS_PERIOD_US = 100000;  // 10Hz
+const uint64_t MAG_PERIOD_US = 4000;    // 250Hz
+const int NUM_MAGNETOMETERS = 2;
+const int DEVICES_PER_PLATFORM = 1 + NUM_MAGNETOMETERS;  // GPS y magnetómetros
+const int IMU_DEVICE = DEVICES_PER_PLATFORM;  // Puerto opcional de la IMU (imu_rate_hz)
+const int MAX_PORTS_PER_PLATFORM = DEVICES_PER_PLATFORM + 1;
+const int MAX_PLATFORMS = 8;
+const int MAX_DECIMATION_TAPS = 256;  // Longitud máxima del FIR de decimación
+
+// ============================================================================
+// Actitud de la plataforma y firma magnética (Tolles–Lawson)
+// ============================================================================
+
+// Actitud en radianes con la convención aeronáutica (guiñada desde el norte
+// hacia el este, cabeceo positivo con el morro arriba, alabeo positivo con el
+// ala derecha abajo) y sus derivadas en rad/s
+struct Attitude {
+    double roll, pitch, yaw;
+    double roll_rate, pitch_rate, yaw_rate;
+};
+
+// Serie de actitud leída de un CSV (t_s, alabeo, cabeceo y guiñada en grados)
+struct AttitudeTable {
+    std::vector<double> t_s;
+    std::vector<double> angles[3];  // Alabeo, cabeceo y guiñada (desenrollada) en rad
+};
+
+std::shared_ptr<const AttitudeTable> loadAttitudeTable(const std::string& path, std::string& error) {
+    FILE* file = fopen(path.c_str(), "r");
+    if (!file) {
+        error = path + ": " + strerror(errno);
+        return std::shared_ptr<const AttitudeTable>();
+    }
+    std::shared_ptr<AttitudeTable> table(new AttitudeTable());
+    char line[512];
+    while (fgets(line, sizeof(line), file)) {
+        double t, roll, pitch, yaw;
+        if (sscanf(line, " %lf , %lf , %lf , %lf", &t, &roll, &pitch, &yaw) != 4) continue;
+        if (!table->t_s.empty() && t <= table->t_s.back()) continue;
+        yaw *= M_PI / 180.0;
+        if (!table->t_s.empty()) {
+            // Sin saltos de 2π entre filas
+            double previous = table->angles[2].back();
+            yaw = previous + std::remainder(yaw - previous, 2.0 * M_PI);
+        }
+        table->t_s.push_back(t);
+        table->angles[0].push_back(roll * M_PI / 180.0);
+        table->angles[1].push_back(pitch * M_PI / 180.0);
+        table->angles[2].push_back(yaw);
+    }
+    fclose(file);
+    if (table->t_s.empty()) {
+        error = path + ": ninguna fila 't_s, alabeo, cabeceo, guinada'";
+        return std::shared_ptr<const AttitudeTable>();
+    }
+    return table;
+}
+
+// Guion de actitud de las plataformas. Con tabla, la actitud es la suya
+// (interpolada linealmente; fuera de ella se mantiene el extremo). Si no, el
+// rumbo es la dirección de avance del plan y encima se vuelan maniobras de
+// compensación: oscilaciones senoidales de alabeo, cabeceo y guiñada por
+// turnos, cada una durante block_s (redondeado a periodos enteros para que
+// los bloques empalmen sin saltos). Las de amplitud nula no tienen turno.
+struct AttitudeScript {
+    std::shared_ptr<const AttitudeTable> table;
+    double roll_deg = 0.0;
+    double pitch_deg = 0.0;
+    double yaw_deg = 0.0;
+    double period_s = 6.0;
+    double block_s = 30.0;
+
+    Attitude at(const SurveyPlan& survey, double t_s) const {
+        Attitude attitude = {0.0, 0.0, 0.0, 0.0, 0.0, 0.0};
+        if (table) {
+            const std::vector<double>& t = table->t_s;
+            size_t k = std::upper_bound(t.begin(), t.end(), t_s) - t.begin();
+            if (k == 0 || k == t.size()) {
+                size_t edge = k == 0 ? 0 : t.size() - 1;
+                attitude.roll = table->angles[0][edge];
+                attitude.pitch = table->angles[1][edge];
+                attitude.yaw = table->angles[2][edge];
+                return attitude;
+            }
+            double span = t[k] - t[k - 1];
+            double f = (t_s - t[k - 1]) / span;
+            double* angles[3] = {&attitude.roll, &attitude.pitch, &attitude.yaw};
+            double* rates[3] = {&attitude.roll_rate, &attitude.pitch_rate, &attitude.yaw_rate};
+            for (int a = 0; a < 3; a++) {
+                const std::vector<double>& angle = table->angles[a];
+                *angles[a] = angle[k - 1] + f * (angle[k] - angle[k - 1]);
+                *rates[a] = (angle[k] - angle[k - 1]) / span;
+            }
+            return attitude;
+        }
+
+        // Rumbo de avance y su derivada; un giro de más de 45° en 0.1 s es
+        // un cambio de línea (discontinuidad del plan), no una velocidad angular
+        const double dt = 0.05;
+        double heading_before, heading, heading_after;
+        if (headingAt(survey, t_s - dt, heading_before) && headingAt(survey, t_s, heading) &&
+            headingAt(survey, t_s + dt, heading_after)) {
+            attitude.yaw = heading;
+            double turn = std::remainder(heading_after - heading_before, 2.0 * M_PI);
+            if (std::abs(turn) < M_PI / 4.0) attitude.yaw_rate = turn / (2.0 * dt);
+        }
+
+        double amplitudes[3] = {roll_deg, pitch_deg, yaw_deg};
+        int active[3], count = 0;
+        for (int a = 0; a < 3; a++) {
+            if (amplitudes[a] != 0.0) active[count++] = a;
+        }
+        if (count == 0 || period_s <= 0.0 || t_s < 0.0) return attitude;
+        double block = std::max(1.0, std::round(block_s / period_s)) * period_s;
+        int turn = active[static_cast<int64_t>(t_s / block) % count];
+        double omega = 2.0 * M_PI / period_s;
+        double phase = omega * std::fmod(t_s, block);
+        double amplitude = amplitudes[turn] * M_PI / 180.0;
+        double angle = amplitude * std::sin(phase);
+        double rate = amplitude * omega * std::cos(phase);
+        if (turn == 0) { attitude.roll = angle; attitude.roll_rate = rate; }
+        else if (turn == 1) { attitude.pitch = angle; attitude.pitch_rate = rate; }
+        else { attitude.yaw += angle; attitude.yaw_rate += rate; }
+        return attitude;
+    }
+
+private:
+    static bool headingAt(const SurveyPlan& survey, double t_s, double& heading) {
+        const double dt = 0.025;
+        Vec3 step = survey.position(t_s + dt) - survey.position(t_s - dt);
+        if (step.x * step.x + step.y * step.y < 1e-12) return false;
+        heading = std::atan2(step.x, step.y);  // Desde el norte hacia el este
+        return true;
+    }
+};
+
+// Giro del marco local (este, norte, arriba) a los ejes de la plataforma (x al
+// morro, y al ala derecha, z abajo) para una actitud
+struct BodyRotation {
+    double cr, sr, cp, sp, cy, sy;
+
+    explicit BodyRotation(const Attitude& a)
+        : cr(std::cos(a.roll)), sr(std::sin(a.roll)), cp(std::cos(a.pitch)), sp(std::sin(a.pitch)),
+          cy(std::cos(a.yaw)), sy(std::sin(a.yaw)) {}
+
+    Vec3 apply(const Vec3& v) const {
+        // Local a norte, este, abajo; después guiñada, cabeceo y alabeo
+        double n = v.y, e = v.x, down = -v.z;
+        double x1 = cy * n + sy * e, y1 = -sy * n + cy * e, z1 = down;
+        double x2 = cp * x1 - sp * z1, z2 = sp * x1 + cp * z1;
+        return Vec3(x2, cr * y1 + sr * z2, -sr * y1 + cr * z2);
+    }
+
+    // Velocidad angular (p, q, r) en ejes de la plataforma
+    Vec3 rates(const Attitude& a) const {
+        return Vec3(a.roll_rate - a.yaw_rate * sp, a.pitch_rate * cr + a.yaw_rate * cp * sr,
+                    -a.pitch_rate * sr + a.yaw_rate * cp * cr);
+    }
+};
+
+// Cosenos directores de la dirección unitaria d (marco local) en ejes de la
+// plataforma y su derivada: el campo está fijo, así que ċ = c × ω con ω la
+// velocidad angular en ejes de la plataforma
+void bodyCosines(const Attitude& a, const Vec3& d, double c[3], double dc[3]) {
+    BodyRotation rotation(a);
+    Vec3 body = rotation.apply(d);
+    Vec3 w = rotation.rates(a);
+    c[0] = body.x;
+    c[1] = body.y;
+    c[2] = body.z;
+    dc[0] = c[1] * w.z - c[2] * w.y;
+    dc[1] = c[2] * w.x - c[0] * w.z;
+    dc[2] = c[0] * w.y - c[1] * w.x;
+}
+
+// Coeficientes de Tolles–Lawson de un cabezal. La interferencia de la
+// plataforma sobre el campo total |B| es
+//   H = Σ p_i c_i + |B| Σ a_ij c_i c_j + |B| Σ b_ij c_i ċ_j
+// con el término permanente en nT, el inducido (i <= j, seis términos)
+// adimensional y el de corrientes de Foucault (nueve términos) en segundos.
+struct PlatformSignature {
+    double permanent_nT[3] = {0.0, 0.0, 0.0};
+    double induced[6] = {0.0, 0.0, 0.0, 0.0, 0.0, 0.0};  // xx, xy, xz, yy, yz, zz
+    double eddy[9] = {0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0};  // xx, xy, xz, yx, ... zz
+
+    bool active() const {
+        for (int i = 0; i < 3; i++) if (permanent_nT[i] != 0.0) return true;
+        for (int i = 0; i < 6; i++) if (induced[i] != 0.0) return true;
+        for (int i = 0; i < 9; i++) if (eddy[i] != 0.0) return true;
+        return false;
+    }
+
+    // Coeficiente de la clave "perm_x", "ind_xy", "eddy_zx"... (NULL si no existe)
+    double* coefficient(const std::string& term) {
+        static const char* const axes = "xyz";
+        if (term.size() == 6 && term.compare(0, 5, "perm_") == 0 && strchr(axes, term[5])) {
+            return &permanent_nT[strchr(axes, term[5]) - axes];
+        }
+        if (term.size() == 6 && term.compare(0, 4, "ind_") == 0 && strchr(axes, term[4]) && strchr(axes, term[5])) {
+            int i = static_cast<int>(strchr(axes, term[4]) - axes), j = static_cast<int>(strchr(axes, term[5]) - axes);
+            if (i > j) std::swap(i, j);
+            static const int slot[3][3] = {{0, 1, 2}, {1, 3, 4}, {2, 4, 5}};
+            return &induced[slot[i][j]];
+        }
+        if (term.size() == 7 && term.compare(0, 5, "eddy_") == 0 && strchr(axes, term[5]) && strchr(axes, term[6])) {
+            return &eddy[3 * (strchr(axes, term[5]) - axes) + (strchr(axes, term[6]) - axes)];
+        }
+        return NULL;
+    }
+};
+
+// ============================================================================
+// Fórmulas de campo por muestra (field, magN_field)
+// ============================================================================
+
+// Expresión aritmética del escenario con el campo escalar sin ruido de un
+// cabezal, p. ej. "base + anomaly + 5 * sin(2 * pi * 0.3 * t)". Se compila una
+// vez a un bytecode de pila, con las subexpresiones constantes ya plegadas, y
+// se evalúa por lotes: cada instrucción recorre todas las muestras del lote,
+// así que el despacho se paga una vez por lote y no por muestra.
+const int FORMULA_BATCH = 64;
+const int FORMULA_MAX_DEPTH = 32;
+
+enum FormulaVariable {
+    FORMULA_T,         // Tiempo de simulación (s)
+    FORMULA_X,         // Posición del cabezal en el marco local (m)
+    FORMULA_Y,
+    FORMULA_Z,
+    FORMULA_HEAD,      // Número de cabezal (1..)
+    FORMULA_PLATFORM,  // Número de plataforma (1..)
+    FORMULA_BASE,      // Campo de referencia escalar (nT)
+    FORMULA_ANOMALY,   // Anomalía de las fuentes (nT)
+    FORMULA_VARIABLES
+};
+
+struct FormulaInputs {
+    double values[FORMULA_VARIABLES][FORMULA_BATCH];
+};
+
+class FieldFormula {
+public:
+    static std::shared_ptr<const FieldFormula> compile(const std::string& text, std::string& error) {
+        std::shared_ptr<FieldFormula> formula(new FieldFormula());
+        Parser parser(text, *formula);
+        if (!parser.parse(error)) return std::shared_ptr<const FieldFormula>();
+        return formula;
+    }
+
+    // out[i] para las count (<= FORMULA_BATCH) muestras de inputs
+    void evaluate(const FormulaInputs& inputs, int count, double* out) const {
+        double stack[FORMULA_MAX_DEPTH][FORMULA_BATCH];
+        run(code_.data(), code_.size(), &inputs, count, stack);
+        std::copy(stack[0], stack[0] + count, out);
+    }
+
+    bool uses(FormulaVariable variable) const { return (variables_ & (1u << variable)) != 0; }
+
+private:
+    enum Op : uint8_t {
+        PUSH_CONST, PUSH_VAR, NEG, NOT, ADD, SUB, MUL, DIV, MOD, POW,
+        LT, LE, GT, GE, EQ, NE, AND, OR, CALL1, CALL2, SELECT
+    };
+
+    struct Instruction {
+        Op op;
+        uint8_t arg;  // Variable o función
+        double value;
+    };
+
+    typedef double (*Function1)(double);
+    typedef double (*Function2)(double, double);
+
+    struct FunctionName {
+        const char* name;
+        int arity;
+        Function1 f1;
+        Function2 f2;
+    };
+
+    static const FunctionName* functions() {
+        static const FunctionName table[] = {
+            {"sin", 1, [](double a) { return std::sin(a); }, NULL},
+            {"cos", 1, [](double a) { return std::cos(a); }, NULL},
+            {"tan", 1, [](double a) { return std::tan(a); }, NULL},
+            {"asin", 1, [](double a) { return std::asin(a); }, NULL},
+            {"acos", 1, [](double a) { return std::acos(a); }, NULL},
+            {"atan", 1, [](double a) { return std::atan(a); }, NULL},
+            {"sqrt", 1, [](double a) { return std::sqrt(a); }, NULL},
+            {"exp", 1, [](double a) { return std::exp(a); }, NULL},
+            {"log", 1, [](double a) { return std::log(a); }, NULL},
+            {"log10", 1, [](double a) { return std::log10(a); }, NULL},
+            {"abs", 1, [](double a) { return std::abs(a); }, NULL},
+            {"floor", 1, [](double a) { return std::floor(a); }, NULL},
+            {"ceil", 1, [](double a) { return std::ceil(a); }, NULL},
+            {"round", 1, [](double a) { return std::round(a); }, NULL},
+            {"step", 1, [](double a) { return a >= 0.0 ? 1.0 : 0.0; }, NULL},
+            {"atan2", 2, NULL, [](double a, double b) { return std::atan2(a, b); }},
+            {"pow", 2, NULL, [](double a, double b) { return std::pow(a, b); }},
+            {"min", 2, NULL, [](double a, double b) { return std::min(a, b); }},
+            {"max", 2, NULL, [](double a, double b) { return std::max(a, b); }},
+            {"hypot", 2, NULL, [](double a, double b) { return std::hypot(a, b); }},
+            {"if", 3, NULL, NULL},
+            {NULL, 0, NULL, NULL}};
+        return table;
+    }
+
+    static void run(const Instruction* code, size_t length, const FormulaInputs* inputs, int count,
+                    double (*stack)[FORMULA_BATCH]) {
+        int top = -1;
+        for (size_t k = 0; k < length; k++) {
+            const Instruction& in = code[k];
+            if (in.op == PUSH_CONST) {
+                top++;
+                std::fill(stack[top], stack[top] + count, in.value);
+                continue;
+            }
+            if (in.op == PUSH_VAR) {
+                top++;
+                std::copy(inputs->values[in.arg], inputs->values[in.arg] + count, stack[top]);
+                continue;
+            }
+            double* a = stack[top];
+            if (in.op == NEG) {
+                for (int i = 0; i < count; i++) a[i] = -a[i];
+            } else if (in.op == NOT) {
+                for (int i = 0; i < count; i++) a[i] = a[i] == 0.0 ? 1.0 : 0.0;
+            } else if (in.op == CALL1) {
+                Function1 f = functions()[in.arg].f1;
+                for (int i = 0; i < count; i++) a[i] = f(a[i]);
+            } else if (in.op == SELECT) {
+                top -= 2;
+                double* c = stack[top];
+                const double* x = stack[top + 1];
+                const double* y = stack[top + 2];
+                for (int i = 0; i < count; i++) c[i] = c[i] != 0.0 ? x[i] : y[i];
+            } else {
+                top--;
+                a = stack[top];
+                const double* b = stack[top + 1];
+                switch (in.op) {
+                    case ADD: for (int i = 0; i < count; i++) a[i] += b[i]; break;
+                    case SUB: for (int i = 0; i < count; i++) a[i] -= b[i]; break;
+                    case MUL: for (int i = 0; i < count; i++) a[i] *= b[i]; break;
+                    case DIV: for (int i = 0; i < count; i++) a[i] /= b[i]; break;
+                    case MOD: for (int i = 0; i < count; i++) a[i] = std::fmod(a[i], b[i]); break;
+                    case POW: for (int i = 0; i < count; i++) a[i] = std::pow(a[i], b[i]); break;
+                    case LT: for (int i = 0; i < count; i++) a[i] = a[i] < b[i] ? 1.0 : 0.0; break;
+                    case LE: for (int i = 0; i < count; i++) a[i] = a[i] <= b[i] ? 1.0 : 0.0; break;
+                    case GT: for (int i = 0; i < count; i++) a[i] = a[i] > b[i] ? 1.0 : 0.0; break;
+                    case GE: for (int i = 0; i < count; i++) a[i] = a[i] >= b[i] ? 1.0 : 0.0; break;
+                    case EQ: for (int i = 0; i < count; i++) a[i] = a[i] == b[i] ? 1.0 : 0.0; break;
+                    case NE: for (int i = 0; i < count; i++) a[i] = a[i] != b[i] ? 1.0 : 0.0; break;
+                    case AND: for (int i = 0; i < count; i++) a[i] = a[i] != 0.0 && b[i] != 0.0 ? 1.0 : 0.0; break;
+                    case OR: for (int i = 0; i < count; i++) a[i] = a[i] != 0.0 || b[i] != 0.0 ? 1.0 : 0.0; break;
+                    case CALL2: {
+                        Function2 f = functions()[in.arg].f2;
+                        for (int i = 0; i < count; i++) a[i] = f(a[i], b[i]);
+                        break;
+                    }
+                    default: break;
+                }
+            }
+        }
+    }
+
+    // Descenso recursivo que emite el bytecode directamente. Precedencia de
+    // menor a mayor: ||, &&, comparaciones, + -, * / %, unarios, ^ (por la
+    // derecha, de modo que -2^2 = -4)
+    class Parser {
+    public:
+        Parser(const std::string& text, FieldFormula& formula)
+            : text_(text), pos_(0), depth_(0), formula_(formula) {}
+
+        bool parse(std::string& error) {
+            bool ok = parseOr() && (skipSpace(), pos_ == text_.size() || fail("sobra texto"));
+            if (ok && formula_.code_.empty()) ok = fail("expresion vacia");
+            if (!ok) error = "posicion " + std::to_string(error_pos_ + 1) + ": " + error_;
+            return ok;
+        }
+
+    private:
+        bool fail(const std::string& message) {
+            error_ = message;
+            error_pos_ = pos_;
+            return false;
+        }
+
+        void skipSpace() {
+            while (pos_ < text_.size() && (text_[pos_] == ' ' || text_[pos_] == '\t')) pos_++;
+        }
+
+        // Consume token si es el siguiente (sin confundir "<" con "<=")
+        bool accept(const char* token) {
+            skipSpace();
+            size_t length = strlen(token);
+            if (text_.compare(pos_, length, token) != 0) return false;
+            if (length == 1 && pos_ + 1 < text_.size() && text_[pos_ + 1] == '=' && strchr("<>=!", token[0])) {
+                return false;
+            }
+            pos_ += length;
+            return true;
+        }
+
+        // Pliega la instrucción si sus operandos son las últimas constantes
+        bool emit(Op op, int operands, uint8_t arg = 0) {
+            std::vector<Instruction>& code = formula_.code_;
+            Instruction in = {op, arg, 0.0};
+            bool constant = static_cast<int>(code.size()) >= operands;
+            for (int k = 1; constant && k <= operands; k++) constant = code[code.size() - k].op == PUSH_CONST;
+            if (constant) {
+                double stack[FORMULA_MAX_DEPTH][FORMULA_BATCH];
+                code.push_back(in);
+                run(&code[code.size() - 1 - operands], operands + 1, NULL, 1, stack);
+                code.resize(code.size() - 1 - operands);
+                Instruction folded = {PUSH_CONST, 0, stack[0][0]};
+                code.push_back(folded);
+            } else {
+                code.push_back(in);
+            }
+            depth_ -= operands - 1;
+            return true;
+        }
+
+        bool push(Op op, uint8_t arg, double value) {
+            if (++depth_ > FORMULA_MAX_DEPTH) return fail("expresion demasiado anidada");
+            Instruction in = {op, arg, value};
+            formula_.code_.push_back(in);
+            if (op == PUSH_VAR) formula_.variables_ |= 1u << arg;
+            return true;
+        }
+
+        bool parseOr() {
+            if (!parseAnd()) return false;
+            while (accept("||")) {
+                if (!parseAnd()) return false;
+                emit(OR, 2);
+            }
+            return true;
+        }
+
+        bool parseAnd() {
+            if (!parseComparison()) return false;
+            while (accept("&&")) {
+                if (!parseComparison()) return false;
+                emit(AND, 2);
+            }
+            return true;
+        }
+
+        bool parseComparison() {
+            if (!parseSum()) return false;
+            static const char* const tokens[] = {"<=", ">=", "==", "!=", "<", ">"};
+            static const Op ops[] = {LE, GE, EQ, NE, LT, GT};
+            for (bool found = true; found;) {
+                found = false;
+                for (int k = 0; k < 6 && !found; k++) {
+                    if (!accept(tokens[k])) continue;
+                    if (!parseSum()) return false;
+                    emit(ops[k], 2);
+                    found = true;
+                }
+            }
+            return true;
+        }
+
+        bool parseSum() {
+            if (!parseProduct()) return false;
+            for (;;) {
+                Op op;
+                if (accept("+")) op = ADD;
+                else if (accept("-")) op = SUB;
+                else return true;
+                if (!parseProduct()) return false;
+                emit(op, 2);
+            }
+        }
+
+        bool parseProduct() {
+            if (!parseUnary()) return false;
+            for (;;) {
+                Op op;
+                if (accept("*")) op = MUL;
+                else if (accept("/")) op = DIV;
+                else if (accept("%")) op = MOD;
+                else return true;
+                if (!parseUnary()) return false;
+                emit(op, 2);
+            }
+        }
+
+        bool parseUnary() {
+            if (accept("-")) return parseUnary() && emit(NEG, 1);
+            if (accept("!")) return parseUnary() && emit(NOT, 1);
+            if (accept("+")) return parseUnary();
+            return parsePower();
+        }
+
+        bool parsePower() {
+            if (!parsePrimary()) return false;
+            if (accept("^")) return parseUnary() && emit(POW, 2);
+            return true;
+        }
+
+        bool parsePrimary() {
+            skipSpace();
+            if (pos_ >= text_.size()) return fail("se esperaba un valor");
+            char c = text_[pos_];
+            if ((c >= '0' && c <= '9') || c == '.') {
+                const char* begin = text_.c_str() + pos_;
+                char* end = NULL;
+                double value = strtod(begin, &end);
+                if (end == begin) return fail("numero no valido");
+                pos_ += static_cast<size_t>(end - begin);
+                return push(PUSH_CONST, 0, value);
+            }
+            if (accept("(")) {
+                if (!parseOr()) return false;
+                return accept(")") || fail("se esperaba ')'");
+            }
+            if (!isalpha(static_cast<unsigned char>(c)) && c != '_') return fail("se esperaba un valor");
+
+            size_t start = pos_;
+            while (pos_ < text_.size() && (isalnum(static_cast<unsigned char>(text_[pos_])) || text_[pos_] == '_')) {
+                pos_++;
+            }
+            std::string name = text_.substr(start, pos_ - start);
+            if (accept("(")) return parseCall(name, start);
+
+            static const struct { const char* name; FormulaVariable variable; } variables[] = {
+                {"t", FORMULA_T}, {"x", FORMULA_X}, {"east", FORMULA_X}, {"y", FORMULA_Y},
+                {"north", FORMULA_Y}, {"z", FORMULA_Z}, {"height", FORMULA_Z}, {"head", FORMULA_HEAD},
+                {"platform", FORMULA_PLATFORM}, {"base", FORMULA_BASE}, {"anomaly", FORMULA_ANOMALY}};
+            for (size_t k = 0; k < sizeof(variables) / sizeof(variables[0]); k++) {
+                if (name == variables[k].name) return push(PUSH_VAR, static_cast<uint8_t>(variables[k].variable), 0.0);
+            }
+            if (name == "pi") return push(PUSH_CONST, 0, M_PI);
+            if (name == "e") return push(PUSH_CONST, 0, M_E);
+            pos_ = start;
+            return fail("identificador desconocido '" + name + "'");
+        }
+
+        bool parseCall(const std::string& name, size_t start) {
+            const FunctionName* table = functions();
+            int f = 0;
+            while (table[f].name != NULL && name != table[f].name) f++;
+            if (table[f].name == NULL) {
+                pos_ = start;
+                return fail("funcion desconocida '" + name + "'");
+            }
+            for (int a = 0; a < table[f].arity; a++) {
+                if (a > 0 && !accept(",")) return fail(name + "() necesita " + std::to_string(table[f].arity) + " argumentos");
+                if (!parseOr()) return false;
+            }
+            if (!accept(")")) return fail("se esperaba ')'");
+            if (table[f].arity == 3) return emit(SELECT, 3);
+            return emit(table[f].arity == 1 ? CALL1 : CALL2, table[f].arity, static_cast<uint8_t>(f));
+        }
+
+        const std::string& text_;
+        size_t pos_;
+        int depth_;
+        FieldFormula& formula_;
+        std::string error_;
+        size_t error_pos_ = 0;
+    };
+
+    FieldFormula() : variables_(0) {}
+
+    std::vector<Instruction> code_;
+    uint32_t variables_;  // Bit por FormulaVariable leída
+};
+
+// ============================================================================
+// Escenarios: archivo "clave = valor" con los parámetros de la simulación
+// ============================================================================
+
+// Transporte de un puerto a través de un adaptador USB-serie (tipo FTDI):
+// los bytes se entregan en paquetes de tamaño fijo o al vencer el temporizador
+// de latencia del adaptador (ver PortWriter)
+struct PortTransport {
+    double latency_ms = 0.0;  // 0: cada write() llega al pty al instante
+    int packet_bytes = 62;    // Carga útil de un paquete full-speed (64 - 2 de estado)
+};
+
+// Modelo de ruido por canal (escalar, X, Y, Z), sumado al ruido uniforme de
+// noise_nT: blanco gaussiano, 1/f por debajo de una frecuencia de esquina,
+// paseo aleatorio y tonos. Sin tonos, su PSD unilateral es
+//   S(f) = w² (1 + fc / f) + q² / (2 π² f²)
+// con w en nT/√Hz y q en nT/√s; es el modelo que ajusta --fit-noise.
+const int NOISE_CHANNELS = 4;
+const int NOISE_TONES = 4;
+const char* const NOISE_CHANNEL_NAMES[NOISE_CHANNELS] = {"scalar", "x", "y", "z"};
+
+struct NoiseTone {
+    double hz;
+    double amplitude_nT;
+};
+
+struct ChannelNoise {
+    double white_nT_rtHz = 0.0;
+    double corner_hz = 0.0;     // Donde la componente 1/f iguala a la blanca (0: sin 1/f)
+    double walk_nT_rts = 0.0;
+    NoiseTone tones[NOISE_TONES] = {};
+};
+
+struct ScenarioConfig {
+    double noise_nT = 1.0;          // Amplitud del ruido de los magnetómetros
+    ChannelNoise channel_noise[NOISE_CHANNELS];
+    double head_spacing_m = 1.0;    // Separación este-oeste entre cabezales
+    double depth_offset_m = 0.0;    // Profundidad adicional de las fuentes
+    std::string sources_path;       // CSV de fuentes dipolares
+    double source_cutoff_m = 100.0; // Radio de la suma directa (<= 0: todas)
+    double source_theta = 0.0;      // Precisión de Barnes–Hut (0: suma directa)
+    double field_cache_error_nT = 0.0;      // Cota de la caché de campo (0: sin caché)
+    double field_cache_max_interval_s = 1.0;
+    double field_cache_max_step_m = 0.5;
+    double duration_s = 60.0;       // Duración de los renders offline
+    uint64_t seed = 0;
+    bool seed_given = false;
+    SurveyPlan survey;
+    PortTransport gps_transport;
+    PortTransport mag_transport[NUM_MAGNETOMETERS];
+    double internal_rate_hz = 0.0;      // Frecuencia interna de medida (0: sin decimación)
+    double decimation_cutoff_hz = 100.0;
+    int decimation_taps = 0;            // 0: 8 por fase
+    int platforms = 1;                  // Plataformas simultáneas (cada una con sus puertos)
+    double platform_spacing_m = 50.0;   // Separación este-oeste entre zonas de vuelo
+    bool truth_export = false;          // Renders offline: truth.qst junto a magN.txt
+    double truth_min_nT = 0.01;         // Aporte mínimo de una fuente para etiquetarla
+    std::shared_ptr<const FieldFormula> field_formula[NUM_MAGNETOMETERS];  // Nulo: campo del modelo
+    AttitudeScript attitude;
+    PlatformSignature platform_signature[NUM_MAGNETOMETERS];
+    double imu_rate_hz = 0.0;           // Muestras inerciales por segundo (0: sin IMU ni su puerto)
+    bool imu_binary = false;            // Tramas binarias en vez de líneas $PSIMU
+    double imu_accel_noise_mps2 = 0.02;
+    double imu_gyro_noise_rads = 0.001;
+    PortTransport imu_transport;
+    std::string imu_port;               // Puerto de la IMU de la plataforma 1 (vacío: ttyQSIM1_IMU)
+};
+
+struct ScenarioEntry {
+    std::string key;
+    std::vector<std::string> values;  // Más de uno solo en barridos
+    int line;
+};
+
+std::string trim(const std::string& text) {
+    size_t begin = text.find_first_not_of(" \t\r\n");
+    if (begin == std::string::npos) return "";
+    size_t end = text.find_last_not_of(" \t\r\n");
+    return text.substr(begin, end - begin + 1);
+}
+
+bool readScenarioFile(const std::string& path, std::vector<ScenarioEntry>& entries, std::string& error) {
+    FILE* file = fopen(path.c_str(), "r");
+    if (!file) {
+        error = path + ": " + strerror(errno);
+        return false;
+    }
+    char buffer[1024];
+    int line_number = 0;
+    while (fgets(buffer, sizeof(buffer), file)) {
+        line_number++;
+        std::string line = buffer;
+        size_t comment = line.find('#');
+        if (comment != std::string::npos) line.erase(comment);
+        line = trim(line);
+        if (line.empty()) continue;
+
+        size_t equals = line.find('=');
+        if (equals == std::string::npos) {
+            fclose(file);
+            error = path + ":" + std::to_string(line_number) + ": se esperaba 'clave = valor'";
+            return false;
+        }
+        ScenarioEntry entry;
+        entry.key = trim(line.substr(0, equals));
+        entry.line = line_number;
+        // Las comas dentro de paréntesis son argumentos de una fórmula
+        std::string values = line.substr(equals + 1);
+        int depth = 0;
+        size_t begin = 0;
+        for (size_t i = 0; i <= values.size(); i++) {
+            if (i < values.size() && values[i] == '(') depth++;
+            else if (i < values.size() && values[i] == ')') depth--;
+            else if ((i == values.size() && begin < i) || (i < values.size() && values[i] == ',' && depth == 0)) {
+                entry.values.push_back(trim(values.substr(begin, i - begin)));
+                begin = i + 1;
+            }
+        }
+        entries.push_back(entry);
+    }
+    fclose(file);
+    return true;
+}
+
+bool parseNumber(const std::string& text, double& value) {
+    char* end = NULL;
+    value = strtod(text.c_str(), &end);
+    return !text.empty() && end && *end == '\0';
+}
+
+bool applyScenarioValue(ScenarioConfig& config, const std::string& key, const std::string& value, std::string& error) {
+    if (key == "sources") {
+        config.sources_path = value;
+        return true;
+    }
+    // Fórmula del campo: "field" para todos los cabezales, "magN_field" para uno
+    if (key.size() >= 5 && key.compare(key.size() - 5, 5, "field") == 0) {
+        std::string head = key.substr(0, key.size() - 5);
+        std::vector<int> targets;
+        for (int i = 0; i < NUM_MAGNETOMETERS; i++) {
+            if (head.empty() || head == "mag" + std::to_string(i + 1) + "_") targets.push_back(i);
+        }
+        if (!targets.empty()) {
+            std::shared_ptr<const FieldFormula> formula = FieldFormula::compile(value, error);
+            if (!formula) {
+                error = key + ": " + error;
+                return false;
+            }
+            for (size_t t = 0; t < targets.size(); t++) config.field_formula[targets[t]] = formula;
+            return true;
+        }
+    }
+    if (key == "attitude") {
+        config.attitude.table = loadAttitudeTable(value, error);
+        return static_cast<bool>(config.attitude.table);
+    }
+    if (key == "track") {
+        config.survey.track = TrackLog::open(value, error);
+        return static_cast<bool>(config.survey.track);
+    }
+    if (key == "imu_format") {
+        if (value != "ascii" && value != "binary") {
+            error = "imu_format debe ser ascii o binary";
+            return false;
+        }
+        config.imu_binary = value == "binary";
+        return true;
+    }
+    if (key == "imu_port") {
+        if (value.empty() || value[value.size() - 1] == '/') {
+            error = "imu_port debe ser una ruta de puerto";
+            return false;
+        }
+        config.imu_port = value;
+        return true;
+    }
+
+    double number;
+    if (!parseNumber(value, number)) {
+        error = "valor no numerico para '" + key + "': " + value;
+        return false;
+    }
+
+    // Transporte USB: "usb_*" para todos los puertos, "gps_usb_*", "magN_usb_*" o "imu_usb_*" para uno
+    size_t usb = key.find("usb_");
+    if (usb != std::string::npos) {
+        std::string port = key.substr(0, usb);
+        std::string field = key.substr(usb);
+        std::vector<PortTransport*> targets;
+        if (port.empty() || port == "gps_") targets.push_back(&config.gps_transport);
+        if (port.empty() || port == "imu_") targets.push_back(&config.imu_transport);
+        for (int i = 0; i < NUM_MAGNETOMETERS; i++) {
+            if (port.empty() || port == "mag" + std::to_string(i + 1) + "_") targets.push_back(&config.mag_transport[i]);
+        }
+        bool valid = !targets.empty() && (field == "usb_latency_ms" || field == "usb_packet_bytes");
+        if (valid && field == "usb_packet_bytes" && number < 1) {
+            error = "usb_packet_bytes debe ser al menos 1";
+            return false;
+        }
+        for (size_t t = 0; valid && t < targets.size(); t++) {
+            if (field == "usb_latency_ms") targets[t]->latency_ms = std::max(0.0, number);
+            else targets[t]->packet_bytes = static_cast<int>(number);
+        }
+        if (valid) return true;
+    }
+
+    // Modelo de ruido: "noise_*" para todos los canales, "scalar_noise_*",
+    // "x_noise_*", "y_noise_*" o "z_noise_*" para uno
+    size_t noise = key.find("noise_");
+    if (noise != std::string::npos && key != "noise_nT") {
+        std::string channel = key.substr(0, noise);
+        std::string field = key.substr(noise);
+        std::vector<ChannelNoise*> targets;
+        for (int c = 0; c < NOISE_CHANNELS; c++) {
+            if (channel.empty() || channel == std::string(NOISE_CHANNEL_NAMES[c]) + "_") {
+                targets.push_back(&config.channel_noise[c]);
+            }
+        }
+        int tone = -1;
+        std::string tone_field;
+        if (field.compare(0, 10, "noise_tone") == 0 && field.size() > 11 && field[10] >= '1' &&
+            field[10] < '1' + NOISE_TONES) {
+            tone = field[10] - '1';
+            tone_field = field.substr(11);
+        }
+        bool valid = !targets.empty() && (field == "noise_white_nT_rtHz" || field == "noise_corner_hz" ||
+                                          field == "noise_walk_nT_rts" || tone_field == "_hz" || tone_field == "_nT");
+        if (valid && number < 0.0) {
+            error = key + " no puede ser negativo";
+            return false;
+        }
+        for (size_t t = 0; valid && t < targets.size(); t++) {
+            if (field == "noise_white_nT_rtHz") targets[t]->white_nT_rtHz = number;
+            else if (field == "noise_corner_hz") targets[t]->corner_hz = number;
+            else if (field == "noise_walk_nT_rts") targets[t]->walk_nT_rts = number;
+            else if (tone_field == "_hz") targets[t]->tones[tone].hz = number;
+            else targets[t]->tones[tone].amplitude_nT = number;
+        }
+        if (valid) return true;
+    }
+
+    // Firma de la plataforma: "tl_*" para todos los cabezales, "magN_tl_*" para uno
+    size_t tl = key.find("tl_");
+    if (tl != std::string::npos) {
+        std::string head = key.substr(0, tl);
+        std::vector<double*> targets;
+        for (int i = 0; i < NUM_MAGNETOMETERS; i++) {
+            if (head.empty() || head == "mag" + std::to_string(i + 1) + "_") {
+                double* coefficient = config.platform_signature[i].coefficient(key.substr(tl + 3));
+                if (coefficient) targets.push_back(coefficient);
+            }
+        }
+        for (size_t t = 0; t < targets.size(); t++) *targets[t] = number;
+        if (!targets.empty()) return true;
+    }
+
+    if (key == "noise_nT") config.noise_nT = number;
+    else if (key == "head_spacing_m") config.head_spacing_m = number;
+    else if (key == "depth_offset_m") config.depth_offset_m = number;
+    else if (key == "source_cutoff_m") config.source_cutoff_m = number;
+    else if (key == "source_theta") config.source_theta = number;
+    else if (key == "field_cache_error_nT") config.field_cache_error_nT = number;
+    else if (key == "field_cache_max_interval_s") config.field_cache_max_interval_s = number;
+    else if (key == "field_cache_max_step_m") config.field_cache_max_step_m = number;
+    else if (key == "duration_s") config.duration_s = number;
+    else if (key == "seed") { config.seed = static_cast<uint64_t>(number); config.seed_given = true; }
+    else if (key == "survey_speed_mps") config.survey.speed_mps = number;
+    else if (key == "survey_line_length_m") config.survey.line_length_m = number;
+    else if (key == "survey_line_spacing_m") config.survey.line_spacing_m = number;
+    else if (key == "survey_lines") config.survey.lines = static_cast<int>(number);
+    else if (key == "flight_height_m") config.survey.flight_height_m = number;
+    else if (key == "track_offset_s") config.survey.track_offset_s = number;
+    else if (key == "manoeuvre_roll_deg") config.attitude.roll_deg = number;
+    else if (key == "manoeuvre_pitch_deg") config.attitude.pitch_deg = number;
+    else if (key == "manoeuvre_yaw_deg") config.attitude.yaw_deg = number;
+    else if (key == "manoeuvre_period_s") config.attitude.period_s = number;
+    else if (key == "manoeuvre_block_s") config.attitude.block_s = number;
+    else if (key == "internal_rate_hz") {
+        double factor = number * MAG_PERIOD_US / 1e6;
+        if (number != 0.0 && (factor < 2.0 || std::abs(factor - std::round(factor)) > 1e-9)) {
+            error = "internal_rate_hz debe ser 0 o un multiplo (>= 2) de " + std::to_string(1000000 / MAG_PERIOD_US) + " Hz";
+            return false;
+        }
+        config.internal_rate_hz = number;
+    }
+    else if (key == "decimation_cutoff_hz") config.decimation_cutoff_hz = number;
+    else if (key == "imu_rate_hz") {
+        double period_us = number > 0.0 ? 1e6 / number : 0.0;
+        if (number != 0.0 && (number < 0.0 || number > 2000.0 || std::abs(period_us - std::round(period_us)) > 1e-6)) {
+            error = "imu_rate_hz debe ser 0 o hasta 2000 Hz con un periodo entero de microsegundos";
+            return false;
+        }
+        config.imu_rate_hz = number;
+    }
+    else if (key == "imu_accel_noise_mps2" || key == "imu_gyro_noise_rads") {
+        if (number < 0.0) {
+            error = key + " no puede ser negativo";
+            return false;
+        }
+        (key == "imu_accel_noise_mps2" ? config.imu_accel_noise_mps2 : config.imu_gyro_noise_rads) = number;
+    }
+    else if (key == "platforms") {
+        if (number < 1 || number > MAX_PLATFORMS) {
+            error = "platforms debe estar entre 1 y " + std::to_string(MAX_PLATFORMS);
+            return false;
+        }
+        config.platforms = static_cast<int>(number);
+    }
+    else if (key == "platform_spacing_m") config.platform_spacing_m = number;
+    else if (key == "truth_export") config.truth_export = number != 0.0;
+    else if (key == "truth_min_nT") config.truth_min_nT = number;
+    else if (key == "decimation_taps") {
+        if (number < 0 || number > MAX_DECIMATION_TAPS) {
+            error = "decimation_taps debe estar entre 0 y " + std::to_string(MAX_DECIMATION_TAPS);
+            return false;
+        }
+        config.decimation_taps = static_cast<int>(number);
+    }
+    else {
+        error = "clave de escenario desconocida: " + key;
+        return false;
+    }
+    return true;
+}
+
+// Carga el índice de fuentes de un escenario (nulo si no define fuentes)
+bool loadSourceIndex(const ScenarioConfig& config, std::shared_ptr<const AnomalySourceIndex>& index, std::string& error) {
+    index.reset();
+    if (config.sources_path.empty()) return true;
+    std::vector<DipoleSource> sources;
+    if (!loadDipoleSources(config.sources_path, sources, error)) return false;
+    index.reset(new AnomalySourceIndex(sources, config.source_cutoff_m, config.source_theta));
+    return true;
+}
+
+// Escenario y modelo de campo de la simulación en tiempo real
+ScenarioConfig scenario;
+FieldModel field_model;
+
+// Reloj de simulación: tiempo transcurrido desde el inicio (o desde el instante
+// guardado en un checkpoint). Cada dispositivo programa su muestra n en
+// origin + n * periodo, por lo que no acumula deriva entre muestras.
+struct SimClock {
+    std::chrono::steady_clock::time_point origin;
+
+    void start(uint64_t initial_us) {
+        origin = std::chrono::steady_clock::now() - std::chrono::microseconds(initial_us);
+    }
+
+    uint64_t nowUs() const {
+        return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - origin).count());
+    }
+
+    std::chrono::steady_clock::time_point at(uint64_t sim_us) const {
+        return origin + std::chrono::microseconds(sim_us);
+    }
+};
+
+SimClock sim_clock;
+
+// ============================================================================
+// Registro de diagnósticos
+// ============================================================================
+
+// Los hilos no escriben los diagnósticos en la consola: cada uno encola
+// registros binarios de tamaño fijo (el formato literal y los argumentos sin
+// formatear) en su propia cola SPSC sin bloqueos, y un hilo de fondo los
+// ordena por tiempo, les da formato y los escribe. Con la cola llena el
+// registro se descarta y se cuenta, así que un dispositivo nunca espera por la
+// consola. Los puntos de depuración, y todos una vez que los dispositivos
+// emiten (log_rate_limit_all), admiten LOG_RATE_PER_SECOND registros por
+// segundo: el arranque nunca pierde mensajes. Los que sobran se cuentan y se
+// informan con el siguiente que pasa o, si no pasa ninguno, los informa el
+// escritor de fondo cuando vence el segundo.
+// Los niveles por debajo de log_level se descartan antes de tocar la cola.
+enum LogLevel { LOG_LEVEL_DEBUG = 0, LOG_LEVEL_INFO, LOG_LEVEL_WARN, LOG_LEVEL_ERROR };
+const char* const LOG_LEVEL_NAMES[] = {"debug", "info", "warn", "error"};
+const char* const LOG_CONSOLE_TAGS[] = {"[DEBUG] ", "", "[AVISO] ", "[ERROR] "};
+
+const int LOG_MAX_ARGS = 6;
+const size_t LOG_TEXT_BYTES = 160;
+const size_t LOG_QUEUE_CAPACITY = 256;
+const uint32_t LOG_RATE_PER_SECOND = 20;
+const int LOG_WRITE_INTERVAL_MS = 20;
+
+std::atomic<int> log_level(LOG_LEVEL_INFO);
+std::atomic<bool> log_rate_limit_all(false);  // También info, avisos y errores (tras el arranque)
+std::string log_path;  // Vacío: la consola
+
+uint64_t coarseMonotonicNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + static_cast<uint64_t>(ts.tv_nsec);
+}
+
+struct LogArg {
+    enum Type { INT, UINT, REAL, TEXT } type;
+    union {
+        int64_t i;
+        uint64_t u;
+        double d;
+        uint32_t text_offset;
+    } value;
+    uint32_t text_length;
+};
+
+struct LogRecord {
+    uint64_t time_ns;
+    const char* format;   // Literal con un {} (o {.N} para N decimales) por argumento
+    uint8_t level;
+    uint8_t arg_count;
+    uint16_t text_used;
+    uint32_t suppressed;  // Registros de este punto descartados antes por el límite de tasa
+    LogArg args[LOG_MAX_ARGS];
+    char text[LOG_TEXT_BYTES];  // Argumentos de texto copiados (truncados si no caben)
+};
+
+template <typename T>
+typename std::enable_if<std::is_integral<T>::value>::type addLogArg(LogRecord& record, T value) {
+    if (record.arg_count == LOG_MAX_ARGS) return;
+    LogArg& arg = record.args[record.arg_count++];
+    if (std::is_signed<T>::value) {
+        arg.type = LogArg::INT;
+        arg.value.i = static_cast<int64_t>(value);
+    } else {
+        arg.type = LogArg::UINT;
+        arg.value.u = static_cast<uint64_t>(value);
+    }
+}
+
+inline void addLogArg(LogRecord& record, double value) {
+    if (record.arg_count == LOG_MAX_ARGS) return;
+    LogArg& arg = record.args[record.arg_count++];
+    arg.type = LogArg::REAL;
+    arg.value.d = value;
+}
+
+inline void addLogArg(LogRecord& record, const char* text) {
+    if (record.arg_count == LOG_MAX_ARGS) return;
+    LogArg& arg = record.args[record.arg_count++];
+    size_t length = std::min(strlen(text), LOG_TEXT_BYTES - record.text_used);
+    arg.type = LogArg::TEXT;
+    arg.value.text_offset = record.text_used;
+    arg.text_length = static_cast<uint32_t>(length);
+    memcpy(record.text + record.text_used, text, length);
+    record.text_used = static_cast<uint16_t>(record.text_used + length);
+}
+
+inline void addLogArg(LogRecord& record, const std::string& text) { addLogArg(record, text.c_str()); }
+
+inline void packLogArgs(LogRecord&) {}
+
+template <typename T, typename... Rest>
+void packLogArgs(LogRecord& record, const T& first, const Rest&... rest) {
+    addLogArg(record, first);
+    packLogArgs(record, rest...);
+}
+
+struct LogQueue {
+    LogQueue() : head(0), tail(0), dropped(0), retired(false) {}
+
+    std::atomic<uint64_t> head;     // Próximo registro a escribir (productor)
+    std::atomic<uint64_t> tail;     // Próximo registro a leer (escritor de fondo)
+    std::atomic<uint64_t> dropped;  // Descartados con la cola llena
+    std::atomic<bool> retired;      // El hilo productor terminó
+    LogRecord records[LOG_QUEUE_CAPACITY];
+};
+
+struct LogSite;
+void listSuppressingSite(LogSite* site);
+
+// Límite de tasa de un punto de registro (static en cada LOG_*). El primero
+// que descarta algo se añade a la lista que revisa el escritor de fondo.
+struct LogSite {
+    std::atomic<uint64_t> window_s;
+    std::atomic<uint32_t> count;
+    std::atomic<uint32_t> suppressed;
+    std::atomic<bool> listed;
+    const char* format;  // Fijados antes de entrar en la lista
+    uint8_t level;
+    LogSite* next;
+
+    bool admit(LogLevel record_level, const char* record_format, uint32_t& suppressed_before) {
+        if (record_level != LOG_LEVEL_DEBUG && !log_rate_limit_all.load(std::memory_order_relaxed)) return true;
+        uint64_t now_s = coarseMonotonicNs() / 1000000000ULL;
+        uint64_t window = window_s.load(std::memory_order_relaxed);
+        if (window != now_s && window_s.compare_exchange_strong(window, now_s)) count.store(0);
+        if (count.fetch_add(1) >= LOG_RATE_PER_SECOND) {
+            suppressed.fetch_add(1);
+            if (!listed.exchange(true)) {
+                format = record_format;
+                level = static_cast<uint8_t>(record_level);
+                listSuppressingSite(this);
+            }
+            return false;
+        }
+        suppressed_before = suppressed.exchange(0);
+        return true;
+    }
+};
+
+// Pila sin bloqueos de los puntos que han descartado algún registro (nunca se quitan)
+std::atomic<LogSite*> suppressing_sites(NULL);
+
+void listSuppressingSite(LogSite* site) {
+    site->next = suppressing_sites.load(std::memory_order_relaxed);
+    while (!suppressing_sites.compare_exchange_weak(site->next, site, std::memory_order_release,
+                                                    std::memory_order_relaxed)) {
+    }
+}
+
+struct Logger {
+    Logger() : writer(NULL), stopping(false), flush_requested(0), flush_done(0), fd(STDOUT_FILENO) {}
+
+    std::mutex registry_mutex;  // Solo al registrar un hilo y una vez por ciclo del escritor
+    std::vector<LogQueue*> queues;
+    std::thread* writer;
+
+    std::mutex wake_mutex;
+    std::condition_variable wake;
+    std::condition_variable flushed;
+    bool stopping;
+    uint64_t flush_requested;
+    uint64_t flush_done;
+
+    int fd;
+    std::chrono::steady_clock::time_point start;
+};
+
+Logger logger;
+
+// Cola del hilo actual; la marca como retirada cuando el hilo termina
+struct LogQueueHandle {
+    LogQueueHandle() : queue(NULL) {}
+    ~LogQueueHandle() {
+        if (queue != NULL) queue->retired.store(true, std::memory_order_release);
+    }
+    LogQueue* queue;
+};
+
+thread_local LogQueueHandle log_queue_handle;
+
+LogQueue* logQueueForThread() {
+    if (log_queue_handle.queue == NULL) {
+        log_queue_handle.queue = new LogQueue();
+        std::lock_guard<std::mutex> lock(logger.registry_mutex);
+        logger.queues.push_back(log_queue_handle.queue);
+    }
+    return log_queue_handle.queue;
+}
+
+template <typename... Args>
+void logRecord(LogSite& site, LogLevel level, const char* format, const Args&... args) {
+    if (level < log_level.load(std::memory_order_relaxed)) return;
+    uint32_t suppressed = 0;
+    if (!site.admit(level, format, suppressed)) return;
+
+    LogQueue* queue = logQueueForThread();
+    uint64_t head = queue->head.load(std::memory_order_relaxed);
+    if (head - queue->tail.load(std::memory_order_acquire) >= LOG_QUEUE_CAPACITY) {
+        queue->dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    LogRecord& record = queue->records[head % LOG_QUEUE_CAPACITY];
+    record.time_ns = static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+    record.format = format;
+    record.level = static_cast<uint8_t>(level);
+    record.arg_count = 0;
+    record.text_used = 0;
+    record.suppressed = suppressed;
+    packLogArgs(record, args...);
+    queue->head.store(head + 1, std::memory_order_release);
+}
+
+#define LOG_AT(level, ...)                             \
+    do {                                               \
+        static LogSite log_site_;                      \
+        logRecord(log_site_, level, __VA_ARGS__);      \
+    } while (0)
+#define LOG_DEBUG(...) LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define LOG_INFO(...) LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+#define LOG_WARN(...) LOG_AT(LOG_LEVEL_WARN, __VA_ARGS__)
+#define LOG_ERROR(...) LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
+
+void formatLogRecord(const LogRecord& record, bool to_file, std::string& out) {
+    char prefix[48];
+    if (to_file) {
+        double t = (record.time_ns - static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                         logger.start.time_since_epoch()).count())) / 1e9;
+        snprintf(prefix, sizeof(prefix), "%10.3f %-5s ", t, LOG_LEVEL_NAMES[record.level]);
+        out += prefix;
+    } else {
+        out += LOG_CONSOLE_TAGS[record.level];
+    }
+
+    int next = 0;
+    for (const char* p = record.format; *p != '\0'; p++) {
+        const char* close = p[0] == '{' ? strchr(p, '}') : NULL;
+        if (close == NULL || next >= record.arg_count) {
+            out += *p;
+            continue;
+        }
+        int precision = p[1] == '.' ? atoi(p + 2) : -1;
+        const LogArg& arg = record.args[next++];
+        char number[64];
+        switch (arg.type) {
+        case LogArg::INT:
+            snprintf(number, sizeof(number), "%lld", static_cast<long long>(arg.value.i));
+            out += number;
+            break;
+        case LogArg::UINT:
+            snprintf(number, sizeof(number), "%llu", static_cast<unsigned long long>(arg.value.u));
+            out += number;
+            break;
+        case LogArg::REAL:
+            if (precision >= 0) snprintf(number, sizeof(number), "%.*f", precision, arg.value.d);
+            else snprintf(number, sizeof(number), "%g", arg.value.d);
+            out += number;
+            break;
+        case LogArg::TEXT:
+            out.append(record.text + arg.value.text_offset, arg.text_length);
+            break;
+        }
+        p = close;
+    }
+    if (record.suppressed > 0) out += " (+" + std::to_string(record.suppressed) + " suprimidos)";
+    out += '\n';
+}
+
+void logWriterThread() {
+    std::vector<LogRecord> batch;
+    std::string text;
+    bool to_file = logger.fd != STDOUT_FILENO;
+    for (;;) {
+        uint64_t target;
+        bool stop;
+        {
+            std::unique_lock<std::mutex> lock(logger.wake_mutex);
+            logger.wake.wait_for(lock, std::chrono::milliseconds(LOG_WRITE_INTERVAL_MS), [] {
+                return logger.stopping || logger.flush_requested > logger.flush_done;
+            });
+            target = logger.flush_requested;
+            stop = logger.stopping;
+        }
+
+        // Vaciar todas las colas y ordenar por tiempo
+        batch.clear();
+        text.clear();
+        {
+            std::lock_guard<std::mutex> lock(logger.registry_mutex);
+            for (size_t q = 0; q < logger.queues.size();) {
+                LogQueue* queue = logger.queues[q];
+                bool retired = queue->retired.load(std::memory_order_acquire);
+                uint64_t head = queue->head.load(std::memory_order_acquire);
+                for (uint64_t i = queue->tail.load(std::memory_order_relaxed); i < head; i++) {
+                    batch.push_back(queue->records[i % LOG_QUEUE_CAPACITY]);
+                }
+                queue->tail.store(head, std::memory_order_release);
+                uint64_t dropped = queue->dropped.exchange(0);
+                if (dropped > 0) {
+                    text += std::string(LOG_CONSOLE_TAGS[LOG_LEVEL_WARN]) + std::to_string(dropped) +
+                            " registros descartados (cola de un hilo llena)\n";
+                }
+                if (retired) {
+                    delete queue;
+                    logger.queues.erase(logger.queues.begin() + q);
+                } else {
+                    q++;
+                }
+            }
+        }
+        std::stable_sort(batch.begin(), batch.end(),
+                         [](const LogRecord& a, const LogRecord& b) { return a.time_ns < b.time_ns; });
+        for (size_t i = 0; i < batch.size(); i++) formatLogRecord(batch[i], to_file, text);
+
+        // Descartes de puntos cuyo segundo ya venció (o todos al terminar) sin
+        // otro registro que los informe
+        uint64_t now_s = coarseMonotonicNs() / 1000000000ULL;
+        for (LogSite* site = suppressing_sites.load(std::memory_order_acquire); site != NULL; site = site->next) {
+            if (!stop && site->window_s.load(std::memory_order_relaxed) == now_s) continue;
+            uint32_t suppressed = site->suppressed.exchange(0);
+            if (suppressed == 0) continue;
+            text += std::string(LOG_CONSOLE_TAGS[site->level]) + std::to_string(suppressed) +
+                    " registros suprimidos: " + site->format + "\n";
+        }
+        for (size_t done = 0; done < text.size();) {
+            ssize_t n = write(logger.fd, text.data() + done, text.size() - done);
+            if (n <= 0 && errno != EINTR) break;
+            if (n > 0) done += static_cast<size_t>(n);
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(logger.wake_mutex);
+            logger.flush_done = target;
+        }
+        logger.flushed.notify_all();
+        if (stop) return;
+    }
+}
+
+// Los hilos de fondo (escritores) no atienden señales: nacen con todas
+// bloqueadas para que SIGINT y SIGTERM lleguen siempre por signalfd aunque se
+// lancen antes que initEngine()
+std::thread* startBackgroundThread(const std::function<void()>& body) {
+    sigset_t all, previous;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &previous);
+    std::thread* thread = new std::thread(body);
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+    return thread;
+}
+
+std::thread* startLogWriter() {
+    return startBackgroundThread(logWriterThread);
+}
+
+bool startLogger() {
+    logger.start = std::chrono::steady_clock::now();
+    if (!log_path.empty()) {
+        logger.fd = open(log_path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (logger.fd == -1) {
+            logger.fd = STDOUT_FILENO;
+            return false;
+        }
+    }
+    logger.stopping = false;
+    logger.writer = startLogWriter();
+    return true;
+}
+
+// Espera a que esté escrito todo lo registrado hasta ahora (antes de mostrar
+// menús o preguntas en la consola, para que no se mezclen)
+void flushLog() {
+    std::unique_lock<std::mutex> lock(logger.wake_mutex);
+    if (logger.writer == NULL) return;
+    uint64_t target = ++logger.flush_requested;
+    logger.wake.notify_one();
+    logger.flushed.wait(lock, [target] { return logger.flush_done >= target; });
+}
+
+// Detiene el hilo escritor tras vaciar las colas; el destino sigue abierto.
+// Sin él el proceso vuelve a tener un solo hilo y puede hacer fork.
+bool pauseLogWriter() {
+    if (logger.writer == NULL) return false;
+    {
+        std::lock_guard<std::mutex> lock(logger.wake_mutex);
+        logger.stopping = true;
+    }
+    logger.wake.notify_one();
+    logger.writer->join();
+    delete logger.writer;
+    logger.writer = NULL;
+    return true;
+}
+
+void resumeLogWriter() {
+    logger.stopping = false;
+    logger.writer = startLogWriter();
+}
+
+void stopLogger() {
+    if (!pauseLogWriter()) return;
+    if (logger.fd != STDOUT_FILENO) close(logger.fd);
+    logger.fd = STDOUT_FILENO;
+}
+
+// Cierra el registro al salir de main() por cualquier camino
+struct LoggerGuard {
+    ~LoggerGuard() { stopLogger(); }
+};
+
+// ============================================================================
+// Motor: esperas de los dispositivos y parada
+// ============================================================================
+
+// Las señales se bloquean en todos los hilos y llegan por signalfd al hilo de
+// control. La orden de parada se difunde con un eventfd que nunca se vacía:
+// todos los hilos lo vigilan mientras esperan su próximo instante, así que
+// despiertan en cuanto se pide la parada en lugar de al terminar su espera.
+int signal_fd = -1;
+int shutdown_fd = -1;
+
+bool initEngine() {
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    if (pthread_sigmask(SIG_BLOCK, &signals, NULL) != 0) return false;
+
+    signal_fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    shutdown_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    return signal_fd != -1 && shutdown_fd != -1;
+}
+
+void requestShutdown() {
+    running = false;
+    uint64_t one = 1;
+    if (shutdown_fd != -1) {
+        ssize_t ignored = write(shutdown_fd, &one, sizeof(one));
+        (void)ignored;
+    }
+}
+
+// Espera hasta el instante indicado; devuelve false si se pidió la parada
+bool waitUntil(std::chrono::steady_clock::time_point deadline) {
+    for (;;) {
+        if (!running) return false;
+        auto remaining = deadline - std::chrono::steady_clock::now();
+        if (remaining <= std::chrono::steady_clock::duration::zero()) return true;
+
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(remaining).count();
+        struct timespec timeout;
+        timeout.tv_sec = static_cast<time_t>(ns / 1000000000);
+        timeout.tv_nsec = static_cast<long>(ns % 1000000000);
+        struct pollfd pfd = {shutdown_fd, POLLIN, 0};
+        int ready = ppoll(&pfd, 1, &timeout, NULL);
+        if (ready > 0) return false;
+        if (ready == 0) return running;
+        // EINTR: recalcular el tiempo restante
+    }
+}
+
+// Lee y reporta una señal pendiente del signalfd (desde un hilo normal,
+// por lo que aquí sí se puede escribir en la consola)
+void handlePendingSignal() {
+    struct signalfd_siginfo info;
+    if (read(signal_fd, &info, sizeof(info)) == static_cast<ssize_t>(sizeof(info))) {
+        LOG_INFO("Recibida senal {}. Terminando...", info.ssi_signo);
+        requestShutdown();
+    }
+}
+
+// Derivación (tap) por memoria compartida de un puerto: anillo de difusión
+// con pérdidas en /dev/shm. El escritor nunca espera: sobrescribe lo más
+// antiguo y cada lector lleva su propia posición y cuenta lo que ha perdido.
+// Los lectores renuevan un latido en la cabecera; sin latido reciente el
+// escritor no copia nada.
+const size_t TAP_RING_CAPACITY = 256 * 1024;
+const char TAP_RING_PREFIX[] = "/dev/shm/quspin_tap_";
+const uint64_t TAP_HEARTBEAT_NS = 1000000000ULL;
+
+struct TapRingHeader {
+    std::atomic<uint64_t> write_position;
+    uint64_t capacity;
+    char pad[48];
+    std::atomic<uint64_t> reader_deadline_ns;  // CLOCK_MONOTONIC
+};
+
+const size_t TAP_RING_HEADER_SIZE = 128;
+static_assert(sizeof(TapRingHeader) <= TAP_RING_HEADER_SIZE, "cabecera del anillo demasiado grande");
+
+// Archivo del anillo de un puerto: /dev/ttyAMA2 -> /dev/shm/quspin_tap_ttyAMA2
+std::string tapRingPath(const std::string& port_path) {
+    size_t slash = port_path.rfind('/');
+    return TAP_RING_PREFIX + (slash == std::string::npos ? port_path : port_path.substr(slash + 1));
+}
+
+class TapRing {
+public:
+    TapRing() : header_(NULL), data_(NULL) {}
+    ~TapRing() { unmap(); }
+
+    // Crea el anillo del escritor. Si ya existe uno con la misma capacidad
+    // (p. ej. de la instancia relevada) se reutiliza y los lectores siguen.
+    bool create(const std::string& path) {
+        int fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+        if (fd == -1) return false;
+        fchmod(fd, 0666);
+        struct stat st;
+        bool fresh = fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) != TAP_RING_HEADER_SIZE + TAP_RING_CAPACITY;
+        if (fresh && ftruncate(fd, TAP_RING_HEADER_SIZE + TAP_RING_CAPACITY) == -1) {
+            close(fd);
+            return false;
+        }
+        bool ok = map(fd);
+        close(fd);
+        if (!ok) return false;
+        if (fresh || header_->capacity != TAP_RING_CAPACITY) {
+            new (header_) TapRingHeader();
+            header_->write_position.store(0);
+            header_->capacity = TAP_RING_CAPACITY;
+            header_->reader_deadline_ns.store(0);
+        }
+        return true;
+    }
+
+    // Abre el anillo de un puerto como lector
+    bool attach(const std::string& path) {
+        int fd = open(path.c_str(), O_RDWR | O_CLOEXEC);
+        if (fd == -1) return false;
+        bool ok = map(fd);
+        close(fd);
+        return ok;
+    }
+
+    bool mapped() const { return header_ != NULL; }
+
+    bool readerAttached() const {
+        return header_ != NULL &&
+               header_->reader_deadline_ns.load(std::memory_order_relaxed) > coarseMonotonicNs();
+    }
+
+    // Escritor (un único hilo por puerto). Los fragmentos de más de un cuarto
+    // de la capacidad no caben en la ventana segura de los lectores: se descartan.
+    bool publish(const char* data, size_t length) {
+        if (length > TAP_RING_CAPACITY / 4) return false;
+        uint64_t position = header_->write_position.load(std::memory_order_relaxed);
+        copyIn(position, data, length);
+        header_->write_position.store(position + length, std::memory_order_release);
+        return true;
+    }
+
+    void heartbeat() {
+        header_->reader_deadline_ns.store(coarseMonotonicNs() + TAP_HEARTBEAT_NS, std::memory_order_relaxed);
+    }
+
+    uint64_t writePosition() const { return header_->write_position.load(std::memory_order_acquire); }
+
+    // Lector: añade a out lo publicado desde position y la avanza. Devuelve los
+    // bytes perdidos por quedarse atrás o por sobrescribirse durante la copia.
+    uint64_t read(uint64_t& position, std::string& out) {
+        const uint64_t window = TAP_RING_CAPACITY - TAP_RING_CAPACITY / 4;
+        uint64_t end = writePosition();
+        uint64_t lost = 0;
+        if (position > end) position = end;  // Anillo reiniciado
+        if (end - position > window) {
+            lost = end - window - position;
+            position = end - window;
+        }
+        size_t length = static_cast<size_t>(end - position);
+        size_t offset = out.size();
+        out.resize(offset + length);
+        for (size_t done = 0; done < length;) {
+            size_t at = static_cast<size_t>((position + done) % TAP_RING_CAPACITY);
+            size_t chunk = std::min(length - done, TAP_RING_CAPACITY - at);
+            memcpy(&out[offset + done], data_ + at, chunk);
+            done += chunk;
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        uint64_t after = header_->write_position.load(std::memory_order_relaxed);
+        if (after - position > window) {
+            size_t overwritten = static_cast<size_t>(std::min<uint64_t>(length, after - window - position));
+            out.erase(offset, overwritten);
+            lost += overwritten;
+        }
+        position = end;
+        return lost;
+    }
+
+private:
+    bool map(int fd) {
+        void* memory = mmap(NULL, TAP_RING_HEADER_SIZE + TAP_RING_CAPACITY, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (memory == MAP_FAILED) return false;
+        header_ = static_cast<TapRingHeader*>(memory);
+        data_ = static_cast<char*>(memory) + TAP_RING_HEADER_SIZE;
+        return true;
+    }
+
+    void unmap() {
+        if (header_ != NULL) munmap(header_, TAP_RING_HEADER_SIZE + TAP_RING_CAPACITY);
+        header_ = NULL;
+        data_ = NULL;
+    }
+
+    void copyIn(uint64_t position, const char* data, size_t length) {
+        for (size_t done = 0; done < length;) {
+            size_t at = static_cast<size_t>((position + done) % TAP_RING_CAPACITY);
+            size_t chunk = std::min(length - done, TAP_RING_CAPACITY - at);
+            memcpy(data_ + at, data + done, chunk);
+            done += chunk;
+        }
+    }
+
+    TapRingHeader* header_;
+    char* data_;
+};
+
+// Suscriptores de solo lectura de un puerto: sockets SOCK_SEQPACKET (cada
+// fragmento llega entero o no llega) y, con --shm-taps, el anillo compartido.
+// Se les envía una copia de lo mismo que se escribe en el pty sin esperar
+// nunca: si un suscriptor no tiene sitio el fragmento se descarta y se cuenta.
+// Sin suscriptores el hilo del dispositivo solo lee un contador atómico.
+struct TapHub {
+    TapHub() : subscriber_count(0), dropped_bytes(0) {}
+
+    std::atomic<int> subscriber_count;
+    std::atomic<uint64_t> dropped_bytes;
+    std::mutex mutex;
+    std::vector<int> sockets;
+    TapRing ring;
+
+    bool active() const {
+        return subscriber_count.load(std::memory_order_relaxed) > 0 || ring.readerAttached();
+    }
+
+    void publish(const char* data, size_t length) {
+        if (ring.readerAttached() && !ring.publish(data, length)) {
+            dropped_bytes.fetch_add(length, std::memory_order_relaxed);
+        }
+        if (subscriber_count.load(std::memory_order_relaxed) == 0) return;
+        std::lock_guard<std::mutex> lock(mutex);
+        for (size_t i = 0; i < sockets.size();) {
+            if (send(sockets[i], data, length, MSG_DONTWAIT | MSG_NOSIGNAL) >= 0) {
+                i++;
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) {
+                dropped_bytes.fetch_add(length, std::memory_order_relaxed);
+                i++;
+            } else {
+                // Suscriptor desconectado
+                close(sockets[i]);
+                sockets.erase(sockets.begin() + i);
+                subscriber_count.store(static_cast<int>(sockets.size()), std::memory_order_relaxed);
+            }
+        }
+    }
+
+    void add(int sock) {
+        std::lock_guard<std::mutex> lock(mutex);
+        sockets.push_back(sock);
+        subscriber_count.store(static_cast<int>(sockets.size()), std::memory_order_relaxed);
+    }
+
+    void closeAll() {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (size_t i = 0; i < sockets.size(); i++) close(sockets[i]);
+        sockets.clear();
+        subscriber_count.store(0, std::memory_order_relaxed);
+    }
+};
+
+// Retraso del consumidor: cada LAG_SAMPLE_MS el hilo del dispositivo mira
+// cuántos bytes siguen sin leer en la cola del tty (TIOCINQ sobre el slave; el
+// master no tiene cola de salida propia) y los suma a los retenidos por el
+// adaptador USB. Se expresa también en milisegundos de flujo con la tasa media
+// de bytes del puerto. La cola del line discipline se llena en ~4 KB; a partir
+// de ahí el pty rechaza escrituras, que se cuentan como bytes descartados.
+const int LAG_SAMPLE_MS = 100;
+const int LAG_MS_BUCKET_COUNT = 12;
+const double LAG_MS_BUCKETS[LAG_MS_BUCKET_COUNT] = {1, 2, 5, 10, 20, 50, 100, 200, 500, 1000, 2000, 5000};
+const int LAG_BYTES_BUCKET_COUNT = 7;
+const double LAG_BYTES_BUCKETS[LAG_BYTES_BUCKET_COUNT] = {0, 64, 256, 1024, 2048, 4096, 16384};
+
+// Contadores de un puerto para el panel de la consola y las métricas. Solo
+// los escribe el hilo del dispositivo (cargar y guardar, sin instrucciones
+// atómicas de lectura-modificación-escritura); los demás hilos solo los leen.
+struct PortCounters {
+    PortCounters()
+        : path(""), writes(0), bytes(0), deadline_misses(0), buffered(0), dropped_bytes(0), queued(0), lag_ms(0.0),
+          lag_samples(0), lag_ms_sum(0.0), lag_bytes_sum(0) {
+        for (int b = 0; b <= LAG_MS_BUCKET_COUNT; b++) lag_ms_histogram[b].store(0);
+        for (int b = 0; b <= LAG_BYTES_BUCKET_COUNT; b++) lag_bytes_histogram[b].store(0);
+    }
+
+    const char* path;                       // Ruta del puerto, para los diagnósticos
+    std::atomic<uint64_t> writes;           // Muestras (o grupos de sentencias) emitidas
+    std::atomic<uint64_t> bytes;
+    std::atomic<uint64_t> deadline_misses;  // Esperas que empezaron con la muestra ya vencida
+    std::atomic<uint32_t> buffered;         // Bytes retenidos en el búfer del adaptador USB
+    std::atomic<uint64_t> dropped_bytes;    // Rechazados por el pty con la cola llena
+
+    // Última muestra del retraso del consumidor e histogramas (el último
+    // cubo de cada uno cuenta lo que supera el mayor límite)
+    std::atomic<uint32_t> queued;           // Bytes sin leer en la cola del tty
+    std::atomic<double> lag_ms;
+    std::atomic<uint64_t> lag_samples;
+    std::atomic<double> lag_ms_sum;
+    std::atomic<uint64_t> lag_bytes_sum;
+    std::atomic<uint64_t> lag_ms_histogram[LAG_MS_BUCKET_COUNT + 1];
+    std::atomic<uint64_t> lag_bytes_histogram[LAG_BYTES_BUCKET_COUNT + 1];
+
+    static void bump(std::atomic<uint64_t>& counter, uint64_t amount) {
+        counter.store(counter.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+    }
+
+    void recordLag(uint32_t queue_bytes, uint64_t lag_bytes, double lag_milliseconds) {
+        queued.store(queue_bytes, std::memory_order_relaxed);
+        lag_ms.store(lag_milliseconds, std::memory_order_relaxed);
+        int ms_bucket = static_cast<int>(std::lower_bound(LAG_MS_BUCKETS, LAG_MS_BUCKETS + LAG_MS_BUCKET_COUNT,
+                                                          lag_milliseconds) - LAG_MS_BUCKETS);
+        int bytes_bucket = static_cast<int>(std::lower_bound(LAG_BYTES_BUCKETS, LAG_BYTES_BUCKETS + LAG_BYTES_BUCKET_COUNT,
+                                                             static_cast<double>(lag_bytes)) - LAG_BYTES_BUCKETS);
+        bump(lag_ms_histogram[ms_bucket], 1);
+        bump(lag_bytes_histogram[bytes_bucket], 1);
+        lag_ms_sum.store(lag_ms_sum.load(std::memory_order_relaxed) + lag_milliseconds, std::memory_order_relaxed);
+        bump(lag_bytes_sum, lag_bytes);
+        bump(lag_samples, 1);
+    }
+};
+
+// Salida sin copia a una tubería (FIFO): las líneas se escriben en un anillo
+// de páginas propio y vmsplice() entrega al núcleo referencias a esas páginas
+// en lugar de copiar los bytes como write(). Las páginas siguen siendo del
+// proceso, así que una zona no se reutiliza hasta que el consumidor la ha
+// leído: lo entregado menos lo que FIONREAD dice que sigue en la tubería.
+// Con el anillo lleno (consumidor lento) los datos se descartan, igual que
+// cuando la cola de un pty está llena. El consumidor debe leer con read():
+// si mueve las páginas a otra tubería con splice() o tee() puede verlas ya
+// sobrescritas.
+const size_t SPLICE_RING_CAPACITY = 1 << 20;  // Múltiplo de página; también el tamaño de la tubería
+
+// Con --fifo-dir los puertos son FIFO con el mismo nombre dentro de ese
+// directorio; con --fifo-vmsplice se escriben con vmsplice() en lugar de write()
+std::string fifo_dir;
+bool fifo_vmsplice = false;
+
+class SpliceRing {
+public:
+    SpliceRing() : handed_(0), consumed_(0) {
+        memory_ = static_cast<char*>(mmap(NULL, SPLICE_RING_CAPACITY, PROT_READ | PROT_WRITE,
+                                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+        if (memory_ == MAP_FAILED) memory_ = NULL;
+    }
+
+    // Las páginas que aún estén en la tubería siguen vivas: el núcleo tiene su propia referencia
+    ~SpliceRing() {
+        if (memory_ != NULL) munmap(memory_, SPLICE_RING_CAPACITY);
+    }
+
+    bool valid() const { return memory_ != NULL; }
+
+    // Como write(): bytes entregados, o -1 con errno (EAGAIN si no caben)
+    ssize_t write(int fd, const char* data, size_t length) {
+        int unread = 0;
+        if (ioctl(fd, FIONREAD, &unread) == 0) {
+            // Lo que haya en la tubería por delante de lo nuestro (p. ej. de
+            // la instancia anterior tras un relevo) no libera nada
+            consumed_ = handed_ - std::min<uint64_t>(static_cast<uint64_t>(unread), handed_ - consumed_);
+        }
+        if (length > SPLICE_RING_CAPACITY - (handed_ - consumed_)) {
+            errno = EAGAIN;
+            return -1;
+        }
+
+        struct iovec iov[2];
+        int segments = 0;
+        for (size_t done = 0; done < length; segments++) {
+            size_t offset = static_cast<size_t>((handed_ + done) % SPLICE_RING_CAPACITY);
+            size_t chunk = std::min(length - done, SPLICE_RING_CAPACITY - offset);
+            memcpy(memory_ + offset, data + done, chunk);
+            iov[segments].iov_base = memory_ + offset;
+            iov[segments].iov_len = chunk;
+            done += chunk;
+        }
+        ssize_t handed = vmsplice(fd, iov, static_cast<unsigned long>(segments), SPLICE_F_NONBLOCK);
+        if (handed > 0) handed_ += static_cast<uint64_t>(handed);
+        return handed;
+    }
+
+private:
+    char* memory_;
+    uint64_t handed_;    // Bytes entregados a la tubería desde el principio
+    uint64_t consumed_;  // De ellos, los que el consumidor ya leyó
+};
+
+// Salida de un puerto virtual. Sin modelo de transporte cada write() llega al
+// pty al instante. Con él se comporta como un adaptador USB-serie: envía un
+// paquete en cuanto acumula packet_bytes y lo pendiente cuando vence el
+// temporizador de latencia, que corre en ticks periódicos y se rearma con cada
+// paquete lleno. El temporizador lo atiende el propio hilo del dispositivo
+// desde wait(), sin hilos adicionales por puerto. Lo que llega al pty se
+// copia también a las derivaciones del puerto, si tiene alguna. Si el puerto
+// es una FIFO (--fifo-dir) la cola es la tubería y, con --fifo-vmsplice, las
+// escrituras van por vmsplice() (SpliceRing).
+class PortWriter {
+public:
+    PortWriter(int fd, const PortTransport& transport, TapHub* taps = NULL, PortCounters* counters = NULL)
+        : fd_(fd), taps_(taps), counters_(counters), probe_fd_(-1), fifo_(false), dropping_(false),
+          packet_bytes_(static_cast<size_t>(std::max(1, transport.packet_bytes))),
+          latency_(std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+              std::chrono::duration<double, std::milli>(transport.latency_ms))),
+          timer_(std::chrono::steady_clock::now() + latency_), started_(std::chrono::steady_clock::now()),
+          next_lag_sample_(started_), start_bytes_(counters != NULL ? counters->bytes.load() : 0) {
+        struct stat st;
+        fifo_ = fstat(fd_, &st) == 0 && S_ISFIFO(st.st_mode);
+        if (fifo_ && fifo_vmsplice) {
+            splice_.reset(new SpliceRing());
+            if (!splice_->valid()) splice_.reset();
+        }
+        // El slave abierto solo para consultar su cola (no lee ni escribe)
+        char slave_name[128];
+        if (!fifo_ && counters_ != NULL && ptsname_r(fd_, slave_name, sizeof(slave_name)) == 0) {
+            probe_fd_ = open(slave_name, O_RDONLY | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+        }
+    }
+
+    ~PortWriter() {
+        if (probe_fd_ != -1) close(probe_fd_);
+    }
+
+    void write(const std::string& data) {
+        write(data.data(), data.size());
+    }
+
+    void write(const char* data, size_t length) {
+        if (counters_ != NULL) {
+            PortCounters::bump(counters_->writes, 1);
+            PortCounters::bump(counters_->bytes, length);
+        }
+        if (latency_ <= std::chrono::steady_clock::duration::zero()) {
+            send(data, length);
+            return;
+        }
+        auto now = std::chrono::steady_clock::now();
+        if (pending_.empty() && timer_ <= now) {
+            // Ticks vencidos sin datos: avanzar el temporizador manteniendo su fase
+            timer_ += latency_ * ((now - timer_) / latency_ + 1);
+        }
+        pending_.append(data, length);
+        size_t sent = 0;
+        while (pending_.size() - sent >= packet_bytes_) {
+            send(pending_.data() + sent, packet_bytes_);
+            sent += packet_bytes_;
+        }
+        if (sent > 0) {
+            pending_.erase(0, sent);
+            timer_ = now + latency_;
+        }
+        if (counters_ != NULL) counters_->buffered.store(static_cast<uint32_t>(pending_.size()), std::memory_order_relaxed);
+    }
+
+    // Espera hasta deadline entregando los paquetes cuyo temporizador vence
+    // antes; devuelve false si se pidió la parada
+    bool wait(std::chrono::steady_clock::time_point deadline) {
+        if (counters_ != NULL) {
+            auto now = std::chrono::steady_clock::now();
+            if (now > deadline) PortCounters::bump(counters_->deadline_misses, 1);
+            if (now >= next_lag_sample_) sampleLag(now);
+        }
+        while (!pending_.empty() && timer_ < deadline) {
+            if (!waitUntil(timer_)) return false;
+            send(pending_.data(), pending_.size());
+            pending_.clear();
+            if (counters_ != NULL) counters_->buffered.store(0, std::memory_order_relaxed);
+            timer_ += latency_;
+        }
+        return waitUntil(deadline);
+    }
+
+    // Entrega lo pendiente (al terminar o antes de un relevo)
+    void flush() {
+        send(pending_.data(), pending_.size());
+        pending_.clear();
+    }
+
+private:
+    void send(const char* data, size_t length) {
+        if (length == 0) return;
+        ssize_t written = splice_ ? splice_->write(fd_, data, length) : ::write(fd_, data, length);
+        if (counters_ != NULL && written < static_cast<ssize_t>(length)) {
+            PortCounters::bump(counters_->dropped_bytes, length - static_cast<size_t>(std::max<ssize_t>(0, written)));
+            if (!dropping_) LOG_WARN("{}: el consumidor no lee; descartando datos", counters_->path);
+            dropping_ = true;
+        } else if (dropping_ && counters_ != NULL) {
+            LOG_INFO("{}: el consumidor vuelve a leer", counters_->path);
+            dropping_ = false;
+        }
+        if (taps_ != NULL && taps_->active()) taps_->publish(data, length);
+    }
+
+    void sampleLag(std::chrono::steady_clock::time_point now) {
+        next_lag_sample_ = now + std::chrono::milliseconds(LAG_SAMPLE_MS);
+        // En una FIFO la cola es la propia tubería (TIOCINQ equivale a FIONREAD)
+        int queue_bytes = 0;
+        int queue_fd = fifo_ ? fd_ : probe_fd_;
+        if (queue_fd == -1 || ioctl(queue_fd, TIOCINQ, &queue_bytes) == -1) queue_bytes = 0;
+        uint64_t lag_bytes = static_cast<uint64_t>(queue_bytes) + pending_.size();
+        uint64_t stream_bytes = counters_->bytes.load(std::memory_order_relaxed) - start_bytes_;
+        double elapsed_ms = std::chrono::duration<double, std::milli>(now - started_).count();
+        double lag_ms = stream_bytes > 0 ? lag_bytes * elapsed_ms / stream_bytes : 0.0;
+        counters_->recordLag(static_cast<uint32_t>(queue_bytes), lag_bytes, lag_ms);
+    }
+
+    int fd_;
+    TapHub* taps_;
+    PortCounters* counters_;
+    int probe_fd_;
+    bool fifo_;
+    bool dropping_;  // La última escritura se descartó (para avisar solo del cambio)
+    size_t packet_bytes_;
+    std::chrono::steady_clock::duration latency_;
+    std::chrono::steady_clock::time_point timer_;
+    std::chrono::steady_clock::time_point started_;
+    std::chrono::steady_clock::time_point next_lag_sample_;
+    uint64_t start_bytes_;
+    std::string pending_;
+    std::unique_ptr<SpliceRing> splice_;
+};
+
+// Entrada estándar leída sin bloquear: bytes aún sin línea completa y si sigue abierta
+std::string stdin_pending;
+bool stdin_open = true;
+
+// Espera una línea de la entrada estándar vigilando también las señales.
+// Devuelve false si se pidió la parada. Al cerrarse la entrada (p. ej. en CI)
+// entrega una última línea vacía y a partir de ahí solo espera la parada.
+// Con timeout_ms >= 0 devuelve true con *timed_out a true si no llega ninguna
+// línea a tiempo.
+bool readInputLine(std::string& line, int timeout_ms = -1, bool* timed_out = NULL) {
+    if (timed_out != NULL) *timed_out = false;
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+    for (;;) {
+        size_t newline = stdin_pending.find('\n');
+        if (newline != std::string::npos) {
+            line = stdin_pending.substr(0, newline);
+            stdin_pending.erase(0, newline + 1);
+            if (!line.empty() && line[line.size() - 1] == '\r') line.erase(line.size() - 1);
+            return true;
+        }
+
+        struct pollfd fds[3] = {
+            {shutdown_fd, POLLIN, 0},
+            {signal_fd, POLLIN, 0},
+            {STDIN_FILENO, POLLIN, 0},
+        };
+        int wait_ms = -1;
+        if (timeout_ms >= 0) {
+            wait_ms = static_cast<int>(std::max<int64_t>(0, std::chrono::duration_cast<std::chrono::milliseconds>(
+                deadline - std::chrono::steady_clock::now()).count()));
+        }
+        int ready = poll(fds, stdin_open ? 3 : 2, wait_ms);
+        if (ready < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        if (ready == 0) {
+            if (timed_out != NULL) *timed_out = true;
+            return true;
+        }
+        if (fds[1].revents & POLLIN) {
+            handlePendingSignal();
+            return false;
+        }
+        if (fds[0].revents & POLLIN) return false;
+
+        if (stdin_open && (fds[2].revents & (POLLIN | POLLHUP))) {
+            char buffer[256];
+            ssize_t n = read(STDIN_FILENO, buffer, sizeof(buffer));
+            if (n > 0) {
+                stdin_pending.append(buffer, static_cast<size_t>(n));
+            } else {
+                stdin_open = false;
+                stdin_pending += '\n';
+            }
+        }
+    }
+}
+
+// ============================================================================
+// Decimación FIR de la señal interna de alta frecuencia
+// ============================================================================
+
+// El QTFM mide internamente a una frecuencia mayor y entrega la salida filtrada
+// y diezmada. Con internal_rate_hz > 0 cada cabezal genera campo + ruido a esa
+// frecuencia, las guarda en un anillo y un FIR paso bajo de fase lineal en
+// forma directa se evalúa solo en las muestras que se emiten (una convolución
+// completa por cada factor muestras internas, no una descomposición
+// polifásica), de modo que el espectro, el aliasing y el retardo de grupo
+// ((taps - 1) / 2 muestras internas) se parecen a los del equipo real.
+const int DECIMATION_CHANNELS = 4;  // Escalar, X, Y, Z
+
+struct DecimationFilter {
+    int factor;           // Muestras internas por muestra de salida
+    int taps;
+    double noise_scale;   // Mantiene la densidad de ruido de noise_nT en la banda útil
+    std::vector<double> coefficients;  // Aplicados de la muestra más antigua a la más reciente
+};
+
+// Historia del filtro: anillo con las últimas taps muestras internas
+struct DecimatorState {
+    int length;    // Muestras válidas (distinto de taps: sin cebar)
+    int position;  // Próxima posición a escribir (= la muestra más antigua)
+    double samples[MAX_DECIMATION_TAPS][DECIMATION_CHANNELS];
+};
+
+// Acumula en acc[c] la suma de coefficients[k] * samples[k][c]. Las versiones
+// SIMD procesan los cuatro canales a la vez sin FMA, con el mismo orden de
+// operaciones por canal que la escalar: todas dan exactamente el mismo
+// resultado, así que la reproducibilidad no depende de la CPU.
+typedef void (*DecimationKernel)(const double* coefficients, const double (*samples)[DECIMATION_CHANNELS],
+                                 int count, double acc[DECIMATION_CHANNELS]);
+
+void accumulateScalar(const double* coefficients, const double (*samples)[DECIMATION_CHANNELS],
+                      int count, double acc[DECIMATION_CHANNELS]) {
+    for (int k = 0; k < count; k++) {
+        for (int c = 0; c < DECIMATION_CHANNELS; c++) {
+            acc[c] += coefficients[k] * samples[k][c];
+        }
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2")))
+void accumulateAvx2(const double* coefficients, const double (*samples)[DECIMATION_CHANNELS],
+                    int count, double acc[DECIMATION_CHANNELS]) {
+    __m256d sum = _mm256_loadu_pd(acc);
+    for (int k = 0; k < count; k++) {
+        __m256d product = _mm256_mul_pd(_mm256_set1_pd(coefficients[k]), _mm256_loadu_pd(samples[k]));
+        sum = _mm256_add_pd(sum, product);
+    }
+    _mm256_storeu_pd(acc, sum);
+}
+#endif
+
+#if defined(__aarch64__)
+void accumulateNeon(const double* coefficients, const double (*samples)[DECIMATION_CHANNELS],
+                    int count, double acc[DECIMATION_CHANNELS]) {
+    float64x2_t low = vld1q_f64(acc);
+    float64x2_t high = vld1q_f64(acc + 2);
+    for (int k = 0; k < count; k++) {
+        float64x2_t h = vdupq_n_f64(coefficients[k]);
+        low = vaddq_f64(low, vmulq_f64(h, vld1q_f64(samples[k])));
+        high = vaddq_f64(high, vmulq_f64(h, vld1q_f64(samples[k] + 2)));
+    }
+    vst1q_f64(acc, low);
+    vst1q_f64(acc + 2, high);
+}
+#endif
+
+// Elige el kernel en tiempo de ejecución (AVX2 solo si la CPU lo tiene;
+// NEON es obligatorio en aarch64, como en la Raspberry Pi 5)
+DecimationKernel selectDecimationKernel(const char** name) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        if (name) *name = "avx2";
+        return accumulateAvx2;
+    }
+#elif defined(__aarch64__)
+    if (name) *name = "neon";
+    return accumulateNeon;
+#endif
+    if (name) *name = "escalar";
+    return accumulateScalar;
+}
+
+const DecimationKernel decimation_kernel = selectDecimationKernel(NULL);
+
+// Diseña el FIR (sinc con ventana de Blackman, ganancia 1 en continua);
+// nulo si la escena no pide frecuencia interna
+std::shared_ptr<const DecimationFilter> makeDecimationFilter(const ScenarioConfig& config) {
+    if (config.internal_rate_hz <= 0.0) return std::shared_ptr<const DecimationFilter>();
+    double output_rate_hz = 1e6 / MAG_PERIOD_US;
+
+    std::shared_ptr<DecimationFilter> filter(new DecimationFilter);
+    filter->factor = static_cast<int>(std::lround(config.internal_rate_hz / output_rate_hz));
+    filter->taps = config.decimation_taps > 0 ? config.decimation_taps : 8 * filter->factor;
+    filter->taps = std::min(filter->taps, MAX_DECIMATION_TAPS);
+    filter->noise_scale = std::sqrt(static_cast<double>(filter->factor));
+
+    double cutoff = std::min(config.decimation_cutoff_hz, 0.5 * output_rate_hz) / config.internal_rate_hz;
+    double center = (filter->taps - 1) / 2.0;
+    double sum = 0.0;
+    filter->coefficients.resize(filter->taps);
+    for (int k = 0; k < filter->taps; k++) {
+        double m = k - center;
+        double sinc = m == 0.0 ? 2.0 * cutoff : std::sin(2.0 * M_PI * cutoff * m) / (M_PI * m);
+        double phase = filter->taps > 1 ? 2.0 * M_PI * k / (filter->taps - 1) : 0.0;
+        double window = 0.42 - 0.5 * std::cos(phase) + 0.08 * std::cos(2.0 * phase);
+        filter->coefficients[k] = sinc * window;
+        sum += filter->coefficients[k];
+    }
+    for (int k = 0; k < filter->taps; k++) {
+        filter->coefficients[k] /= sum;
+    }
+    return filter;
+}
+
+// Convolución de la historia (de la más antigua a la más reciente) con el FIR
+void runDecimationFilter(const DecimationFilter& filter, const DecimatorState& history,
+                         double output[DECIMATION_CHANNELS]) {
+    for (int c = 0; c < DECIMATION_CHANNELS; c++) output[c] = 0.0;
+    int older = filter.taps - history.position;
+    decimation_kernel(&filter.coefficients[0], history.samples + history.position, older, output);
+    decimation_kernel(&filter.coefficients[older], history.samples, history.position, output);
+}
+
+// Nodos de la caché de campo de un cabezal (ver cachedHeadField)
+const int FIELD_CACHE_KNOTS = 4;
+const int FIELD_CACHE_VALUES = 5;  // Escalar, X, Y, Z, anomalía
+
+struct FieldCacheState {
+    int count;          // Nodos válidos (0 = caché vacía)
+    double interval;    // Espaciado actual entre nodos, en muestras
+    uint64_t break_at;  // Primera muestra tras una discontinuidad (0 = ninguna)
+    double t[FIELD_CACHE_KNOTS];  // Nodos, en índices de muestra
+    double value[FIELD_CACHE_KNOTS][FIELD_CACHE_VALUES];
+};
+
+// Estado del ruido coloreado de un cabezal (ver NoiseShaping): los filtros de
+// la componente 1/f y el paseo aleatorio de cada canal. Arranca en reposo.
+const int PINK_POLES = 18;
+const double PINK_MIN_HZ = 1e-3;
+
+struct NoiseState {
+    double pink[NOISE_CHANNELS][PINK_POLES];
+    double walk[NOISE_CHANNELS];
+};
+
+// Progreso de un magnetómetro, publicado tras cada muestra: contadores,
+// generador y caché de campo. La historia del FIR y el ruido coloreado (varios
+// KB) no entran; se publican solo cuando un checkpoint los pide.
+struct MagnetometerProgress {
+    uint64_t sample_index;  // Próxima muestra a emitir
+    uint16_t counter;       // Datacount 0-498
+    uint32_t timestamp_ms;
+    char axis;              // Próximo eje vectorial
+    uint64_t rng_state;
+    FieldCacheState cache;
+};
+
+// Estado completo de un magnetómetro entre dos muestras
+struct MagnetometerState : MagnetometerProgress {
+    DecimatorState decimator;
+    NoiseState noise;
+};
+
+// Estado completo del GPS entre dos sentencias
+struct GPSState {
+    uint64_t sample_index;
+    double latitude;
+    double longitude;
+    double altitude;
+    int hours;
+    int minutes;
+    int seconds;
+    int centiseconds;
+    int gnzda_counter;
+    uint64_t rng_state;
+};
+
+// Cada dispositivo de cada plataforma tiene su propio flujo de ruido; la
+// plataforma 0 conserva los índices de siempre (GPS 0, magnetómetros 1..N)
+MagnetometerState initialMagnetometerState(int mag_id, uint64_t seed, int platform = 0) {
+    MagnetometerState state;
+    state.sample_index = 0;
+    state.counter = 0;
+    state.timestamp_ms = 86336800;  // Timestamp inicial del ejemplo
+    state.axis = 'X';
+    state.rng_state = deviceSeed(seed, platform * DEVICES_PER_PLATFORM + mag_id);
+    memset(&state.cache, 0, sizeof(state.cache));
+    state.decimator.length = 0;
+    state.decimator.position = 0;
+    memset(&state.noise, 0, sizeof(state.noise));
+    return state;
+}
+
+GPSState initialGPSState(uint64_t seed, int platform = 0) {
+    GPSState state;
+    state.sample_index = 0;
+    state.latitude = sim_values.base_latitude;
+    state.longitude = sim_values.base_longitude;
+    state.altitude = sim_values.base_altitude;
+    // Tiempo inicial basado en ejemplo: 16:57:32.50
+    state.hours = 16;
+    state.minutes = 57;
+    state.seconds = 32;
+    state.centiseconds = 50;
+    state.gnzda_counter = 0;
+    state.rng_state = deviceSeed(seed, platform * DEVICES_PER_PLATFORM);
+    return state;
+}
+
+// Publicación sin bloqueo del estado de un dispositivo (seqlock de doble buffer).
+// El hilo del dispositivo escribe siempre en el buffer que no está publicado y
+// luego lo publica; el lector copia el publicado y reintenta solo si el
+// escritor llegó a reutilizar ese mismo buffer mientras copiaba.
+template <typename T>
+class SnapshotSlot {
+public:
+    SnapshotSlot() : begun_(0), published_(0), has_value_(false) {}
+
+    void publish(const T& value) {
+        uint64_t v = begun_.load(std::memory_order_relaxed) + 1;
+        begun_.store(v, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        buffers_[v & 1] = value;
+        published_.store(v, std::memory_order_release);
+        has_value_.store(true, std::memory_order_release);
+    }
+
+    bool read(T& out) const {
+        if (!has_value_.load(std::memory_order_acquire)) return false;
+        for (;;) {
+            uint64_t v = published_.load(std::memory_order_acquire);
+            out = buffers_[v & 1];
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (begun_.load(std::memory_order_relaxed) - v < 2) return true;
+        }
+    }
+
+private:
+    T buffers_[2];
+    std::atomic<uint64_t> begun_;
+    std::atomic<uint64_t> published_;
+    std::atomic<bool> has_value_;
+};
+
+// ============================================================================
+// Estadísticas en línea de la señal emitida por cada cabezal
+// ============================================================================
+
+// Cada hilo de magnetómetro acumula, por canal, media y varianza (Welford),
+// mínimo, máximo y una PSD de Welch (bloques Hann de WELCH_BLOCK muestras con
+// solapamiento del 50 %, sin la media del bloque). Los ejes vectoriales se
+// emiten por turnos, así que su frecuencia de muestreo es un tercio de la
+// escalar. El hilo publica una copia cada WELCH_STEP muestras para las métricas.
+const int STATS_CHANNELS = 4;  // Escalar, X, Y, Z
+const int WELCH_BLOCK = 256;
+const int WELCH_STEP = WELCH_BLOCK / 2;
+const int WELCH_BINS = WELCH_BLOCK / 2 + 1;
+const char* const STATS_CHANNEL_NAMES[STATS_CHANNELS] = {"scalar", "x", "y", "z"};
+
+struct ChannelStatistics {
+    uint64_t count;
+    double mean;
+    double m2;              // Suma de cuadrados de las desviaciones (Welford)
+    double min;
+    double max;
+    double last;            // Último valor emitido
+    double sample_rate_hz;
+    uint64_t blocks;        // Bloques promediados en la PSD
+    double psd[WELCH_BINS]; // nT^2/Hz, unilateral; bin k en k * fs / WELCH_BLOCK
+
+    double variance() const { return count > 1 ? m2 / (count - 1) : 0.0; }
+};
+
+struct HeadStatistics {
+    ChannelStatistics channels[STATS_CHANNELS];
+};
+
+// FFT compleja radix-2 in situ de tamaño WELCH_BLOCK
+void fftInPlace(std::complex<double>* data) {
+    for (int i = 1, j = 0; i < WELCH_BLOCK; i++) {
+        int bit = WELCH_BLOCK >> 1;
+        for (; j & bit; bit >>= 1) j ^= bit;
+        j ^= bit;
+        if (i < j) std::swap(data[i], data[j]);
+    }
+    for (int length = 2; length <= WELCH_BLOCK; length <<= 1) {
+        std::complex<double> step = std::polar(1.0, -2.0 * M_PI / length);
+        for (int start = 0; start < WELCH_BLOCK; start += length) {
+            std::complex<double> w(1.0, 0.0);
+            for (int k = 0; k < length / 2; k++) {
+                std::complex<double> even = data[start + k];
+                std::complex<double> odd = data[start + k + length / 2] * w;
+                data[start + k] = even + odd;
+                data[start + k + length / 2] = even - odd;
+                w *= step;
+            }
+        }
+    }
+}
+
+class HeadStatisticsAccumulator {
+public:
+    HeadStatisticsAccumulator() : window_power_(0.0) {
+        memset(&stats_, 0, sizeof(stats_));
+        memset(filled_, 0, sizeof(filled_));
+        for (int c = 0; c < STATS_CHANNELS; c++) {
+            stats_.channels[c].sample_rate_hz = 1e6 / MAG_PERIOD_US / (c == 0 ? 1.0 : 3.0);
+        }
+        for (int k = 0; k < WELCH_BLOCK; k++) {
+            window_[k] = 0.5 - 0.5 * std::cos(2.0 * M_PI * k / WELCH_BLOCK);
+            window_power_ += window_[k] * window_[k];
+        }
+    }
+
+    void add(int channel, double value) {
+        ChannelStatistics& s = stats_.channels[channel];
+        s.count++;
+        double delta = value - s.mean;
+        s.mean += delta / s.count;
+        s.m2 += delta * (value - s.mean);
+        s.min = s.count == 1 ? value : std::min(s.min, value);
+        s.max = s.count == 1 ? value : std::max(s.max, value);
+        s.last = value;
+
+        block_[channel][filled_[channel]++] = value;
+        if (filled_[channel] == WELCH_BLOCK) {
+            accumulateBlock(channel);
+            memmove(block_[channel], block_[channel] + WELCH_STEP, sizeof(double) * (WELCH_BLOCK - WELCH_STEP));
+            filled_[channel] = WELCH_BLOCK - WELCH_STEP;
+        }
+    }
+
+    const HeadStatistics& statistics() const { return stats_; }
+
+private:
+    void accumulateBlock(int channel) {
+        ChannelStatistics& s = stats_.channels[channel];
+        double block_mean = 0.0;
+        for (int k = 0; k < WELCH_BLOCK; k++) block_mean += block_[channel][k];
+        block_mean /= WELCH_BLOCK;
+
+        std::complex<double> spectrum[WELCH_BLOCK];
+        for (int k = 0; k < WELCH_BLOCK; k++) {
+            spectrum[k] = std::complex<double>((block_[channel][k] - block_mean) * window_[k], 0.0);
+        }
+        fftInPlace(spectrum);
+
+        // Promedio incremental de los periodogramas de todos los bloques
+        s.blocks++;
+        double scale = 1.0 / (s.sample_rate_hz * window_power_);
+        for (int k = 0; k < WELCH_BINS; k++) {
+            double power = std::norm(spectrum[k]) * scale * ((k == 0 || k == WELCH_BLOCK / 2) ? 1.0 : 2.0);
+            s.psd[k] += (power - s.psd[k]) / s.blocks;
+        }
+    }
+
+    HeadStatistics stats_;
+    double block_[STATS_CHANNELS][WELCH_BLOCK];
+    int filled_[STATS_CHANNELS];
+    double window_[WELCH_BLOCK];
+    double window_power_;
+};
+
+// ============================================================================
+// Canal de verdad etiquetada (--truth, truth_export)
+// ============================================================================
+
+// Junto a cada muestra emitida se puede exportar su descomposición: valor
+// emitido, campo de referencia, anomalía de las fuentes, interferencia y ruido
+// (lo que resta), para el escalar y para el eje vectorial de la línea, más las
+// fuentes que más aportan con su id y su aporte. El hilo del cabezal arma la
+// fila con lo que ya calculó al generar la muestra (fillTruthRecord) y la deja
+// en su cola; un hilo de fondo la pasa a columnas y escribe bloques binarios.
+//
+// Archivo (little-endian): cabecera "QSTRUTH\0", versión u32, máximo de
+// fuentes por fila u32; después bloques con cabecera {magia u32 "QSTB",
+// filas u32, fuentes u32, bytes del bloque u32} y las columnas contiguas:
+// sample_index u64, los TRUTH_VALUES valores f64, timestamp_ms u32,
+// source_id u32, source_scalar_nT f32, source_vector_nT f32 (estas tres con
+// una entrada por fuente), platform u8, head u8, axis u8 y source_count u8,
+// rellenado a múltiplo de 8 bytes.
+const int TRUTH_VALUES = 10;
+const char* const TRUTH_VALUE_NAMES[TRUTH_VALUES] = {
+    "emitted_scalar", "reference_scalar", "anomaly_scalar", "interference_scalar", "noise_scalar",
+    "emitted_vector", "reference_vector", "anomaly_vector", "interference_vector", "noise_vector"};
+const int TRUTH_MAX_SOURCES = 16;          // Fuentes por fila, las de mayor aporte escalar
+const size_t TRUTH_QUEUE_CAPACITY = 1024;  // Filas por cabezal (4 s a 250 Hz)
+const size_t TRUTH_BLOCK_ROWS = 8192;
+const int TRUTH_WRITE_INTERVAL_MS = 100;
+const int TRUTH_BLOCK_MAX_AGE_MS = 1000;   // Un bloque parcial se escribe tras este tiempo
+const uint32_t TRUTH_FILE_VERSION = 1;
+const uint32_t TRUTH_BLOCK_MAGIC = 0x42545351;  // "QSTB"
+
+struct TruthRecord {
+    uint64_t sample_index;
+    uint32_t timestamp_ms;
+    uint8_t platform;
+    uint8_t head;
+    char axis;
+    uint8_t source_count;
+    double values[TRUTH_VALUES];
+    uint32_t source_id[TRUTH_MAX_SOURCES];
+    float source_scalar_nT[TRUTH_MAX_SOURCES];
+    float source_vector_nT[TRUTH_MAX_SOURCES];
+};
+
+// Cola SPSC de un cabezal, como las del registro de diagnósticos
+struct TruthQueue {
+    TruthQueue() : head(0), tail(0), dropped(0), retired(false) {}
+    TruthRecord records[TRUTH_QUEUE_CAPACITY];
+    std::atomic<uint64_t> head;
+    std::atomic<uint64_t> tail;
+    std::atomic<uint64_t> dropped;
+    std::atomic<bool> retired;  // El productor terminó; el escritor la libera al vaciarla
+};
+
+class TruthExporter {
+public:
+    TruthExporter() : fd_(-1), stopping_(false), drain_requested_(false), writer_(NULL) {}
+    ~TruthExporter() { stop(); }
+
+    // Abre el archivo (añadiendo si ya existe: un relevo o una partición
+    // relanzada continúan el mismo) y arranca el hilo de escritura
+    bool start(const std::string& path, std::string& error) {
+        fd_ = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        struct stat st;
+        char header[16] = "QSTRUTH";
+        uint32_t max_sources = TRUTH_MAX_SOURCES;
+        memcpy(header + 8, &TRUTH_FILE_VERSION, 4);
+        memcpy(header + 12, &max_sources, 4);
+        if (fd_ == -1 || fstat(fd_, &st) == -1 || (st.st_size == 0 && !writeAll(header, sizeof(header)))) {
+            error = path + ": " + strerror(errno);
+            if (fd_ != -1) close(fd_);
+            fd_ = -1;
+            return false;
+        }
+        path_ = path;
+        stopping_ = false;
+        last_block_ = std::chrono::steady_clock::now();
+        writer_ = startBackgroundThread([this] { writerLoop(); });
+        return true;
+    }
+
+    bool active() const { return fd_ != -1; }
+
+    // Cola del hilo productor que llama
+    TruthQueue* attach() {
+        TruthQueue* queue = new TruthQueue;
+        std::lock_guard<std::mutex> lock(registry_mutex_);
+        queues_.push_back(queue);
+        return queue;
+    }
+
+    void detach(TruthQueue* queue) {
+        if (queue != NULL) queue->retired.store(true, std::memory_order_release);
+    }
+
+    // En tiempo real una cola llena descarta la fila (se avisa en el registro);
+    // en los renders offline (wait) se espera al escritor
+    void push(TruthQueue& queue, const TruthRecord& record, bool wait) {
+        uint64_t head = queue.head.load(std::memory_order_relaxed);
+        while (head - queue.tail.load(std::memory_order_acquire) >= TRUTH_QUEUE_CAPACITY) {
+            if (!wait) {
+                queue.dropped.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+            {
+                std::lock_guard<std::mutex> lock(wake_mutex_);
+                drain_requested_ = true;
+            }
+            wake_.notify_one();
+            std::this_thread::sleep_for(std::chrono::microseconds(200));
+        }
+        queue.records[head % TRUTH_QUEUE_CAPACITY] = record;
+        queue.head.store(head + 1, std::memory_order_release);
+    }
+
+    // Tras parar a todos los productores: escribe lo pendiente y cierra
+    void stop() {
+        if (writer_ == NULL) return;
+        {
+            std::lock_guard<std::mutex> lock(wake_mutex_);
+            stopping_ = true;
+        }
+        wake_.notify_one();
+        writer_->join();
+        delete writer_;
+        writer_ = NULL;
+        close(fd_);
+        fd_ = -1;
+    }
+
+private:
+    void writerLoop() {
+        for (;;) {
+            bool stop;
+            {
+                std::unique_lock<std::mutex> lock(wake_mutex_);
+                wake_.wait_for(lock, std::chrono::milliseconds(TRUTH_WRITE_INTERVAL_MS),
+                               [this] { return stopping_ || drain_requested_; });
+                stop = stopping_;
+                drain_requested_ = false;
+            }
+            drain();
+            auto now = std::chrono::steady_clock::now();
+            if (!sample_index_.empty() &&
+                (stop || now - last_block_ >= std::chrono::milliseconds(TRUTH_BLOCK_MAX_AGE_MS))) {
+                writeBlock();
+            }
+            if (stop) return;
+        }
+    }
+
+    void drain() {
+        std::lock_guard<std::mutex> lock(registry_mutex_);
+        for (size_t q = 0; q < queues_.size();) {
+            TruthQueue* queue = queues_[q];
+            bool retired = queue->retired.load(std::memory_order_acquire);
+            uint64_t head = queue->head.load(std::memory_order_acquire);
+            for (uint64_t i = queue->tail.load(std::memory_order_relaxed); i < head; i++) {
+                appendRow(queue->records[i % TRUTH_QUEUE_CAPACITY]);
+                if (sample_index_.size() >= TRUTH_BLOCK_ROWS) writeBlock();
+            }
+            queue->tail.store(head, std::memory_order_release);
+            uint64_t dropped = queue->dropped.exchange(0);
+            if (dropped > 0) LOG_WARN("{} filas de verdad descartadas ({} no da abasto)", dropped, path_.c_str());
+            if (retired) {
+                delete queue;
+                queues_.erase(queues_.begin() + q);
+            } else {
+                q++;
+            }
+        }
+    }
+
+    void appendRow(const TruthRecord& record) {
+        sample_index_.push_back(record.sample_index);
+        timestamp_ms_.push_back(record.timestamp_ms);
+        for (int v = 0; v < TRUTH_VALUES; v++) values_[v].push_back(record.values[v]);
+        for (int k = 0; k < record.source_count; k++) {
+            source_id_.push_back(record.source_id[k]);
+            source_scalar_.push_back(record.source_scalar_nT[k]);
+            source_vector_.push_back(record.source_vector_nT[k]);
+        }
+        platform_.push_back(record.platform);
+        head_.push_back(record.head);
+        axis_.push_back(static_cast<uint8_t>(record.axis));
+        source_count_.push_back(record.source_count);
+    }
+
+    template <typename T>
+    static void appendColumn(std::string& block, const std::vector<T>& column) {
+        block.append(reinterpret_cast<const char*>(column.data()), column.size() * sizeof(T));
+    }
+
+    void writeBlock() {
+        uint32_t header[4] = {TRUTH_BLOCK_MAGIC, static_cast<uint32_t>(sample_index_.size()),
+                              static_cast<uint32_t>(source_id_.size()), 0};
+        block_.assign(reinterpret_cast<const char*>(header), sizeof(header));
+        appendColumn(block_, sample_index_);
+        for (int v = 0; v < TRUTH_VALUES; v++) appendColumn(block_, values_[v]);
+        appendColumn(block_, timestamp_ms_);
+        appendColumn(block_, source_id_);
+        appendColumn(block_, source_scalar_);
+        appendColumn(block_, source_vector_);
+        appendColumn(block_, platform_);
+        appendColumn(block_, head_);
+        appendColumn(block_, axis_);
+        appendColumn(block_, source_count_);
+        block_.resize((block_.size() + 7) & ~static_cast<size_t>(7), '\0');
+        header[3] = static_cast<uint32_t>(block_.size());
+        memcpy(&block_[12], &header[3], sizeof(header[3]));
+        if (!writeAll(block_.data(), block_.size())) {
+            LOG_ERROR("Error al escribir el canal de verdad en {}: {}", path_.c_str(), strerror(errno));
+        }
+
+        sample_index_.clear();
+        timestamp_ms_.clear();
+        for (int v = 0; v < TRUTH_VALUES; v++) values_[v].clear();
+        source_id_.clear();
+        source_scalar_.clear();
+        source_vector_.clear();
+        platform_.clear();
+        head_.clear();
+        axis_.clear();
+        source_count_.clear();
+        last_block_ = std::chrono::steady_clock::now();
+    }
+
+    bool writeAll(const char* data, size_t length) {
+        for (size_t done = 0; done < length;) {
+            ssize_t n = write(fd_, data + done, length - done);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            done += static_cast<size_t>(n);
+        }
+        return true;
+    }
+
+    int fd_;
+    std::string path_;
+    std::mutex registry_mutex_;
+    std::vector<TruthQueue*> queues_;
+    std::mutex wake_mutex_;
+    std::condition_variable wake_;
+    bool stopping_;
+    bool drain_requested_;  // Un productor offline espera sitio en su cola
+    std::thread* writer_;
+    std::chrono::steady_clock::time_point last_block_;
+
+    // Bloque en curso, por columnas
+    std::vector<uint64_t> sample_index_;
+    std::vector<uint32_t> timestamp_ms_;
+    std::vector<double> values_[TRUTH_VALUES];
+    std::vector<uint32_t> source_id_;
+    std::vector<float> source_scalar_;
+    std::vector<float> source_vector_;
+    std::vector<uint8_t> platform_, head_, axis_, source_count_;
+    std::string block_;
+};
+
+// Exportador de la simulación en tiempo real (--truth; con particiones cada
+// proceso de trabajo escribe el suyo en RUTA.N)
+std::string truth_path;
+TruthExporter truth_exporter;
+
+// ============================================================================
+// Unidad inercial (IMU) de la plataforma
+// ============================================================================
+
+// Muestra inercial en ejes de la plataforma (x al morro, y al ala derecha,
+// z abajo): fuerza específica en m/s² (nivelada y sin acelerar, z = -g) y
+// velocidad angular en rad/s
+struct ImuSample {
+    uint64_t index;  // Número de muestra: instante index * periodo
+    uint64_t time_us;
+    double accel_mps2[3];
+    double gyro_rads[3];
+};
+
+const double STANDARD_GRAVITY_MPS2 = 9.80665;
+const double IMU_DIFFERENCE_S = 0.01;      // Paso de la segunda diferencia de la trayectoria
+const double IMU_MAX_ACCEL_MPS2 = 50.0;    // Por encima, un cambio de línea del plan
+const size_t IMU_FRAME_BYTES = 37;         // Trama binaria (ver formatImuSample)
+const size_t IMU_MAX_BYTES = 128;          // Cota de una línea $PSIMU o una trama
+
+// IMU de una plataforma. Las muestras no tienen estado: la n-ésima sale de la
+// trayectoria y la actitud en t = n * periodo, y su ruido de un generador
+// sembrado con n. Al reanudar (checkpoint, relevo, partición relanzada) no
+// hay nada que restaurar y el flujo sigue igual que sin interrupción.
+struct ImuModel {
+    const SurveyPlan* survey;
+    const AttitudeScript* attitude;
+    uint64_t period_us;
+    double accel_noise_mps2;
+    double gyro_noise_rads;
+    uint64_t seed;
+};
+
+ImuModel makeImuModel(const ScenarioConfig& config, const SurveyPlan& survey, uint64_t seed, int platform) {
+    ImuModel model;
+    model.survey = &survey;
+    model.attitude = &config.attitude;
+    model.period_us = static_cast<uint64_t>(std::llround(1e6 / config.imu_rate_hz));
+    model.accel_noise_mps2 = config.imu_accel_noise_mps2;
+    model.gyro_noise_rads = config.imu_gyro_noise_rads;
+    // Semilla aparte de la de los demás dispositivos (no altera sus flujos)
+    model.seed = deviceSeed(seed, MAX_PLATFORMS * DEVICES_PER_PLATFORM + platform);
+    return model;
+}
+
+// La aceleración es la segunda diferencia de la misma trayectoria que siguen
+// el GPS y los cabezales; la fuerza específica le suma la reacción a la
+// gravedad y se gira a ejes de la plataforma con la misma actitud que mueve
+// la firma magnética, cuyas velocidades angulares son las del giróscopo
+ImuSample sampleImu(const ImuModel& model, uint64_t index) {
+    ImuSample sample;
+    sample.index = index;
+    sample.time_us = index * model.period_us;
+    double t_s = sample.time_us / 1e6;
+    const double h = IMU_DIFFERENCE_S;
+
+    Vec3 before = model.survey->position(t_s - h);
+    Vec3 here = model.survey->position(t_s);
+    Vec3 after = model.survey->position(t_s + h);
+    Vec3 acceleration = (after - here * 2.0 + before) * (1.0 / (h * h));
+    if (acceleration.norm() > IMU_MAX_ACCEL_MPS2) acceleration = Vec3();
+    Vec3 specific_force = acceleration + Vec3(0.0, 0.0, STANDARD_GRAVITY_MPS2);
+
+    Attitude attitude = model.attitude->at(*model.survey, t_s);
+    BodyRotation rotation(attitude);
+    Vec3 accel = rotation.apply(specific_force);
+    Vec3 gyro = rotation.rates(attitude);
+
+    SimRng rng(model.seed + index * 0x632BE59BD9B4E019ULL);
+    sample.accel_mps2[0] = accel.x + rng.gaussian() * model.accel_noise_mps2;
+    sample.accel_mps2[1] = accel.y + rng.gaussian() * model.accel_noise_mps2;
+    sample.accel_mps2[2] = accel.z + rng.gaussian() * model.accel_noise_mps2;
+    sample.gyro_rads[0] = gyro.x + rng.gaussian() * model.gyro_noise_rads;
+    sample.gyro_rads[1] = gyro.y + rng.gaussian() * model.gyro_noise_rads;
+    sample.gyro_rads[2] = gyro.z + rng.gaussian() * model.gyro_noise_rads;
+    return sample;
+}
+
+// CRC-16/CCITT-FALSE (polinomio 0x1021, inicial 0xFFFF)
+uint16_t crc16Ccitt(const unsigned char* data, size_t length) {
+    uint16_t crc = 0xFFFF;
+    for (size_t i = 0; i < length; i++) {
+        crc ^= static_cast<uint16_t>(data[i] << 8);
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc & 0x8000) ? static_cast<uint16_t>((crc << 1) ^ 0x1021) : static_cast<uint16_t>(crc << 1);
+        }
+    }
+    return crc;
+}
+
+void putLittleEndian(unsigned char* out, uint32_t value) {
+    for (int i = 0; i < 4; i++) out[i] = static_cast<unsigned char>(value >> (8 * i));
+}
+
+// Escribe la muestra en out (IMU_MAX_BYTES, sin memoria dinámica) y devuelve
+// su longitud. En ASCII, una sentencia con checksum NMEA:
+//   $PSIMU,n,t_s,ax,ay,az,gx,gy,gz*hh
+// En binario, una trama little-endian de IMU_FRAME_BYTES: 0xA5 0x5A, longitud
+// de la carga (32), n y t en µs (u32, módulo 2^32), aceleración en µm/s² y
+// velocidad angular en µrad/s (i32) y el CRC-16/CCITT de longitud y carga.
+size_t formatImuSample(const ImuSample& sample, bool binary, char* out) {
+    if (!binary) {
+        int length = snprintf(out, IMU_MAX_BYTES - 5, "$PSIMU,%llu,%.6f,%.5f,%.5f,%.5f,%.6f,%.6f,%.6f",
+                              static_cast<unsigned long long>(sample.index), sample.time_us / 1e6,
+                              sample.accel_mps2[0], sample.accel_mps2[1], sample.accel_mps2[2], sample.gyro_rads[0],
+                              sample.gyro_rads[1], sample.gyro_rads[2]);
+        size_t end = std::min(static_cast<size_t>(std::max(length, 0)), IMU_MAX_BYTES - 6);
+        unsigned char checksum = 0;
+        for (size_t i = 1; i < end; i++) checksum ^= static_cast<unsigned char>(out[i]);
+        static const char hex[] = "0123456789ABCDEF";
+        out[end++] = '*';
+        out[end++] = hex[checksum >> 4];
+        out[end++] = hex[checksum & 0x0F];
+        out[end++] = '\r';
+        out[end++] = '\n';
+        return end;
+    }
+
+    unsigned char* frame = reinterpret_cast<unsigned char*>(out);
+    frame[0] = 0xA5;
+    frame[1] = 0x5A;
+    frame[2] = static_cast<unsigned char>(IMU_FRAME_BYTES - 5);
+    putLittleEndian(frame + 3, static_cast<uint32_t>(sample.index));
+    putLittleEndian(frame + 7, static_cast<uint32_t>(sample.time_us));
+    for (int a = 0; a < 3; a++) {
+        int64_t accel = std::llround(sample.accel_mps2[a] * 1e6);
+        int64_t gyro = std::llround(sample.gyro_rads[a] * 1e6);
+        accel = std::max<int64_t>(INT32_MIN, std::min<int64_t>(INT32_MAX, accel));
+        gyro = std::max<int64_t>(INT32_MIN, std::min<int64_t>(INT32_MAX, gyro));
+        putLittleEndian(frame + 11 + 4 * a, static_cast<uint32_t>(static_cast<int32_t>(accel)));
+        putLittleEndian(frame + 23 + 4 * a, static_cast<uint32_t>(static_cast<int32_t>(gyro)));
+    }
+    uint16_t crc = crc16Ccitt(frame + 2, IMU_FRAME_BYTES - 4);
+    frame[IMU_FRAME_BYTES - 2] = static_cast<unsigned char>(crc & 0xFF);
+    frame[IMU_FRAME_BYTES - 1] = static_cast<unsigned char>(crc >> 8);
+    return IMU_FRAME_BYTES;
+}
+
+// ============================================================================
+// Plataformas: GPS y cabezales con trayectoria y puertos propios
+// ============================================================================
+
+// Memoria compartida con los procesos de trabajo (--shards): un mmap anónimo
+// MAP_SHARED creado antes de los fork del que se reservan las plataformas.
+// Sin él (un solo proceso) las plataformas van al heap normal.
+struct SharedArena {
+    char* base;
+    size_t size;
+    size_t used;
+};
+
+SharedArena shared_arena = {NULL, 0, 0};
+
+bool createSharedArena(size_t size) {
+    void* memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) return false;
+    shared_arena.base = static_cast<char*>(memory);
+    shared_arena.size = size;
+    shared_arena.used = 0;
+    return true;
+}
+
+// Reserva alineada a línea de caché; NULL si no hay arena
+void* sharedArenaAllocate(size_t size) {
+    if (shared_arena.base == NULL) return NULL;
+    size_t offset = (shared_arena.used + 63) & ~static_cast<size_t>(63);
+    if (offset + size > shared_arena.size) throw std::bad_alloc();
+    shared_arena.used = offset + size;
+    return shared_arena.base + offset;
+}
+
+bool sharedArenaContains(const void* memory) {
+    const char* p = static_cast<const char*>(memory);
+    return shared_arena.base != NULL && p >= shared_arena.base && p < shared_arena.base + shared_arena.size;
+}
+
+// Estado completo de un cabezal bajo demanda: el hilo lo publica en la muestra
+// siguiente a una petición (un checkpoint) y siempre al terminar, así que el
+// coste por muestra es una lectura atómica
+struct MagnetometerStateRequest {
+    SnapshotSlot<MagnetometerState> state;
+    std::atomic<uint64_t> requested;
+    std::atomic<uint64_t> served;  // UINT64_MAX: el hilo terminó y publicó su estado final
+
+    MagnetometerStateRequest() : requested(0), served(0) {}
+
+    void serve(const MagnetometerState& current, bool final) {
+        uint64_t pending = requested.load(std::memory_order_acquire);
+        if (!final && served.load(std::memory_order_relaxed) >= pending) return;
+        state.publish(current);
+        served.store(final ? UINT64_MAX : pending, std::memory_order_release);
+    }
+};
+
+// Sin muestra de la IMU que continuar: se empieza por la que toca según el reloj
+const uint64_t IMU_INDEX_FROM_CLOCK = UINT64_MAX;
+
+// Todas las plataformas comparten field_model (campo de referencia e índice de
+// fuentes, inmutables y los componentes caros); cada una tiene su plan de vuelo
+// desplazado platform_spacing_m hacia el este, sus hilos y sus puertos.
+// Con --shards el objeto vive en la arena compartida: lo que publican los
+// hilos (instantáneas, estadísticas, contadores) lo ven todos los procesos.
+// Los miembros con memoria propia (cadenas, plan de vuelo) se fijan antes de
+// los fork y después solo se leen.
+struct Platform {
+    static void* operator new(size_t size) {
+        void* memory = sharedArenaAllocate(size);
+        return memory != NULL ? memory : ::operator new(size);
+    }
+    static void operator delete(void* memory) {
+        if (!sharedArenaContains(memory)) ::operator delete(memory);
+    }
+
+    int index;
+    SurveyPlan survey;
+    std::string port_paths[MAX_PORTS_PER_PLATFORM];  // GPS, magnetómetros y, si la hay, la IMU
+    int port_fds[MAX_PORTS_PER_PLATFORM];
+
+    // Estado inicial de cada dispositivo (por defecto o restaurado) y su última publicación
+    GPSState gps_initial_state;
+    MagnetometerState mag_initial_states[NUM_MAGNETOMETERS];
+    SnapshotSlot<GPSState> gps_snapshot;
+    SnapshotSlot<MagnetometerProgress> mag_snapshots[NUM_MAGNETOMETERS];
+    MagnetometerStateRequest mag_full_states[NUM_MAGNETOMETERS];
+    SnapshotSlot<HeadStatistics> head_statistics[NUM_MAGNETOMETERS];
+    uint64_t imu_initial_index;  // Primera muestra de la IMU (IMU_INDEX_FROM_CLOCK: la que toca)
+    SnapshotSlot<ImuSample> imu_snapshot;
+    TapHub taps[MAX_PORTS_PER_PLATFORM];
+    PortCounters port_counters[MAX_PORTS_PER_PLATFORM];
+
+    // Datos compartidos para modo idéntico (Y-splitter)
+    QuSpinData shared_data;
+    TruthRecord shared_truth;
+    std::mutex shared_data_mutex;
+};
+
+std::vector<std::unique_ptr<Platform>> platforms;
+
+// Puertos de cada plataforma: DEVICES_PER_PLATFORM, más el de la IMU si el
+// escenario la activa (lo fija createPlatforms)
+int platform_ports = DEVICES_PER_PLATFORM;
+
+// Puertos de la plataforma 0, los únicos ttyAMA que el simulador sustituye
+const char* const BASELINE_PORT_NAMES[DEVICES_PER_PLATFORM] = {"ttyAMA0", "ttyAMA2", "ttyAMA4"};
+const char* const PLATFORM_DEVICE_SUFFIXES[DEVICES_PER_PLATFORM] = {"_GPS", "_MAG1", "_MAG2"};
+
+// Puerto del dispositivo device (0 = GPS) de una plataforma: la plataforma 0
+// usa /dev/ttyAMA0, 2 y 4; las siguientes, nombres propios (ttyQSIM2_GPS,
+// ttyQSIM2_MAG1...) que no coinciden con UART reales como ttyAMA10 en la Pi 5.
+// La IMU, que el baseline no tenía, siempre usa el suyo (ttyQSIM1_IMU...);
+// imu_port cambia el de la plataforma 1.
+std::string platformPortPath(int platform, int device, const std::string& imu_port) {
+    std::string name;
+    if (device == IMU_DEVICE && platform == 0 && !imu_port.empty()) {
+        size_t slash = imu_port.rfind('/');
+        if (fifo_dir.empty() && slash != std::string::npos) return imu_port;
+        name = slash == std::string::npos ? imu_port : imu_port.substr(slash + 1);
+    } else if (device == IMU_DEVICE) {
+        name = "ttyQSIM" + std::to_string(platform + 1) + "_IMU";
+    } else if (platform == 0) {
+        name = BASELINE_PORT_NAMES[device];
+    } else {
+        name = "ttyQSIM" + std::to_string(platform + 1) + PLATFORM_DEVICE_SUFFIXES[device];
+    }
+    return (fifo_dir.empty() ? "/dev" : fifo_dir) + "/" + name;
+}
+
+// Puertos del GPS: ttyAMA0 o ttyQSIM<n>_GPS
+bool isGpsPortPath(const std::string& path) {
+    size_t slash = path.rfind('/');
+    std::string name = slash == std::string::npos ? path : path.substr(slash + 1);
+    const std::string suffix = PLATFORM_DEVICE_SUFFIXES[0];
+    return name == BASELINE_PORT_NAMES[0] ||
+           (name.size() > suffix.size() && name.compare(name.size() - suffix.size(), suffix.size(), suffix) == 0);
+}
+
+// Solo los puertos de /dev de la plataforma 0 pueden sustituir un dispositivo real
+bool isBaselinePortPath(const std::string& path) {
+    for (int d = 0; d < DEVICES_PER_PLATFORM; d++) {
+        if (path == std::string("/dev/") + BASELINE_PORT_NAMES[d]) return true;
+    }
+    return false;
+}
+
+void createPlatforms(const ScenarioConfig& config) {
+    platforms.clear();
+    platform_ports = config.imu_rate_hz > 0.0 ? MAX_PORTS_PER_PLATFORM : DEVICES_PER_PLATFORM;
+    for (int p = 0; p < config.platforms; p++) {
+        std::unique_ptr<Platform> platform(new Platform);
+        platform->index = p;
+        platform->imu_initial_index = IMU_INDEX_FROM_CLOCK;
+        platform->survey = config.survey;
+        platform->survey.origin_east_m += p * config.platform_spacing_m;
+        for (int d = 0; d < platform_ports; d++) {
+            platform->port_paths[d] = platformPortPath(p, d, config.imu_port);
+            platform->port_fds[d] = -1;
+            platform->port_counters[d].path = platform->port_paths[d].c_str();
+        }
+        platforms.push_back(std::move(platform));
+    }
+}
+
+// Densidad de ruido (mediana de la PSD sin el bin de continua) y el tono más
+// destacado sobre ese fondo, para comprobar la configuración sin análisis offline
+struct SpectrumSummary {
+    double noise_density;  // nT/sqrt(Hz)
+    double peak_hz;
+    double peak_ratio_db;  // Pico sobre la mediana
+};
+
+SpectrumSummary summarizeSpectrum(const ChannelStatistics& s) {
+    SpectrumSummary summary = {0.0, 0.0, 0.0};
+    if (s.blocks == 0) return summary;
+    std::vector<double> bins(s.psd + 1, s.psd + WELCH_BINS);
+    std::vector<double> sorted = bins;
+    std::nth_element(sorted.begin(), sorted.begin() + sorted.size() / 2, sorted.end());
+    double median = sorted[sorted.size() / 2];
+    summary.noise_density = std::sqrt(median);
+
+    size_t peak = std::max_element(bins.begin(), bins.end()) - bins.begin();
+    summary.peak_hz = (peak + 1) * s.sample_rate_hz / WELCH_BLOCK;
+    summary.peak_ratio_db = median > 0.0 ? 10.0 * std::log10(bins[peak] / median) : 0.0;
+    return summary;
+}
+
+// Genera la siguiente sentencia GNGGA y avanza el estado del GPS. La posición
+// reportada es la del plan de vuelo más el error acumulado del receptor.
+GPSData stepGPS(GPSState& state, const SurveyPlan& survey) {
+    SimRng rng(state.rng_state);
+    Vec3 platform = survey.position(state.sample_index * GPS_PERIOD_US / 1e6);
+
+    GPSData gps_data;
+    gps_data.hdop = 0.57;
+    gps_data.satellites = 9;
+    gps_data.fix_quality = 1;
+
+    // Actualizar tiempo UTC
+    int hours = state.hours, minutes = state.minutes, seconds = state.seconds, centiseconds = state.centiseconds;
+    if (survey.track) {
+        // La hora del registro en el instante seguido
+        double t_s = state.sample_index * GPS_PERIOD_US / 1e6 + survey.track_offset_s;
+        int64_t day_cs = std::llround(survey.track->startTimeOfDay() * 100.0 + t_s * 100.0) % 8640000;
+        if (day_cs < 0) day_cs += 8640000;
+        hours = static_cast<int>(day_cs / 360000);
+        minutes = static_cast<int>(day_cs / 6000 % 60);
+        seconds = static_cast<int>(day_cs / 100 % 60);
+        centiseconds = static_cast<int>(day_cs % 100);
+    }
+    std::stringstream time_ss;
+    time_ss << std::setfill('0') << std::setw(2) << hours
+            << std::setfill('0') << std::setw(2) << minutes
+            << std::setfill('0') << std::setw(2) << seconds
+            << "." << std::setfill('0') << std::setw(2) << centiseconds;
+    gps_data.utc_time = time_ss.str();
+
+    const double meters_per_degree = 111320.0;
+    if (survey.track) {
+        // Posición del registro (sin el error del receptor simulado)
+        const TrackLog& track = *survey.track;
+        gps_data.latitude = track.latitude0() + platform.y / meters_per_degree;
+        gps_data.longitude = track.longitude0() + platform.x / (meters_per_degree * track.cosLatitude0());
+        gps_data.altitude = track.altitude0_m() + platform.z - survey.flight_height_m;
+    } else {
+        // Pequeña variación en posición
+        state.latitude += rng.uniform(-0.1, 0.1) * 0.000001;
+        state.longitude += rng.uniform(-0.1, 0.1) * 0.000001;
+        state.altitude += rng.uniform(-0.1, 0.1) * 0.1;
+        gps_data.latitude = state.latitude + platform.y / meters_per_degree;
+        gps_data.longitude = state.longitude
+            + platform.x / (meters_per_degree * std::cos(state.latitude * M_PI / 180.0));
+        gps_data.altitude = state.altitude;
+    }
+
+    // Incrementar tiempo (0.1 segundos)
+    state.centiseconds += 10;
+    if (state.centiseconds >= 100) {
+        state.centiseconds -= 100;
+        state.seconds++;
+        if (state.seconds >= 60) {
+            state.seconds = 0;
+            state.minutes++;
+            if (state.minutes >= 60) {
+                state.minutes = 0;
+                state.hours++;
+                if (state.hours >= 24) {
+                    state.hours = 0;
+                }
+            }
+        }
+    }
+
+    state.rng_state = rng.state;
+    state.sample_index++;
+    return gps_data;
+}
+
+// Coeficientes del modelo de ruido coloreado de un cabezal. Cada canal avanza
+// al ritmo al que se emite: el escalar en cada muestra y cada eje vectorial en
+// una de cada tres. La componente 1/f es la suma de filtros de un polo con la
+// misma varianza y polos espaciados logarítmicamente, tres por década desde
+// PINK_MIN_HZ (por debajo se aplana): la suma de sus espectros lorentzianos
+// sigue 1/f con un rizado de ~0.5 dB. La ganancia se calibra con la PSD exacta
+// de los filtros discretos en el centro geométrico de la banda.
+struct NoiseShaping {
+    struct Channel {
+        double rate_hz;
+        double white_sigma;
+        double walk_sigma;
+        int poles;
+        double pole[PINK_POLES];
+        double drive[PINK_POLES];  // Desviación de la entrada de cada polo
+        NoiseTone tones[NOISE_TONES];
+    };
+    Channel channels[NOISE_CHANNELS];
+
+    // Ruido del canal c para la muestra sample_index del cabezal; avanza su estado
+    double sample(NoiseState& state, int c, uint64_t sample_index, SimRng& rng) const {
+        const Channel& channel = channels[c];
+        double value = channel.white_sigma > 0.0 ? channel.white_sigma * rng.gaussian() : 0.0;
+        for (int k = 0; k < channel.poles; k++) {
+            state.pink[c][k] = channel.pole[k] * state.pink[c][k] + channel.drive[k] * rng.gaussian();
+            value += state.pink[c][k];
+        }
+        if (channel.walk_sigma > 0.0) {
+            state.walk[c] += channel.walk_sigma * rng.gaussian();
+            value += state.walk[c];
+        }
+        double t = sample_index * (MAG_PERIOD_US / 1e6);
+        for (int k = 0; k < NOISE_TONES; k++) {
+            if (channel.tones[k].amplitude_nT > 0.0) {
+                value += channel.tones[k].amplitude_nT * std::sin(2.0 * M_PI * channel.tones[k].hz * t);
+            }
+        }
+        return value;
+    }
+};
+
+// Nulo si ningún canal tiene modelo de ruido (solo el uniforme de noise_nT)
+std::shared_ptr<const NoiseShaping> makeNoiseShaping(const ScenarioConfig& config) {
+    bool any = false;
+    for (int c = 0; c < NOISE_CHANNELS; c++) {
+        const ChannelNoise& noise = config.channel_noise[c];
+        any = any || noise.white_nT_rtHz > 0.0 || noise.walk_nT_rts > 0.0;
+        for (int k = 0; k < NOISE_TONES; k++) any = any || noise.tones[k].amplitude_nT > 0.0;
+    }
+    if (!any) return std::shared_ptr<const NoiseShaping>();
+
+    std::shared_ptr<NoiseShaping> shaping(new NoiseShaping);
+    for (int c = 0; c < NOISE_CHANNELS; c++) {
+        const ChannelNoise& noise = config.channel_noise[c];
+        NoiseShaping::Channel& channel = shaping->channels[c];
+        channel.rate_hz = 1e6 / MAG_PERIOD_US / (c == 0 ? 1.0 : 3.0);
+        channel.white_sigma = noise.white_nT_rtHz * std::sqrt(channel.rate_hz / 2.0);
+        channel.walk_sigma = noise.walk_nT_rts / std::sqrt(channel.rate_hz);
+        memcpy(channel.tones, noise.tones, sizeof(channel.tones));
+
+        channel.poles = 0;
+        double pink_level = noise.white_nT_rtHz * noise.white_nT_rtHz * noise.corner_hz;  // S(f) = pink_level / f
+        if (pink_level <= 0.0) continue;
+        for (int k = 0; k < PINK_POLES; k++) {
+            double pole_hz = PINK_MIN_HZ * std::pow(10.0, k / 3.0);
+            if (pole_hz >= channel.rate_hz / 2.0) break;
+            channel.pole[channel.poles++] = std::exp(-2.0 * M_PI * pole_hz / channel.rate_hz);
+        }
+        // PSD unilateral de los polos con varianza unidad en f_ref
+        double f_ref = std::sqrt(PINK_MIN_HZ * channel.rate_hz / 2.0);
+        double omega = 2.0 * M_PI * f_ref / channel.rate_hz;
+        double unit_psd = 0.0;
+        for (int k = 0; k < channel.poles; k++) {
+            double a = channel.pole[k];
+            unit_psd += 2.0 * (1.0 - a * a) / (channel.rate_hz * (1.0 - 2.0 * a * std::cos(omega) + a * a));
+        }
+        double gain = std::sqrt(pink_level / f_ref / unit_psd);
+        for (int k = 0; k < channel.poles; k++) {
+            channel.drive[k] = gain * std::sqrt(1.0 - channel.pole[k] * channel.pole[k]);
+        }
+    }
+    return shaping;
+}
+
+// Lo que necesita un cabezal además de su estado para generar una muestra
+struct HeadModel {
+    const FieldModel* field;
+    const SurveyPlan* survey;
+    Vec3 offset_m;            // Posición del cabezal respecto a la plataforma
+    double noise_nT;
+    double scalar_offset_nT;  // Diferencia fija entre sensores
+    double cache_error_nT;    // Error admitido por la caché de campo (0 = sin caché)
+    double cache_max_interval_s;
+    double cache_max_step_m;
+    std::shared_ptr<const DecimationFilter> decimator;  // Nulo: sin frecuencia interna
+    std::shared_ptr<const NoiseShaping> noise;          // Nulo: solo ruido uniforme
+    std::shared_ptr<const FieldFormula> formula;        // Nulo: campo del modelo
+    int head_number;                                    // Variables head y platform de la fórmula
+    int platform_number;
+    std::shared_ptr<const PlatformSignature> signature; // Nulo: sin firma de la plataforma
+    const AttitudeScript* attitude;
+};
+
+// Cabezal mag_id (1..n) de una plataforma con n cabezales alineados este-oeste
+HeadModel makeHeadModel(const FieldModel& field, const ScenarioConfig& config, int mag_id, int head_count) {
+    HeadModel head;
+    head.field = &field;
+    head.survey = &config.survey;
+    head.offset_m = Vec3((mag_id - 1 - (head_count - 1) / 2.0) * config.head_spacing_m, 0.0, 0.0);
+    head.noise_nT = config.noise_nT;
+    head.scalar_offset_nT = 0.0;
+    head.cache_error_nT = config.field_cache_error_nT;
+    head.cache_max_interval_s = config.field_cache_max_interval_s;
+    head.cache_max_step_m = config.field_cache_max_step_m;
+    head.decimator = makeDecimationFilter(config);
+    head.noise = makeNoiseShaping(config);
+    head.formula = config.field_formula[mag_id - 1];
+    head.head_number = mag_id;
+    head.platform_number = 1;
+    if (config.platform_signature[mag_id - 1].active()) {
+        head.signature = std::make_shared<PlatformSignature>(config.platform_signature[mag_id - 1]);
+    }
+    head.attitude = &config.attitude;
+    return head;
+}
+
+Vec3 headPosition(const HeadModel& head, double t_s) {
+    return head.survey->position(t_s) + head.offset_m;
+}
+
+// Caché de campo por cabezal. Entre dos muestras a 250Hz la plataforma apenas
+// se mueve, así que el campo se evalúa solo en nodos temporales y cada muestra
+// se interpola con el polinomio cúbico de Lagrange de los cuatro nodos que la
+// rodean. Los nodos caen siempre sobre índices de muestra, de modo que coinciden
+// exactamente con los instantes que evaluaría el camino sin caché.
+//
+// El espaciado se adapta: antes de aceptar un nodo nuevo se extrapola su valor
+// con los cuatro anteriores; el error de esa extrapolación es ~40 veces el de
+// interpolar en el tramo central, así que error/20 estima (con margen) el
+// error de interpolación. Esa estimación supone una trayectoria suave, por lo que se
+// comprueba aparte la interpolación de la posición (ver trajectoryError). Si
+// el error supera la cota la caché se reinicia en la muestra actual con la
+// mitad de espaciado (nodos uniformes, para no mezclar espaciados muy
+// distintos en un mismo polinomio); si queda 32 veces por debajo, se duplica.
+// Un salto de posición mayor que cache_max_step_m entre muestras consecutivas
+// (p. ej. al cambiar de línea) es una discontinuidad: hasta ella se evalúa
+// directo y después la caché arranca de nuevo. Todo el estado vive en MagnetometerState, así que entra en
+// el checkpoint y la reanudación sigue siendo exacta.
+void fieldValues(const FieldSample& sample, double values[FIELD_CACHE_VALUES]) {
+    values[0] = sample.scalar_nT;
+    values[1] = sample.vector_nT.x;
+    values[2] = sample.vector_nT.y;
+    values[3] = sample.vector_nT.z;
+    values[4] = sample.anomaly_nT;
+}
+
+FieldSample evaluateHeadField(const HeadModel& head, double sample_index, SourceContributions* contributions = NULL) {
+    return head.field->evaluate(headPosition(head, sample_index * MAG_PERIOD_US / 1e6), contributions);
+}
+
+// Distancia recorrida por el cabezal entre dos índices de muestra
+double headStep(const HeadModel& head, double from, double to) {
+    return (headPosition(head, to * MAG_PERIOD_US / 1e6) - headPosition(head, from * MAG_PERIOD_US / 1e6)).norm();
+}
+
+void storeFieldKnot(FieldCacheState& cache, int k, double sample_index, const FieldSample& sample) {
+    cache.t[k] = sample_index;
+    fieldValues(sample, cache.value[k]);
+}
+
+void interpolateKnots(const FieldCacheState& cache, double t, double values[FIELD_CACHE_VALUES]) {
+    double weights[FIELD_CACHE_KNOTS];
+    for (int i = 0; i < FIELD_CACHE_KNOTS; i++) {
+        weights[i] = 1.0;
+        for (int j = 0; j < FIELD_CACHE_KNOTS; j++) {
+            if (j != i) weights[i] *= (t - cache.t[j]) / (cache.t[i] - cache.t[j]);
+        }
+    }
+    for (int v = 0; v < FIELD_CACHE_VALUES; v++) {
+        values[v] = 0.0;
+        for (int k = 0; k < FIELD_CACHE_KNOTS; k++) values[v] += weights[k] * cache.value[k][v];
+    }
+}
+
+// Error de interpolación de la ventana de nodos en el punto medio de su tramo
+// k (entre t[k] y t[k + 1]), evaluando ahí el modelo completo
+double segmentError(const FieldCacheState& cache, const HeadModel& head, int k) {
+    double mid = std::floor((cache.t[k] + cache.t[k + 1]) * 0.5);
+    if (mid <= cache.t[k]) return 0.0;
+    double predicted[FIELD_CACHE_VALUES], actual[FIELD_CACHE_VALUES];
+    interpolateKnots(cache, mid, predicted);
+    fieldValues(evaluateHeadField(head, mid), actual);
+    double error_nT = 0.0;
+    for (int v = 0; v < FIELD_CACHE_VALUES; v++) {
+        error_nT = std::max(error_nT, std::abs(predicted[v] - actual[v]));
+    }
+    return error_nT;
+}
+
+// Error en metros de interpolar la posición del cabezal con los nodos de la
+// ventana, en el punto medio de su último tramo
+double trajectoryError(const FieldCacheState& cache, const HeadModel& head) {
+    const int last = FIELD_CACHE_KNOTS - 1;
+    double mid = std::floor((cache.t[last - 1] + cache.t[last]) * 0.5);
+    if (mid <= cache.t[last - 1]) return 0.0;
+    double weights[FIELD_CACHE_KNOTS];
+    for (int i = 0; i < FIELD_CACHE_KNOTS; i++) {
+        weights[i] = 1.0;
+        for (int j = 0; j < FIELD_CACHE_KNOTS; j++) {
+            if (j != i) weights[i] *= (mid - cache.t[j]) / (cache.t[i] - cache.t[j]);
+        }
+    }
+    Vec3 predicted;
+    for (int k = 0; k < FIELD_CACHE_KNOTS; k++) {
+        predicted += headPosition(head, cache.t[k] * MAG_PERIOD_US / 1e6) * weights[k];
+    }
+    return (predicted - headPosition(head, mid * MAG_PERIOD_US / 1e6)).norm();
+}
+
+// Reinicia la caché con nodos uniformes n, n+Δ, n+2Δ, n+3Δ validando cada
+// tramo; si alguno no cumple la cota el espaciado se reduce a la mitad. Con
+// Δ = 1 muestra un salto mayor que cache_max_step_m es una discontinuidad y
+// se marca en break_at.
+void restartFieldCache(FieldCacheState& cache, const HeadModel& head, double n, double interval) {
+    for (;;) {
+        cache.interval = interval;
+        cache.break_at = 0;
+        for (int k = 0; k < FIELD_CACHE_KNOTS; k++) {
+            storeFieldKnot(cache, k, n + k * interval, evaluateHeadField(head, n + k * interval));
+        }
+        bool ok = true;
+        for (int k = 0; k + 1 < FIELD_CACHE_KNOTS; k++) {
+            if (headStep(head, cache.t[k], cache.t[k + 1]) > head.cache_max_step_m) {
+                if (interval <= 1.0 && cache.break_at == 0) {
+                    cache.break_at = static_cast<uint64_t>(cache.t[k + 1]);
+                }
+                ok = false;
+            } else if (segmentError(cache, head, k) > head.cache_error_nT) {
+                ok = false;
+            }
+        }
+        if (ok || interval <= 1.0) break;
+        interval = std::max(1.0, std::floor(interval * 0.5));
+    }
+    cache.count = FIELD_CACHE_KNOTS;
+}
+
+FieldSample cachedHeadField(FieldCacheState& cache, const HeadModel& head, double sample_index) {
+    // Los nodos caen siempre en instantes de muestra, aunque se pida un instante
+    // intermedio (muestras internas de la decimación)
+    double n = sample_index;
+    double knot_n = std::floor(n);
+    double max_interval = std::max(1.0, std::floor(head.cache_max_interval_s * 1e6 / MAG_PERIOD_US));
+
+    bool past_break = cache.break_at > 0 && n >= static_cast<double>(cache.break_at);
+    if (cache.count < FIELD_CACHE_KNOTS || n < cache.t[0] || past_break) {
+        // Arranque conservador: un nodo por muestra; el espaciado crece solo
+        restartFieldCache(cache, head, knot_n, 1.0);
+    }
+
+    while (n > cache.t[2] && cache.break_at == 0) {
+        double t_new = cache.t[3] + cache.interval;
+        if (headStep(head, cache.t[3], t_new) > head.cache_max_step_m) {
+            if (cache.interval <= 1.0) {
+                cache.break_at = static_cast<uint64_t>(t_new);
+            } else {
+                restartFieldCache(cache, head, knot_n, std::floor(cache.interval * 0.5));
+            }
+            continue;
+        }
+
+        // Error del campo: extrapolación con la ventana actual / 20
+        FieldSample sample = evaluateHeadField(head, t_new);
+        double predicted[FIELD_CACHE_VALUES], actual[FIELD_CACHE_VALUES];
+        interpolateKnots(cache, t_new, predicted);
+        fieldValues(sample, actual);
+        double error_nT = 0.0, change_nT = 0.0;
+        for (int v = 0; v < FIELD_CACHE_VALUES; v++) {
+            error_nT = std::max(error_nT, std::abs(predicted[v] - actual[v]) / 20.0);
+            change_nT = std::max(change_nT, std::abs(actual[v] - cache.value[FIELD_CACHE_KNOTS - 1][v]));
+        }
+
+        FieldCacheState candidate = cache;
+        for (int k = 0; k + 1 < FIELD_CACHE_KNOTS; k++) {
+            candidate.t[k] = candidate.t[k + 1];
+            memcpy(candidate.value[k], candidate.value[k + 1], sizeof(candidate.value[k]));
+        }
+        storeFieldKnot(candidate, FIELD_CACHE_KNOTS - 1, t_new, sample);
+
+        // Error de la trayectoria: un quiebre (giro, fin de línea) no lo ve la
+        // extrapolación del campo, pero sí la interpolación de la posición
+        // en el punto medio del tramo nuevo, que además es barata de evaluar
+        double step_m = headStep(head, cache.t[3], t_new);
+        if (step_m > 0.0) {
+            double gradient = change_nT / step_m;
+            error_nT = std::max(error_nT, trajectoryError(candidate, head) * gradient);
+        }
+        if (error_nT > head.cache_error_nT && cache.interval > 1.0) {
+            restartFieldCache(cache, head, knot_n, std::floor(cache.interval * 0.5));
+            continue;
+        }
+
+        cache = candidate;
+        if (error_nT < head.cache_error_nT / 32.0) {
+            cache.interval = std::min(cache.interval * 2.0, max_interval);
+        }
+    }
+
+    // Ventana que cruza una discontinuidad: evaluación directa hasta el salto
+    if (cache.break_at > 0 && cache.t[FIELD_CACHE_KNOTS - 1] >= cache.break_at) {
+        return evaluateHeadField(head, n);
+    }
+
+    double values[FIELD_CACHE_VALUES];
+    interpolateKnots(cache, n, values);
+    FieldSample field;
+    field.scalar_nT = values[0];
+    field.vector_nT = Vec3(values[1], values[2], values[3]);
+    field.anomaly_nT = values[4];
+    return field;
+}
+
+// Genera la siguiente muestra QuSpin a partir del estado (sin avanzar contadores).
+// Si se pide, devuelve también el campo sin ruido en la posición del cabezal
+// y los aportes de cada fuente (no con la caché, que solo interpola la suma).
+FieldSample headField(MagnetometerState& state, const HeadModel& head, double sample_index,
+                      SourceContributions* contributions = NULL) {
+    return head.cache_error_nT > 0.0
+        ? cachedHeadField(state.cache, head, sample_index)
+        : evaluateHeadField(head, sample_index, contributions);
+}
+
+// Sustituye el campo escalar de count muestras por el de la fórmula del
+// cabezal. La diferencia con el modelo se suma a la anomalía (en la verdad
+// exportada queda con la de las fuentes) y al vector en la dirección de la
+// referencia, como haría un campo anómalo débil.
+void applyFieldFormula(const HeadModel& head, const double* sample_index, FieldSample* fields, int count) {
+    const FieldFormula& formula = *head.formula;
+    const Vec3& direction = head.field->reference->direction;
+    bool position = formula.uses(FORMULA_X) || formula.uses(FORMULA_Y) || formula.uses(FORMULA_Z);
+    FormulaInputs inputs;
+    double value[FORMULA_BATCH];
+    for (int begin = 0; begin < count; begin += FORMULA_BATCH) {
+        int batch = std::min(FORMULA_BATCH, count - begin);
+        for (int i = 0; i < batch; i++) {
+            const FieldSample& field = fields[begin + i];
+            double t_s = sample_index[begin + i] * MAG_PERIOD_US / 1e6;
+            Vec3 p = position ? headPosition(head, t_s) : Vec3();
+            inputs.values[FORMULA_T][i] = t_s;
+            inputs.values[FORMULA_X][i] = p.x;
+            inputs.values[FORMULA_Y][i] = p.y;
+            inputs.values[FORMULA_Z][i] = p.z;
+            inputs.values[FORMULA_HEAD][i] = head.head_number;
+            inputs.values[FORMULA_PLATFORM][i] = head.platform_number;
+            inputs.values[FORMULA_BASE][i] = field.scalar_nT - field.anomaly_nT;
+            inputs.values[FORMULA_ANOMALY][i] = field.anomaly_nT;
+        }
+        formula.evaluate(inputs, batch, value);
+        for (int i = 0; i < batch; i++) {
+            FieldSample& field = fields[begin + i];
+            double delta = value[i] - field.scalar_nT;
+            field.scalar_nT = value[i];
+            field.anomaly_nT += delta;
+            field.vector_nT += direction * delta;
+        }
+    }
+}
+
+// Suma la firma de la plataforma a count muestras. Se evalúa por lotes en
+// estructura de arrays: primero la actitud y los cosenos de cada muestra y
+// después cada término de Tolles–Lawson en un bucle sobre todo el lote.
+// La actitud (seis consultas al plan por el rumbo) solo se evalúa en los
+// extremos del lote y se interpola entre ellos: las muestras internas de un
+// lote caen dentro de un periodo de salida (4 ms), donde las maniobras son
+// lineales muy por debajo del nT. Si el rumbo salta (cambio de línea) o una
+// velocidad angular cambia de golpe (relevo de eje de maniobra, guiñada
+// anulada en el cambio de línea) se evalúa muestra a muestra.
+const int SIGNATURE_BATCH = 64;
+const double SIGNATURE_MAX_YAW_STEP = M_PI / 36.0;
+const double SIGNATURE_MAX_RATE_STEP = 1e-3;  // rad/s
+
+bool attitudeIsSmooth(const Attitude& a, const Attitude& b) {
+    return std::abs(std::remainder(b.yaw - a.yaw, 2.0 * M_PI)) < SIGNATURE_MAX_YAW_STEP &&
+           std::abs(b.roll_rate - a.roll_rate) < SIGNATURE_MAX_RATE_STEP &&
+           std::abs(b.pitch_rate - a.pitch_rate) < SIGNATURE_MAX_RATE_STEP &&
+           std::abs(b.yaw_rate - a.yaw_rate) < SIGNATURE_MAX_RATE_STEP;
+}
+
+Attitude interpolateAttitude(const Attitude& a, const Attitude& b, double f) {
+    Attitude attitude;
+    attitude.roll = a.roll + f * (b.roll - a.roll);
+    attitude.pitch = a.pitch + f * (b.pitch - a.pitch);
+    attitude.yaw = a.yaw + f * std::remainder(b.yaw - a.yaw, 2.0 * M_PI);
+    attitude.roll_rate = a.roll_rate + f * (b.roll_rate - a.roll_rate);
+    attitude.pitch_rate = a.pitch_rate + f * (b.pitch_rate - a.pitch_rate);
+    attitude.yaw_rate = a.yaw_rate + f * (b.yaw_rate - a.yaw_rate);
+    return attitude;
+}
+
+void applyPlatformSignature(const HeadModel& head, const double* sample_index, FieldSample* fields, int count) {
+    const PlatformSignature& s = *head.signature;
+    const Vec3& direction = head.field->reference->direction;
+    const double seconds_per_sample = MAG_PERIOD_US / 1e6;
+    double c[3][SIGNATURE_BATCH], dc[3][SIGNATURE_BATCH], total[SIGNATURE_BATCH], h[SIGNATURE_BATCH];
+    for (int begin = 0; begin < count; begin += SIGNATURE_BATCH) {
+        int batch = std::min(SIGNATURE_BATCH, count - begin);
+        double t_first = sample_index[begin] * seconds_per_sample;
+        double t_last = sample_index[begin + batch - 1] * seconds_per_sample;
+        Attitude first = head.attitude->at(*head.survey, t_first);
+        Attitude last = batch > 1 ? head.attitude->at(*head.survey, t_last) : first;
+        bool smooth = t_last > t_first && attitudeIsSmooth(first, last);
+        for (int i = 0; i < batch; i++) {
+            double t = sample_index[begin + i] * seconds_per_sample;
+            Attitude attitude = i == 0 ? first
+                              : i == batch - 1 ? last
+                              : smooth ? interpolateAttitude(first, last, (t - t_first) / (t_last - t_first))
+                                       : head.attitude->at(*head.survey, t);
+            double ci[3], dci[3];
+            bodyCosines(attitude, direction, ci, dci);
+            for (int k = 0; k < 3; k++) {
+                c[k][i] = ci[k];
+                dc[k][i] = dci[k];
+            }
+            total[i] = fields[begin + i].scalar_nT;
+        }
+        const double* x = c[0];
+        const double* y = c[1];
+        const double* z = c[2];
+        for (int i = 0; i < batch; i++) {
+            h[i] = s.permanent_nT[0] * x[i] + s.permanent_nT[1] * y[i] + s.permanent_nT[2] * z[i];
+        }
+        for (int i = 0; i < batch; i++) {
+            double induced = s.induced[0] * x[i] * x[i] + s.induced[1] * x[i] * y[i] + s.induced[2] * x[i] * z[i] +
+                             s.induced[3] * y[i] * y[i] + s.induced[4] * y[i] * z[i] + s.induced[5] * z[i] * z[i];
+            h[i] += total[i] * induced;
+        }
+        for (int a = 0; a < 3; a++) {
+            const double* ca = c[a];
+            const double* b = s.eddy + 3 * a;
+            for (int i = 0; i < batch; i++) {
+                h[i] += total[i] * ca[i] * (b[0] * dc[0][i] + b[1] * dc[1][i] + b[2] * dc[2][i]);
+            }
+        }
+        for (int i = 0; i < batch; i++) {
+            FieldSample& field = fields[begin + i];
+            field.scalar_nT += h[i];
+            field.vector_nT += direction * h[i];
+            field.interference_nT += h[i];
+        }
+    }
+}
+
+// Genera las muestras internas hasta la muestra de salida actual (la última
+// coincide con ella), las añade a la historia del filtro y devuelve la salida
+// diezmada. En field queda el campo verdadero en el instante de salida.
+void decimateHeadSignal(MagnetometerState& state, const HeadModel& head, SimRng& rng,
+                        double output[DECIMATION_CHANNELS], FieldSample& field, SourceContributions* contributions) {
+    const DecimationFilter& filter = *head.decimator;
+    DecimatorState& history = state.decimator;
+    double noise_nT = head.noise_nT * filter.noise_scale;
+
+    // Las muestras internas van por lotes para evaluar la fórmula de una vez
+    double indices[FORMULA_BATCH];
+    FieldSample fields[FORMULA_BATCH];
+    for (int begin = 0; begin < filter.factor; begin += FORMULA_BATCH) {
+        int batch = std::min(FORMULA_BATCH, filter.factor - begin);
+        for (int i = 0; i < batch; i++) {
+            int j = begin + i;
+            double offset = static_cast<double>(filter.factor - 1 - j) / filter.factor;
+            indices[i] = std::max(0.0, state.sample_index - offset);
+            fields[i] = headField(state, head, indices[i], j == filter.factor - 1 ? contributions : NULL);
+        }
+        if (head.formula) applyFieldFormula(head, indices, fields, batch);
+        if (head.signature) applyPlatformSignature(head, indices, fields, batch);
+
+        for (int i = 0; i < batch; i++) {
+            field = fields[i];
+            double truth[DECIMATION_CHANNELS] = {field.scalar_nT, field.vector_nT.x, field.vector_nT.y,
+                                                 field.vector_nT.z};
+
+            // Arranque (o cambio de filtro): historia en régimen permanente con el
+            // campo verdadero, sin transitorio desde cero
+            if (history.length != filter.taps) {
+                for (int k = 0; k < filter.taps; k++) {
+                    memcpy(history.samples[k], truth, sizeof(truth));
+                }
+                history.length = filter.taps;
+                history.position = 0;
+            }
+
+            double* sample = history.samples[history.position];
+            sample[0] = truth[0] + rng.uniform(-1.0, 1.0) * noise_nT;
+            sample[1] = truth[1] + rng.uniform(-1.0, 1.0) * noise_nT;
+            sample[2] = truth[2] + rng.uniform(-1.0, 1.0) * 10 * noise_nT;
+            sample[3] = truth[3] + rng.uniform(-1.0, 1.0) * noise_nT;
+            history.position = (history.position + 1) % filter.taps;
+        }
+    }
+    runDecimationFilter(filter, history, output);
+}
+
+QuSpinData sampleMagnetometer(MagnetometerState& state, const HeadModel& head, FieldSample* truth = NULL,
+                              SourceContributions* contributions = NULL) {
+    SimRng rng(state.rng_state);
+    QuSpinData quspin_data;
+    if (contributions) contributions->clear();
+
+    if (head.decimator) {
+        FieldSample field;
+        double output[DECIMATION_CHANNELS];
+        decimateHeadSignal(state, head, rng, output, field, contributions);
+        if (truth) *truth = field;
+
+        quspin_data.scalar_field_nT = output[0] + head.scalar_offset_nT;
+        quspin_data.vector_field_nT = output[1 + (state.axis - 'X')];
+    } else {
+        double index = static_cast<double>(state.sample_index);
+        FieldSample field = headField(state, head, index, contributions);
+        if (head.formula) applyFieldFormula(head, &index, &field, 1);
+        if (head.signature) applyPlatformSignature(head, &index, &field, 1);
+        if (truth) *truth = field;
+
+        quspin_data.scalar_field_nT = field.scalar_nT + head.scalar_offset_nT + rng.uniform(-1.0, 1.0) * head.noise_nT;
+
+        switch (state.axis) {
+            case 'X':
+                quspin_data.vector_field_nT = field.vector_nT.x + rng.uniform(-1.0, 1.0) * head.noise_nT;
+                break;
+            case 'Y':
+                quspin_data.vector_field_nT = field.vector_nT.y + rng.uniform(-1.0, 1.0) * 10 * head.noise_nT;
+                break;
+            case 'Z':
+                quspin_data.vector_field_nT = field.vector_nT.z + rng.uniform(-1.0, 1.0) * head.noise_nT;
+                break;
+        }
+    }
+
+    if (head.noise) {
+        quspin_data.scalar_field_nT += head.noise->sample(state.noise, 0, state.sample_index, rng);
+        quspin_data.vector_field_nT += head.noise->sample(state.noise, 1 + (state.axis - 'X'), state.sample_index, rng);
+    }
+
+    quspin_data.scalar_validation = '_';
+    quspin_data.vector_axis = state.axis;
+    quspin_data.vector_validation = '=';
+    quspin_data.data_counter = state.counter;
+    quspin_data.timestamp_ms = state.timestamp_ms;
+    quspin_data.scalar_sensitivity = 135 + rng.below(10);
+    quspin_data.vector_sensitivity = 110 + rng.below(10);
+
+    state.rng_state = rng.state;
+    return quspin_data;
+}
+
+// Avanza datacount, timestamp y eje tras emitir una muestra
+void advanceMagnetometer(MagnetometerState& state) {
+    state.counter += 2;
+    if (state.counter > 498) {
+        state.counter = 0;
+    }
+
+    state.timestamp_ms += 4;
+
+    // Rotar entre ejes X, Y, Z
+    switch (state.axis) {
+        case 'X': state.axis = 'Y'; break;
+        case 'Y': state.axis = 'Z'; break;
+        case 'Z': state.axis = 'X'; break;
+    }
+}
+
+// Fila de verdad de la muestra que acaba de generar sampleMagnetometer, con el
+// campo sin ruido y los aportes que apuntó. La referencia (lineal) se evalúa en
+// la posición del cabezal; las fuentes no se vuelven a evaluar. Con decimación
+// la verdad es la del instante de salida y el retardo del filtro queda en el
+// ruido; con la caché de campo no hay aportes individuales. La interferencia
+// es el desfase fijo del cabezal más la firma de la plataforma.
+void fillTruthRecord(TruthRecord& record, const MagnetometerState& state, const HeadModel& head,
+                     const QuSpinData& data, const FieldSample& field, SourceContributions& contributions,
+                     double min_nT) {
+    const ReferenceField& reference = *head.field->reference;
+    int axis = data.vector_axis - 'X';
+    Vec3 reference_vector = reference.at(headPosition(head, state.sample_index * MAG_PERIOD_US / 1e6));
+    double field_vector = axis == 0 ? field.vector_nT.x : axis == 1 ? field.vector_nT.y : field.vector_nT.z;
+    double reference_axis = axis == 0 ? reference_vector.x : axis == 1 ? reference_vector.y : reference_vector.z;
+    const Vec3& direction = reference.direction;
+    double direction_axis = axis == 0 ? direction.x : axis == 1 ? direction.y : direction.z;
+    double interference_axis = field.interference_nT * direction_axis;
+
+    record.sample_index = state.sample_index;
+    record.timestamp_ms = data.timestamp_ms;
+    record.axis = data.vector_axis;
+    double* v = record.values;
+    v[0] = data.scalar_field_nT;
+    v[1] = field.scalar_nT - field.anomaly_nT - field.interference_nT;
+    v[2] = field.anomaly_nT;
+    v[3] = head.scalar_offset_nT + field.interference_nT;
+    v[4] = v[0] - v[1] - v[2] - v[3];
+    v[5] = data.vector_field_nT;
+    v[6] = reference_axis;
+    v[7] = field_vector - reference_axis - interference_axis;
+    v[8] = interference_axis;
+    v[9] = v[5] - v[6] - v[7] - v[8];
+
+    // Las de mayor aporte escalar entre las que superan min_nT en algún canal
+    size_t kept = 0;
+    for (size_t i = 0; i < contributions.size(); i++) {
+        const Vec3& b = contributions[i].field_nT;
+        double along_axis = axis == 0 ? b.x : axis == 1 ? b.y : b.z;
+        if (std::abs(b.dot(reference.direction)) >= min_nT || std::abs(along_axis) >= min_nT) {
+            contributions[kept++] = contributions[i];
+        }
+    }
+    auto stronger = [&reference](const SourceContribution& a, const SourceContribution& b) {
+        return std::abs(a.field_nT.dot(reference.direction)) > std::abs(b.field_nT.dot(reference.direction));
+    };
+    size_t count = std::min<size_t>(kept, TRUTH_MAX_SOURCES);
+    std::partial_sort(contributions.begin(), contributions.begin() + count, contributions.begin() + kept, stronger);
+    record.source_count = static_cast<uint8_t>(count);
+    for (size_t k = 0; k < count; k++) {
+        const Vec3& b = contributions[k].field_nT;
+        record.source_id[k] = contributions[k].id;
+        record.source_scalar_nT[k] = static_cast<float>(b.dot(reference.direction));
+        record.source_vector_nT[k] = static_cast<float>(axis == 0 ? b.x : axis == 1 ? b.y : b.z);
+    }
+}
+
+// Texto que emite el GPS en un ciclo: GNGGA y, ocasionalmente, GNZDA
+std::string nextGPSOutput(GPSState& state, const SurveyPlan& survey) {
+    // Generar sentencia GNGGA
+    GPSData gps_data = stepGPS(state, survey);
+    std::string output = generateGNGGA(gps_data) + "\r\n";
+
+    // Ocasionalmente enviar GNZDA (cada ~50 mensajes como en el ejemplo)
+    state.gnzda_counter++;
+    if (state.gnzda_counter >= 50) {
+        output += generateGNZDA(gps_data.utc_time) + "\r\n";
+        state.gnzda_counter = 0;
+    }
+    return output;
+}
+
+// Thread para emular GPS
+void gpsEmulatorThread(Platform* platform) {
+    GPSState state = platform->gps_initial_state;
+    PortWriter port(platform->port_fds[0], scenario.gps_transport, &platform->taps[0], &platform->port_counters[0]);
+
+    while (running) {
+        std::string nmea_output = nextGPSOutput(state, platform->survey);
+
+        // Escribir al puerto
+        port.write(nmea_output);
+
+        platform->gps_snapshot.publish(state);
+
+        // GPS típicamente envía a 10Hz
+        if (!port.wait(sim_clock.at(state.sample_index * GPS_PERIOD_US))) break;
+    }
+    port.flush();
+}
+
+// Thread para emular magnetómetro QuSpin
+void magnetometerEmulatorThread(Platform* platform, int mag_id) {
+    QuSpinData& shared_data = platform->shared_data;
+    std::mutex& shared_data_mutex = platform->shared_data_mutex;
+
+    QuSpinData quspin_data;
+    MagnetometerState state = platform->mag_initial_states[mag_id - 1];
+    PortWriter port(platform->port_fds[mag_id], scenario.mag_transport[mag_id - 1], &platform->taps[mag_id],
+                    &platform->port_counters[mag_id]);
+    HeadStatisticsAccumulator statistics;
+    uint64_t emitted = 0;
+
+    // Valores base con pequeño offset entre magnetómetros si no son idénticos
+    HeadModel head = makeHeadModel(field_model, scenario, mag_id, NUM_MAGNETOMETERS);
+    head.survey = &platform->survey;
+    head.platform_number = platform->index + 1;
+    HeadModel shared_head = head;
+    head.scalar_offset_nT = (mag_id == 1 && !identical_magnetometers) ? 10.0 : 0.0;
+
+    // Canal de verdad: búferes de la muestra en curso y fila de salida
+    TruthQueue* truth_queue = truth_exporter.active() ? truth_exporter.attach() : NULL;
+    FieldSample truth;
+    SourceContributions contributions;
+    TruthRecord truth_record;
+    truth_record.platform = static_cast<uint8_t>(platform->index);
+    FieldSample* truth_field = truth_queue ? &truth : NULL;
+    SourceContributions* truth_contributions = truth_queue ? &contributions : NULL;
+
+    while (running) {
+        if (identical_magnetometers) {
+            if (mag_id == 1) {
+                // Magnetómetro 1 genera los datos
+                quspin_data = sampleMagnetometer(state, shared_head, truth_field, truth_contributions);
+                if (truth_queue) {
+                    fillTruthRecord(truth_record, state, shared_head, quspin_data, truth, contributions,
+                                    scenario.truth_min_nT);
+                }
+
+                // Guardar datos para mag2
+                std::lock_guard<std::mutex> lock(shared_data_mutex);
+                shared_data = quspin_data;
+                if (truth_queue) platform->shared_truth = truth_record;
+            } else {
+                // Magnetómetro 2 usa los mismos datos
+                std::this_thread::sleep_for(std::chrono::microseconds(100)); // Pequeño delay
+                std::lock_guard<std::mutex> lock(shared_data_mutex);
+                quspin_data = shared_data;
+                if (truth_queue) truth_record = platform->shared_truth;
+            }
+        } else {
+            // Modo independiente - cada magnetómetro genera sus propios datos
+            quspin_data = sampleMagnetometer(state, head, truth_field, truth_contributions);
+            if (truth_queue) {
+                fillTruthRecord(truth_record, state, head, quspin_data, truth, contributions, scenario.truth_min_nT);
+            }
+        }
+        if (truth_queue) {
+            truth_record.head = static_cast<uint8_t>(mag_id);
+            truth_exporter.push(*truth_queue, truth_record, false);
+        }
+
+        // Generar línea de datos
+        std::string data_line = generateQuSpinLine(quspin_data) + "\n";
+
+        // Escribir al puerto
+        port.write(data_line);
+
+        // Estadísticas de lo emitido, publicadas periódicamente para las métricas
+        statistics.add(0, quspin_data.scalar_field_nT);
+        statistics.add(1 + (quspin_data.vector_axis - 'X'), quspin_data.vector_field_nT);
+        if (++emitted % WELCH_STEP == 0) {
+            platform->head_statistics[mag_id - 1].publish(statistics.statistics());
+        }
+
+        // Solo el mag1 actualiza contadores en modo idéntico
+        if (!identical_magnetometers || mag_id == 1) {
+            advanceMagnetometer(state);
+        }
+        state.sample_index++;
+        platform->mag_snapshots[mag_id - 1].publish(state);
+        platform->mag_full_states[mag_id - 1].serve(state, false);
+
+        // QuSpin típicamente envía a ~250Hz (4ms entre muestras)
+        if (!port.wait(sim_clock.at(state.sample_index * MAG_PERIOD_US))) break;
+    }
+    platform->mag_full_states[mag_id - 1].serve(state, true);
+    port.flush();
+    truth_exporter.detach(truth_queue);
+}
+
+// Thread para emular la IMU
+void imuEmulatorThread(Platform* platform) {
+    ImuModel model = makeImuModel(scenario, platform->survey, master_seed, platform->index);
+    PortWriter port(platform->port_fds[IMU_DEVICE], scenario.imu_transport, &platform->taps[IMU_DEVICE],
+                    &platform->port_counters[IMU_DEVICE]);
+    char buffer[IMU_MAX_BYTES];
+
+    // Al reanudar, tras un relevo o al relanzar la partición, la siguiente a la
+    // última emitida (las que faltan salen en ráfaga, como en los cabezales);
+    // sin ella, la primera que aún no ha llegado (la del instante 0 al empezar)
+    uint64_t index = platform->imu_initial_index;
+    if (index == IMU_INDEX_FROM_CLOCK) {
+        uint64_t now_us = sim_clock.nowUs();
+        index = now_us < model.period_us ? 0 : (now_us + model.period_us - 1) / model.period_us;
+    }
+
+    while (running) {
+        ImuSample sample = sampleImu(model, index);
+        port.write(buffer, formatImuSample(sample, scenario.imu_binary, buffer));
+        platform->imu_snapshot.publish(sample);
+
+        index++;
+        if (!port.wait(sim_clock.at(index * model.period_us))) break;
+    }
+    port.flush();
+}
+
+// ============================================================================
+// Checkpoint y restauración del estado del simulador
+// ============================================================================
+
+const uint32_t CHECKPOINT_MAGIC = 0x4B435351;  // "QSCK"
+const uint32_t CHECKPOINT_VERSION = 6;  // v2: caché de campo; v3: historia del FIR; v4: plataformas; v5: ruido coloreado; v6: IMU
+
+// Configuración de checkpoints (vacío = deshabilitado)
+std::string checkpoint_path;
+int checkpoint_interval_s = 60;
+
+struct PlatformState {
+    GPSState gps;
+    MagnetometerState mags[NUM_MAGNETOMETERS];
+    uint64_t imu_next_index;  // IMU_INDEX_FROM_CLOCK si no emitió ninguna muestra
+};
+
+struct CheckpointData {
+    uint64_t sim_time_us;
+    uint64_t master_seed;
+    bool identical;
+    std::vector<PlatformState> platforms;
+};
+
+// Serializador binario little-endian, independiente del layout de los structs
+class ByteWriter {
+public:
+    void u8(uint8_t v) { bytes_.push_back(static_cast<char>(v)); }
+    void u16(uint16_t v) { for (int i = 0; i < 2; i++) u8(static_cast<uint8_t>(v >> (8 * i))); }
+    void u32(uint32_t v) { for (int i = 0; i < 4; i++) u8(static_cast<uint8_t>(v >> (8 * i))); }
+    void u64(uint64_t v) { for (int i = 0; i < 8; i++) u8(static_cast<uint8_t>(v >> (8 * i))); }
+    void i32(int32_t v) { u32(static_cast<uint32_t>(v)); }
+    void f64(double v) { uint64_t bits; memcpy(&bits, &v, sizeof(bits)); u64(bits); }
+    const std::string& bytes() const { return bytes_; }
+
+private:
+    std::string bytes_;
+};
+
+class ByteReader {
+public:
+    ByteReader(const std::string& bytes) : bytes_(bytes), pos_(0), ok_(true) {}
+    uint8_t u8() {
+        if (pos_ >= bytes_.size()) { ok_ = false; return 0; }
+        return static_cast<uint8_t>(bytes_[pos_++]);
+    }
+    uint16_t u16() { uint16_t v = 0; for (int i = 0; i < 2; i++) v |= static_cast<uint16_t>(u8()) << (8 * i); return v; }
+    uint32_t u32() { uint32_t v = 0; for (int i = 0; i < 4; i++) v |= static_cast<uint32_t>(u8()) << (8 * i); return v; }
+    uint64_t u64() { uint64_t v = 0; for (int i = 0; i < 8; i++) v |= static_cast<uint64_t>(u8()) << (8 * i); return v; }
+    int32_t i32() { return static_cast<int32_t>(u32()); }
+    double f64() { uint64_t bits = u64(); double v; memcpy(&v, &bits, sizeof(v)); return v; }
+    bool ok() const { return ok_; }
+    size_t position() const { return pos_; }
+
+private:
+    const std::string& bytes_;
+    size_t pos_;
+    bool ok_;
+};
+
+// FNV-1a de 32 bits para detectar checkpoints truncados o corruptos
+uint32_t checksum32(const char* data, size_t length) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= static_cast<uint8_t>(data[i]);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+std::string serializeCheckpoint(const CheckpointData& data) {
+    ByteWriter w;
+    w.u32(CHECKPOINT_MAGIC);
+    w.u32(CHECKPOINT_VERSION);
+    w.u64(data.sim_time_us);
+    w.u64(data.master_seed);
+    w.u8(data.identical ? 1 : 0);
+
+    w.u32(static_cast<uint32_t>(data.platforms.size()));
+    for (size_t p = 0; p < data.platforms.size(); p++) {
+        const PlatformState& platform = data.platforms[p];
+        w.u64(platform.gps.sample_index);
+        w.f64(platform.gps.latitude);
+        w.f64(platform.gps.longitude);
+        w.f64(platform.gps.altitude);
+        w.i32(platform.gps.hours);
+        w.i32(platform.gps.minutes);
+        w.i32(platform.gps.seconds);
+        w.i32(platform.gps.centiseconds);
+        w.i32(platform.gps.gnzda_counter);
+        w.u64(platform.gps.rng_state);
+
+        w.u32(NUM_MAGNETOMETERS);
+        for (int i = 0; i < NUM_MAGNETOMETERS; i++) {
+            const MagnetometerState& mag = platform.mags[i];
+            w.u64(mag.sample_index);
+            w.u16(mag.counter);
+            w.u32(mag.timestamp_ms);
+            w.u8(static_cast<uint8_t>(mag.axis));
+            w.u64(mag.rng_state);
+
+            w.u32(static_cast<uint32_t>(mag.cache.count));
+            w.f64(mag.cache.interval);
+            w.u64(mag.cache.break_at);
+            for (int k = 0; k < mag.cache.count; k++) {
+                w.f64(mag.cache.t[k]);
+                for (int v = 0; v < FIELD_CACHE_VALUES; v++) w.f64(mag.cache.value[k][v]);
+            }
+
+            w.u32(static_cast<uint32_t>(mag.decimator.length));
+            w.u32(static_cast<uint32_t>(mag.decimator.position));
+            for (int k = 0; k < mag.decimator.length; k++) {
+                for (int c = 0; c < DECIMATION_CHANNELS; c++) w.f64(mag.decimator.samples[k][c]);
+            }
+
+            for (int c = 0; c < NOISE_CHANNELS; c++) {
+                for (int k = 0; k < PINK_POLES; k++) w.f64(mag.noise.pink[c][k]);
+                w.f64(mag.noise.walk[c]);
+            }
+        }
+        w.u64(platform.imu_next_index);
+    }
+
+    std::string bytes = w.bytes();
+    uint32_t sum = checksum32(bytes.data(), bytes.size());
+    ByteWriter trailer;
+    trailer.u32(sum);
+    return bytes + trailer.bytes();
+}
+
+bool deserializeCheckpoint(const std::string& bytes, CheckpointData& data, std::string& error) {
+    if (bytes.size() < 4) {
+        error = "archivo demasiado corto";
+        return false;
+    }
+    ByteReader trailer(bytes.substr(bytes.size() - 4));
+    if (trailer.u32() != checksum32(bytes.data(), bytes.size() - 4)) {
+        error = "checksum invalido";
+        return false;
+    }
+
+    ByteReader r(bytes);
+    if (r.u32() != CHECKPOINT_MAGIC) {
+        error = "no es un checkpoint del simulador";
+        return false;
+    }
+    uint32_t version = r.u32();
+    if (version < 1 || version > CHECKPOINT_VERSION) {
+        error = "version de checkpoint no soportada";
+        return false;
+    }
+    data.sim_time_us = r.u64();
+    data.master_seed = r.u64();
+    data.identical = r.u8() != 0;
+
+    // Hasta v3 el checkpoint guardaba una sola plataforma
+    uint32_t platform_count = version >= 4 ? r.u32() : 1;
+    if (platform_count < 1 || platform_count > static_cast<uint32_t>(MAX_PLATFORMS)) {
+        error = "numero de plataformas invalido";
+        return false;
+    }
+    data.platforms.resize(platform_count);
+    for (uint32_t p = 0; p < platform_count; p++) {
+        PlatformState& platform = data.platforms[p];
+        platform.gps.sample_index = r.u64();
+        platform.gps.latitude = r.f64();
+        platform.gps.longitude = r.f64();
+        platform.gps.altitude = r.f64();
+        platform.gps.hours = r.i32();
+        platform.gps.minutes = r.i32();
+        platform.gps.seconds = r.i32();
+        platform.gps.centiseconds = r.i32();
+        platform.gps.gnzda_counter = r.i32();
+        platform.gps.rng_state = r.u64();
+
+        if (r.u32() != NUM_MAGNETOMETERS) {
+            error = "numero de magnetometros distinto";
+            return false;
+        }
+        for (int i = 0; i < NUM_MAGNETOMETERS; i++) {
+            MagnetometerState& mag = platform.mags[i];
+            mag.sample_index = r.u64();
+            mag.counter = r.u16();
+            mag.timestamp_ms = r.u32();
+            mag.axis = static_cast<char>(r.u8());
+            mag.rng_state = r.u64();
+
+            memset(&mag.cache, 0, sizeof(mag.cache));
+            if (version >= 2) {
+                mag.cache.count = static_cast<int>(r.u32());
+                mag.cache.interval = r.f64();
+                mag.cache.break_at = r.u64();
+                if (mag.cache.count < 0 || mag.cache.count > FIELD_CACHE_KNOTS) {
+                    error = "cache de campo invalida";
+                    return false;
+                }
+                for (int k = 0; k < mag.cache.count; k++) {
+                    mag.cache.t[k] = r.f64();
+                    for (int v = 0; v < FIELD_CACHE_VALUES; v++) mag.cache.value[k][v] = r.f64();
+                }
+            }
+
+            mag.decimator.length = 0;
+            mag.decimator.position = 0;
+            if (version >= 3) {
+                mag.decimator.length = static_cast<int>(r.u32());
+                mag.decimator.position = static_cast<int>(r.u32());
+                if (mag.decimator.length < 0 || mag.decimator.length > MAX_DECIMATION_TAPS ||
+                    mag.decimator.position < 0 || mag.decimator.position >= std::max(1, mag.decimator.length)) {
+                    error = "historia de decimacion invalida";
+                    return false;
+                }
+                for (int k = 0; k < mag.decimator.length; k++) {
+                    for (int c = 0; c < DECIMATION_CHANNELS; c++) mag.decimator.samples[k][c] = r.f64();
+                }
+            }
+
+            memset(&mag.noise, 0, sizeof(mag.noise));
+            if (version >= 5) {
+                for (int c = 0; c < NOISE_CHANNELS; c++) {
+                    for (int k = 0; k < PINK_POLES; k++) mag.noise.pink[c][k] = r.f64();
+                    mag.noise.walk[c] = r.f64();
+                }
+            }
+        }
+        platform.imu_next_index = version >= 6 ? r.u64() : IMU_INDEX_FROM_CLOCK;
+    }
+
+    if (!r.ok() || r.position() != bytes.size() - 4) {
+        error = "contenido truncado";
+        return false;
+    }
+    return true;
+}
+
+// Espera máxima a que los cabezales publiquen su estado completo
+const int CHECKPOINT_CAPTURE_TIMEOUT_MS = 1000;
+
+// Toma una instantánea consistente del estado publicado por cada dispositivo.
+// Los hilos de los dispositivos nunca esperan: los cabezales publican su
+// estado completo (con la historia del FIR) en su siguiente muestra y es
+// esta función la que espera por ellos. Un cabezal que no responde (su
+// partición cayó) aporta el último estado completo que publicó.
+CheckpointData captureCheckpoint() {
+    CheckpointData data;
+    data.sim_time_us = sim_clock.nowUs();
+    data.master_seed = master_seed;
+    data.identical = identical_magnetometers;
+
+    std::vector<uint64_t> requests;
+    for (size_t p = 0; p < platforms.size(); p++) {
+        for (int i = 0; i < NUM_MAGNETOMETERS; i++) {
+            requests.push_back(platforms[p]->mag_full_states[i].requested.fetch_add(1) + 1);
+        }
+    }
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(CHECKPOINT_CAPTURE_TIMEOUT_MS);
+
+    data.platforms.resize(platforms.size());
+    for (size_t p = 0; p < platforms.size(); p++) {
+        Platform& platform = *platforms[p];
+        PlatformState& state = data.platforms[p];
+        if (!platform.gps_snapshot.read(state.gps)) state.gps = platform.gps_initial_state;
+        for (int i = 0; i < NUM_MAGNETOMETERS; i++) {
+            MagnetometerStateRequest& full = platform.mag_full_states[i];
+            while (full.served.load(std::memory_order_acquire) < requests[p * NUM_MAGNETOMETERS + i] &&
+                   std::chrono::steady_clock::now() < deadline) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+            if (!full.state.read(state.mags[i])) state.mags[i] = platform.mag_initial_states[i];
+        }
+        ImuSample imu;
+        state.imu_next_index = platform.imu_snapshot.read(imu) ? imu.index + 1 : platform.imu_initial_index;
+    }
+    return data;
+}
+
+// Usa el estado de un checkpoint (o de un relevo) como estado inicial de las plataformas
+bool restorePlatformStates(const CheckpointData& data, std::string& error) {
+    if (data.platforms.size() != platforms.size()) {
+        error = "el estado tiene " + std::to_string(data.platforms.size()) + " plataformas y el escenario " +
+                std::to_string(platforms.size());
+        return false;
+    }
+    master_seed = data.master_seed;
+    identical_magnetometers = data.identical;
+    for (size_t p = 0; p < platforms.size(); p++) {
+        platforms[p]->gps_initial_state = data.platforms[p].gps;
+        for (int i = 0; i < NUM_MAGNETOMETERS; i++) {
+            platforms[p]->mag_initial_states[i] = data.platforms[p].mags[i];
+        }
+        platforms[p]->imu_initial_index = data.platforms[p].imu_next_index;
+    }
+    return true;
+}
+
+// Reemplaza un archivo de forma atómica (archivo temporal + rename); con
+// durable también hace fsync antes del rename
+bool writeFileAtomically(const std::string& path, const std::string& bytes, bool durable) {
+    std::string tmp_path = path + ".tmp";
+
+    int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        LOG_ERROR("Error al escribir {}: {}", tmp_path, strerror(errno));
+        return false;
+    }
+    ssize_t written = write(fd, bytes.data(), bytes.size());
+    bool ok = written == static_cast<ssize_t>(bytes.size()) && (!durable || fsync(fd) == 0);
+    close(fd);
+
+    if (!ok || rename(tmp_path.c_str(), path.c_str()) == -1) {
+        LOG_ERROR("Error al escribir {}: {}", path, strerror(errno));
+        unlink(tmp_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool writeCheckpointFile(const std::string& path, const CheckpointData& data) {
+    return writeFileAtomically(path, serializeCheckpoint(data), true);
+}
+
+bool readCheckpointFile(const std::string& path, CheckpointData& data) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd == -1) {
+        LOG_ERROR("Error al abrir checkpoint {}: {}", path, strerror(errno));
+        return false;
+    }
+    std::string bytes;
+    char buffer[4096];
+    ssize_t n;
+    while ((n = read(fd, buffer, sizeof(buffer))) > 0) {
+        bytes.append(buffer, static_cast<size_t>(n));
+    }
+    close(fd);
+
+    std::string error;
+    if (!deserializeCheckpoint(bytes, data, error)) {
+        LOG_ERROR("Checkpoint {} invalido: {}", path, error);
+        return false;
+    }
+    return true;
+}
+
+// Thread que guarda checkpoints periódicamente sin detener la emisión
+std::atomic<uint64_t> checkpoints_written(0);
+
+void checkpointThread() {
+    auto next_checkpoint = std::chrono::steady_clock::now() + std::chrono::seconds(checkpoint_interval_s);
+    while (waitUntil(next_checkpoint)) {
+        if (writeCheckpointFile(checkpoint_path, captureCheckpoint())) checkpoints_written++;
+        next_checkpoint += std::chrono::seconds(checkpoint_interval_s);
+    }
+}
+
+// ============================================================================
+// Métricas del simulador
+// ============================================================================
+
+// Superficie de métricas: texto en formato de exposición de Prometheus,
+// construido solo a partir de las instantáneas publicadas por los hilos.
+// Se escribe periódicamente en un archivo (--metrics) y el comando 's' de la
+// consola muestra un resumen.
+std::string metrics_path;
+int metrics_interval_s = 5;
+
+void writeMetricHeader(std::ostringstream& out, const char* name, const char* type, const char* help) {
+    out << "# HELP " << name << " " << help << "\n# TYPE " << name << " " << type << "\n";
+}
+
+std::string formatMetrics() {
+    // Cabezales de todas las plataformas, en orden; etiqueta platform="p",head="m"
+    size_t head_count = platforms.size() * NUM_MAGNETOMETERS;
+    std::vector<HeadStatistics> stats(head_count);
+    std::vector<bool> available(head_count);
+    std::vector<std::string> labels(head_count);
+    for (size_t h = 0; h < head_count; h++) {
+        HeadStatistics head_stats;
+        available[h] = platforms[h / NUM_MAGNETOMETERS]->head_statistics[h % NUM_MAGNETOMETERS].read(head_stats);
+        stats[h] = head_stats;
+        labels[h] = "platform=\"" + std::to_string(h / NUM_MAGNETOMETERS + 1) + "\",head=\"" +
+                    std::to_string(h % NUM_MAGNETOMETERS + 1) + "\"";
+    }
+
+    std::ostringstream out;
+    out << std::setprecision(10);
+    writeMetricHeader(out, "quspin_sim_time_seconds", "gauge", "Tiempo de simulacion");
+    out << "quspin_sim_time_seconds " << sim_clock.nowUs() / 1e6 << "\n";
+
+    // Un valor por cabezal y canal
+    struct ChannelMetric {
+        const char* name;
+        const char* type;
+        const char* help;
+    };
+    const ChannelMetric channel_metrics[] = {
+        {"quspin_head_samples_total", "counter", "Muestras emitidas por canal"},
+        {"quspin_head_mean_nT", "gauge", "Media de lo emitido"},
+        {"quspin_head_stddev_nT", "gauge", "Desviacion tipica de lo emitido"},
+        {"quspin_head_min_nT", "gauge", "Minimo emitido"},
+        {"quspin_head_max_nT", "gauge", "Maximo emitido"},
+        {"quspin_head_noise_density_nT_per_rtHz", "gauge", "Mediana de la PSD de Welch (raiz)"},
+        {"quspin_head_peak_frequency_hz", "gauge", "Frecuencia del pico mas alto de la PSD"},
+        {"quspin_head_peak_ratio_db", "gauge", "Pico de la PSD sobre la mediana"},
+    };
+    for (size_t m = 0; m < sizeof(channel_metrics) / sizeof(channel_metrics[0]); m++) {
+        writeMetricHeader(out, channel_metrics[m].name, channel_metrics[m].type, channel_metrics[m].help);
+        for (size_t h = 0; h < head_count; h++) {
+            if (!available[h]) continue;
+            for (int c = 0; c < STATS_CHANNELS; c++) {
+                const ChannelStatistics& s = stats[h].channels[c];
+                SpectrumSummary spectrum = summarizeSpectrum(s);
+                double values[] = {static_cast<double>(s.count), s.mean, std::sqrt(s.variance()), s.min, s.max,
+                                   spectrum.noise_density, spectrum.peak_hz, spectrum.peak_ratio_db};
+                out << channel_metrics[m].name << "{" << labels[h] << ",channel=\""
+                    << STATS_CHANNEL_NAMES[c] << "\"} " << values[m] << "\n";
+            }
+        }
+    }
+
+    writeMetricHeader(out, "quspin_head_psd_nT2_per_Hz", "gauge", "PSD de Welch de lo emitido por bin de frecuencia");
+    for (size_t h = 0; h < head_count; h++) {
+        if (!available[h]) continue;
+        for (int c = 0; c < STATS_CHANNELS; c++) {
+            const ChannelStatistics& s = stats[h].channels[c];
+            for (int k = 0; s.blocks > 0 && k < WELCH_BINS; k++) {
+                out << "quspin_head_psd_nT2_per_Hz{" << labels[h] << ",channel=\"" << STATS_CHANNEL_NAMES[c]
+                    << "\",freq_hz=\"" << k * s.sample_rate_hz / WELCH_BLOCK << "\"} " << s.psd[k] << "\n";
+            }
+        }
+    }
+
+    // Derivaciones de solo lectura por puerto
+    writeMetricHeader(out, "quspin_tap_subscribers", "gauge", "Suscriptores por socket conectados al puerto");
+    for (size_t p = 0; p < platforms.size(); p++) {
+        for (int d = 0; d < platform_ports; d++) {
+            out << "quspin_tap_subscribers{port=\"" << platforms[p]->port_paths[d] << "\"} "
+                << platforms[p]->taps[d].subscriber_count.load() << "\n";
+        }
+    }
+    writeMetricHeader(out, "quspin_tap_dropped_bytes_total", "counter",
+                      "Bytes descartados hacia derivaciones sin sitio (el puerto no se retrasa)");
+    for (size_t p = 0; p < platforms.size(); p++) {
+        for (int d = 0; d < platform_ports; d++) {
+            out << "quspin_tap_dropped_bytes_total{port=\"" << platforms[p]->port_paths[d] << "\"} "
+                << platforms[p]->taps[d].dropped_bytes.load() << "\n";
+        }
+    }
+
+    // Escritura de cada puerto y retraso de su consumidor
+    struct PortMetric {
+        const char* name;
+        const char* type;
+        const char* help;
+    };
+    const PortMetric port_metrics[] = {
+        {"quspin_port_deadline_misses_total", "counter", "Muestras que el hilo del dispositivo empezo a esperar ya vencidas"},
+        {"quspin_port_dropped_bytes_total", "counter", "Bytes rechazados por el pty con la cola del consumidor llena"},
+        {"quspin_port_tty_queue_bytes", "gauge", "Bytes sin leer en la cola del tty (ultima muestra)"},
+        {"quspin_port_consumer_lag_last_ms", "gauge", "Retraso del consumidor en milisegundos de flujo (ultima muestra)"},
+    };
+    for (size_t m = 0; m < sizeof(port_metrics) / sizeof(port_metrics[0]); m++) {
+        writeMetricHeader(out, port_metrics[m].name, port_metrics[m].type, port_metrics[m].help);
+        for (size_t p = 0; p < platforms.size(); p++) {
+            for (int d = 0; d < platform_ports; d++) {
+                const PortCounters& c = platforms[p]->port_counters[d];
+                double values[] = {static_cast<double>(c.deadline_misses.load()), static_cast<double>(c.dropped_bytes.load()),
+                                   static_cast<double>(c.queued.load()), c.lag_ms.load()};
+                out << port_metrics[m].name << "{port=\"" << platforms[p]->port_paths[d] << "\"} " << values[m] << "\n";
+            }
+        }
+    }
+
+    writeMetricHeader(out, "quspin_port_consumer_lag_ms", "histogram",
+                      "Retraso del consumidor (cola del tty mas buffer del adaptador) en milisegundos de flujo");
+    for (size_t p = 0; p < platforms.size(); p++) {
+        for (int d = 0; d < platform_ports; d++) {
+            const PortCounters& c = platforms[p]->port_counters[d];
+            const std::string& port = platforms[p]->port_paths[d];
+            uint64_t cumulative = 0;
+            for (int b = 0; b < LAG_MS_BUCKET_COUNT; b++) {
+                cumulative += c.lag_ms_histogram[b].load();
+                out << "quspin_port_consumer_lag_ms_bucket{port=\"" << port << "\",le=\"" << LAG_MS_BUCKETS[b] << "\"} "
+                    << cumulative << "\n";
+            }
+            out << "quspin_port_consumer_lag_ms_bucket{port=\"" << port << "\",le=\"+Inf\"} " << c.lag_samples.load() << "\n";
+            out << "quspin_port_consumer_lag_ms_sum{port=\"" << port << "\"} " << c.lag_ms_sum.load() << "\n";
+            out << "quspin_port_consumer_lag_ms_count{port=\"" << port << "\"} " << c.lag_samples.load() << "\n";
+        }
+    }
+    writeMetricHeader(out, "quspin_port_consumer_lag_bytes", "histogram",
+                      "Retraso del consumidor (cola del tty mas buffer del adaptador) en bytes");
+    for (size_t p = 0; p < platforms.size(); p++) {
+        for (int d = 0; d < platform_ports; d++) {
+            const PortCounters& c = platforms[p]->port_counters[d];
+            const std::string& port = platforms[p]->port_paths[d];
+            uint64_t cumulative = 0;
+            for (int b = 0; b < LAG_BYTES_BUCKET_COUNT; b++) {
+                cumulative += c.lag_bytes_histogram[b].load();
+                out << "quspin_port_consumer_lag_bytes_bucket{port=\"" << port << "\",le=\"" << LAG_BYTES_BUCKETS[b]
+                    << "\"} " << cumulative << "\n";
+            }
+            out << "quspin_port_consumer_lag_bytes_bucket{port=\"" << port << "\",le=\"+Inf\"} " << c.lag_samples.load() << "\n";
+            out << "quspin_port_consumer_lag_bytes_sum{port=\"" << port << "\"} " << c.lag_bytes_sum.load() << "\n";
+            out << "quspin_port_consumer_lag_bytes_count{port=\"" << port << "\"} " << c.lag_samples.load() << "\n";
+        }
+    }
+    return out.str();
+}
+
+// Resumen legible de las estadísticas de cada cabezal (comando 's')
+void showStatistics() {
+    std::cout << "\n=== ESTADISTICAS DE LA SENAL EMITIDA ===" << std::endl;
+    std::cout << "plat cabezal canal    muestras        media      desv      min        max   ruido nT/rHz  pico Hz  pico dB"
+              << std::endl;
+    for (size_t h = 0; h < platforms.size() * NUM_MAGNETOMETERS; h++) {
+        HeadStatistics stats;
+        size_t p = h / NUM_MAGNETOMETERS;
+        if (!platforms[p]->head_statistics[h % NUM_MAGNETOMETERS].read(stats)) {
+            std::cout << std::setw(4) << p + 1 << std::setw(8) << h % NUM_MAGNETOMETERS + 1 << "  (sin datos aun)" << std::endl;
+            continue;
+        }
+        for (int c = 0; c < STATS_CHANNELS; c++) {
+            const ChannelStatistics& s = stats.channels[c];
+            SpectrumSummary spectrum = summarizeSpectrum(s);
+            std::cout << std::setw(4) << p + 1 << std::setw(8) << h % NUM_MAGNETOMETERS + 1 << " "
+                      << std::left << std::setw(6) << STATS_CHANNEL_NAMES[c]
+                      << std::right << std::setw(10) << s.count << std::fixed << std::setprecision(3)
+                      << std::setw(13) << s.mean << std::setw(10) << std::sqrt(s.variance())
+                      << std::setw(11) << s.min << std::setw(11) << s.max
+                      << std::setw(14) << spectrum.noise_density << std::setprecision(2)
+                      << std::setw(9) << spectrum.peak_hz << std::setprecision(1)
+                      << std::setw(9) << spectrum.peak_ratio_db << std::endl;
+        }
+    }
+    std::cout << std::endl;
+}
+
+// Thread que reescribe el archivo de métricas periódicamente
+void metricsThread() {
+    auto next_write = std::chrono::steady_clock::now() + std::chrono::seconds(metrics_interval_s);
+    while (waitUntil(next_write)) {
+        writeFileAtomically(metrics_path, formatMetrics(), false);
+        next_write += std::chrono::seconds(metrics_interval_s);
+    }
+}
+
+// ============================================================================
+// Reinicio en caliente: entrega de puertos y estado a una nueva instancia
+// ============================================================================
+
+// La instancia en marcha escucha en un socket Unix de control. Una instancia
+// nueva lanzada con --takeover se conecta y pide el relevo: la antigua detiene
+// sus dispositivos y le envía los masters de los pty (SCM_RIGHTS) junto con el
+// estado serializado como checkpoint y el origen del reloj de simulación.
+// Los symlinks de /dev no se tocan, así que los consumidores no ven EOF.
+// steady_clock es CLOCK_MONOTONIC y lo comparten ambos procesos: la nueva
+// instancia sigue el mismo calendario de muestras y los contadores continúan.
+const uint32_t HANDOFF_MAGIC = 0x4F485351;  // "QSHO"
+const uint32_t HANDOFF_VERSION = 1;
+const char HANDOFF_REQUEST[] = "TAKEOVER";
+const size_t HANDOFF_HEADER_SIZE = 24;
+
+const int MAX_HANDOFF_FDS = MAX_PLATFORMS * MAX_PORTS_PER_PLATFORM;
+
+std::string control_socket_path = "/run/quspin_simulator.sock";
+int control_listen_fd = -1;
+std::atomic<int> handoff_client_fd(-1);
+int broker_lease_fd = -1;  // Préstamo de puertos del agente de pty, si los dio él
+
+bool makeSocketAddress(const std::string& path, struct sockaddr_un& addr) {
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) return false;
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+    return true;
+}
+
+// Socket Unix de escucha en path; devuelve -1 con errno si falla
+int openUnixListener(const std::string& path, int type, int backlog) {
+    struct sockaddr_un addr;
+    if (!makeSocketAddress(path, addr)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    int fd = socket(AF_UNIX, type | SOCK_CLOEXEC, 0);
+    if (fd == -1) return -1;
+
+    // Socket de una instancia anterior ya relevada o caída
+    unlink(path.c_str());
+    if (bind(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) == -1 || listen(fd, backlog) == -1) {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        return -1;
+    }
+    return fd;
+}
+
+// Abre el socket de control donde se aceptan peticiones de relevo
+bool openControlSocket(const std::string& path) {
+    control_listen_fd = openUnixListener(path, SOCK_STREAM, 1);
+    return control_listen_fd != -1;
+}
+
+// Thread que espera una petición de relevo y, al recibirla, detiene los dispositivos.
+// La entrega en sí la hace main() cuando los hilos de los dispositivos han terminado.
+void handoffListenerThread() {
+    while (running) {
+        struct pollfd fds[2] = {
+            {shutdown_fd, POLLIN, 0},
+            {control_listen_fd, POLLIN, 0},
+        };
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            return;
+        }
+        if (fds[0].revents & POLLIN) return;
+        if (!(fds[1].revents & POLLIN)) continue;
+
+        int client = accept4(control_listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (client == -1) continue;
+
+        // Un cliente que conecta y no envía la petición no bloquea el socket de control
+        struct timeval timeout = {1, 0};
+        setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        char request[sizeof(HANDOFF_REQUEST)] = {0};
+        ssize_t n = recv(client, request, sizeof(HANDOFF_REQUEST) - 1, MSG_WAITALL);
+        if (n == static_cast<ssize_t>(sizeof(HANDOFF_REQUEST) - 1) && strcmp(request, HANDOFF_REQUEST) == 0) {
+            handoff_client_fd = client;
+            requestShutdown();
+            return;
+        }
+        close(client);
+    }
+}
+
+// Envía los puertos (plataforma a plataforma, GPS y magnetómetros) y el estado
+// final de los dispositivos a la nueva instancia y espera su confirmación.
+// Devuelve false si la nueva instancia no los adoptó.
+bool sendHandoff(int client) {
+    std::vector<int> port_fds;
+    for (size_t p = 0; p < platforms.size(); p++) {
+        port_fds.insert(port_fds.end(), platforms[p]->port_fds, platforms[p]->port_fds + platform_ports);
+    }
+    int port_count = static_cast<int>(port_fds.size());
+    // El préstamo del agente de pty viaja detrás de los puertos para que no los libere
+    if (broker_lease_fd != -1) port_fds.push_back(broker_lease_fd);
+
+    std::string state = serializeCheckpoint(captureCheckpoint());
+    ByteWriter header;
+    header.u32(HANDOFF_MAGIC);
+    header.u32(HANDOFF_VERSION);
+    header.u64(static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        sim_clock.origin.time_since_epoch()).count()));
+    header.u32(static_cast<uint32_t>(port_count));
+    header.u32(static_cast<uint32_t>(state.size()));
+    std::string message = header.bytes() + state;
+
+    struct iovec iov;
+    iov.iov_base = &message[0];
+    iov.iov_len = message.size();
+    std::vector<char> control(CMSG_SPACE(sizeof(int) * port_fds.size()), 0);
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = &control[0];
+    msg.msg_controllen = control.size();
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * port_fds.size());
+    memcpy(CMSG_DATA(cmsg), &port_fds[0], sizeof(int) * port_fds.size());
+
+    if (sendmsg(client, &msg, MSG_NOSIGNAL) != static_cast<ssize_t>(message.size())) return false;
+    char ack = 0;
+    return recv(client, &ack, 1, 0) == 1 && ack == 'K';
+}
+
+// Pide el relevo a la instancia que escucha en path y recibe sus puertos
+// (port_count, en el orden de sendHandoff, más el préstamo del agente de pty
+// si lo había) y su estado. Deja sim_clock con el origen de la instancia anterior.
+bool receiveHandoff(const std::string& path, int port_count, CheckpointData& state, std::vector<int>& port_fds,
+                    std::string& error) {
+    struct sockaddr_un addr;
+    if (!makeSocketAddress(path, addr)) {
+        error = "ruta de socket demasiado larga";
+        return false;
+    }
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock == -1 || connect(sock, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) == -1) {
+        error = std::string("no se pudo conectar: ") + strerror(errno);
+        if (sock != -1) close(sock);
+        return false;
+    }
+    struct timeval timeout = {5, 0};
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    if (send(sock, HANDOFF_REQUEST, sizeof(HANDOFF_REQUEST) - 1, MSG_NOSIGNAL) == -1) {
+        error = std::string("no se pudo enviar la peticion: ") + strerror(errno);
+        close(sock);
+        return false;
+    }
+
+    // Los descriptores llegan con el primer fragmento; el resto del estado puede llegar después
+    std::string message(65536, '\0');
+    struct iovec iov;
+    iov.iov_base = &message[0];
+    iov.iov_len = message.size();
+    char control[CMSG_SPACE(sizeof(int) * (MAX_HANDOFF_FDS + 1))];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    ssize_t n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+
+    port_fds.clear();
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); n > 0 && cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            size_t received = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            const int* fds = reinterpret_cast<const int*>(CMSG_DATA(cmsg));
+            port_fds.insert(port_fds.end(), fds, fds + received);
+        }
+    }
+
+    size_t length = n > 0 ? static_cast<size_t>(n) : 0;
+    uint32_t state_size = 0;
+    uint64_t origin_ns = 0;
+    bool ok = (port_fds.size() == static_cast<size_t>(port_count) || port_fds.size() == static_cast<size_t>(port_count) + 1) &&
+              !(msg.msg_flags & MSG_CTRUNC) &&
+              length >= HANDOFF_HEADER_SIZE;
+    if (ok) {
+        std::string header_bytes = message.substr(0, HANDOFF_HEADER_SIZE);
+        ByteReader header(header_bytes);
+        ok = header.u32() == HANDOFF_MAGIC && header.u32() == HANDOFF_VERSION;
+        origin_ns = header.u64();
+        ok = ok && header.u32() == static_cast<uint32_t>(port_count);
+        state_size = header.u32();
+        ok = ok && HANDOFF_HEADER_SIZE + state_size <= message.size();
+    }
+    while (ok && length < HANDOFF_HEADER_SIZE + state_size) {
+        ssize_t more = recv(sock, &message[length], HANDOFF_HEADER_SIZE + state_size - length, 0);
+        if (more <= 0) ok = false;
+        else length += static_cast<size_t>(more);
+    }
+    if (!ok) {
+        error = n <= 0 ? "la instancia en marcha no respondio"
+                       : "mensaje de relevo invalido (" + std::to_string(port_fds.size()) + " puertos, se esperaban " +
+                             std::to_string(port_count) + ")";
+        for (size_t i = 0; i < port_fds.size(); i++) close(port_fds[i]);
+        close(sock);
+        return false;
+    }
+    if (!deserializeCheckpoint(message.substr(HANDOFF_HEADER_SIZE, state_size), state, error)) {
+        for (size_t i = 0; i < port_fds.size(); i++) close(port_fds[i]);
+        close(sock);
+        return false;
+    }
+
+    sim_clock.origin = std::chrono::steady_clock::time_point(
+        std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::nanoseconds(origin_ns)));
+    char ack = 'K';
+    ssize_t ignored = send(sock, &ack, 1, MSG_NOSIGNAL);
+    (void)ignored;
+    close(sock);
+    return true;
+}
+
+// ============================================================================
+// Derivaciones de solo lectura de los puertos
+// ============================================================================
+
+// Un cliente se conecta al socket de derivaciones (SOCK_SEQPACKET), envía la
+// ruta del puerto (/dev/ttyAMA2 o ttyAMA2) y recibe "OK" seguido de una copia
+// de todo lo que se escribe en ese puerto, o "ERR ..." si no existe. Un
+// suscriptor lento pierde fragmentos en lugar de retrasar al dispositivo.
+std::string tap_socket_path = "/run/quspin_taps.sock";
+int tap_listen_fd = -1;
+bool shm_taps = false;
+
+bool openTapSocket(const std::string& path) {
+    tap_listen_fd = openUnixListener(path, SOCK_SEQPACKET, 16);
+    if (tap_listen_fd == -1) return false;
+    // Cualquier usuario puede mirar los puertos, como con los propios pty
+    chmod(path.c_str(), 0666);
+    return true;
+}
+
+TapHub* findTapHub(const std::string& port) {
+    for (size_t p = 0; p < platforms.size(); p++) {
+        for (int d = 0; d < platform_ports; d++) {
+            const std::string& path = platforms[p]->port_paths[d];
+            if (port == path || "/dev/" + port == path) return &platforms[p]->taps[d];
+        }
+    }
+    return NULL;
+}
+
+// Crea los anillos compartidos de todos los puertos (--shm-taps)
+bool createTapRings() {
+    for (size_t p = 0; p < platforms.size(); p++) {
+        for (int d = 0; d < platform_ports; d++) {
+            if (!platforms[p]->taps[d].ring.create(tapRingPath(platforms[p]->port_paths[d]))) return false;
+        }
+    }
+    return true;
+}
+
+// Thread que acepta suscriptores y los añade al puerto que piden
+void tapListenerThread() {
+    while (running) {
+        struct pollfd fds[2] = {
+            {shutdown_fd, POLLIN, 0},
+            {tap_listen_fd, POLLIN, 0},
+        };
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            return;
+        }
+        if (fds[0].revents & POLLIN) return;
+        if (!(fds[1].revents & POLLIN)) continue;
+
+        int client = accept4(tap_listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (client == -1) continue;
+        struct timeval timeout = {1, 0};
+        setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        char request[256];
+        ssize_t n = recv(client, request, sizeof(request) - 1, 0);
+        std::string port = n > 0 ? std::string(request, static_cast<size_t>(n)) : std::string();
+        while (!port.empty() && (port[port.size() - 1] == '\n' || port[port.size() - 1] == '\r')) {
+            port.erase(port.size() - 1);
+        }
+        TapHub* hub = findTapHub(port);
+        if (hub == NULL) {
+            std::string reply = "ERR puerto desconocido: " + port;
+            ssize_t ignored = send(client, reply.data(), reply.size(), MSG_NOSIGNAL);
+            (void)ignored;
+            close(client);
+            continue;
+        }
+        if (send(client, "OK", 2, MSG_NOSIGNAL) != 2) {
+            close(client);
+            continue;
+        }
+        hub->add(client);
+    }
+}
+
+void closeTaps() {
+    for (size_t p = 0; p < platforms.size(); p++) {
+        for (int d = 0; d < platform_ports; d++) {
+            platforms[p]->taps[d].closeAll();
+        }
+    }
+}
+
+// Cliente: vuelca en la salida estándar lo que se escribe en un puerto
+// (--tap), a través del socket o del anillo compartido (--tap-shm).
+// No necesita root ni crea nada. Los huecos se avisan por la salida de error.
+int runTapClient(const std::string& port, bool use_shm) {
+    if (use_shm) {
+        TapRing ring;
+        std::string path = tapRingPath(port);
+        if (!ring.attach(path)) {
+            std::cerr << "No se pudo abrir " << path << ": " << strerror(errno)
+                      << " (el simulador debe ejecutarse con --shm-taps)" << std::endl;
+            return 1;
+        }
+        ring.heartbeat();
+        uint64_t position = ring.writePosition();
+        std::string chunk;
+        for (;;) {
+            ring.heartbeat();
+            chunk.clear();
+            uint64_t lost = ring.read(position, chunk);
+            if (lost > 0) std::cerr << "\n[tap: " << lost << " bytes perdidos]" << std::endl;
+            if (!chunk.empty() && write(STDOUT_FILENO, chunk.data(), chunk.size()) == -1) return 0;
+            usleep(10000);
+        }
+    }
+
+    struct sockaddr_un addr;
+    int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (sock == -1 || !makeSocketAddress(tap_socket_path, addr) ||
+        connect(sock, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) == -1) {
+        std::cerr << "No se pudo conectar a " << tap_socket_path << ": " << strerror(errno) << std::endl;
+        return 1;
+    }
+    if (send(sock, port.data(), port.size(), MSG_NOSIGNAL) == -1) {
+        std::cerr << "No se pudo enviar la peticion: " << strerror(errno) << std::endl;
+        return 1;
+    }
+    std::vector<char> buffer(65536);
+    ssize_t n = recv(sock, &buffer[0], buffer.size(), 0);
+    if (n != 2 || memcmp(&buffer[0], "OK", 2) != 0) {
+        std::cerr << "Derivacion rechazada: " << (n > 0 ? std::string(&buffer[0], n) : "sin respuesta") << std::endl;
+        return 1;
+    }
+    while ((n = recv(sock, &buffer[0], buffer.size(), 0)) > 0) {
+        if (write(STDOUT_FILENO, &buffer[0], static_cast<size_t>(n)) == -1) break;
+    }
+    close(sock);
+    return 0;
+}
+
+// ============================================================================
+// Reparto de plataformas entre procesos de trabajo
+// ============================================================================
+
+// Con --shards N el proceso principal (coordinador) crea los puertos y reparte
+// las plataformas entre N procesos de trabajo: la plataforma p la emula el
+// proceso p % N con sus hilos de GPS y cabezales, fijado a su propio núcleo, y
+// escribe directamente en sus puertos. El coordinador publica en ShardControl
+// el origen del reloj de simulación y el modo idéntico, y lee de la arena
+// compartida lo que publican los procesos para checkpoints, métricas, el panel
+// y los relevos. Si un proceso muere los demás siguen: el coordinador lo
+// relanza desde la última instantánea de sus dispositivos.
+//
+// Los procesos no salen de un fork del coordinador, que ya tiene hilos (un
+// hijo heredaría mutex bloqueados por hilos que en él no existen). Antes de
+// lanzar ningún hilo salvo el del registro, que se detiene un momento, el
+// coordinador crea un proceso semilla de un solo hilo; es él quien hace fork
+// de cada proceso de trabajo cuando el coordinador se lo pide por un socket,
+// y le avisa por el mismo socket cuando alguno termina. Cada proceso muere
+// con su padre (PR_SET_PDEATHSIG): semilla con el coordinador y los de
+// trabajo con la semilla.
+struct ShardControl {
+    std::atomic<int64_t> clock_origin_ns;
+    std::atomic<bool> identical;
+};
+
+const int SHARD_POLL_MS = 100;
+
+// Mensaje entre coordinador y semilla: petición de lanzar shard (pid 0), o
+// aviso de que lo lanzó (exited 0) o de que terminó con status (exited 1)
+struct ShardMessage {
+    int32_t shard;
+    int32_t pid;
+    int32_t exited;
+    int32_t status;
+};
+
+int shard_count = 1;
+ShardControl* shard_control = NULL;
+std::vector<pid_t> shard_pids;
+pid_t zygote_pid = -1;
+int zygote_fd = -1;  // Extremo del coordinador (en la semilla, el suyo)
+
+// Arena para ShardControl y las plataformas de un escenario
+bool prepareShards(int platform_count) {
+    size_t size = sizeof(ShardControl) + static_cast<size_t>(platform_count) * (sizeof(Platform) + 64) + 4096;
+    if (!createSharedArena(size)) return false;
+    shard_control = new (sharedArenaAllocate(sizeof(ShardControl))) ShardControl();
+    shard_pids.assign(static_cast<size_t>(shard_count), -1);
+    return true;
+}
+
+// Cuerpo de un proceso de trabajo (hijo de la semilla); no vuelve
+void runShardWorker(int shard, bool log_writer) {
+    // Si la semilla ya no está, nadie avisaría de la muerte del coordinador
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    if (getppid() == 1) _exit(0);
+    close(zygote_fd);
+    if (log_writer) resumeLogWriter();
+    if (!truth_path.empty()) {
+        std::string error;
+        if (!truth_exporter.start(truth_path + "." + std::to_string(shard + 1), error)) {
+            LOG_ERROR("Particion {}: error al abrir el canal de verdad: {}", shard + 1, error);
+        }
+    }
+    int cpus = static_cast<int>(sysconf(_SC_NPROCESSORS_ONLN));
+    if (cpus > 1) {
+        // El núcleo 0 queda para el coordinador
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(1 + shard % (cpus - 1), &set);
+        sched_setaffinity(0, sizeof(set), &set);
+    }
+
+    // Puertos de las demás particiones
+    for (size_t p = 0; p < platforms.size(); p++) {
+        if (static_cast<int>(p) % shard_count == shard) continue;
+        for (int d = 0; d < platform_ports; d++) close(platforms[p]->port_fds[d]);
+    }
+
+    // SIGTERM (bloqueada en todos los hilos) llega aquí cuando muere la semilla
+    sigset_t terminate;
+    sigemptyset(&terminate);
+    sigaddset(&terminate, SIGTERM);
+    int terminate_fd = signalfd(-1, &terminate, SFD_CLOEXEC);
+
+    sim_clock.origin = std::chrono::steady_clock::time_point(std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+        std::chrono::nanoseconds(shard_control->clock_origin_ns.load())));
+    identical_magnetometers = shard_control->identical.load();
+
+    std::vector<std::thread> device_threads;
+    for (size_t p = shard; p < platforms.size(); p += shard_count) {
+        device_threads.push_back(std::thread(gpsEmulatorThread, platforms[p].get()));
+        for (int m = 1; m <= NUM_MAGNETOMETERS; m++) {
+            device_threads.push_back(std::thread(magnetometerEmulatorThread, platforms[p].get(), m));
+        }
+        if (platform_ports > IMU_DEVICE) device_threads.push_back(std::thread(imuEmulatorThread, platforms[p].get()));
+    }
+
+    // El eventfd de parada es el del coordinador (heredado). Mientras tanto se
+    // sigue el modo idéntico.
+    struct pollfd pfds[2] = {{shutdown_fd, POLLIN, 0}, {terminate_fd, POLLIN, 0}};
+    while (poll(pfds, terminate_fd != -1 ? 2 : 1, SHARD_POLL_MS) <= 0) {
+        identical_magnetometers = shard_control->identical.load();
+    }
+    running = false;
+    requestShutdown();
+    for (size_t t = 0; t < device_threads.size(); t++) {
+        device_threads[t].join();
+    }
+    truth_exporter.stop();
+    stopLogger();
+    _exit(0);
+}
+
+// Cuerpo de la semilla: un solo hilo que lanza los procesos de trabajo que
+// pide el coordinador y le avisa de los que terminan. Al cerrarse el socket
+// espera a que terminen todos; no vuelve.
+void runShardZygote(bool log_writer) {
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+    if (getppid() == 1) _exit(0);
+
+    // Descriptores que solo usa el coordinador
+    if (control_listen_fd != -1) close(control_listen_fd);
+    if (tap_listen_fd != -1) close(tap_listen_fd);
+    if (broker_lease_fd != -1) close(broker_lease_fd);
+    close(signal_fd);
+    control_listen_fd = tap_listen_fd = broker_lease_fd = signal_fd = -1;
+
+    bool open = true;
+    while (open) {
+        struct pollfd pfd = {zygote_fd, POLLIN, 0};
+        if (poll(&pfd, 1, SHARD_POLL_MS) > 0) {
+            ShardMessage request;
+            ssize_t n = recv(zygote_fd, &request, sizeof(request), 0);
+            if (n == static_cast<ssize_t>(sizeof(request))) {
+                ShardMessage reply = {request.shard, 0, 0, 0};
+                reply.pid = fork();
+                if (reply.pid == 0) runShardWorker(request.shard, log_writer);
+                if (reply.pid == -1) reply.status = errno;
+                send(zygote_fd, &reply, sizeof(reply), MSG_NOSIGNAL);
+            } else if (n == 0 || (n == -1 && errno != EINTR)) {
+                open = false;
+            }
+        }
+
+        int status = 0;
+        pid_t pid;
+        while ((pid = waitpid(-1, &status, open ? WNOHANG : 0)) > 0) {
+            ShardMessage event = {-1, pid, 1, status};
+            if (open) send(zygote_fd, &event, sizeof(event), MSG_NOSIGNAL);
+        }
+    }
+    _exit(0);
+}
+
+// Crea la semilla. El coordinador aún no tiene más hilo que el del registro,
+// que se detiene mientras tanto para que el fork sea de un proceso de un hilo.
+bool startShardZygote() {
+    int pair[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, pair) == -1) return false;
+    flushLog();
+    std::cout.flush();
+    fflush(NULL);
+    bool log_writer = pauseLogWriter();
+    zygote_pid = fork();
+    if (zygote_pid == 0) {
+        close(pair[0]);
+        zygote_fd = pair[1];
+        runShardZygote(log_writer);
+    }
+    if (log_writer) resumeLogWriter();
+    close(pair[1]);
+    if (zygote_pid == -1) {
+        close(pair[0]);
+        return false;
+    }
+    zygote_fd = pair[0];
+    return true;
+}
+
+// Pide a la semilla un proceso de trabajo. Su pid (o el error) llega por
+// zygote_fd antes que cualquier aviso de que ha terminado y lo recoge
+// shardSupervisorThread.
+bool requestShard(int shard) {
+    ShardMessage request = {shard, 0, 0, 0};
+    return send(zygote_fd, &request, sizeof(request), MSG_NOSIGNAL) == static_cast<ssize_t>(sizeof(request));
+}
+
+bool startShards() {
+    shard_control->clock_origin_ns =
+        std::chrono::duration_cast<std::chrono::nanoseconds>(sim_clock.origin.time_since_epoch()).count();
+    shard_control->identical = identical_magnetometers.load();
+    if (!startShardZygote()) return false;
+    for (int s = 0; s < shard_count; s++) {
+        if (!requestShard(s)) return false;
+    }
+    return true;
+}
+
+// Thread del coordinador que anota los procesos que lanza la semilla y pide
+// de nuevo los que mueren. El nuevo continúa desde la última muestra publicada: las que faltan se emiten en
+// ráfaga hasta alcanzar el calendario, sin saltos en los contadores.
+void shardSupervisorThread() {
+    auto next_check = std::chrono::steady_clock::now();
+    for (;;) {
+        next_check += std::chrono::milliseconds(SHARD_POLL_MS);
+        if (!waitUntil(next_check)) return;
+
+        ShardMessage event;
+        ssize_t n;
+        while ((n = recv(zygote_fd, &event, sizeof(event), MSG_DONTWAIT)) == static_cast<ssize_t>(sizeof(event))) {
+            if (!event.exited) {
+                if (event.pid == -1) {
+                    LOG_ERROR("No se pudo lanzar la particion {}: {}", event.shard + 1, strerror(event.status));
+                } else {
+                    shard_pids[event.shard] = event.pid;
+                }
+                continue;
+            }
+            pid_t pid = event.pid;
+            int status = event.status;
+            int shard = static_cast<int>(std::find(shard_pids.begin(), shard_pids.end(), pid) - shard_pids.begin());
+            if (shard >= shard_count) continue;
+            shard_pids[shard] = -1;
+            LOG_WARN("Particion {} (pid {}) terminada ({} {}); relanzando desde su ultima instantanea", shard + 1, pid,
+                     WIFSIGNALED(status) ? "senal" : "codigo",
+                     WIFSIGNALED(status) ? WTERMSIG(status) : WEXITSTATUS(status));
+            for (size_t p = shard; p < platforms.size(); p += shard_count) {
+                Platform& platform = *platforms[p];
+                platform.gps_snapshot.read(platform.gps_initial_state);
+                for (int i = 0; i < NUM_MAGNETOMETERS; i++) {
+                    // El progreso es el de la última muestra; la historia del FIR y
+                    // el ruido coloreado solo si el último estado completo es de esa
+                    // misma muestra (si no, arrancan de nuevo como al empezar)
+                    MagnetometerState& initial = platform.mag_initial_states[i];
+                    MagnetometerProgress progress;
+                    if (!platform.mag_snapshots[i].read(progress)) continue;
+                    if (!platform.mag_full_states[i].state.read(initial) ||
+                        initial.sample_index != progress.sample_index) {
+                        initial.decimator.length = 0;
+                        initial.decimator.position = 0;
+                        memset(&initial.noise, 0, sizeof(initial.noise));
+                    }
+                    static_cast<MagnetometerProgress&>(initial) = progress;
+                }
+                ImuSample imu;
+                if (platform.imu_snapshot.read(imu)) platform.imu_initial_index = imu.index + 1;
+                // El proceso muerto pudo dejarlo bloqueado
+                new (&platform.shared_data_mutex) std::mutex();
+            }
+            if (!requestShard(shard)) LOG_ERROR("No se pudo relanzar la particion {}", shard + 1);
+        }
+        // Sin semilla no se puede relanzar nada (y sus procesos ya terminan con ella)
+        if (n == 0 || (n == -1 && errno != EAGAIN && errno != EINTR)) {
+            LOG_ERROR("El proceso semilla de las particiones ha terminado; deteniendo el simulador");
+            requestShutdown();
+            return;
+        }
+    }
+}
+
+// Espera a que terminen todas las particiones (tras pedir la parada)
+void waitForShards() {
+    if (zygote_pid <= 0) return;
+    shutdown(zygote_fd, SHUT_WR);
+    waitpid(zygote_pid, NULL, 0);
+    close(zygote_fd);
+    zygote_fd = -1;
+}
+
+// ============================================================================
+// Render offline y barrido de parámetros
+// ============================================================================
+
+struct RenderResult {
+    bool ok;
+    uint64_t mag_samples;
+    uint64_t gps_samples;
+    double peak_anomaly_nT;  // Máxima anomalía de campo total vista por un cabezal
+    double elapsed_s;
+};
+
+// Genera sin pausas el levantamiento completo de un escenario en archivos:
+// gps.nmea, magN.txt y, con IMU, imu.txt o imu.bin con exactamente el mismo
+// formato que los puertos
+RenderResult renderOffline(const ScenarioConfig& config, const FieldModel& field, const std::string& output_dir) {
+    RenderResult result = {false, 0, 0, 0.0, 0.0};
+    auto start = std::chrono::steady_clock::now();
+    uint64_t duration_us = static_cast<uint64_t>(config.duration_s * 1e6);
+
+    std::ofstream gps_out((output_dir + "/gps.nmea").c_str(), std::ios::binary);
+    if (!gps_out) return result;
+    GPSState gps = initialGPSState(config.seed);
+    while (gps.sample_index * GPS_PERIOD_US < duration_us) {
+        gps_out << nextGPSOutput(gps, config.survey);
+        result.gps_samples++;
+    }
+
+    if (config.imu_rate_hz > 0.0) {
+        std::ofstream imu_out((output_dir + (config.imu_binary ? "/imu.bin" : "/imu.txt")).c_str(), std::ios::binary);
+        if (!imu_out) return result;
+        ImuModel imu = makeImuModel(config, config.survey, config.seed, 0);
+        char buffer[IMU_MAX_BYTES];
+        for (uint64_t n = 0; n * imu.period_us < duration_us; n++) {
+            imu_out.write(buffer, formatImuSample(sampleImu(imu, n), config.imu_binary, buffer));
+        }
+        if (!imu_out) return result;
+    }
+
+    // Canal de verdad: lo escribe un hilo aparte mientras se genera
+    TruthExporter exporter;
+    TruthQueue* truth_queue = NULL;
+    if (config.truth_export) {
+        std::string error;
+        if (!exporter.start(output_dir + "/truth.qst", error)) {
+            LOG_ERROR("Error al crear el canal de verdad: {}", error);
+            return result;
+        }
+        truth_queue = exporter.attach();
+    }
+    SourceContributions contributions;
+    TruthRecord truth_record;
+    truth_record.platform = 0;
+
+    for (int mag_id = 1; mag_id <= NUM_MAGNETOMETERS; mag_id++) {
+        std::ofstream mag_out((output_dir + "/mag" + std::to_string(mag_id) + ".txt").c_str(), std::ios::binary);
+        if (!mag_out) return result;
+
+        MagnetometerState state = initialMagnetometerState(mag_id, config.seed);
+        HeadModel head = makeHeadModel(field, config, mag_id, NUM_MAGNETOMETERS);
+        head.scalar_offset_nT = (mag_id == 1) ? 10.0 : 0.0;
+        truth_record.head = static_cast<uint8_t>(mag_id);
+
+        FieldSample truth;
+        while (state.sample_index * MAG_PERIOD_US < duration_us) {
+            QuSpinData quspin_data = sampleMagnetometer(state, head, &truth, truth_queue ? &contributions : NULL);
+            mag_out << generateQuSpinLine(quspin_data) << '\n';
+            if (truth_queue) {
+                fillTruthRecord(truth_record, state, head, quspin_data, truth, contributions, config.truth_min_nT);
+                exporter.push(*truth_queue, truth_record, true);
+            }
+            advanceMagnetometer(state);
+            state.sample_index++;
+            result.peak_anomaly_nT = std::max(result.peak_anomaly_nT, std::abs(truth.anomaly_nT));
+            result.mag_samples++;
+        }
+        if (!mag_out) return result;
+    }
+    exporter.detach(truth_queue);
+    exporter.stop();
+
+    result.ok = static_cast<bool>(gps_out);
+    result.elapsed_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return result;
+}
+
+// Ejecuta el producto cartesiano de los valores del archivo de barrido. Cada
+// clave con varios valores separados por comas es un eje de la rejilla. Las
+// corridas se reparten entre todos los núcleos y comparten el campo de
+// referencia y los índices de fuentes, que se cargan una sola vez.
+int runSweep(const std::string& grid_path, const std::string& output_dir, int jobs) {
+    std::vector<ScenarioEntry> entries;
+    std::string error;
+    if (!readScenarioFile(grid_path, entries, error)) {
+        std::cerr << "Error al leer barrido: " << error << std::endl;
+        return 1;
+    }
+
+    ScenarioConfig base;
+    base.seed = master_seed;
+    std::vector<ScenarioConfig> runs(1, base);
+    std::vector<std::vector<std::string> > run_labels(1);
+    std::vector<std::string> swept_keys;
+    for (size_t e = 0; e < entries.size(); e++) {
+        const ScenarioEntry& entry = entries[e];
+        if (entry.values.size() > 1) swept_keys.push_back(entry.key);
+
+        std::vector<ScenarioConfig> expanded;
+        std::vector<std::vector<std::string> > expanded_labels;
+        for (size_t r = 0; r < runs.size(); r++) {
+            for (size_t v = 0; v < entry.values.size(); v++) {
+                ScenarioConfig config = runs[r];
+                if (!applyScenarioValue(config, entry.key, entry.values[v], error)) {
+                    std::cerr << grid_path << ":" << entry.line << ": " << error << std::endl;
+                    return 1;
+                }
+                expanded.push_back(config);
+                expanded_labels.push_back(run_labels[r]);
+                if (entry.values.size() > 1) expanded_labels.back().push_back(entry.values[v]);
+            }
+        }
+        runs.swap(expanded);
+        run_labels.swap(expanded_labels);
+    }
+
+    // Componentes inmutables compartidos por todas las corridas
+    std::shared_ptr<const ReferenceField> reference = makeReferenceField(sim_values);
+    std::vector<FieldModel> models(runs.size());
+    std::vector<std::pair<std::string, std::shared_ptr<const AnomalySourceIndex> > > source_cache;
+    for (size_t r = 0; r < runs.size(); r++) {
+        std::string cache_key = runs[r].sources_path + "|" + std::to_string(runs[r].source_cutoff_m)
+                                + "|" + std::to_string(runs[r].source_theta);
+        size_t c = 0;
+        while (c < source_cache.size() && source_cache[c].first != cache_key) c++;
+        if (c == source_cache.size()) {
+            std::shared_ptr<const AnomalySourceIndex> index;
+            if (!loadSourceIndex(runs[r], index, error)) {
+                std::cerr << "Error al cargar fuentes: " << error << std::endl;
+                return 1;
+            }
+            source_cache.push_back(std::make_pair(cache_key, index));
+        }
+        models[r].reference = reference;
+        models[r].sources = source_cache[c].second;
+        models[r].depth_offset_m = runs[r].depth_offset_m;
+    }
+
+    if (mkdir(output_dir.c_str(), 0755) == -1 && errno != EEXIST) {
+        std::cerr << "Error al crear " << output_dir << ": " << strerror(errno) << std::endl;
+        return 1;
+    }
+    if (jobs < 1) jobs = std::max(1u, std::thread::hardware_concurrency());
+    std::cout << "Barrido: " << runs.size() << " corridas en " << jobs << " hilos" << std::endl;
+
+    std::vector<RenderResult> results(runs.size());
+    std::vector<std::string> run_dirs(runs.size());
+    std::atomic<size_t> next_run(0);
+    auto start = std::chrono::steady_clock::now();
+
+    std::vector<std::thread> workers;
+    for (int j = 0; j < jobs; j++) {
+        workers.push_back(std::thread([&]() {
+            for (size_t r = next_run++; r < runs.size(); r = next_run++) {
+                char name[32];
+                snprintf(name, sizeof(name), "run_%04zu", r + 1);
+                run_dirs[r] = name;
+                std::string dir = output_dir + "/" + name;
+                if (mkdir(dir.c_str(), 0755) == -1 && errno != EEXIST) {
+                    results[r].ok = false;
+                    continue;
+                }
+                results[r] = renderOffline(runs[r], models[r], dir);
+            }
+        }));
+    }
+    for (size_t j = 0; j < workers.size(); j++) {
+        workers[j].join();
+    }
+    double elapsed_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    // Índice resumen: una fila por corrida con los valores barridos
+    std::ofstream index((output_dir + "/index.csv").c_str());
+    index << "run";
+    for (size_t k = 0; k < swept_keys.size(); k++) index << "," << swept_keys[k];
+    index << ",seed,mag_samples,gps_samples,peak_anomaly_nT,elapsed_s,status" << std::endl;
+
+    uint64_t total_samples = 0;
+    int failed = 0;
+    for (size_t r = 0; r < runs.size(); r++) {
+        index << run_dirs[r];
+        for (size_t k = 0; k < run_labels[r].size(); k++) {
+            // Las fórmulas pueden llevar comas: entre comillas, como en CSV
+            const std::string& label = run_labels[r][k];
+            if (label.find_first_of(",\"") == std::string::npos) {
+                index << "," << label;
+            } else {
+                std::string quoted;
+                for (size_t i = 0; i < label.size(); i++) quoted += label[i] == '"' ? "\"\"" : std::string(1, label[i]);
+                index << ",\"" << quoted << "\"";
+            }
+        }
+        index << "," << runs[r].seed << "," << results[r].mag_samples << "," << results[r].gps_samples
+              << "," << std::fixed << std::setprecision(3) << results[r].peak_anomaly_nT
+              << "," << results[r].elapsed_s << "," << (results[r].ok ? "ok" : "error") << std::endl;
+        total_samples += results[r].mag_samples + results[r].gps_samples;
+        if (!results[r].ok) failed++;
+    }
+
+    std::cout << "Barrido terminado en " << std::fixed << std::setprecision(2) << elapsed_s << " s: "
+              << total_samples << " muestras, "
+              << std::setprecision(0) << total_samples / elapsed_s << " muestras-corrida/s" << std::endl;
+    std::cout << "Indice: " << output_dir << "/index.csv" << std::endl;
+    if (failed > 0) {
+        std::cerr << failed << " corridas fallaron" << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+// ============================================================================
+// Ajuste del modelo de ruido a capturas reales (--fit-noise)
+// ============================================================================
+
+// Recorre capturas QTFM (líneas con el formato de los puertos) proyectadas en
+// memoria, en tramos de FIT_CHUNK_BYTES repartidos entre --jobs hilos, y
+// acumula por régimen de sensibilidad y canal (escalar, X, Y, Z) una PSD de
+// Welch con bloques largos (FIT_BLOCK muestras, Hann, 50 %) para llegar a
+// frecuencias de milihercios. Un salto del timestamp, una muestra inválida,
+// un eje fuera de turno o un cambio de régimen cortan los bloques en curso;
+// los bloques no cruzan tramos. Los bloques se transforman de dos en dos con
+// una sola FFT compleja (uno en la parte real y otro en la imaginaria).
+//
+// Con la PSD media se buscan primero los tonos (picos FIT_TONE_RATIO veces
+// por encima de la mediana local) y, sin ellos, se ajusta el modelo de
+// ChannelNoise, lineal en sus coeficientes: a + b/f + c/f² con a = w²,
+// b = w² fc y c = q² / (2 π²). Es un ajuste por mínimos cuadrados relativos
+// sobre bandas logarítmicas, probando todos los subconjuntos de coeficientes
+// y quedándose con el mejor sin coeficientes negativos. Los datos deben ser
+// de un sensor quieto: la señal de un vuelo se confundiría con ruido 1/f.
+const int FIT_BLOCK = 1 << 16;
+const int FIT_BINS = FIT_BLOCK / 2 + 1;
+const size_t FIT_CHUNK_BYTES = 64 << 20;
+const int FIT_REGIME_WIDTH = 50;  // Sensibilidad escalar por régimen: s100-149, s150-199...
+const int FIT_REGIMES = 1000 / FIT_REGIME_WIDTH;
+const int FIT_BANDS_PER_DECADE = 10;
+const double FIT_TONE_RATIO = 30.0;
+const int FIT_TONE_HALF_WIDTH = 4;  // Bins a cada lado del pico que suman su potencia
+const uint32_t DAY_MS = 86400000;
+
+// FFT compleja radix-2 de tamaño FIT_BLOCK con tablas precalculadas
+class FitFft {
+public:
+    FitFft() : twiddle_(FIT_BLOCK / 2), reversed_(FIT_BLOCK) {
+        for (int k = 0; k < FIT_BLOCK / 2; k++) twiddle_[k] = std::polar(1.0, -2.0 * M_PI * k / FIT_BLOCK);
+        for (int i = 0, j = 0; i < FIT_BLOCK; i++) {
+            reversed_[i] = j;
+            int bit = FIT_BLOCK >> 1;
+            for (; j & bit; bit >>= 1) j ^= bit;
+            j ^= bit;
+        }
+    }
+
+    void transform(std::complex<double>* data) const {
+        for (int i = 0; i < FIT_BLOCK; i++) {
+            if (i < reversed_[i]) std::swap(data[i], data[reversed_[i]]);
+        }
+        for (int length = 2, stride = FIT_BLOCK / 2; length <= FIT_BLOCK; length <<= 1, stride >>= 1) {
+            for (int start = 0; start < FIT_BLOCK; start += length) {
+                for (int k = 0; k < length / 2; k++) {
+                    const std::complex<double>& w = twiddle_[k * stride];
+                    std::complex<double>& a = data[start + k];
+                    std::complex<double>& b = data[start + k + length / 2];
+                    // Producto escrito a mano: sin la comprobación de NaN de operator*
+                    double re = b.real() * w.real() - b.imag() * w.imag();
+                    double im = b.real() * w.imag() + b.imag() * w.real();
+                    b = std::complex<double>(a.real() - re, a.imag() - im);
+                    a = std::complex<double>(a.real() + re, a.imag() + im);
+                }
+            }
+        }
+    }
+
+private:
+    std::vector<std::complex<double> > twiddle_;
+    std::vector<int> reversed_;
+};
+
+// Suma de periodogramas de un canal en un régimen
+struct FitSpectrum {
+    FitSpectrum() : blocks(0), psd(FIT_BINS, 0.0) {}
+    uint64_t blocks;
+    std::vector<double> psd;  // Suma de |X|², sin normalizar
+};
+
+struct FitAccumulator {
+    FitAccumulator() : spectra(FIT_REGIMES * NOISE_CHANNELS), lines(0), rejected(0), samples(FIT_REGIMES, 0) {}
+    std::vector<std::unique_ptr<FitSpectrum> > spectra;  // Índice regime * NOISE_CHANNELS + canal
+    uint64_t lines;
+    uint64_t rejected;               // Líneas que no son muestras válidas
+    std::vector<uint64_t> samples;   // Muestras escalares por régimen
+
+    FitSpectrum& spectrum(int regime, int channel) {
+        std::unique_ptr<FitSpectrum>& s = spectra[regime * NOISE_CHANNELS + channel];
+        if (!s) s.reset(new FitSpectrum);
+        return *s;
+    }
+
+    void merge(FitAccumulator& other) {
+        lines += other.lines;
+        rejected += other.rejected;
+        for (int r = 0; r < FIT_REGIMES; r++) samples[r] += other.samples[r];
+        for (size_t i = 0; i < spectra.size(); i++) {
+            if (!other.spectra[i]) continue;
+            if (!spectra[i]) {
+                spectra[i] = std::move(other.spectra[i]);
+                continue;
+            }
+            spectra[i]->blocks += other.spectra[i]->blocks;
+            for (int k = 0; k < FIT_BINS; k++) spectra[i]->psd[k] += other.spectra[i]->psd[k];
+        }
+    }
+};
+
+inline bool parseUnsigned(const char*& p, const char* end, uint32_t& value) {
+    const char* digits = p;
+    value = 0;
+    for (; p < end && *p >= '0' && *p <= '9'; p++) value = value * 10 + static_cast<uint32_t>(*p - '0');
+    return p != digits;
+}
+
+// Una línea "!52939.486_X-784.260=@000>86336800s139v113" (con o sin \r).
+// Se guarda dónde está el texto de cada valor para poder sustituirlo (--replay).
+struct CapturedSample {
+    double scalar_nT;
+    double vector_nT;
+    int channel;  // 1..3: eje del valor vectorial
+    bool valid;   // Ambas validaciones correctas
+    uint32_t timestamp_ms;
+    uint32_t scalar_sensitivity;
+    const char* scalar_end;    // El valor escalar empieza tras el '!'
+    const char* vector_begin;
+    const char* vector_end;
+};
+
+bool parseCapturedLine(const char* p, const char* end, CapturedSample& sample) {
+    uint32_t counter, vector_sensitivity;
+    if (p == end || *p++ != '!' || !parseFixedPoint(p, end, sample.scalar_nT) || end - p < 2) return false;
+    sample.scalar_end = p;
+    char scalar_validation = *p++;
+    char axis = *p++;
+    sample.vector_begin = p;
+    if (axis < 'X' || axis > 'Z' || !parseFixedPoint(p, end, sample.vector_nT) || p == end) return false;
+    sample.vector_end = p;
+    char vector_validation = *p++;
+    if (p == end || *p++ != '@' || !parseUnsigned(p, end, counter) || p == end || *p++ != '>' ||
+        !parseUnsigned(p, end, sample.timestamp_ms) || p == end || *p++ != 's' ||
+        !parseUnsigned(p, end, sample.scalar_sensitivity) || p == end || *p++ != 'v' ||
+        !parseUnsigned(p, end, vector_sensitivity)) {
+        return false;
+    }
+    if (p < end && *p == '\r') p++;
+    sample.channel = 1 + (axis - 'X');
+    sample.valid = scalar_validation == '_' && vector_validation == '=';
+    return p == end;
+}
+
+// Acumula los bloques de un tramo. Cada canal llena su bloque en curso; al
+// completarse se aparta con la ventana aplicada y la media restada, y los
+// apartados se transforman de dos en dos.
+class FitChunkProcessor {
+public:
+    FitChunkProcessor(const FitFft& fft, FitAccumulator& accumulator)
+        : fft_(fft), accumulator_(accumulator), window_(FIT_BLOCK), fft_buffer_(FIT_BLOCK),
+          regime_(-1), last_timestamp_(0), next_channel_(0), pending_spectrum_(NULL) {
+        for (int k = 0; k < FIT_BLOCK; k++) window_[k] = 0.5 - 0.5 * std::cos(2.0 * M_PI * k / FIT_BLOCK);
+        for (int c = 0; c < NOISE_CHANNELS; c++) streams_[c].reserve(FIT_BLOCK);
+        pending_.resize(FIT_BLOCK);
+    }
+
+    void process(const char* begin, const char* end) {
+        reset();
+        for (const char* line = begin; line < end;) {
+            const char* newline = static_cast<const char*>(memchr(line, '\n', end - line));
+            const char* line_end = newline != NULL ? newline : end;
+            if (line_end > line) {
+                accumulator_.lines++;
+                CapturedSample sample;
+                if (parseCapturedLine(line, line_end, sample) && sample.valid) {
+                    add(sample);
+                } else {
+                    accumulator_.rejected++;
+                    reset();
+                }
+            }
+            line = line_end + 1;
+        }
+        reset();
+    }
+
+    // El bloque que quede apartado sin pareja se transforma solo
+    void finish() {
+        if (pending_spectrum_ == NULL) return;
+        for (int k = 0; k < FIT_BLOCK; k++) fft_buffer_[k] = std::complex<double>(pending_[k], 0.0);
+        fft_.transform(&fft_buffer_[0]);
+        for (int k = 0; k < FIT_BINS; k++) pending_spectrum_->psd[k] += std::norm(fft_buffer_[k]);
+        pending_spectrum_->blocks++;
+        pending_spectrum_ = NULL;
+    }
+
+private:
+    void reset() {
+        for (int c = 0; c < NOISE_CHANNELS; c++) streams_[c].clear();
+        regime_ = -1;
+        next_channel_ = 0;
+    }
+
+    void add(const CapturedSample& sample) {
+        int regime = static_cast<int>(std::min<uint32_t>(sample.scalar_sensitivity / FIT_REGIME_WIDTH, FIT_REGIMES - 1));
+        // Pasada la medianoche el timestamp puede seguir creciendo o volver a cero
+        uint32_t expected_ms = last_timestamp_ + MAG_PERIOD_US / 1000;
+        bool continuous = regime == regime_ &&
+                          (sample.timestamp_ms == expected_ms || sample.timestamp_ms == expected_ms % DAY_MS) &&
+                          (next_channel_ == 0 || sample.channel == next_channel_);
+        if (!continuous) reset();
+        regime_ = regime;
+        last_timestamp_ = sample.timestamp_ms;
+        next_channel_ = sample.channel % 3 + 1;
+        accumulator_.samples[regime]++;
+
+        push(0, sample.scalar_nT);
+        push(sample.channel, sample.vector_nT);
+    }
+
+    void push(int channel, double value) {
+        std::vector<double>& stream = streams_[channel];
+        stream.push_back(value);
+        if (stream.size() < static_cast<size_t>(FIT_BLOCK)) return;
+
+        double mean = 0.0;
+        for (int k = 0; k < FIT_BLOCK; k++) mean += stream[k];
+        mean /= FIT_BLOCK;
+        FitSpectrum& spectrum = accumulator_.spectrum(regime_, channel);
+        if (pending_spectrum_ == NULL) {
+            for (int k = 0; k < FIT_BLOCK; k++) pending_[k] = (stream[k] - mean) * window_[k];
+            pending_spectrum_ = &spectrum;
+        } else {
+            for (int k = 0; k < FIT_BLOCK; k++) {
+                fft_buffer_[k] = std::complex<double>(pending_[k], (stream[k] - mean) * window_[k]);
+            }
+            fft_.transform(&fft_buffer_[0]);
+            // Z = A + iB: A[k] = (Z[k] + conj(Z[N-k])) / 2, B[k] = (Z[k] - conj(Z[N-k])) / 2i
+            for (int k = 0; k < FIT_BINS; k++) {
+                std::complex<double> z = fft_buffer_[k];
+                std::complex<double> mirror = std::conj(fft_buffer_[(FIT_BLOCK - k) % FIT_BLOCK]);
+                pending_spectrum_->psd[k] += 0.25 * std::norm(z + mirror);
+                spectrum.psd[k] += 0.25 * std::norm(z - mirror);
+            }
+            pending_spectrum_->blocks++;
+            spectrum.blocks++;
+            pending_spectrum_ = NULL;
+        }
+        stream.erase(stream.begin(), stream.begin() + FIT_BLOCK / 2);
+    }
+
+    const FitFft& fft_;
+    FitAccumulator& accumulator_;
+    std::vector<double> window_;
+    std::vector<std::complex<double> > fft_buffer_;
+    std::vector<double> streams_[NOISE_CHANNELS];
+    int regime_;
+    uint32_t last_timestamp_;
+    int next_channel_;  // Eje que debe venir a continuación (0: cualquiera)
+    std::vector<double> pending_;
+    FitSpectrum* pending_spectrum_;
+};
+
+struct FitChunk {
+    size_t file;
+    size_t begin;
+    size_t end;
+};
+
+// Archivos regulares de una ruta (un archivo o, recursivamente, un directorio)
+bool collectCaptureFiles(const std::string& path, std::vector<std::string>& files, std::string& error) {
+    struct stat st;
+    if (stat(path.c_str(), &st) == -1) {
+        error = path + ": " + strerror(errno);
+        return false;
+    }
+    if (S_ISREG(st.st_mode)) {
+        files.push_back(path);
+        return true;
+    }
+    DIR* dir = opendir(path.c_str());
+    if (dir == NULL) {
+        error = path + ": " + strerror(errno);
+        return false;
+    }
+    std::vector<std::string> names;
+    while (struct dirent* entry = readdir(dir)) {
+        std::string name = entry->d_name;
+        if (name != "." && name != "..") names.push_back(name);
+    }
+    closedir(dir);
+    std::sort(names.begin(), names.end());
+    for (size_t n = 0; n < names.size(); n++) {
+        if (!collectCaptureFiles(path + "/" + names[n], files, error)) return false;
+    }
+    return true;
+}
+
+// Procesa un tramo de un archivo: empieza tras el primer salto de línea
+// (salvo al principio del archivo) y termina con la línea que cruza su final
+bool processFitChunk(const std::string& path, const FitChunk& chunk, FitChunkProcessor& processor) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return false;
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return false;
+    }
+    size_t size = static_cast<size_t>(st.st_size);
+    void* memory = size > 0 ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (memory == MAP_FAILED) return size == 0;
+    const char* data = static_cast<const char*>(memory);
+    size_t begin = std::min(chunk.begin, size);
+    size_t end = std::min(chunk.end, size);
+    madvise(const_cast<char*>(data) + (begin & ~static_cast<size_t>(4095)), end - (begin & ~static_cast<size_t>(4095)),
+            MADV_SEQUENTIAL);
+
+    if (begin > 0) {
+        const char* newline = static_cast<const char*>(memchr(data + begin - 1, '\n', end - begin + 1));
+        begin = newline != NULL ? static_cast<size_t>(newline - data) + 1 : end;
+    }
+    if (end < size) {
+        const char* newline = static_cast<const char*>(memchr(data + end - 1, '\n', size - end + 1));
+        end = newline != NULL ? static_cast<size_t>(newline - data) + 1 : size;
+    }
+    if (begin < end) processor.process(data + begin, data + end);
+    munmap(memory, size);
+    return true;
+}
+
+// PSD unilateral media (nT²/Hz) de un espectro acumulado
+std::vector<double> normalizedFitPsd(const FitSpectrum& spectrum, double rate_hz) {
+    double window_power = 0.0;
+    for (int k = 0; k < FIT_BLOCK; k++) {
+        double w = 0.5 - 0.5 * std::cos(2.0 * M_PI * k / FIT_BLOCK);
+        window_power += w * w;
+    }
+    std::vector<double> psd(FIT_BINS);
+    for (int k = 0; k < FIT_BINS; k++) {
+        double one_sided = (k == 0 || k == FIT_BINS - 1) ? 1.0 : 2.0;
+        psd[k] = one_sided * spectrum.psd[k] / (spectrum.blocks * rate_hz * window_power);
+    }
+    return psd;
+}
+
+struct FittedChannel {
+    ChannelNoise noise;
+    int tone_count;
+    uint64_t blocks;
+    double residual_db;  // Desviación cuadrática media del ajuste respecto a la PSD medida
+};
+
+// Mínimos cuadrados ponderados con los coeficientes de mask (bits de a, b, c);
+// devuelve el residuo o -1 si la solución tiene algún coeficiente negativo
+double solveNoiseFit(const std::vector<double>& f, const std::vector<double>& p, int mask, double coefficients[3]) {
+    int used[3];
+    int n = 0;
+    for (int j = 0; j < 3; j++) {
+        if (mask & (1 << j)) used[n++] = j;
+    }
+    // Residuo relativo: (modelo - p) / p, con bases 1, 1/f, 1/f²
+    double normal[3][4] = {{0}};
+    for (size_t i = 0; i < f.size(); i++) {
+        double basis[3] = {1.0 / p[i], 1.0 / (f[i] * p[i]), 1.0 / (f[i] * f[i] * p[i])};
+        for (int r = 0; r < n; r++) {
+            for (int c = 0; c < n; c++) normal[r][c] += basis[used[r]] * basis[used[c]];
+            normal[r][3] += basis[used[r]];
+        }
+    }
+    for (int col = 0; col < n; col++) {
+        int pivot = col;
+        for (int r = col + 1; r < n; r++) {
+            if (std::abs(normal[r][col]) > std::abs(normal[pivot][col])) pivot = r;
+        }
+        if (normal[pivot][col] == 0.0) return -1.0;
+        for (int c = 0; c < 4; c++) std::swap(normal[col][c], normal[pivot][c]);
+        for (int r = 0; r < n; r++) {
+            if (r == col) continue;
+            double factor = normal[r][col] / normal[col][col];
+            for (int c = 0; c < 4; c++) normal[r][c] -= factor * normal[col][c];
+        }
+    }
+    coefficients[0] = coefficients[1] = coefficients[2] = 0.0;
+    for (int r = 0; r < n; r++) {
+        coefficients[used[r]] = normal[r][3] / normal[r][r];
+        if (coefficients[used[r]] < 0.0) return -1.0;
+    }
+    double residual = 0.0;
+    for (size_t i = 0; i < f.size(); i++) {
+        double model = coefficients[0] + coefficients[1] / f[i] + coefficients[2] / (f[i] * f[i]);
+        double ratio = model > 0.0 ? 10.0 * std::log10(model / p[i]) : 100.0;
+        residual += ratio * ratio;
+    }
+    return std::sqrt(residual / f.size());
+}
+
+FittedChannel fitChannelNoise(const FitSpectrum& spectrum, double rate_hz) {
+    FittedChannel fitted;
+    fitted.tone_count = 0;
+    fitted.blocks = spectrum.blocks;
+    fitted.residual_db = 0.0;
+    std::vector<double> psd = normalizedFitPsd(spectrum, rate_hz);
+    double bin_hz = rate_hz / FIT_BLOCK;
+
+    // Base local: mediana de ±64 bins, calculada cada 8 bins
+    const int half_window = 64, step = 8;
+    std::vector<double> baseline(FIT_BINS);
+    std::vector<double> window;
+    for (int center = 0; center < FIT_BINS; center += step) {
+        window.assign(psd.begin() + std::max(1, center - half_window),
+                      psd.begin() + std::min(FIT_BINS, center + half_window + 1));
+        std::nth_element(window.begin(), window.begin() + window.size() / 2, window.end());
+        for (int k = center; k < std::min(FIT_BINS, center + step); k++) baseline[k] = window[window.size() / 2];
+    }
+
+    // Tonos: máximos locales muy por encima de la base, de mayor a menor,
+    // separados entre sí; lejos de continua, donde la base no es fiable
+    std::vector<std::pair<double, int> > peaks;
+    for (int k = 2 * half_window; k < FIT_BINS - 1; k++) {
+        if (psd[k] >= psd[k - 1] && psd[k] >= psd[k + 1] && psd[k] > FIT_TONE_RATIO * baseline[k]) {
+            peaks.push_back(std::make_pair(psd[k], k));
+        }
+    }
+    std::sort(peaks.rbegin(), peaks.rend());
+    std::vector<double> cleaned = psd;
+    for (size_t i = 0; i < peaks.size() && fitted.tone_count < NOISE_TONES; i++) {
+        int k = peaks[i].second;
+        bool near = false;
+        for (int t = 0; t < fitted.tone_count; t++) {
+            near = near || std::abs(fitted.noise.tones[t].hz / bin_hz - k) < 4 * FIT_TONE_HALF_WIDTH;
+        }
+        if (near) continue;
+        double power = 0.0, weighted = 0.0;
+        for (int j = std::max(1, k - FIT_TONE_HALF_WIDTH); j <= std::min(FIT_BINS - 1, k + FIT_TONE_HALF_WIDTH); j++) {
+            double excess = std::max(0.0, psd[j] - baseline[j]);
+            power += excess * bin_hz;
+            weighted += excess * j;
+            cleaned[j] = baseline[j];
+        }
+        // Potencia de una senoide de amplitud A: A² / 2
+        fitted.noise.tones[fitted.tone_count].hz = weighted / (power / bin_hz) * bin_hz;
+        fitted.noise.tones[fitted.tone_count].amplitude_nT = std::sqrt(2.0 * power);
+        fitted.tone_count++;
+    }
+
+    // Bandas logarítmicas desde el primer bin hasta el 90 % de Nyquist
+    std::vector<double> band_f, band_p;
+    double low = bin_hz;
+    while (low < 0.9 * rate_hz / 2.0) {
+        double high = low * std::pow(10.0, 1.0 / FIT_BANDS_PER_DECADE);
+        double sum_f = 0.0, sum_p = 0.0;
+        int count = 0;
+        for (int k = static_cast<int>(std::ceil(low / bin_hz)); k < FIT_BINS - 1 && k * bin_hz < high; k++) {
+            sum_f += k * bin_hz;
+            sum_p += cleaned[k];
+            count++;
+        }
+        if (count > 0 && sum_p > 0.0) {
+            band_f.push_back(sum_f / count);
+            band_p.push_back(sum_p / count);
+        }
+        low = high;
+    }
+
+    double best[3] = {0.0, 0.0, 0.0};
+    double best_residual = -1.0;
+    for (int mask = 1; mask < 8 && !band_f.empty(); mask++) {
+        double coefficients[3];
+        double residual = solveNoiseFit(band_f, band_p, mask, coefficients);
+        if (residual >= 0.0 && (best_residual < 0.0 || residual < best_residual)) {
+            best_residual = residual;
+            memcpy(best, coefficients, sizeof(best));
+        }
+    }
+    fitted.residual_db = std::max(0.0, best_residual);
+    if (best[0] <= 0.0 && best[1] > 0.0) {
+        // 1/f sin suelo blanco: se representa con la esquina en el extremo de la banda
+        best[0] = best[1] / band_f.back();
+    }
+    fitted.noise.white_nT_rtHz = std::sqrt(best[0]);
+    fitted.noise.corner_hz = best[0] > 0.0 ? best[1] / best[0] : 0.0;
+    fitted.noise.walk_nT_rts = M_PI * std::sqrt(2.0 * best[2]);
+    return fitted;
+}
+
+void writeFittedChannel(std::ostringstream& out, int channel, const FittedChannel& fitted, const char* prefix) {
+    const char* name = NOISE_CHANNEL_NAMES[channel];
+    out << prefix << "# " << name << ": " << fitted.blocks << " bloques, residuo " << std::setprecision(2)
+        << fitted.residual_db << " dB\n";
+    out << std::setprecision(6);
+    out << prefix << name << "_noise_white_nT_rtHz = " << fitted.noise.white_nT_rtHz << "\n";
+    out << prefix << name << "_noise_corner_hz = " << fitted.noise.corner_hz << "\n";
+    out << prefix << name << "_noise_walk_nT_rts = " << fitted.noise.walk_nT_rts << "\n";
+    for (int t = 0; t < NOISE_TONES; t++) {
+        // Se escriben todos para anular tonos de un escenario previo
+        const NoiseTone& tone = fitted.noise.tones[t];
+        out << prefix << name << "_noise_tone" << t + 1 << "_hz = " << (t < fitted.tone_count ? tone.hz : 0.0) << "\n";
+        out << prefix << name << "_noise_tone" << t + 1 << "_nT = " << (t < fitted.tone_count ? tone.amplitude_nT : 0.0)
+            << "\n";
+    }
+}
+
+int runNoiseFit(const std::vector<std::string>& inputs, const std::string& output_path, int jobs) {
+    std::vector<std::string> files;
+    std::string error;
+    for (size_t i = 0; i < inputs.size(); i++) {
+        if (!collectCaptureFiles(inputs[i], files, error)) {
+            std::cerr << "Error al leer capturas: " << error << std::endl;
+            return 1;
+        }
+    }
+    std::vector<FitChunk> chunks;
+    uint64_t total_bytes = 0;
+    for (size_t f = 0; f < files.size(); f++) {
+        struct stat st;
+        if (stat(files[f].c_str(), &st) == -1) continue;
+        size_t size = static_cast<size_t>(st.st_size);
+        total_bytes += size;
+        for (size_t begin = 0; begin < size; begin += FIT_CHUNK_BYTES) {
+            FitChunk chunk = {f, begin, std::min(size, begin + FIT_CHUNK_BYTES)};
+            chunks.push_back(chunk);
+        }
+    }
+    if (jobs < 1) jobs = std::max(1u, std::thread::hardware_concurrency());
+    jobs = std::max(1, std::min<int>(jobs, static_cast<int>(chunks.size())));
+    std::cout << "Ajuste de ruido: " << files.size() << " archivos, " << std::fixed << std::setprecision(1)
+              << total_bytes / 1e6 << " MB en " << chunks.size() << " tramos, " << jobs << " hilos" << std::endl;
+
+    FitFft fft;
+    FitAccumulator total;
+    std::mutex total_mutex;
+    std::atomic<size_t> next_chunk(0);
+    std::atomic<int> failed(0);
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> workers;
+    for (int j = 0; j < jobs; j++) {
+        workers.push_back(std::thread([&]() {
+            FitAccumulator local;
+            FitChunkProcessor processor(fft, local);
+            for (size_t c = next_chunk++; c < chunks.size(); c = next_chunk++) {
+                if (!processFitChunk(files[chunks[c].file], chunks[c], processor)) failed++;
+            }
+            processor.finish();
+            std::lock_guard<std::mutex> lock(total_mutex);
+            total.merge(local);
+        }));
+    }
+    for (size_t j = 0; j < workers.size(); j++) workers[j].join();
+    double elapsed_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    uint64_t valid = 0;
+    std::vector<int> regimes;
+    for (int r = 0; r < FIT_REGIMES; r++) {
+        valid += total.samples[r];
+        bool complete = total.samples[r] > 0;
+        for (int c = 0; c < NOISE_CHANNELS; c++) complete = complete && total.spectra[r * NOISE_CHANNELS + c];
+        if (complete) regimes.push_back(r);
+    }
+    std::cout << total.lines << " lineas (" << total.rejected << " descartadas) en " << std::setprecision(2)
+              << elapsed_s << " s: " << std::setprecision(1) << total_bytes / 1e6 / std::max(elapsed_s, 1e-9)
+              << " MB/s" << std::endl;
+    if (failed > 0) std::cerr << failed << " tramos no se pudieron leer" << std::endl;
+    if (regimes.empty()) {
+        std::cerr << "Sin datos continuos suficientes: cada canal necesita al menos " << FIT_BLOCK
+                  << " muestras seguidas en un mismo regimen" << std::endl;
+        return 1;
+    }
+    // El régimen con más muestras queda activo; los demás, comentados
+    std::stable_sort(regimes.begin(), regimes.end(), [&](int a, int b) { return total.samples[a] > total.samples[b]; });
+
+    std::ostringstream out;
+    out << "# Modelo de ruido ajustado con --fit-noise\n";
+    out << "# " << files.size() << " archivos, " << valid << " muestras validas\n";
+    for (size_t i = 0; i < regimes.size(); i++) {
+        int r = regimes[i];
+        const char* prefix = i == 0 ? "" : "# ";
+        out << "\n# Regimen de sensibilidad s" << r * FIT_REGIME_WIDTH << "-" << (r + 1) * FIT_REGIME_WIDTH - 1 << ": "
+            << std::fixed << std::setprecision(1) << 100.0 * total.samples[r] / valid << "% de las muestras"
+            << (i == 0 ? "" : " (descomentar para usarlo)") << "\n";
+        out << prefix << "noise_nT = 0\n";
+        for (int c = 0; c < NOISE_CHANNELS; c++) {
+            double rate_hz = 1e6 / MAG_PERIOD_US / (c == 0 ? 1.0 : 3.0);
+            FittedChannel fitted = fitChannelNoise(*total.spectra[r * NOISE_CHANNELS + c], rate_hz);
+            writeFittedChannel(out, c, fitted, prefix);
+            if (i == 0) {
+                std::cout << "  s" << r * FIT_REGIME_WIDTH << " " << std::setw(6) << NOISE_CHANNEL_NAMES[c]
+                          << ": blanco " << std::setprecision(5) << fitted.noise.white_nT_rtHz << " nT/rHz, esquina "
+                          << std::setprecision(4) << fitted.noise.corner_hz << " Hz, paseo " << std::setprecision(5)
+                          << fitted.noise.walk_nT_rts << " nT/rs, " << fitted.tone_count << " tonos, residuo "
+                          << std::setprecision(2) << fitted.residual_db << " dB" << std::endl;
+            }
+        }
+    }
+    if (!writeFileAtomically(output_path, out.str(), false)) return 1;
+    std::cout << "Fragmento de escenario escrito en " << output_path << std::endl;
+    return 0;
+}
+
+// ============================================================================
+// Reproducción de capturas con objetivos sintéticos (--replay)
+// ============================================================================
+
+// Emite por los puertos de la plataforma 1 una captura real (gps.nmea,
+// mag1.txt y mag2.txt de un directorio, como los que escriben los renders)
+// sumando a cada muestra válida el campo de las fuentes del escenario en la
+// posición del cabezal. gps.nmea se abre como un TrackLog: la trayectoria,
+// la hora de cada GGA y la medianoche son las de track = ARCHIVO, en el marco
+// local con origen en el primer fix; los cabezales se separan head_spacing_m
+// hacia el este como en la simulación y van a flight_height_m más la
+// variación de la altitud registrada.
+// Las líneas se leen de la captura proyectada en memoria y solo se reescriben
+// los dos valores: el resto del texto se copia tal cual, sin reservar memoria.
+// El ritmo lo marcan los tiempos de la captura (UTC de las GGA, timestamp
+// de las líneas QuSpin) divididos por replay_speed; 0 = sin esperas.
+// Cada reloj cuenta desde su primera línea: se supone que la primera GGA y
+// la primera muestra de cada cabezal son del mismo instante, salvo el
+// desfase replay_mag_offset_s (cuánto después de la primera GGA empezó la
+// captura de los cabezales), que mueve tanto la posición como el ritmo.
+std::string replay_dir;
+double replay_speed = 1.0;
+double replay_mag_offset_s = 0.0;
+
+// Escribe value con tres decimales ("-784.260") y devuelve el final
+char* formatMilli(char* out, double value) {
+    int64_t milli = static_cast<int64_t>(std::llround(value * 1000.0));
+    if (milli < 0) {
+        *out++ = '-';
+        milli = -milli;
+    }
+    char digits[24];
+    int n = 0;
+    int64_t whole = milli / 1000;
+    do {
+        digits[n++] = static_cast<char>('0' + whole % 10);
+        whole /= 10;
+    } while (whole > 0);
+    while (n > 0) *out++ = digits[--n];
+    int fraction = static_cast<int>(milli % 1000);
+    *out++ = '.';
+    *out++ = static_cast<char>('0' + fraction / 100);
+    *out++ = static_cast<char>('0' + fraction / 10 % 10);
+    *out++ = static_cast<char>('0' + fraction % 10);
+    return out;
+}
+
+// t_s en el reloj de las GGA; con desfase negativo (cabezales antes que el
+// GPS) todo se retrasa para que la primera muestra no salga antes del origen
+std::chrono::steady_clock::time_point replayDeadline(std::chrono::steady_clock::time_point origin, double t_s) {
+    double lead_s = std::max(0.0, -replay_mag_offset_s);
+    return origin + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                        std::chrono::duration<double>((t_s + lead_s) / replay_speed));
+}
+
+// El texto entre dos GGA sale tal cual; cada GGA espera a su hora
+void gpsReplayThread(Platform* platform, const TrackLog* track, std::chrono::steady_clock::time_point origin) {
+    PortWriter port(platform->port_fds[0], scenario.gps_transport, &platform->taps[0], &platform->port_counters[0]);
+    const MappedFile& gps = track->file();
+    const char* written = gps.data;
+    bool stopped = false;
+    track->forEachFix([&](double t_s, const char* begin, const char* end) {
+        port.write(written, static_cast<size_t>(begin - written));
+        if (!running || (replay_speed > 0.0 && !port.wait(replayDeadline(origin, t_s)))) {
+            stopped = true;
+            return false;
+        }
+        port.write(begin, static_cast<size_t>(end - begin));
+        written = end;
+        return true;
+    });
+    if (!stopped) port.write(written, static_cast<size_t>(gps.data + gps.size - written));
+    port.flush();
+    if (running) LOG_INFO("Fin de la reproduccion del GPS");
+}
+
+void magnetometerReplayThread(Platform* platform, int mag_id, const MappedFile* capture, const TrackLog* track,
+                              std::chrono::steady_clock::time_point origin) {
+    PortWriter port(platform->port_fds[mag_id], scenario.mag_transport[mag_id - 1], &platform->taps[mag_id],
+                    &platform->port_counters[mag_id]);
+    HeadModel head = makeHeadModel(field_model, scenario, mag_id, NUM_MAGNETOMETERS);
+    const Vec3& direction = field_model.reference->direction;
+    Vec3 lift(head.offset_m.x, head.offset_m.y, scenario.survey.flight_height_m + field_model.depth_offset_m);
+    bool started = false;
+    uint32_t first_ms = 0;
+    uint64_t modified = 0;
+    uint64_t oversized = 0;  // Muestras válidas demasiado largas para reescribirlas en buffer
+    char buffer[256];
+
+    const char* data_end = capture->data + capture->size;
+    for (const char* line = capture->data; line < data_end && running;) {
+        const char* newline = static_cast<const char*>(memchr(line, '\n', data_end - line));
+        const char* end = newline != NULL ? newline : data_end;
+        const char* next = newline != NULL ? newline + 1 : data_end;
+        CapturedSample sample;
+        if (!parseCapturedLine(line, end, sample)) {
+            port.write(line, static_cast<size_t>(next - line));  // Texto ajeno: se reenvía igual
+            line = next;
+            continue;
+        }
+        if (!started) {
+            first_ms = sample.timestamp_ms;
+            started = true;
+        }
+        // Tiempo de la trayectoria: el de la captura del cabezal más su desfase
+        double t = ((sample.timestamp_ms + DAY_MS - first_ms) % DAY_MS) / 1000.0 + replay_mag_offset_s;
+        if (replay_speed > 0.0 && !port.wait(replayDeadline(origin, t))) break;
+
+        bool fits = next - line <= static_cast<ptrdiff_t>(sizeof(buffer)) - 32;
+        if (sample.valid && field_model.sources && !fits && oversized++ == 0) {
+            LOG_WARN("Magnetometro {}: linea de {} bytes reenviada sin objetivos", mag_id, next - line);
+        }
+        if (!sample.valid || !field_model.sources || !fits) {
+            port.write(line, static_cast<size_t>(next - line));
+            line = next;
+            continue;
+        }
+        Vec3 anomaly = field_model.sources->field(track->position(t) + lift);
+        double component = sample.channel == 1 ? anomaly.x : sample.channel == 2 ? anomaly.y : anomaly.z;
+
+        // "!" escalar, validación y eje, vector, y el resto de la línea tal cual
+        char* out = buffer;
+        *out++ = '!';
+        out = formatMilli(out, sample.scalar_nT + anomaly.dot(direction));
+        memcpy(out, sample.scalar_end, sample.vector_begin - sample.scalar_end);
+        out += sample.vector_begin - sample.scalar_end;
+        out = formatMilli(out, sample.vector_nT + component);
+        memcpy(out, sample.vector_end, next - sample.vector_end);
+        out += next - sample.vector_end;
+        port.write(buffer, static_cast<size_t>(out - buffer));
+        modified++;
+        line = next;
+    }
+    port.flush();
+    if (running) {
+        LOG_INFO("Fin de la reproduccion del magnetometro {} ({} muestras con objetivos, {} demasiado largas)", mag_id,
+                 modified, oversized);
+    }
+}
+
+// ============================================================================
+// Benchmarks
+// ============================================================================
+
+// Compara la aproximación de Barnes–Hut y la suma directa con radio de corte
+// contra la suma exacta sobre todas las fuentes: error y aceleración
+int runSourceBenchmark(size_t source_count, size_t point_count) {
+    SimRng rng(master_seed);
+    const double area_m = 1000.0;
+
+    // Población de fuentes tipo UXO repartida en 1 km² cerca de la superficie:
+    // magnetización inducida según el campo de referencia más una remanente
+    // aleatoria. La parte inducida no se cancela a distancia, así que el radio
+    // de corte pierde el campo agregado de las fuentes lejanas.
+    Vec3 induced = makeReferenceField(sim_values)->direction;
+    std::vector<DipoleSource> sources(source_count);
+    for (size_t i = 0; i < source_count; i++) {
+        sources[i].position = Vec3(rng.uniform(0.0, area_m), rng.uniform(0.0, area_m), -rng.uniform(0.5, 5.0));
+        sources[i].moment = induced * rng.uniform(0.0, 10.0)
+            + Vec3(rng.uniform(-3.0, 3.0), rng.uniform(-3.0, 3.0), rng.uniform(-3.0, 3.0));
+        sources[i].id = static_cast<uint32_t>(i);
+    }
+    std::vector<Vec3> points(point_count);
+    for (size_t i = 0; i < point_count; i++) {
+        points[i] = Vec3(rng.uniform(0.0, area_m), rng.uniform(0.0, area_m), 2.0);
+    }
+
+    // Referencia: suma exacta
+    std::vector<Vec3> exact(point_count);
+    auto start = std::chrono::steady_clock::now();
+    for (size_t p = 0; p < point_count; p++) {
+        for (size_t i = 0; i < source_count; i++) {
+            exact[p] += dipoleField(sources[i].moment, points[p] - sources[i].position);
+        }
+    }
+    double exact_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    double field_ms = 0.0;
+    for (size_t p = 0; p < point_count; p++) field_ms += exact[p].dot(exact[p]);
+    double field_rms = std::sqrt(field_ms / point_count);
+
+    std::cout << "Fuentes: " << source_count << ", puntos: " << point_count
+              << ", campo RMS: " << std::fixed << std::setprecision(3) << field_rms << " nT" << std::endl;
+    std::cout << "metodo,parametro,construccion_ms,us_por_punto,aceleracion,error_rms_nT,error_max_nT,"
+                 "error_rel,cabezales_a_250Hz" << std::endl;
+
+    struct Variant { const char* name; double cutoff; double theta; };
+    const Variant variants[] = {
+        {"exacto", 0.0, 0.0},
+        {"corte", 50.0, 0.0},
+        {"corte", 100.0, 0.0},
+        {"barnes_hut", 0.0, 0.2},
+        {"barnes_hut", 0.0, 0.35},
+        {"barnes_hut", 0.0, 0.5},
+        {"barnes_hut", 0.0, 0.7},
+        {"barnes_hut", 0.0, 1.0},
+    };
+    for (size_t v = 0; v < sizeof(variants) / sizeof(variants[0]); v++) {
+        const Variant& variant = variants[v];
+        double build_s = 0.0, eval_s = exact_s, err_ms = 0.0, err_max = 0.0;
+
+        if (v > 0) {
+            start = std::chrono::steady_clock::now();
+            AnomalySourceIndex index(sources, variant.cutoff, variant.theta);
+            build_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+            std::vector<Vec3> approx(point_count);
+            start = std::chrono::steady_clock::now();
+            for (size_t p = 0; p < point_count; p++) {
+                approx[p] = index.field(points[p]);
+            }
+            eval_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+            for (size_t p = 0; p < point_count; p++) {
+                double err = (approx[p] - exact[p]).norm();
+                err_ms += err * err;
+                err_max = std::max(err_max, err);
+            }
+        }
+        double err_rms = std::sqrt(err_ms / point_count);
+        double us_per_point = eval_s * 1e6 / point_count;
+
+        std::cout << variant.name << "," << std::setprecision(2)
+                  << (variant.theta > 0.0 ? variant.theta : variant.cutoff) << ","
+                  << std::setprecision(1) << build_s * 1e3 << ","
+                  << std::setprecision(2) << us_per_point << ","
+                  << std::setprecision(1) << exact_s / eval_s << ","
+                  << std::setprecision(4) << err_rms << "," << err_max << ","
+                  << std::scientific << std::setprecision(2) << (field_rms > 0.0 ? err_rms / field_rms : 0.0)
+                  << std::fixed << "," << static_cast<long>(1e6 / us_per_point / 250.0) << std::endl;
+    }
+    return 0;
+}
+
+// Mide la caché de campo por cabezal a lo largo de un levantamiento: coste por
+// muestra y error frente a evaluar el modelo completo en cada muestra
+int runFieldCacheBenchmark(size_t source_count) {
+    SimRng rng(master_seed);
+    ScenarioConfig config;
+    config.survey.lines = 6;
+    config.survey.line_length_m = 100.0;
+    config.survey.line_spacing_m = 10.0;
+    config.survey.speed_mps = 5.0;
+    config.source_cutoff_m = 0.0;  // Suma exacta: se mide solo la caché
+
+    Vec3 induced = makeReferenceField(sim_values)->direction;
+    std::vector<DipoleSource> sources(source_count);
+    for (size_t i = 0; i < source_count; i++) {
+        sources[i].position = Vec3(rng.uniform(-10.0, 60.0), rng.uniform(-10.0, 110.0), -rng.uniform(0.5, 3.0));
+        sources[i].moment = induced * rng.uniform(0.0, 5.0);
+        sources[i].id = static_cast<uint32_t>(i);
+    }
+    FieldModel field;
+    field.reference = makeReferenceField(sim_values);
+    field.sources.reset(new AnomalySourceIndex(sources, config.source_cutoff_m, config.source_theta));
+
+    uint64_t samples = static_cast<uint64_t>(config.survey.duration() * 1e6 / MAG_PERIOD_US);
+    std::vector<FieldSample> exact(samples);
+    HeadModel head = makeHeadModel(field, config, 1, 1);
+    auto start = std::chrono::steady_clock::now();
+    for (uint64_t n = 0; n < samples; n++) {
+        exact[n] = evaluateHeadField(head, static_cast<double>(n));
+    }
+    double exact_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::cout << "Fuentes: " << source_count << ", muestras: " << samples << " ("
+              << config.survey.lines << " lineas a " << config.survey.speed_mps << " m/s)" << std::endl;
+    std::cout << "cota_nT,us_por_muestra,aceleracion,error_rms_nT,error_max_nT" << std::endl;
+    std::cout << "exacto," << std::fixed << std::setprecision(3) << exact_s * 1e6 / samples << ",1.0,0,0" << std::endl;
+
+    const double bounds[] = {0.1, 0.01, 0.001, 0.0001};
+    for (size_t b = 0; b < sizeof(bounds) / sizeof(bounds[0]); b++) {
+        config.field_cache_error_nT = bounds[b];
+        head = makeHeadModel(field, config, 1, 1);
+        FieldCacheState cache;
+        memset(&cache, 0, sizeof(cache));
+
+        std::vector<FieldSample> cached(samples);
+        start = std::chrono::steady_clock::now();
+        for (uint64_t n = 0; n < samples; n++) {
+            cached[n] = cachedHeadField(cache, head, n);
+        }
+        double cached_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        double err_ms = 0.0, err_max = 0.0;
+        for (uint64_t n = 0; n < samples; n++) {
+            double err = std::abs(cached[n].scalar_nT - exact[n].scalar_nT);
+            err = std::max(err, (cached[n].vector_nT - exact[n].vector_nT).norm());
+            err_ms += err * err;
+            err_max = std::max(err_max, err);
+        }
+        std::cout << std::defaultfloat << bounds[b] << "," << std::fixed << std::setprecision(3)
+                  << cached_s * 1e6 / samples << "," << std::setprecision(1) << exact_s / cached_s << ","
+                  << std::setprecision(5) << std::sqrt(err_ms / samples) << "," << err_max << std::endl;
+    }
+    return 0;
+}
+
+// Coste de la decimación por cabezal: filtro (kernel escalar frente al
+// elegido en tiempo de ejecución) y muestra completa, sin fuentes
+int runDecimationBenchmark(size_t output_samples) {
+    const char* kernel_name = NULL;
+    selectDecimationKernel(&kernel_name);
+    FieldModel field;
+    field.reference = makeReferenceField(sim_values);
+    ScenarioConfig config;
+
+    std::cout << "Kernel: " << kernel_name << ", muestras de salida: " << output_samples << std::endl;
+    std::cout << "frecuencia_interna_hz,taps,ns_filtro_escalar,ns_filtro,resultado_identico,"
+              << "us_por_muestra,cabezales_250Hz,ruido_rms_nT" << std::endl;
+    const double rates[] = {0.0, 1000.0, 2000.0, 4000.0};
+    for (size_t r = 0; r < sizeof(rates) / sizeof(rates[0]); r++) {
+        config.internal_rate_hz = rates[r];
+        HeadModel head = makeHeadModel(field, config, 1, 1);
+        MagnetometerState state = initialMagnetometerState(1, master_seed);
+
+        double reference = evaluateHeadField(head, 0.0).scalar_nT;
+        double noise_ms = 0.0;
+        auto start = std::chrono::steady_clock::now();
+        for (size_t n = 0; n < output_samples; n++) {
+            QuSpinData data = sampleMagnetometer(state, head);
+            double noise = data.scalar_field_nT - reference;
+            noise_ms += noise * noise;
+            advanceMagnetometer(state);
+            state.sample_index++;
+        }
+        double sample_us = std::chrono::duration<double, std::micro>(
+            std::chrono::steady_clock::now() - start).count() / output_samples;
+
+        double scalar_ns = 0.0, kernel_ns = 0.0;
+        bool identical = true;
+        if (head.decimator) {
+            const DecimationFilter& filter = *head.decimator;
+            double acc_scalar[DECIMATION_CHANNELS], acc_kernel[DECIMATION_CHANNELS];
+            start = std::chrono::steady_clock::now();
+            for (size_t n = 0; n < output_samples; n++) {
+                for (int c = 0; c < DECIMATION_CHANNELS; c++) acc_scalar[c] = 0.0;
+                accumulateScalar(&filter.coefficients[0], state.decimator.samples, filter.taps, acc_scalar);
+            }
+            scalar_ns = std::chrono::duration<double, std::nano>(
+                std::chrono::steady_clock::now() - start).count() / output_samples;
+            start = std::chrono::steady_clock::now();
+            for (size_t n = 0; n < output_samples; n++) {
+                for (int c = 0; c < DECIMATION_CHANNELS; c++) acc_kernel[c] = 0.0;
+                decimation_kernel(&filter.coefficients[0], state.decimator.samples, filter.taps, acc_kernel);
+            }
+            kernel_ns = std::chrono::duration<double, std::nano>(
+                std::chrono::steady_clock::now() - start).count() / output_samples;
+            identical = memcmp(acc_scalar, acc_kernel, sizeof(acc_scalar)) == 0;
+        }
+
+        std::cout << std::fixed << std::setprecision(0) << rates[r] << ","
+                  << (head.decimator ? head.decimator->taps : 0) << "," << std::setprecision(1)
+                  << scalar_ns << "," << kernel_ns << "," << (identical ? "si" : "no") << ","
+                  << std::setprecision(3) << sample_us << "," << std::setprecision(0)
+                  << MAG_PERIOD_US / sample_us << "," << std::setprecision(3)
+                  << std::sqrt(noise_ms / output_samples) << std::endl;
+    }
+    return 0;
+}
+
+// ============================================================================
+// Benchmark de destinos de salida (--bench-sinks)
+// ============================================================================
+
+// Anillo de bytes de un productor y un consumidor sobre memoria compartida.
+// Las posiciones son contadores absolutos (no se reinician al dar la vuelta) en
+// líneas de caché separadas al principio del mapeo; el resto son los datos.
+class ShmRing {
+public:
+    static const size_t HEADER_SIZE = 128;
+
+    ShmRing(void* memory, size_t size)
+        : write_pos_(new (memory) std::atomic<uint64_t>(0)),
+          read_pos_(new (static_cast<char*>(memory) + 64) std::atomic<uint64_t>(0)),
+          data_(static_cast<char*>(memory) + HEADER_SIZE),
+          capacity_(size - HEADER_SIZE) {}
+
+    // Copia data entera, esperando (sin bloquear el núcleo) a que haya sitio
+    bool write(const char* data, size_t length) {
+        if (length > capacity_) return false;
+        uint64_t w = write_pos_->load(std::memory_order_relaxed);
+        while (capacity_ - (w - read_pos_->load(std::memory_order_acquire)) < length) {
+            std::this_thread::yield();
+        }
+        copyIn(w, data, length);
+        write_pos_->store(w + length, std::memory_order_release);
+        return true;
+    }
+
+    size_t read(char* out, size_t max_length) {
+        uint64_t r = read_pos_->load(std::memory_order_relaxed);
+        size_t length = static_cast<size_t>(std::min<uint64_t>(write_pos_->load(std::memory_order_acquire) - r, max_length));
+        for (size_t done = 0; done < length;) {
+            size_t offset = (r + done) % capacity_;
+            size_t chunk = std::min(length - done, capacity_ - offset);
+            memcpy(out + done, data_ + offset, chunk);
+            done += chunk;
+        }
+        read_pos_->store(r + length, std::memory_order_release);
+        return length;
+    }
+
+private:
+    void copyIn(uint64_t position, const char* data, size_t length) {
+        for (size_t done = 0; done < length;) {
+            size_t offset = (position + done) % capacity_;
+            size_t chunk = std::min(length - done, capacity_ - offset);
+            memcpy(data_ + offset, data + done, chunk);
+            done += chunk;
+        }
+    }
+
+    std::atomic<uint64_t>* write_pos_;
+    std::atomic<uint64_t>* read_pos_;
+    char* data_;
+    size_t capacity_;
+};
+
+// Los destinos -4k agrupan las líneas en escrituras de una página, como un
+// adaptador USB con paquetes de 4096 bytes (transport_packet_bytes)
+const char* const SINK_NAMES[] = {"pty", "unix", "tcp", "shm", "file", "fifo", "vmsplice", "fifo-4k", "vmsplice-4k"};
+const int SINK_KINDS = 9;
+const size_t SINK_BATCH_BYTES = 4096;
+const size_t BENCH_SHM_SIZE = ShmRing::HEADER_SIZE + (1 << 20);
+
+// Extremos de un destino: descriptores de escritura y lectura, o el anillo
+struct SinkEndpoints {
+    int write_fd;
+    int read_fd;
+    void* shm;
+    std::unique_ptr<ShmRing> ring;
+    std::unique_ptr<SpliceRing> splice;
+    std::string file_path;
+};
+
+bool openSink(int kind, SinkEndpoints& sink, std::string& error) {
+    sink.write_fd = sink.read_fd = -1;
+    sink.shm = NULL;
+    int fds[2];
+    switch (kind) {
+        case 0: {  // Como createVirtualPort: master no bloqueante, slave en modo raw
+            if (openpty(&fds[0], &fds[1], NULL, NULL, NULL) == -1) break;
+            struct termios tty;
+            tcgetattr(fds[1], &tty);
+            cfmakeraw(&tty);
+            tcsetattr(fds[1], TCSANOW, &tty);
+            fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+            sink.write_fd = fds[0];
+            sink.read_fd = fds[1];
+            return true;
+        }
+        case 1:
+            if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1) break;
+            sink.write_fd = fds[0];
+            sink.read_fd = fds[1];
+            return true;
+        case 2: {
+            int listener = socket(AF_INET, SOCK_STREAM, 0);
+            struct sockaddr_in addr;
+            memset(&addr, 0, sizeof(addr));
+            addr.sin_family = AF_INET;
+            addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            socklen_t addr_length = sizeof(addr);
+            if (listener == -1 || bind(listener, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) == -1 ||
+                listen(listener, 1) == -1 ||
+                getsockname(listener, reinterpret_cast<struct sockaddr*>(&addr), &addr_length) == -1) {
+                if (listener != -1) close(listener);
+                break;
+            }
+            sink.write_fd = socket(AF_INET, SOCK_STREAM, 0);
+            if (sink.write_fd == -1 || connect(sink.write_fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) == -1) {
+                close(listener);
+                break;
+            }
+            sink.read_fd = accept(listener, NULL, NULL);
+            close(listener);
+            int one = 1;
+            setsockopt(sink.write_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            if (sink.read_fd == -1) break;
+            return true;
+        }
+        case 3:
+            sink.shm = mmap(NULL, BENCH_SHM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+            if (sink.shm == MAP_FAILED) {
+                sink.shm = NULL;
+                break;
+            }
+            sink.ring.reset(new ShmRing(sink.shm, BENCH_SHM_SIZE));
+            return true;
+        case 4: {
+            char path[] = "/tmp/quspin_bench_sinkXXXXXX";
+            sink.write_fd = mkstemp(path);
+            if (sink.write_fd == -1) break;
+            sink.file_path = path;
+            sink.read_fd = open(path, O_RDONLY);
+            if (sink.read_fd == -1) break;
+            return true;
+        }
+        case 5:  // Como createFifoPort, con write() o con vmsplice()
+        case 6:
+        case 7:
+        case 8:
+            if (pipe2(fds, O_CLOEXEC) == -1) break;
+            sink.read_fd = fds[0];
+            sink.write_fd = fds[1];
+            fcntl(sink.write_fd, F_SETFL, fcntl(sink.write_fd, F_GETFL) | O_NONBLOCK);
+            fcntl(sink.write_fd, F_SETPIPE_SZ, static_cast<int>(SPLICE_RING_CAPACITY));
+            if (kind == 6 || kind == 8) {
+                sink.splice.reset(new SpliceRing());
+                if (!sink.splice->valid()) break;
+            }
+            return true;
+    }
+    error = std::string(SINK_NAMES[kind]) + ": " + strerror(errno);
+    return false;
+}
+
+void closeSink(SinkEndpoints& sink) {
+    if (sink.write_fd != -1) close(sink.write_fd);
+    if (sink.read_fd != -1) close(sink.read_fd);
+    sink.ring.reset();
+    sink.splice.reset();
+    if (sink.shm) munmap(sink.shm, BENCH_SHM_SIZE);
+    if (!sink.file_path.empty()) unlink(sink.file_path.c_str());
+}
+
+// Escribe el mensaje completo; con un descriptor no bloqueante (pty) espera a
+// que haya sitio en lugar de descartar, para medir el caudal sostenido
+bool sinkWrite(SinkEndpoints& sink, const char* data, size_t length) {
+    if (sink.ring) return sink.ring->write(data, length);
+    while (length > 0) {
+        ssize_t n = sink.splice ? sink.splice->write(sink.write_fd, data, length) : write(sink.write_fd, data, length);
+        if (n > 0) {
+            data += n;
+            length -= static_cast<size_t>(n);
+        } else if (n == -1 && errno == EAGAIN) {
+            // Con vmsplice puede faltar sitio en el anillo aunque la tubería lo tenga
+            struct pollfd pfd = {sink.write_fd, POLLOUT, 0};
+            poll(&pfd, 1, 100);
+            if (sink.splice) std::this_thread::yield();
+        } else if (n == -1 && errno != EINTR) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Lee lo disponible; en archivo y anillo, 0 significa "aún nada"
+ssize_t sinkRead(SinkEndpoints& sink, char* buffer, size_t length) {
+    if (sink.ring) return static_cast<ssize_t>(sink.ring->read(buffer, length));
+    return read(sink.read_fd, buffer, length);
+}
+
+struct SinkResult {
+    uint64_t messages;
+    uint64_t bytes;
+    double seconds;
+    double cpu_seconds;
+    std::vector<double> latency_us;
+    bool complete;
+};
+
+// Envía los mensajes a message_rate por segundo (0: sin pausa) y mide en el
+// lector el instante en que llega el último byte de cada uno
+SinkResult runSinkCell(int kind, const std::vector<std::string>& lines, double message_rate, size_t message_count,
+                       std::string& error) {
+    SinkResult result;
+    result.messages = message_count;
+    result.bytes = 0;
+    result.seconds = result.cpu_seconds = 0.0;
+    result.complete = false;
+
+    SinkEndpoints sink;
+    if (!openSink(kind, sink, error)) {
+        closeSink(sink);
+        return result;
+    }
+    std::vector<uint64_t> message_end(message_count);
+    for (size_t k = 0; k < message_count; k++) {
+        result.bytes += lines[k % lines.size()].size();
+        message_end[k] = result.bytes;
+    }
+    std::vector<std::chrono::steady_clock::time_point> sent(message_count), received(message_count);
+
+    std::atomic<bool> writer_done(false);
+    std::thread reader([&]() {
+        std::vector<char> buffer(65536);
+        uint64_t total = 0;
+        size_t next = 0;
+        auto last_progress = std::chrono::steady_clock::now();
+        while (next < message_count) {
+            ssize_t n = sinkRead(sink, &buffer[0], buffer.size());
+            auto now = std::chrono::steady_clock::now();
+            if (n > 0) {
+                total += static_cast<uint64_t>(n);
+                while (next < message_count && message_end[next] <= total) received[next++] = now;
+                last_progress = now;
+            } else if (n < 0 && errno != EINTR && errno != EAGAIN) {
+                break;
+            } else if (writer_done && now - last_progress > std::chrono::seconds(5)) {
+                break;  // Destino atascado: el resultado se marca incompleto
+            } else {
+                std::this_thread::yield();
+            }
+        }
+        result.complete = next == message_count;
+    });
+
+    struct timespec cpu_start, cpu_end;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu_start);
+    auto start = std::chrono::steady_clock::now();
+    std::string batch;
+    for (size_t k = 0; k < message_count; k++) {
+        if (message_rate > 0.0) {
+            auto target = start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                std::chrono::duration<double>(k / message_rate));
+            if (target > std::chrono::steady_clock::now()) std::this_thread::sleep_until(target);
+        }
+        const std::string& line = lines[k % lines.size()];
+        sent[k] = std::chrono::steady_clock::now();
+        const std::string* data = &line;
+        if (kind >= 7) {
+            // La latencia incluye lo que la línea espera a que se llene la página
+            batch += line;
+            if (batch.size() < SINK_BATCH_BYTES && k + 1 < message_count) continue;
+            data = &batch;
+        }
+        bool ok = sinkWrite(sink, data->data(), data->size());
+        batch.clear();
+        if (!ok) {
+            error = std::string(SINK_NAMES[kind]) + ": error de escritura: " + strerror(errno);
+            break;
+        }
+    }
+    writer_done = true;
+    reader.join();
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu_end);
+    result.cpu_seconds = (cpu_end.tv_sec - cpu_start.tv_sec) + (cpu_end.tv_nsec - cpu_start.tv_nsec) / 1e9;
+    closeSink(sink);
+
+    if (result.complete) {
+        result.latency_us.resize(message_count);
+        for (size_t k = 0; k < message_count; k++) {
+            result.latency_us[k] = std::chrono::duration<double, std::micro>(received[k] - sent[k]).count();
+        }
+        std::sort(result.latency_us.begin(), result.latency_us.end());
+    }
+    return result;
+}
+
+double percentile(const std::vector<double>& sorted, double q) {
+    if (sorted.empty()) return 0.0;
+    size_t index = std::min(sorted.size() - 1, static_cast<size_t>(q * sorted.size()));
+    return sorted[index];
+}
+
+// Matriz destino x tasa con el mismo flujo de líneas QuSpin. Imprime CSV con
+// host y kernel en cada fila para poder comparar informes entre versiones y
+// máquinas. La CPU es la del proceso (escritor y lector); el trabajo que el
+// núcleo hace en sus propios hilos (p. ej. la disciplina de línea del pty) no cuenta.
+int runSinkBenchmark(double seconds_per_cell) {
+    FieldModel field;
+    field.reference = makeReferenceField(sim_values);
+    ScenarioConfig config;
+    HeadModel head = makeHeadModel(field, config, 1, 1);
+    MagnetometerState state = initialMagnetometerState(1, master_seed);
+    std::vector<std::string> lines(4096);
+    for (size_t k = 0; k < lines.size(); k++) {
+        lines[k] = generateQuSpinLine(sampleMagnetometer(state, head)) + "\n";
+        advanceMagnetometer(state);
+        state.sample_index++;
+    }
+
+    char host[256] = "desconocido";
+    gethostname(host, sizeof(host) - 1);
+    struct utsname system_info;
+    std::string kernel = uname(&system_info) == 0 ? system_info.release : "desconocido";
+
+    // Tasas crecientes en mensajes por segundo (250 = un cabezal, 320000 = 32
+    // cabezales a 10 kHz); 0 = sin pausa
+    const double rates[] = {250.0, 2500.0, 25000.0, 250000.0, 320000.0, 0.0};
+    const size_t unpaced_messages = 500000;
+    std::cout << "host,kernel,sink,rate_msgs_s,messages,bytes,throughput_MBps,cpu_s_per_MB,"
+              << "p50_us,p99_us,p999_us,max_us,status" << std::endl;
+    for (int kind = 0; kind < SINK_KINDS; kind++) {
+        for (size_t r = 0; r < sizeof(rates) / sizeof(rates[0]); r++) {
+            size_t count = rates[r] > 0.0 ? static_cast<size_t>(std::max(1.0, rates[r] * seconds_per_cell))
+                                          : unpaced_messages;
+            std::string error;
+            SinkResult result = runSinkCell(kind, lines, rates[r], count, error);
+            double megabytes = result.bytes / 1e6;
+            std::cout << host << "," << kernel << "," << SINK_NAMES[kind] << "," << std::fixed << std::setprecision(0)
+                      << rates[r] << "," << result.messages << "," << result.bytes << "," << std::setprecision(3)
+                      << (result.seconds > 0.0 ? megabytes / result.seconds : 0.0) << "," << std::setprecision(5)
+                      << (megabytes > 0.0 ? result.cpu_seconds / megabytes : 0.0) << "," << std::setprecision(1)
+                      << percentile(result.latency_us, 0.50) << "," << percentile(result.latency_us, 0.99) << ","
+                      << percentile(result.latency_us, 0.999) << ","
+                      << (result.latency_us.empty() ? 0.0 : result.latency_us.back()) << ","
+                      << (result.complete ? "ok" : (error.empty() ? "incompleto" : error)) << std::endl;
+        }
+    }
+    return 0;
+}
+
+// Función para limpiar symlinks existentes
+void cleanupPorts() {
+    struct stat st;
+
+    for (size_t p = 0; p < platforms.size(); p++) {
+        for (int d = 0; d < platform_ports; d++) {
+            const std::string& path = platforms[p]->port_paths[d];
+            if (lstat(path.c_str(), &st) == 0) {
+                if (S_ISLNK(st.st_mode)) {
+                    // Es un symlink, eliminarlo
+                    unlink(path.c_str());
+                    LOG_INFO("Limpiado symlink anterior: {}", path);
+                }
+            }
+        }
+    }
+}
+
+// Sustituye symlink_path por un symlink al slave de un pty. Un dispositivo
+// real en un puerto de la plataforma 0 se conserva como .backup hasta
+// removeVirtualPort(); en cualquier otra ruta se deja intacto y falla.
+bool linkVirtualPort(const char* slave_name, const std::string& symlink_path) {
+    // Verificar si el archivo existe y hacer backup si es necesario
+    struct stat st;
+    if (lstat(symlink_path.c_str(), &st) == 0) {
+        if (S_ISCHR(st.st_mode) && !isBaselinePortPath(symlink_path)) {
+            LOG_ERROR("{} es un dispositivo real que el simulador no sustituye", symlink_path);
+            return false;
+        }
+        LOG_WARN("{} ya existe.", symlink_path);
+
+        // Si es un dispositivo real (character device), hacer backup
+        if (S_ISCHR(st.st_mode)) {
+            std::string backup_path = symlink_path + ".backup";
+            LOG_INFO("Es un dispositivo real. Renombrando a {}", backup_path);
+            rename(symlink_path.c_str(), backup_path.c_str());
+        } else if (S_ISLNK(st.st_mode)) {
+            // Si es un symlink, simplemente eliminarlo
+            LOG_INFO("Es un symlink anterior. Eliminando...");
+            unlink(symlink_path.c_str());
+        } else {
+            // Si es otro tipo de archivo, eliminarlo
+            unlink(symlink_path.c_str());
+        }
+    }
+
+    // Crear symlink
+    if (symlink(slave_name, symlink_path.c_str()) == -1) {
+        LOG_ERROR("Error al crear symlink {}: {}", symlink_path, strerror(errno));
+        LOG_ERROR("¿Estás ejecutando con sudo?");
+        return false;
+    }
+
+    // Configurar permisos
+    chmod(symlink_path.c_str(), 0666);
+    return true;
+}
+
+// Si es GPS, configurar baudrate a 9600 (fd es cualquiera de los dos lados del pty)
+void configurePortSpeed(int fd, const std::string& symlink_path) {
+    if (isGpsPortPath(symlink_path)) {
+        struct termios tty;
+        tcgetattr(fd, &tty);
+        cfsetospeed(&tty, B9600);
+        cfsetispeed(&tty, B9600);
+        tcsetattr(fd, TCSANOW, &tty);
+    }
+}
+
+// Quita el symlink de un puerto y restaura el dispositivo original si existe
+void removeVirtualPort(const std::string& path) {
+    struct stat st;
+    // Un dispositivo real en la ruta no es nuestro (linkVirtualPort no lo sustituyó)
+    if (lstat(path.c_str(), &st) == 0 && S_ISCHR(st.st_mode)) return;
+    unlink(path.c_str());
+    std::string backup = path + ".backup";
+    if (stat(backup.c_str(), &st) == 0) {
+        rename(backup.c_str(), path.c_str());
+        LOG_INFO("Restaurado {} original", path);
+    }
+}
+
+// Crear puerto serial virtual
+int createVirtualPort(const std::string& symlink_path) {
+    int master_fd, slave_fd;
+    char slave_name[256];
+
+    // Abrir pseudo-terminal
+    if (openpty(&master_fd, &slave_fd, slave_name, NULL, NULL) == -1) {
+        LOG_ERROR("Error al crear pty: {}", strerror(errno));
+        return -1;
+    }
+
+    // Configurar el puerto como non-blocking
+    int flags = fcntl(master_fd, F_GETFL, 0);
+    fcntl(master_fd, F_SETFL, flags | O_NONBLOCK);
+
+    if (!linkVirtualPort(slave_name, symlink_path)) {
+        close(master_fd);
+        close(slave_fd);
+        return -1;
+    }
+    configurePortSpeed(slave_fd, symlink_path);
+
+    LOG_INFO("Puerto virtual creado: {} -> {}", symlink_path, slave_name);
+
+    close(slave_fd);  // No necesitamos el slave
+    return master_fd;
+}
+
+// Puerto como FIFO con nombre (--fifo-dir), para consumidores sin privilegios
+// que leen de una tubería: no hace falta pty ni root. El simulador la abre en
+// lectura y escritura, así nunca bloquea ni recibe SIGPIPE sin lector; lo que
+// nadie lee se acumula hasta llenar la tubería y después se descarta.
+int createFifoPort(const std::string& path) {
+    struct stat st;
+    if (lstat(path.c_str(), &st) == 0) {
+        if (!S_ISFIFO(st.st_mode)) {
+            LOG_ERROR("{} ya existe y no es una FIFO", path);
+            return -1;
+        }
+        unlink(path.c_str());
+    }
+    if (mkfifo(path.c_str(), 0666) == -1) {
+        LOG_ERROR("Error al crear FIFO {}: {}", path, strerror(errno));
+        return -1;
+    }
+    chmod(path.c_str(), 0666);
+
+    int fd = open(path.c_str(), O_RDWR | O_NONBLOCK);
+    if (fd == -1) {
+        LOG_ERROR("Error al abrir FIFO {}: {}", path, strerror(errno));
+        unlink(path.c_str());
+        return -1;
+    }
+    // Cada vmsplice() ocupa una entrada de la tubería; con el tamaño por
+    // defecto (16 páginas) se llenaría con 16 muestras
+    if (fcntl(fd, F_SETPIPE_SZ, static_cast<int>(SPLICE_RING_CAPACITY)) == -1) {
+        LOG_WARN("{}: tuberia con el tamano por defecto ({})", path, strerror(errno));
+    }
+    LOG_INFO("FIFO creada: {}", path);
+    return fd;
+}
+
+// ============================================================================
+// Agente de pty preasignados
+// ============================================================================
+
+// Crear cada pty con su symlink cuesta varias llamadas al sistema en cada
+// arranque. Con --pty-broker SOCKET un proceso aparte (root) mantiene un
+// conjunto de pty ya abiertos; una instancia lanzada con --ports-from SOCKET
+// pide los suyos indicando las rutas, y el agente crea los symlinks y le pasa
+// los masters (SCM_RIGHTS). La conexión es el préstamo: cuando se cierra
+// (la instancia termina o muere) el agente quita los symlinks y restaura los
+// dispositivos originales. Los pty no se reutilizan: quien siga con un slave
+// abierto recibe EOF en lugar de datos de la prueba siguiente. El conjunto se
+// repone después de responder, fuera del camino de arranque.
+// El agente corre como root: solo atiende a root y al usuario de
+// --broker-owner (SO_PEERCRED) y solo presta las rutas de --broker-ports.
+const char PTY_BROKER_REQUEST[] = "ACQUIRE";
+const int PTY_BROKER_REQUEST_TIMEOUT_MS = 1000;
+
+std::string ports_from_path;
+int pty_pool_size = 12;
+std::vector<std::string> broker_ports = {"/dev/ttyAMA0", "/dev/ttyAMA2", "/dev/ttyAMA4"};
+uid_t broker_owner_uid = 0;  // 0: solo root
+
+struct PooledPty {
+    int master;
+    std::string slave_name;
+};
+
+struct PtyLease {
+    int client;
+    std::vector<std::string> paths;
+};
+
+bool isBrokerPortPath(const std::string& path) {
+    return std::find(broker_ports.begin(), broker_ports.end(), path) != broker_ports.end();
+}
+
+// Solo root y el dueño configurado pueden pedir préstamos
+bool isBrokerClientAllowed(int client, uid_t& uid) {
+    struct ucred credentials;
+    socklen_t length = sizeof(credentials);
+    if (getsockopt(client, SOL_SOCKET, SO_PEERCRED, &credentials, &length) == -1) return false;
+    uid = credentials.uid;
+    return uid == 0 || (broker_owner_uid != 0 && uid == broker_owner_uid);
+}
+
+// Rechaza una conexión con el motivo
+void rejectBrokerClient(int client, const std::string& error) {
+    std::string reply = "ERR " + error;
+    ssize_t ignored = send(client, reply.data(), reply.size(), MSG_NOSIGNAL);
+    (void)ignored;
+    close(client);
+}
+
+bool openPooledPty(PooledPty& pty) {
+    int slave_fd;
+    char slave_name[256];
+    if (openpty(&pty.master, &slave_fd, slave_name, NULL, NULL) == -1) return false;
+    fcntl(pty.master, F_SETFL, fcntl(pty.master, F_GETFL, 0) | O_NONBLOCK);
+    fcntl(pty.master, F_SETFD, FD_CLOEXEC);
+    close(slave_fd);
+    pty.slave_name = slave_name;
+    return true;
+}
+
+// Atiende una petición: enlaza un pty del conjunto a cada ruta y envía los masters
+bool grantPtyLease(PtyLease& lease, const std::string& request, std::vector<PooledPty>& pool,
+                   const std::vector<PtyLease>& leases, std::string& error) {
+    std::istringstream in(request);
+    std::string line;
+    if (!std::getline(in, line) || line != PTY_BROKER_REQUEST) {
+        error = "peticion invalida";
+        return false;
+    }
+    std::vector<std::string> paths;
+    while (std::getline(in, line)) {
+        if (line.empty()) continue;
+        if (!isBrokerPortPath(line)) {
+            error = "ruta no permitida: " + line;
+            return false;
+        }
+        for (size_t l = 0; l < leases.size(); l++) {
+            if (std::find(leases[l].paths.begin(), leases[l].paths.end(), line) != leases[l].paths.end()) {
+                error = "puerto en uso por otra instancia: " + line;
+                return false;
+            }
+        }
+        paths.push_back(line);
+    }
+    if (paths.empty() || paths.size() > static_cast<size_t>(MAX_HANDOFF_FDS)) {
+        error = "numero de puertos invalido";
+        return false;
+    }
+
+    std::vector<PooledPty> granted;
+    for (size_t i = 0; i < paths.size(); i++) {
+        PooledPty pty;
+        if (!pool.empty()) {
+            pty = pool.back();
+            pool.pop_back();
+        } else if (!openPooledPty(pty)) {
+            error = std::string("no se pudo crear un pty: ") + strerror(errno);
+            break;
+        }
+        granted.push_back(pty);
+        if (!linkVirtualPort(pty.slave_name.c_str(), paths[i])) {
+            error = "no se pudo enlazar " + paths[i];
+            break;
+        }
+        configurePortSpeed(pty.master, paths[i]);
+    }
+
+    std::vector<int> fds;
+    for (size_t i = 0; i < granted.size(); i++) fds.push_back(granted[i].master);
+    bool ok = error.empty();
+    if (ok) {
+        char reply[] = "OK";
+        struct iovec iov = {reply, 2};
+        std::vector<char> control(CMSG_SPACE(sizeof(int) * fds.size()), 0);
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = &control[0];
+        msg.msg_controllen = control.size();
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+        memcpy(CMSG_DATA(cmsg), &fds[0], sizeof(int) * fds.size());
+        ok = sendmsg(lease.client, &msg, MSG_NOSIGNAL) == 2;
+        if (!ok) error = "la instancia cerro la conexion";
+    }
+    // El agente no conserva los masters: el pty vive mientras lo tenga la instancia
+    for (size_t i = 0; i < fds.size(); i++) close(fds[i]);
+    for (size_t i = 0; i < paths.size() && !ok; i++) removeVirtualPort(paths[i]);
+    if (ok) lease.paths = paths;
+    return ok;
+}
+
+int runPtyBroker(const std::string& path, int pool_size) {
+    if (geteuid() != 0) {
+        LOG_ERROR("El agente de pty necesita permisos de root para crear los symlinks en /dev/");
+        return 1;
+    }
+    if (!initEngine()) {
+        LOG_ERROR("Error al preparar senales: {}", strerror(errno));
+        return 1;
+    }
+    int listen_fd = openUnixListener(path, SOCK_SEQPACKET, 64);
+    if (listen_fd == -1) {
+        LOG_ERROR("No se pudo escuchar en {}: {}", path, strerror(errno));
+        return 1;
+    }
+    // Solo root y, si lo hay, el dueño configurado pueden conectarse
+    if (broker_owner_uid != 0 && chown(path.c_str(), broker_owner_uid, static_cast<gid_t>(-1)) == -1) {
+        LOG_ERROR("No se pudo ceder {} al usuario {}: {}", path, broker_owner_uid, strerror(errno));
+        close(listen_fd);
+        return 1;
+    }
+    chmod(path.c_str(), 0600);
+
+    // Conexiones aceptadas que aún no han enviado su petición: se leen cuando
+    // llegan, sin que una lenta retrase a las demás
+    struct PendingClient {
+        int client;
+        std::chrono::steady_clock::time_point deadline;
+    };
+    std::vector<PendingClient> pending;
+    std::vector<PooledPty> pool;
+    std::vector<PtyLease> leases;
+    LOG_INFO("Agente de pty escuchando en {} (conjunto de {}, {} rutas prestables)", path, pool_size,
+             broker_ports.size());
+
+    while (running) {
+        // Reponer el conjunto entre peticiones
+        while (static_cast<int>(pool.size()) < pool_size) {
+            PooledPty pty;
+            if (!openPooledPty(pty)) {
+                LOG_ERROR("Error al crear pty: {}", strerror(errno));
+                break;
+            }
+            pool.push_back(pty);
+        }
+
+        std::vector<struct pollfd> fds;
+        struct pollfd shutdown_pfd = {shutdown_fd, POLLIN, 0};
+        struct pollfd signal_pfd = {signal_fd, POLLIN, 0};
+        struct pollfd listen_pfd = {listen_fd, POLLIN, 0};
+        fds.push_back(shutdown_pfd);
+        fds.push_back(signal_pfd);
+        fds.push_back(listen_pfd);
+        for (size_t l = 0; l < leases.size(); l++) {
+            struct pollfd lease_pfd = {leases[l].client, POLLIN, 0};
+            fds.push_back(lease_pfd);
+        }
+        size_t first_pending = fds.size();
+        int timeout_ms = -1;
+        auto now = std::chrono::steady_clock::now();
+        for (size_t c = 0; c < pending.size(); c++) {
+            struct pollfd pending_pfd = {pending[c].client, POLLIN, 0};
+            fds.push_back(pending_pfd);
+            int remaining = static_cast<int>(
+                std::chrono::duration_cast<std::chrono::milliseconds>(pending[c].deadline - now).count()) + 1;
+            timeout_ms = timeout_ms < 0 ? std::max(0, remaining) : std::min(timeout_ms, std::max(0, remaining));
+        }
+        if (poll(&fds[0], fds.size(), timeout_ms) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (fds[1].revents & POLLIN) handlePendingSignal();
+        if (fds[0].revents & POLLIN) break;
+
+        // Préstamos cerrados, de atrás adelante para no desplazar los índices
+        for (size_t l = leases.size(); l-- > 0;) {
+            if (!(fds[3 + l].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+            char ignored[64];
+            if (recv(leases[l].client, ignored, sizeof(ignored), MSG_DONTWAIT) > 0) continue;
+            for (size_t i = 0; i < leases[l].paths.size(); i++) removeVirtualPort(leases[l].paths[i]);
+            LOG_INFO("Prestamo cerrado: {} puertos liberados", leases[l].paths.size());
+            close(leases[l].client);
+            leases.erase(leases.begin() + l);
+        }
+
+        // Peticiones llegadas (o vencidas), de atrás adelante
+        now = std::chrono::steady_clock::now();
+        for (size_t c = pending.size(); c-- > 0;) {
+            PtyLease lease;
+            lease.client = pending[c].client;
+            bool readable = (fds[first_pending + c].revents & (POLLIN | POLLHUP | POLLERR)) != 0;
+            if (!readable && now < pending[c].deadline) continue;
+            pending.erase(pending.begin() + c);
+
+            char request[4096];
+            ssize_t n = readable ? recv(lease.client, request, sizeof(request), MSG_DONTWAIT) : -1;
+            std::string error;
+            if (n > 0 && grantPtyLease(lease, std::string(request, static_cast<size_t>(n)), pool, leases, error)) {
+                LOG_INFO("Prestados {} puertos", lease.paths.size());
+                leases.push_back(lease);
+            } else {
+                rejectBrokerClient(lease.client, error.empty() ? "sin peticion" : error);
+            }
+        }
+
+        if (fds[2].revents & POLLIN) {
+            int client = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+            if (client == -1) continue;
+            uid_t uid = 0;
+            if (!isBrokerClientAllowed(client, uid)) {
+                LOG_WARN("Agente de pty: peticion rechazada del usuario {}", uid);
+                rejectBrokerClient(client, "usuario no autorizado");
+                continue;
+            }
+            PendingClient waiting = {client, std::chrono::steady_clock::now() +
+                                                 std::chrono::milliseconds(PTY_BROKER_REQUEST_TIMEOUT_MS)};
+            pending.push_back(waiting);
+        }
+    }
+
+    for (size_t c = 0; c < pending.size(); c++) close(pending[c].client);
+
+    for (size_t l = 0; l < leases.size(); l++) {
+        for (size_t i = 0; i < leases[l].paths.size(); i++) removeVirtualPort(leases[l].paths[i]);
+        close(leases[l].client);
+    }
+    for (size_t i = 0; i < pool.size(); i++) close(pool[i].master);
+    close(listen_fd);
+    unlink(path.c_str());
+    LOG_INFO("Agente de pty terminado.");
+    return 0;
+}
+
+// Pide al agente los pty de paths. Deja los masters en fds, en el mismo orden,
+// y el préstamo en broker_lease_fd.
+bool acquireBrokerPorts(const std::string& socket_path, const std::vector<std::string>& paths, std::vector<int>& fds,
+                        std::string& error) {
+    struct sockaddr_un addr;
+    int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (sock == -1 || !makeSocketAddress(socket_path, addr) ||
+        connect(sock, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) == -1) {
+        error = std::string("no se pudo conectar: ") + strerror(errno);
+        if (sock != -1) close(sock);
+        return false;
+    }
+    std::string request = PTY_BROKER_REQUEST;
+    for (size_t i = 0; i < paths.size(); i++) request += "\n" + paths[i];
+    if (send(sock, request.data(), request.size(), MSG_NOSIGNAL) == -1) {
+        error = std::string("no se pudo enviar la peticion: ") + strerror(errno);
+        close(sock);
+        return false;
+    }
+
+    char reply[256];
+    struct iovec iov = {reply, sizeof(reply)};
+    char control[CMSG_SPACE(sizeof(int) * MAX_HANDOFF_FDS)];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    ssize_t n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+
+    fds.clear();
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); n > 0 && cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            const int* received = reinterpret_cast<const int*>(CMSG_DATA(cmsg));
+            fds.insert(fds.end(), received, received + (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+        }
+    }
+    if (n != 2 || memcmp(reply, "OK", 2) != 0 || fds.size() != paths.size()) {
+        error = n > 0 ? std::string(reply, static_cast<size_t>(n)) : "el agente no respondio";
+        for (size_t i = 0; i < fds.size(); i++) close(fds[i]);
+        fds.clear();
+        close(sock);
+        return false;
+    }
+    broker_lease_fd = sock;
+    return true;
+}
+
+// Panel de la consola (comando 'd'): se redibuja cada DASHBOARD_REFRESH_MS
+// desde el hilo de control leyendo solo contadores atómicos e instantáneas
+// publicadas, así que los hilos de los dispositivos no notan si está abierto.
+const int DASHBOARD_REFRESH_MS = 500;
+bool dashboard_open = false;
+
+struct DashboardSample {
+    std::chrono::steady_clock::time_point time;
+    std::vector<uint64_t> writes;
+    std::vector<uint64_t> bytes;
+};
+
+void renderDashboard(DashboardSample& previous) {
+    DashboardSample current;
+    current.time = std::chrono::steady_clock::now();
+    for (size_t p = 0; p < platforms.size(); p++) {
+        for (int d = 0; d < platform_ports; d++) {
+            current.writes.push_back(platforms[p]->port_counters[d].writes.load(std::memory_order_relaxed));
+            current.bytes.push_back(platforms[p]->port_counters[d].bytes.load(std::memory_order_relaxed));
+        }
+    }
+    double dt = std::chrono::duration<double>(current.time - previous.time).count();
+    bool have_rates = previous.writes.size() == current.writes.size() && dt > 0.0;
+
+    std::ostringstream out;
+    out << "\033[H\033[J";
+    out << "=== SIMULADOR QUSPIN - PANEL ===   t = " << std::fixed << std::setprecision(1)
+        << sim_clock.nowUs() / 1e6 << " s   (d + ENTER para cerrar)\n\n";
+    out << std::left << std::setw(14) << "Puerto" << std::setw(6) << "Disp" << std::right << std::setw(9) << "Hz"
+        << std::setw(9) << "nominal" << std::setw(10) << "bytes/s" << std::setw(9) << "retrasos" << std::setw(12)
+        << "buffer USB" << std::setw(16) << "cola consumidor" << std::setw(6) << "taps" << "  ultimo valor\n";
+    for (size_t p = 0; p < platforms.size(); p++) {
+        Platform& platform = *platforms[p];
+        for (int d = 0; d < platform_ports; d++) {
+            size_t i = p * platform_ports + d;
+            const PortCounters& counters = platform.port_counters[d];
+            bool imu = d == IMU_DEVICE;
+            const PortTransport& transport = d == 0 ? scenario.gps_transport
+                                             : imu  ? scenario.imu_transport
+                                                    : scenario.mag_transport[d - 1];
+            std::string device = d == 0 ? "GPS" : imu ? "IMU" : "MAG" + std::to_string(d);
+            double nominal = imu ? scenario.imu_rate_hz : 1e6 / (d == 0 ? GPS_PERIOD_US : MAG_PERIOD_US);
+
+            out << std::left << std::setw(14) << platform.port_paths[d] << std::setw(6) << device << std::right;
+            if (have_rates) {
+                out << std::setprecision(1) << std::setw(9) << (current.writes[i] - previous.writes[i]) / dt
+                    << std::setw(9) << nominal << std::setprecision(0) << std::setw(10)
+                    << (current.bytes[i] - previous.bytes[i]) / dt;
+            } else {
+                out << std::setw(9) << "-" << std::setprecision(1) << std::setw(9) << nominal << std::setw(10) << "-";
+            }
+            out << std::setw(9) << counters.deadline_misses.load(std::memory_order_relaxed);
+            if (transport.latency_ms > 0.0) {
+                out << std::setw(12)
+                    << std::to_string(counters.buffered.load(std::memory_order_relaxed)) + "/" +
+                           std::to_string(transport.packet_bytes);
+            } else {
+                out << std::setw(12) << "-";
+            }
+            std::ostringstream lag;
+            lag << counters.queued.load(std::memory_order_relaxed) << " B/" << std::fixed << std::setprecision(0)
+                << counters.lag_ms.load(std::memory_order_relaxed) << " ms";
+            out << std::setw(16) << lag.str();
+            out << std::setw(6) << platform.taps[d].subscriber_count.load(std::memory_order_relaxed) << "  ";
+
+            if (d == 0) {
+                GPSState gps;
+                if (platform.gps_snapshot.read(gps)) {
+                    out << "UTC " << std::setfill('0') << std::setw(2) << gps.hours << std::setw(2) << gps.minutes
+                        << std::setw(2) << gps.seconds << "." << std::setw(2) << gps.centiseconds
+                        << std::setfill(' ') << "  alt " << std::setprecision(1) << gps.altitude << " m";
+                }
+            } else if (imu) {
+                ImuSample sample;
+                if (platform.imu_snapshot.read(sample)) {
+                    out << std::setprecision(2) << "f " << sample.accel_mps2[0] << " " << sample.accel_mps2[1] << " "
+                        << sample.accel_mps2[2] << " m/s2  w " << std::setprecision(3) << sample.gyro_rads[0] << " "
+                        << sample.gyro_rads[1] << " " << sample.gyro_rads[2] << " rad/s";
+                } else {
+                    out << "(sin datos aun)";
+                }
+            } else {
+                HeadStatistics stats;
+                if (platform.head_statistics[d - 1].read(stats)) {
+                    out << std::setprecision(3) << stats.channels[0].last << " nT  ruido "
+                        << summarizeSpectrum(stats.channels[0]).noise_density << " nT/rHz";
+                } else {
+                    out << "(sin datos aun)";
+                }
+            }
+            out << "\n";
+        }
+    }
+
+    out << "\nGrabacion: checkpoint ";
+    if (checkpoint_path.empty()) {
+        out << "no";
+    } else {
+        out << checkpoint_path << " cada " << checkpoint_interval_s << " s (" << checkpoints_written.load()
+            << " guardados)";
+    }
+    out << " | metricas " << (metrics_path.empty() ? std::string("no") : metrics_path)
+        << " | anillos shm " << (shm_taps ? "si" : "no") << "\n";
+    out << "Magnetometros: " << (identical_magnetometers ? "IDENTICOS (Y-splitter)" : "INDEPENDIENTES") << "\n";
+    std::cout << out.str() << std::flush;
+    previous = current;
+}
+
+// Mostrar menú de control
+void showControlMenu() {
+    std::cout << "\n=== SIMULADOR QUSPIN v2 Y GPS ===" << std::endl;
+    std::cout << "Puertos virtuales activos:" << std::endl;
+    for (size_t p = 0; p < platforms.size(); p++) {
+        if (platforms.size() > 1) {
+            std::cout << " Plataforma " << p + 1 << " (zona a " << platforms[p]->survey.origin_east_m << " m al este):"
+                      << std::endl;
+        }
+        std::cout << "  - GPS:            " << platforms[p]->port_paths[0] << std::endl;
+        for (int m = 1; m <= NUM_MAGNETOMETERS; m++) {
+            std::cout << "  - Magnetometro " << m << ": " << platforms[p]->port_paths[m] << std::endl;
+        }
+        if (platform_ports > IMU_DEVICE) {
+            std::cout << "  - IMU:            " << platforms[p]->port_paths[IMU_DEVICE] << std::endl;
+        }
+    }
+    std::cout << "\nComandos:" << std::endl;
+    std::cout << "  i - Toggle magnetometros identicos/Y-splitter (actual: "
+              << (identical_magnetometers ? "SI - IDENTICOS" : "NO - INDEPENDIENTES") << ")" << std::endl;
+    std::cout << "  s - Mostrar estadisticas de la senal emitida" << std::endl;
+    std::cout << "  d - Abrir/cerrar el panel en vivo" << std::endl;
+    std::cout << "  m - Mostrar este menu" << std::endl;
+    std::cout << "  q - Salir" << std::endl;
+    std::cout << "\nConfiguracion actual:" << std::endl;
+    std::cout << "  - GPS: 9600 baud, 8N1" << std::endl;
+    std::cout << "  - Magnetometros: 115200 baud, 8N1" << std::endl;
+    if (platform_ports > IMU_DEVICE) {
+        std::cout << "  - IMU: " << scenario.imu_rate_hz << " Hz, "
+                  << (scenario.imu_binary ? "tramas binarias" : "sentencias $PSIMU") << std::endl;
+    }
+    std::cout << "  - Datacount: 0-498 (incrementa de 2 en 2)" << std::endl;
+    std::cout << "  - Timestamp: incrementa de 4 en 4 ms" << std::endl;
+    std::cout << "\nPara probar en otra terminal:" << std::endl;
+    std::cout << "  GPS:  screen /dev/ttyAMA0 9600" << std::endl;
+    std::cout << "  MAG1: screen /dev/ttyAMA2 115200" << std::endl;
+    std::cout << "  MAG2: screen /dev/ttyAMA4 115200" << std::endl;
+    std::cout << "================================\n" << std::endl;
+}
+
+// Thread para manejar entrada del usuario
+void userInputThread() {
+    std::string input;
+    DashboardSample dashboard_sample;
+    while (running) {
+        if (show_menu) {
+            flushLog();
+            showControlMenu();
+            show_menu = false;
+        }
+
+        bool timed_out = false;
+        if (!readInputLine(input, dashboard_open ? DASHBOARD_REFRESH_MS : -1, &timed_out)) break;
+        if (timed_out) {
+            renderDashboard(dashboard_sample);
+            continue;
+        }
+
+        if (input == "q") {
+            requestShutdown();
+        } else if (input == "i") {
+            identical_magnetometers = !identical_magnetometers;
+            if (shard_control != NULL) shard_control->identical = identical_magnetometers.load();
+            LOG_INFO("*** Magnetometros configurados como: {} ***",
+                     identical_magnetometers ? "IDENTICOS (Y-splitter)" : "INDEPENDIENTES");
+            if (identical_magnetometers) {
+                LOG_INFO("Ambos magnetometros ahora emiten exactamente los mismos datos.");
+            } else {
+                LOG_INFO("Cada magnetometro genera datos independientes con ruido propio.");
+            }
+        } else if (input == "s") {
+            flushLog();
+            showStatistics();
+        } else if (input == "d") {
+            dashboard_open = !dashboard_open;
+            if (dashboard_open) {
+                renderDashboard(dashboard_sample);
+            } else {
+                show_menu = true;
+            }
+        } else if (input == "m") {
+            show_menu = true;
+        }
+    }
+}
+
+// Muestra las opciones de línea de comandos
+void printUsage(const char* program) {
+    std::cout << "Uso: " << program << " [opciones]" << std::endl;
+    std::cout << "  --seed N                  Semilla del ruido (por defecto aleatoria)" << std::endl;
+    std::cout << "  --checkpoint ARCHIVO      Guardar checkpoints periodicos del estado" << std::endl;
+    std::cout << "  --checkpoint-interval S   Segundos entre checkpoints (por defecto 60)" << std::endl;
+    std::cout << "  --restore ARCHIVO         Reanudar desde un checkpoint" << std::endl;
+    std::cout << "  --metrics ARCHIVO         Escribir metricas (formato Prometheus) periodicamente" << std::endl;
+    std::cout << "  --metrics-interval S      Segundos entre escrituras de metricas (por defecto 5)" << std::endl;
+    std::cout << "  --scenario ARCHIVO        Cargar escenario (fuentes, plan de vuelo, ruido)" << std::endl;
+    std::cout << "  --sweep ARCHIVO           Barrido offline de parametros (no crea puertos)" << std::endl;
+    std::cout << "  --output DIR              Directorio de salida del barrido (por defecto sweep_out)" << std::endl;
+    std::cout << "  --jobs N                  Hilos del barrido o del ajuste (por defecto todos los nucleos)" << std::endl;
+    std::cout << "  --fit-noise RUTA          Ajustar el modelo de ruido a capturas (archivo o directorio; repetible)" << std::endl;
+    std::cout << "  --fit-output ARCHIVO      Fragmento de escenario del ajuste (por defecto noise_fit.scn)" << std::endl;
+    std::cout << "  --bench-sources N         Benchmark de Barnes-Hut contra suma exacta con N fuentes" << std::endl;
+    std::cout << "  --bench-points N          Puntos de evaluacion del benchmark (por defecto 2000)" << std::endl;
+    std::cout << "  --bench-field-cache N     Benchmark de la cache de campo con N fuentes" << std::endl;
+    std::cout << "  --bench-decimation N      Benchmark del filtro de decimacion con N muestras por cabezal" << std::endl;
+    std::cout << "  --bench-sinks S           Benchmark de destinos (pty, unix, tcp, shm, archivo), S segundos por tasa" << std::endl;
+    std::cout << "  --takeover SOCKET         Relevar en caliente a la instancia que escucha en SOCKET" << std::endl;
+    std::cout << "  --control-socket SOCKET   Socket de control para relevos (por defecto " << control_socket_path << ")" << std::endl;
+    std::cout << "  --pty-broker SOCKET       Ejecutar el agente de pty preasignados en SOCKET" << std::endl;
+    std::cout << "  --pty-pool N              Pty que el agente mantiene preparados (por defecto " << pty_pool_size << ")" << std::endl;
+    std::cout << "  --broker-ports LISTA      Rutas que el agente puede prestar, separadas por comas" << std::endl;
+    std::cout << "                            (por defecto /dev/ttyAMA0,/dev/ttyAMA2,/dev/ttyAMA4)" << std::endl;
+    std::cout << "  --broker-owner USUARIO    Usuario, ademas de root, al que atiende el agente" << std::endl;
+    std::cout << "  --ports-from SOCKET       Tomar los puertos del agente de pty en SOCKET" << std::endl;
+    std::cout << "  --fifo-dir DIR            Crear los puertos como FIFO en DIR (sin root)" << std::endl;
+    std::cout << "  --fifo-vmsplice           Entregar a las FIFO con vmsplice() en lugar de write()" << std::endl;
+    std::cout << "  --shards N                Repartir las plataformas entre N procesos de trabajo" << std::endl;
+    std::cout << "  --tap-socket SOCKET       Socket de derivaciones de solo lectura (por defecto " << tap_socket_path << ")" << std::endl;
+    std::cout << "  --shm-taps                Publicar tambien cada puerto en un anillo de /dev/shm" << std::endl;
+    std::cout << "  --log-level NIVEL         Diagnosticos a partir de debug, info, warn o error (por defecto info)" << std::endl;
+    std::cout << "  --log-file ARCHIVO        Escribir los diagnosticos en ARCHIVO en lugar de la consola" << std::endl;
+    std::cout << "  --truth ARCHIVO           Exportar la verdad de cada muestra (referencia, fuentes, ruido)" << std::endl;
+    std::cout << "  --replay DIR              Reproducir una captura (gps.nmea, magN.txt) con las fuentes del escenario" << std::endl;
+    std::cout << "  --replay-speed X          Velocidad de la reproduccion (por defecto 1; 0 = sin esperas)" << std::endl;
+    std::cout << "  --replay-mag-offset-s S   Segundos entre la primera GGA y la primera muestra de los cabezales" << std::endl;
+    std::cout << "  --tap PUERTO              Volcar lo que se escribe en PUERTO (cliente, sin root)" << std::endl;
+    std::cout << "  --tap-shm PUERTO          Igual que --tap, leyendo el anillo de /dev/shm" << std::endl;
+    std::cout << "  -h, --help                Mostrar esta ayuda" << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+    std::string restore_path;
+    std::string takeover_path;
+    std::string scenario_path;
+    std::string sweep_path;
+    std::string sweep_output = "sweep_out";
+    int sweep_jobs = 0;
+    size_t bench_sources = 0;
+    size_t bench_points = 2000;
+    size_t bench_cache_sources = 0;
+    size_t bench_decimation_samples = 0;
+    double bench_sink_seconds = 0.0;
+    std::string tap_port;
+    bool tap_from_shm = false;
+    std::string pty_broker_path;
+    std::vector<std::string> fit_inputs;
+    std::string fit_output = "noise_fit.scn";
+    bool seed_given = false;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (arg == "--seed" && has_value) {
+            master_seed = strtoull(argv[++i], NULL, 10);
+            seed_given = true;
+        } else if (arg == "--checkpoint" && has_value) {
+            checkpoint_path = argv[++i];
+        } else if (arg == "--checkpoint-interval" && has_value) {
+            checkpoint_interval_s = atoi(argv[++i]);
+            if (checkpoint_interval_s < 1) checkpoint_interval_s = 1;
+        } else if (arg == "--metrics" && has_value) {
+            metrics_path = argv[++i];
+        } else if (arg == "--metrics-interval" && has_value) {
+            metrics_interval_s = atoi(argv[++i]);
+            if (metrics_interval_s < 1) metrics_interval_s = 1;
+        } else if (arg == "--restore" && has_value) {
+            restore_path = argv[++i];
+        } else if (arg == "--scenario" && has_value) {
+            scenario_path = argv[++i];
+        } else if (arg == "--sweep" && has_value) {
+            sweep_path = argv[++i];
+        } else if (arg == "--output" && has_value) {
+            sweep_output = argv[++i];
+        } else if (arg == "--jobs" && has_value) {
+            sweep_jobs = atoi(argv[++i]);
+        } else if (arg == "--fit-noise" && has_value) {
+            fit_inputs.push_back(argv[++i]);
+        } else if (arg == "--fit-output" && has_value) {
+            fit_output = argv[++i];
+        } else if (arg == "--bench-sources" && has_value) {
+            bench_sources = strtoull(argv[++i], NULL, 10);
+        } else if (arg == "--bench-points" && has_value) {
+            bench_points = strtoull(argv[++i], NULL, 10);
+        } else if (arg == "--bench-field-cache" && has_value) {
+            bench_cache_sources = strtoull(argv[++i], NULL, 10);
+        } else if (arg == "--bench-decimation" && has_value) {
+            bench_decimation_samples = strtoull(argv[++i], NULL, 10);
+        } else if (arg == "--bench-sinks" && has_value) {
+            bench_sink_seconds = atof(argv[++i]);
+        } else if (arg == "--takeover" && has_value) {
+            takeover_path = argv[++i];
+        } else if (arg == "--control-socket" && has_value) {
+            control_socket_path = argv[++i];
+        } else if (arg == "--pty-broker" && has_value) {
+            pty_broker_path = argv[++i];
+        } else if (arg == "--pty-pool" && has_value) {
+            pty_pool_size = std::max(1, atoi(argv[++i]));
+        } else if (arg == "--broker-ports" && has_value) {
+            broker_ports.clear();
+            std::istringstream list(argv[++i]);
+            std::string port;
+            while (std::getline(list, port, ',')) {
+                if (!trim(port).empty()) broker_ports.push_back(trim(port));
+            }
+        } else if (arg == "--broker-owner" && has_value) {
+            std::string owner = argv[++i];
+            struct passwd* entry = getpwnam(owner.c_str());
+            char* end = NULL;
+            unsigned long uid = strtoul(owner.c_str(), &end, 10);
+            if (entry != NULL) {
+                broker_owner_uid = entry->pw_uid;
+            } else if (!owner.empty() && *end == '\0') {
+                broker_owner_uid = static_cast<uid_t>(uid);
+            } else {
+                std::cerr << "Usuario desconocido para --broker-owner: " << owner << std::endl;
+                return 1;
+            }
+        } else if (arg == "--ports-from" && has_value) {
+            ports_from_path = argv[++i];
+        } else if (arg == "--fifo-dir" && has_value) {
+            fifo_dir = argv[++i];
+        } else if (arg == "--fifo-vmsplice") {
+            fifo_vmsplice = true;
+        } else if (arg == "--shards" && has_value) {
+            shard_count = std::max(1, atoi(argv[++i]));
+        } else if (arg == "--tap-socket" && has_value) {
+            tap_socket_path = argv[++i];
+        } else if (arg == "--shm-taps") {
+            shm_taps = true;
+        } else if (arg == "--log-level" && has_value) {
+            std::string level = argv[++i];
+            int l = 0;
+            while (l <= LOG_LEVEL_ERROR && level != LOG_LEVEL_NAMES[l]) l++;
+            if (l > LOG_LEVEL_ERROR) {
+                std::cerr << "Nivel de registro desconocido: " << level << " (debug, info, warn o error)" << std::endl;
+                return 1;
+            }
+            log_level = l;
+        } else if (arg == "--log-file" && has_value) {
+            log_path = argv[++i];
+        } else if (arg == "--truth" && has_value) {
+            truth_path = argv[++i];
+        } else if (arg == "--replay" && has_value) {
+            replay_dir = argv[++i];
+        } else if (arg == "--replay-speed" && has_value) {
+            replay_speed = std::max(0.0, atof(argv[++i]));
+        } else if (arg == "--replay-mag-offset-s" && has_value) {
+            replay_mag_offset_s = atof(argv[++i]);
+        } else if ((arg == "--tap" || arg == "--tap-shm") && has_value) {
+            tap_from_shm = arg == "--tap-shm";
+            tap_port = argv[++i];
+        } else if (arg == "-h" || arg == "--help") {
+            printUsage(argv[0]);
+            return 0;
+        } else {
+            std::cerr << "Opcion desconocida o incompleta: " << arg << std::endl;
+            printUsage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (!tap_port.empty()) {
+        return runTapClient(tap_port, tap_from_shm);
+    }
+
+    // Diagnósticos asíncronos desde aquí; se vacían al salir de main()
+    if (!startLogger()) {
+        std::cerr << "No se pudo abrir el registro " << log_path << ": " << strerror(errno) << std::endl;
+        return 1;
+    }
+    LoggerGuard logger_guard;
+    if (!pty_broker_path.empty()) {
+        return runPtyBroker(pty_broker_path, pty_pool_size);
+    }
+    if (!fit_inputs.empty()) {
+        return runNoiseFit(fit_inputs, fit_output, sweep_jobs);
+    }
+
+    if (!sweep_path.empty() || bench_sources > 0 || bench_cache_sources > 0 || bench_decimation_samples > 0 ||
+        bench_sink_seconds > 0.0) {
+        if (!seed_given) {
+            std::random_device rd;
+            master_seed = (static_cast<uint64_t>(rd()) << 32) | rd();
+        }
+        if (bench_sources > 0) {
+            return runSourceBenchmark(bench_sources, std::max<size_t>(1, bench_points));
+        }
+        if (bench_cache_sources > 0) {
+            return runFieldCacheBenchmark(bench_cache_sources);
+        }
+        if (bench_decimation_samples > 0) {
+            return runDecimationBenchmark(bench_decimation_samples);
+        }
+        if (bench_sink_seconds > 0.0) {
+            return runSinkBenchmark(bench_sink_seconds);
+        }
+        return runSweep(sweep_path, sweep_output, sweep_jobs);
+    }
+
+    // Escenario de la simulación en tiempo real
+    if (!scenario_path.empty()) {
+        std::vector<ScenarioEntry> entries;
+        std::string error;
+        bool ok = readScenarioFile(scenario_path, entries, error);
+        for (size_t e = 0; ok && e < entries.size(); e++) {
+            if (entries[e].values.size() != 1) {
+                error = "la clave '" + entries[e].key + "' tiene varios valores (solo validos en --sweep)";
+                ok = false;
+            } else {
+                ok = applyScenarioValue(scenario, entries[e].key, entries[e].values[0], error);
+            }
+        }
+        if (ok && scenario.seed_given && !seed_given) {
+            master_seed = scenario.seed;
+            seed_given = true;
+        }
+        if (!ok) {
+            LOG_ERROR("Escenario {} invalido: {}", scenario_path, error);
+            return 1;
+        }
+    }
+    std::string source_error;
+    if (!loadSourceIndex(scenario, field_model.sources, source_error)) {
+        LOG_ERROR("Error al cargar fuentes: {}", source_error);
+        return 1;
+    }
+    field_model.reference = makeReferenceField(sim_values);
+    field_model.depth_offset_m = scenario.depth_offset_m;
+
+    if (!restore_path.empty() && !takeover_path.empty()) {
+        LOG_ERROR("--restore y --takeover son incompatibles");
+        return 1;
+    }
+    if (!fifo_dir.empty() && !ports_from_path.empty()) {
+        LOG_ERROR("--fifo-dir y --ports-from son incompatibles");
+        return 1;
+    }
+
+    // Captura a reproducir: el GPS da la trayectoria; sin un magnetómetro su puerto queda mudo
+    MappedFile replay_mags[NUM_MAGNETOMETERS];
+    std::shared_ptr<const TrackLog> replay_track;
+    if (!replay_dir.empty()) {
+        if (!restore_path.empty() || !takeover_path.empty() || !checkpoint_path.empty() || shard_count > 1 ||
+            scenario.platforms > 1) {
+            LOG_ERROR("--replay reproduce una sola plataforma; no admite --restore, --takeover, --checkpoint ni "
+                      "--shards");
+            return 1;
+        }
+        if (scenario.imu_rate_hz > 0.0) {
+            LOG_ERROR("--replay no admite imu_rate_hz: la captura no trae la actitud que seguiria la IMU");
+            return 1;
+        }
+        std::string error;
+        replay_track = TrackLog::open(replay_dir + "/gps.nmea", error);
+        if (!replay_track) {
+            LOG_ERROR("No se pudo leer la trayectoria de la captura: {}", error);
+            return 1;
+        }
+        if (replay_track->format() != TrackLog::NMEA) {
+            LOG_ERROR("{}/gps.nmea no es un registro NMEA", replay_dir);
+            return 1;
+        }
+        for (int m = 0; m < NUM_MAGNETOMETERS; m++) {
+            std::string path = replay_dir + "/mag" + std::to_string(m + 1) + ".txt";
+            if (!replay_mags[m].open(path)) LOG_WARN("Sin captura en {} ({}); ese puerto no emitira", path, strerror(errno));
+        }
+        LOG_INFO("Reproduciendo {}: {} fuentes sinteticas, velocidad {}", replay_dir,
+                 field_model.sources ? field_model.sources->size() : 0, replay_speed);
+    }
+
+    // Con varias particiones las plataformas se crean en memoria compartida
+    if (shard_count > scenario.platforms) {
+        LOG_WARN("{} particiones para {} plataformas; se usaran {}", shard_count, scenario.platforms,
+                 scenario.platforms);
+        shard_count = scenario.platforms;
+    }
+    if (shard_count > 1 && !prepareShards(scenario.platforms)) {
+        LOG_ERROR("Error al reservar memoria compartida para las particiones: {}", strerror(errno));
+        return 1;
+    }
+
+    // Estado inicial de los dispositivos: restaurado o nuevo (en un relevo
+    // llega de la instancia anterior junto con los puertos)
+    createPlatforms(scenario);
+    uint64_t initial_sim_time_us = 0;
+    if (!restore_path.empty()) {
+        CheckpointData restored;
+        std::string error;
+        if (!readCheckpointFile(restore_path, restored)) {
+            return 1;
+        }
+        if (!restorePlatformStates(restored, error)) {
+            LOG_ERROR("Checkpoint {} incompatible: {}", restore_path, error);
+            return 1;
+        }
+        initial_sim_time_us = restored.sim_time_us;
+        LOG_INFO("Reanudando desde checkpoint {} (t = {.3} s)", restore_path, initial_sim_time_us / 1e6);
+    } else if (takeover_path.empty()) {
+        if (!seed_given) {
+            std::random_device rd;
+            master_seed = (static_cast<uint64_t>(rd()) << 32) | rd();
+        }
+        for (size_t p = 0; p < platforms.size(); p++) {
+            int index = static_cast<int>(p);
+            platforms[p]->gps_initial_state = initialGPSState(master_seed, index);
+            for (int i = 0; i < NUM_MAGNETOMETERS; i++) {
+                platforms[p]->mag_initial_states[i] = initialMagnetometerState(i + 1, master_seed, index);
+            }
+        }
+    }
+
+    // Verificar si se ejecuta como root (con el agente de pty o con FIFO no hace falta)
+    if (geteuid() != 0 && ports_from_path.empty() && fifo_dir.empty()) {
+        LOG_ERROR("Este programa necesita permisos de root para crear dispositivos en /dev/");
+        LOG_ERROR("Por favor ejecuta con: sudo ./quspin_gps_simulator");
+        return 1;
+    }
+
+    // Canal de verdad (con particiones lo abre cada proceso de trabajo)
+    if (!truth_path.empty() && shard_count == 1) {
+        std::string error;
+        if (!truth_exporter.start(truth_path, error)) {
+            LOG_ERROR("Error al abrir el canal de verdad: {}", error);
+            return 1;
+        }
+    }
+
+    // Las señales se atienden por signalfd en el hilo de control
+    if (!initEngine()) {
+        LOG_ERROR("Error al preparar senales: {}", strerror(errno));
+        return 1;
+    }
+
+    if (!takeover_path.empty()) {
+        // Relevo en caliente: los puertos y el estado llegan de la instancia en marcha
+        auto request_time = std::chrono::steady_clock::now();
+        CheckpointData handed;
+        std::vector<int> handed_fds;
+        std::string error;
+        int port_count = static_cast<int>(platforms.size()) * platform_ports;
+        if (!receiveHandoff(takeover_path, port_count, handed, handed_fds, error) ||
+            !restorePlatformStates(handed, error)) {
+            LOG_ERROR("Error en el relevo desde {}: {}", takeover_path, error);
+            return 1;
+        }
+        for (size_t p = 0; p < platforms.size(); p++) {
+            for (int d = 0; d < platform_ports; d++) {
+                platforms[p]->port_fds[d] = handed_fds[p * platform_ports + d];
+            }
+        }
+        if (handed_fds.size() > static_cast<size_t>(port_count)) {
+            broker_lease_fd = handed_fds.back();
+        }
+        double handoff_ms = std::chrono::duration<double, std::milli>(
+            std::chrono::steady_clock::now() - request_time).count();
+        LOG_INFO("Puertos recibidos de {} en {.3} ms (t = {.3} s)", takeover_path, handoff_ms, sim_clock.nowUs() / 1e6);
+    } else {
+        std::cout << "=== INICIANDO SIMULADOR EN RASPBERRY PI 5 ===" << std::endl;
+        std::cout << "NOTA: Este simulador creara puertos virtuales en:" << std::endl;
+        for (size_t p = 0; p < platforms.size(); p++) {
+            std::string suffix = platforms.size() > 1 ? ", plataforma " + std::to_string(p + 1) : "";
+            std::cout << "  " << platforms[p]->port_paths[0] << " (GPS" << suffix << ")" << std::endl;
+            for (int m = 1; m <= NUM_MAGNETOMETERS; m++) {
+                std::cout << "  " << platforms[p]->port_paths[m] << " (Magnetometro " << m << suffix << ")" << std::endl;
+            }
+            if (platform_ports > IMU_DEVICE) {
+                std::cout << "  " << platforms[p]->port_paths[IMU_DEVICE] << " (IMU" << suffix << ")" << std::endl;
+            }
+        }
+        std::cout << "\nSi tienes hardware real conectado, este sera temporalmente deshabilitado." << std::endl;
+        std::cout << "Los dispositivos originales seran restaurados al salir del simulador.\n" << std::endl;
+
+        // Limpiar puertos anteriores (con el agente de pty lo hace él)
+        if (ports_from_path.empty()) {
+            LOG_INFO("Limpiando puertos anteriores...");
+            cleanupPorts();
+        }
+        flushLog();
+
+        std::cout << "\nPresiona ENTER para continuar o Ctrl+C para cancelar..." << std::endl;
+        std::string enter;
+        if (!readInputLine(enter)) {
+            return 0;
+        }
+        LOG_INFO("Creando puertos virtuales...");
+
+        // Crear puertos virtuales (o tomarlos ya creados del agente de pty)
+        bool ports_ok = true;
+        if (!ports_from_path.empty()) {
+            auto acquire_time = std::chrono::steady_clock::now();
+            std::vector<std::string> paths;
+            std::vector<int> fds;
+            for (size_t p = 0; p < platforms.size(); p++) {
+                paths.insert(paths.end(), platforms[p]->port_paths, platforms[p]->port_paths + platform_ports);
+            }
+            std::string error;
+            if (!acquireBrokerPorts(ports_from_path, paths, fds, error)) {
+                LOG_ERROR("Error al obtener puertos de {}: {}", ports_from_path, error);
+                return 1;
+            }
+            for (size_t i = 0; i < fds.size(); i++) {
+                platforms[i / platform_ports]->port_fds[i % platform_ports] = fds[i];
+            }
+            LOG_INFO("{} puertos obtenidos de {} en {.0} us", fds.size(), ports_from_path,
+                     std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - acquire_time).count());
+        } else {
+            for (size_t p = 0; p < platforms.size(); p++) {
+                for (int d = 0; d < platform_ports; d++) {
+                    const std::string& path = platforms[p]->port_paths[d];
+                    platforms[p]->port_fds[d] = fifo_dir.empty() ? createVirtualPort(path) : createFifoPort(path);
+                    ports_ok = ports_ok && platforms[p]->port_fds[d] != -1;
+                }
+            }
+        }
+
+        if (!ports_ok) {
+            LOG_ERROR("Error al crear puertos virtuales");
+            // Limpiar lo que se haya creado
+            cleanupPorts();
+            return 1;
+        }
+        sim_clock.start(initial_sim_time_us);
+    }
+
+    // Socket de control para que una futura instancia pueda relevar a esta
+    // (una reproducción no tiene estado que entregar)
+    if (!replay_dir.empty()) {
+        LOG_INFO("Sin relevo en caliente durante una reproduccion");
+    } else if (!openControlSocket(control_socket_path)) {
+        LOG_WARN("Sin socket de control en {} ({}); el relevo en caliente no estara disponible", control_socket_path,
+                 strerror(errno));
+    }
+    if (shard_count > 1) {
+        // Los suscriptores por socket se registran en el proceso que escribe el puerto
+        LOG_INFO("Con particiones solo hay derivaciones por memoria compartida (--shm-taps)");
+    } else if (!openTapSocket(tap_socket_path)) {
+        LOG_WARN("Sin socket de derivaciones en {} ({})", tap_socket_path, strerror(errno));
+    }
+    if (shm_taps && !createTapRings()) {
+        LOG_WARN("No se pudieron crear los anillos de derivacion en /dev/shm ({})", strerror(errno));
+    }
+
+    // Mostrar menú inicial
+    show_menu = true;
+
+    // A partir de aquí cualquier punto de registro puede repetirse por muestra
+    log_rate_limit_all = true;
+
+    // Crear threads: un GPS y un hilo por cabezal en cada plataforma
+    // (o, con particiones, en los procesos de trabajo)
+    std::vector<std::thread> device_threads;
+    std::thread supervisor_thread;
+    if (shard_count > 1) {
+        if (!startShards()) {
+            LOG_ERROR("Error al crear los procesos de trabajo: {}", strerror(errno));
+            requestShutdown();
+        }
+        LOG_INFO("Plataformas repartidas entre {} procesos de trabajo", shard_count);
+        supervisor_thread = std::thread(shardSupervisorThread);
+    } else if (!replay_dir.empty()) {
+        auto origin = std::chrono::steady_clock::now();
+        device_threads.push_back(std::thread(gpsReplayThread, platforms[0].get(), replay_track.get(), origin));
+        for (int m = 1; m <= NUM_MAGNETOMETERS; m++) {
+            if (replay_mags[m - 1].data == NULL) continue;
+            device_threads.push_back(std::thread(magnetometerReplayThread, platforms[0].get(), m,
+                                                 &replay_mags[m - 1], replay_track.get(), origin));
+        }
+    } else {
+        for (size_t p = 0; p < platforms.size(); p++) {
+            device_threads.push_back(std::thread(gpsEmulatorThread, platforms[p].get()));
+            for (int m = 1; m <= NUM_MAGNETOMETERS; m++) {
+                device_threads.push_back(std::thread(magnetometerEmulatorThread, platforms[p].get(), m));
+            }
+            if (platform_ports > IMU_DEVICE) {
+                device_threads.push_back(std::thread(imuEmulatorThread, platforms[p].get()));
+            }
+        }
+    }
+    std::thread input_thread(userInputThread);
+    std::thread checkpoint_thread;
+    if (!checkpoint_path.empty()) {
+        checkpoint_thread = std::thread(checkpointThread);
+    }
+    std::thread metrics_thread;
+    if (!metrics_path.empty()) {
+        metrics_thread = std::thread(metricsThread);
+    }
+    std::thread handoff_thread;
+    if (control_listen_fd != -1) {
+        handoff_thread = std::thread(handoffListenerThread);
+    }
+    std::thread tap_thread;
+    if (tap_listen_fd != -1) {
+        tap_thread = std::thread(tapListenerThread);
+    }
+
+    // Esperar a que terminen los threads
+    for (size_t t = 0; t < device_threads.size(); t++) {
+        device_threads[t].join();
+    }
+    input_thread.join();
+    if (checkpoint_thread.joinable()) {
+        checkpoint_thread.join();
+    }
+    if (metrics_thread.joinable()) {
+        metrics_thread.join();
+    }
+    if (handoff_thread.joinable()) {
+        handoff_thread.join();
+    }
+    if (tap_thread.joinable()) {
+        tap_thread.join();
+    }
+    if (supervisor_thread.joinable()) {
+        supervisor_thread.join();
+    }
+    if (shard_count > 1) {
+        // Las instantáneas finales deben estar publicadas antes del relevo o del checkpoint
+        waitForShards();
+    }
+    truth_exporter.stop();
+
+    // Los suscriptores por socket ven EOF (tras un relevo pueden conectarse a la
+    // nueva instancia); los anillos de /dev/shm se dejan para que ella los reutilice.
+    closeTaps();
+    if (tap_listen_fd != -1) {
+        close(tap_listen_fd);
+    }
+
+    // Relevo en caliente: la nueva instancia se queda con los puertos y los
+    // symlinks, y vuelve a crear el socket de control en la misma ruta
+    int handoff_client = handoff_client_fd.load();
+    if (handoff_client != -1) {
+        bool handed_off = sendHandoff(handoff_client);
+        close(handoff_client);
+        if (handed_off) {
+            close(control_listen_fd);
+            for (size_t p = 0; p < platforms.size(); p++) {
+                for (int d = 0; d < platform_ports; d++) {
+                    close(platforms[p]->port_fds[d]);
+                }
+            }
+            LOG_INFO("Puertos y estado entregados a la nueva instancia. Simulador terminado.");
+            return 0;
+        }
+        LOG_WARN("La nueva instancia no confirmo el relevo; cerrando los puertos");
+    }
+    if (control_listen_fd != -1) {
+        close(control_listen_fd);
+        unlink(control_socket_path.c_str());
+    }
+    if (tap_listen_fd != -1) {
+        unlink(tap_socket_path.c_str());
+    }
+    if (shm_taps) {
+        for (size_t p = 0; p < platforms.size(); p++) {
+            for (int d = 0; d < platform_ports; d++) {
+                unlink(tapRingPath(platforms[p]->port_paths[d]).c_str());
+            }
+        }
+    }
+
+    // Checkpoint final con el estado exacto en que se detuvo cada dispositivo
+    if (!checkpoint_path.empty() && writeCheckpointFile(checkpoint_path, captureCheckpoint())) {
+        LOG_INFO("Checkpoint final guardado en {}", checkpoint_path);
+    }
+
+    // Limpiar
+    for (size_t p = 0; p < platforms.size(); p++) {
+        for (int d = 0; d < platform_ports; d++) {
+            close(platforms[p]->port_fds[d]);
+        }
+    }
+
+    LOG_INFO("Limpiando puertos virtuales...");
+
+    // Eliminar symlinks y restaurar backups si existen (con puertos del agente
+    // lo hace él al cerrarse el préstamo)
+    if (broker_lease_fd != -1) {
+        close(broker_lease_fd);
+    } else {
+        for (size_t p = 0; p < platforms.size(); p++) {
+            for (int d = 0; d < platform_ports; d++) {
+                removeVirtualPort(platforms[p]->port_paths[d]);
+            }
+        }
+    }
+
+    LOG_INFO("Simulador terminado.");
+
+    return 0;
+}